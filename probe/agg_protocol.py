@@ -0,0 +1,329 @@
+"""
+Probe -> aggregator interval deltas, for PROBE_COUNT > 1 (one probe per AZ,
+or several behind the NLB), where each coordinator only sees its share.
+
+At every report a probe sends what its merge saw in that REPORT_INTERVAL,
+counts already scaled for sampling:
+
+- totals: every packet and byte, IPv6 included
+- the top AGG_TOP_FLOWS IPv4 flows and the top AGG_TOP_HOSTS sources and
+  destinations by bytes, exact
+- count-min sketches of its whole host table (FlowMerge.host_sketch()), so
+  the aggregator can bound a host's traffic on probes where it was not a
+  top host
+
+Records follow the flow_record layout (src_ip, dst_ip, src_port, dst_port,
+proto, packets, bytes), sorted by address and compressed: IPs as deltas
+from the previous record (host order), every integer as a LEB128 varint,
+sketch cells with zero runs collapsed. A delta of a few kB to ~100 kB per
+probe every 5s, whatever the DX line rate.
+
+Frames go over TCP: 4-byte big-endian length, then the payload:
+
+    "DXA" version
+    probe (varint length + UTF-8, at most MAX_PROBE_NAME bytes), seq, start_ms, interval_ms, packets, bytes
+    flows: count, then per flow: src delta, dst delta (zigzag), src_port,
+           dst_port, proto, packets, bytes
+    sources, destinations: count, then per host: ip delta, packets, bytes
+    sketch: depth, width (0, 0 = none), then SKETCH_COUNTERS * depth * width
+           cells; a 0 cell is followed by the number of further zero cells
+"""
+
+import logging
+import queue
+import socket
+import struct
+import threading
+from dataclasses import dataclass, field
+from typing import BinaryIO, Optional
+
+logger = logging.getLogger(__name__)
+
+MAGIC = b"DXA"
+VERSION = 1
+AGG_PORT = 4790
+SKETCH_DEPTH = 3            # count-min rows
+SKETCH_WIDTH = 1024         # cells per row (power of two): overestimate <= ~0.3% of the probe's traffic
+SKETCH_COUNTERS = 4         # src packets, src bytes, dst packets, dst bytes (FlowMerge.HOSTS columns)
+MAX_FRAME = 16 << 20
+MAX_PROBE_NAME = 255         # bytes of UTF-8 probe name
+
+_M64 = (1 << 64) - 1
+_SEED = 0x9E3779B97F4A7C15
+_LEN = struct.Struct("!I")
+
+
+@dataclass
+class IntervalDelta:
+    """One probe's REPORT_INTERVAL. IPs are raw u32 as FlowMerge rows carry them."""
+    probe: str
+    seq: int
+    start_ms: int                   # wall clock at the start of the interval
+    interval_ms: int
+    packets: int
+    bytes: int
+    flows: list[tuple[int, int, int, int, int, int, int]] = field(default_factory=list)  # FlowMerge.FLOWS rows
+    src_hosts: list[tuple[int, int, int]] = field(default_factory=list)  # ip, packets, bytes
+    dst_hosts: list[tuple[int, int, int]] = field(default_factory=list)
+    depth: int = 0
+    width: int = 0
+    sketch: list[int] = field(default_factory=list)  # SKETCH_COUNTERS * depth * width, counter-major
+
+
+# ---- Varints ----
+
+def _put(out: bytearray, n: int) -> None:
+    while n > 0x7F:
+        out.append((n & 0x7F) | 0x80)
+        n >>= 7
+    out.append(n)
+
+
+def _zigzag(n: int) -> int:
+    return n * 2 if n >= 0 else -n * 2 - 1
+
+
+def _unzigzag(n: int) -> int:
+    return n >> 1 if not n & 1 else -((n + 1) >> 1)
+
+
+class _Reader:
+    __slots__ = ("buf", "pos")
+
+    def __init__(self, buf: bytes):
+        self.buf = buf
+        self.pos = 0
+
+    def get(self) -> int:
+        buf, pos, n, shift = self.buf, self.pos, 0, 0
+        while True:
+            if pos >= len(buf) or shift > 63:
+                raise ValueError("truncated or oversized varint")
+            b = buf[pos]
+            pos += 1
+            n |= (b & 0x7F) << shift
+            if b < 0x80:
+                self.pos = pos
+                return n
+            shift += 7
+
+    def count(self, limit: int) -> int:
+        n = self.get()
+        if n > limit:
+            raise ValueError(f"count {n} over {limit}")
+        return n
+
+
+# ---- Sketch ----
+
+def _mix64(h: int) -> int:
+    h ^= h >> 33
+    h = (h * 0xFF51AFD7ED558CCD) & _M64
+    h ^= h >> 33
+    h = (h * 0xC4CEB9FE1A85EC53) & _M64
+    h ^= h >> 33
+    return h
+
+
+def sketch_column(ip: int, row: int, width: int) -> int:
+    """Column of raw u32 ip in sketch row `row`; matches merge_host_sketch()."""
+    return _mix64(ip ^ (((row + 1) * _SEED) & _M64)) & (width - 1)
+
+
+def sketch_estimate(d: IntervalDelta, counter: int, ip: int) -> int:
+    """Count-min estimate (an upper bound) of one host counter of d; 0 without a sketch."""
+    if not d.sketch:
+        return 0
+    plane = counter * d.depth * d.width
+    return min(d.sketch[plane + r * d.width + sketch_column(ip, r, d.width)] for r in range(d.depth))
+
+
+# ---- Encoding ----
+
+def _host_order(ip: int) -> int:
+    return socket.ntohl(ip)
+
+
+def encode(d: IntervalDelta) -> bytes:
+    """ValueError if the probe name is over MAX_PROBE_NAME bytes, which decode() would refuse."""
+    name = d.probe.encode()
+    if len(name) > MAX_PROBE_NAME:
+        raise ValueError(f"probe name of {len(name)} bytes over {MAX_PROBE_NAME}")
+    out = bytearray(MAGIC)
+    out.append(VERSION)
+    _put(out, len(name))
+    out += name
+    for n in (d.seq, d.start_ms, d.interval_ms, d.packets, d.bytes):
+        _put(out, n)
+
+    flows = sorted(((_host_order(f[0]), _host_order(f[1])) + tuple(f[2:]) for f in d.flows))
+    _put(out, len(flows))
+    prev_src = prev_dst = 0
+    for src, dst, sport, dport, proto, pkts, byt in flows:
+        _put(out, src - prev_src)
+        _put(out, _zigzag(dst - prev_dst))
+        prev_src, prev_dst = src, dst
+        for n in (sport, dport, proto, pkts, byt):
+            _put(out, n)
+
+    for hosts in (d.src_hosts, d.dst_hosts):
+        rows = sorted((_host_order(ip), pkts, byt) for ip, pkts, byt in hosts)
+        _put(out, len(rows))
+        prev = 0
+        for ip, pkts, byt in rows:
+            _put(out, ip - prev)
+            prev = ip
+            _put(out, pkts)
+            _put(out, byt)
+
+    _put(out, d.depth if d.sketch else 0)
+    _put(out, d.width if d.sketch else 0)
+    cells = d.sketch
+    i, n = 0, len(cells)
+    while i < n:
+        v = cells[i]
+        _put(out, v)
+        i += 1
+        if not v:
+            run = i
+            while run < n and not cells[run]:
+                run += 1
+            _put(out, run - i)
+            i = run
+    return bytes(out)
+
+
+def decode(buf: bytes) -> IntervalDelta:
+    """Inverse of encode(); ValueError on anything malformed."""
+    if buf[:3] != MAGIC or len(buf) < 4 or buf[3] != VERSION:
+        raise ValueError("not an interval delta (bad magic or version)")
+    r = _Reader(buf)
+    r.pos = 4
+    name_len = r.count(MAX_PROBE_NAME)
+    name = buf[r.pos:r.pos + name_len].decode(errors="replace")
+    r.pos += name_len
+    d = IntervalDelta(name, r.get(), r.get(), r.get(), r.get(), r.get())
+    limit = len(buf)        # every record takes at least one byte
+
+    src = dst = 0
+    for _ in range(r.count(limit)):
+        src += r.get()
+        dst += _unzigzag(r.get())
+        d.flows.append((socket.htonl(src & 0xFFFFFFFF), socket.htonl(dst & 0xFFFFFFFF),
+                        r.get(), r.get(), r.get(), r.get(), r.get()))
+    for hosts in (d.src_hosts, d.dst_hosts):
+        ip = 0
+        for _ in range(r.count(limit)):
+            ip += r.get()
+            hosts.append((socket.htonl(ip & 0xFFFFFFFF), r.get(), r.get()))
+
+    d.depth, d.width = r.count(64), r.count(1 << 16)
+    total = SKETCH_COUNTERS * d.depth * d.width
+    cells = d.sketch
+    while len(cells) < total:
+        v = r.get()
+        cells.append(v)
+        if not v:
+            run = r.get()
+            if len(cells) + run > total:
+                raise ValueError("sketch zero run past the end")
+            cells.extend([0] * run)
+    if r.pos != len(buf):
+        raise ValueError("trailing bytes after interval delta")
+    return d
+
+
+# ---- Framing ----
+
+def frame(payload: bytes) -> bytes:
+    return _LEN.pack(len(payload)) + payload
+
+
+def read_frame(f: BinaryIO) -> Optional[bytes]:
+    """Next payload from a stream, None at a clean EOF; ValueError on an oversized or cut frame."""
+    hdr = f.read(_LEN.size)
+    if not hdr:
+        return None
+    if len(hdr) < _LEN.size:
+        raise ValueError("truncated frame header")
+    (n,) = _LEN.unpack(hdr)
+    if n > MAX_FRAME:
+        raise ValueError(f"frame of {n} bytes over {MAX_FRAME}")
+    payload = f.read(n)
+    if len(payload) < n:
+        raise ValueError("truncated frame")
+    return payload
+
+
+class DeltaUplink:
+    """
+    Frames to the aggregator over one TCP connection, from a daemon thread:
+    an absent or slow aggregator never stalls the coordinator loop. Up to
+    `backlog` frames wait for the connection, the oldest dropped first; a
+    frame whose send fails is dropped too (the next interval carries on).
+    """
+
+    def __init__(self, host: str, port: int, backlog: int = 4):
+        self.addr = (host, port)
+        self._queue: queue.Queue = queue.Queue(maxsize=backlog)
+        self._sock: Optional[socket.socket] = None
+        self._running = False
+        self._thread: Optional[threading.Thread] = None
+        self.sent = 0
+        self.dropped = 0
+
+    def start(self) -> None:
+        self._running = True
+        self._thread = threading.Thread(target=self._loop, name="agg-uplink", daemon=True)
+        self._thread.start()
+
+    def stop(self, timeout: float = 2.0) -> None:
+        """Flush what is queued (within timeout), then close."""
+        self._running = False
+        if self._thread:
+            self._thread.join(timeout)
+            self._thread = None
+        self._close()
+
+    def send(self, payload: bytes) -> None:
+        data = frame(payload)
+        while True:
+            try:
+                self._queue.put_nowait(data)
+                return
+            except queue.Full:
+                try:
+                    self._queue.get_nowait()
+                    self.dropped += 1
+                except queue.Empty:
+                    pass
+
+    def _close(self) -> None:
+        if self._sock:
+            self._sock.close()
+            self._sock = None
+
+    def _loop(self) -> None:
+        backoff = 1.0
+        while self._running or not self._queue.empty():
+            try:
+                data = self._queue.get(timeout=0.5)
+            except queue.Empty:
+                continue
+            try:
+                if not self._sock:
+                    self._sock = socket.create_connection(self.addr, timeout=5)
+                    logger.info("Aggregator uplink connected to %s:%d", *self.addr)
+                self._sock.sendall(data)
+                self.sent += 1
+                backoff = 1.0
+            except OSError as e:
+                self.dropped += 1
+                if self._sock or backoff == 1.0:
+                    logger.warning("Aggregator uplink %s:%d: %s (retrying, %d frames dropped)",
+                                   *self.addr, e, self.dropped)
+                self._close()
+                if not self._running:
+                    return
+                threading.Event().wait(backoff)
+                backoff = min(backoff * 2, 30.0)
@@ -0,0 +1,268 @@
+#!/usr/bin/env python3
+"""
+Multi-probe aggregator: one global view from every probe's interval deltas.
+
+With PROBE_COUNT > 1 each probe only sees its share of the mirrored traffic
+(per AZ, or whatever the NLB hashes to it), so a talker spread over probes
+can stay under ALERT_HOST_BPS on every one of them. Probes started with
+AGGREGATOR_ADDR send an IntervalDelta (agg_protocol.py) per REPORT_INTERVAL;
+the aggregator lines the intervals up, merges one from each probe into its
+own FlowMerge and runs the same report and alert checks as a probe
+(MergeReporter), alerts labelled GLOBAL.
+
+A window is merged once every live probe (sent within PROBE_STALE_SEC) has
+an interval waiting, or REPORT_INTERVAL after the oldest arrived, so a
+stalled probe delays the global report by at most one interval.
+
+Per probe, top flows and hosts are exact; a host that was a top host on
+some probes but not on others gets its count-min estimate from the other
+probes' sketches, capped at that probe's smallest reported host (anything it
+did not list is no bigger). Totals include every packet, IPv6 too.
+"""
+
+import logging
+import os
+import signal
+import socketserver
+import sys
+import threading
+import time
+from collections import deque
+from typing import Optional
+
+_probe_dir = os.path.dirname(os.path.abspath(__file__))
+if _probe_dir not in sys.path:
+    sys.path.insert(0, _probe_dir)
+
+import multiproc_probe
+from agg_protocol import AGG_PORT, IntervalDelta, decode, read_frame, sketch_estimate
+from alerter import FlowAlerter
+from enricher import IPEnricher
+from multiproc_probe import (
+    COORDINATOR_POLL,
+    FLOW_REC_HH_DST,
+    FLOW_REC_HH_FLOW,
+    FLOW_REC_HH_SRC,
+    FLOW_REC_OVERFLOW,
+    REPORT_INTERVAL,
+    FlowMerge,
+    MergeReporter,
+)
+from rate_engine import RateEngine
+
+logger = logging.getLogger("aggregator")
+
+PROBE_STALE_SEC = 3 * REPORT_INTERVAL  # a probe silent this long no longer holds up windows
+SKETCH_SRC_PACKETS, SKETCH_SRC_BYTES, SKETCH_DST_PACKETS, SKETCH_DST_BYTES = range(4)
+
+
+class Aggregator(MergeReporter):
+    def __init__(self, listen_addr: str = "0.0.0.0", listen_port: int = AGG_PORT):
+        self._listen = (listen_addr, listen_port)
+        self._merge: Optional[FlowMerge] = FlowMerge()
+        self._inv_rate = 1.0  # deltas arrive scaled
+        self._enricher = IPEnricher()
+        self._alerter = FlowAlerter(scope="GLOBAL")
+        self._rates = RateEngine(host_bucket_sec=REPORT_INTERVAL)
+        self._lock = threading.Lock()
+        self._pending: dict[str, deque[tuple[float, IntervalDelta]]] = {}  # probe -> (arrival, delta)
+        self._last_seen: dict[str, float] = {}
+        self._last_seq: dict[str, int] = {}
+        self._server: Optional[socketserver.ThreadingTCPServer] = None
+        self._server_thread: Optional[threading.Thread] = None
+        self._stop_event = threading.Event()  # ends run()
+        self._started = False
+        self._stopped = False
+
+    @property
+    def port(self) -> int:
+        return self._server.server_address[1] if self._server else self._listen[1]
+
+    def submit(self, d: IntervalDelta, now: Optional[float] = None) -> None:
+        """Queue one probe interval for the next window."""
+        now = time.monotonic() if now is None else now
+        with self._lock:
+            last = self._last_seq.get(d.probe)
+            if last is not None and d.seq != last + 1:
+                if d.seq <= last:
+                    logger.info("Probe %s restarted (seq %d after %d)", d.probe, d.seq, last)
+                else:
+                    logger.warning("Probe %s: %d intervals missing (seq %d after %d)",
+                                   d.probe, d.seq - last - 1, d.seq, last)
+            elif last is None:
+                logger.info("Probe %s joined", d.probe)
+            self._last_seq[d.probe] = d.seq
+            self._last_seen[d.probe] = now
+            self._pending.setdefault(d.probe, deque()).append((now, d))
+
+    def _next_window(self, now: float) -> list[IntervalDelta]:
+        """One delta from each probe with one pending, once the window is complete or overdue."""
+        with self._lock:
+            waiting = [q for q in self._pending.values() if q]
+            if not waiting:
+                return []
+            live = [p for p, seen in self._last_seen.items() if now - seen < PROBE_STALE_SEC]
+            complete = all(self._pending.get(p) for p in live)
+            overdue = now - min(q[0][0] for q in waiting) >= REPORT_INTERVAL
+            if not (complete or overdue):
+                return []
+            return [q.popleft()[1] for q in waiting]
+
+    def poll(self, now: Optional[float] = None) -> int:
+        """Merge and report every window that is ready. Returns windows reported."""
+        now = time.monotonic() if now is None else now
+        n = 0
+        while True:
+            window = self._next_window(now)
+            if not window:
+                return n
+            self._merge_window(window)
+            n += 1
+
+    def _merge_window(self, deltas: list[IntervalDelta]) -> None:
+        m = self._merge
+        records = []
+        for d in deltas:
+            records.append((FLOW_REC_OVERFLOW, 0, 0, 0, 0, 0, d.packets, d.bytes))
+            records += [(FLOW_REC_HH_FLOW, *f) for f in d.flows]
+            records += [(FLOW_REC_HH_SRC, ip, 0, 0, 0, 0, p, b) for ip, p, b in d.src_hosts]
+            records += [(FLOW_REC_HH_DST, 0, ip, 0, 0, 0, p, b) for ip, p, b in d.dst_hosts]
+        records += self._sketch_fill(deltas)
+        if records:
+            m.add(records)
+
+        interval = max(d.interval_ms for d in deltas) / 1000 or REPORT_INTERVAL
+        packets, nbytes = m.totals()
+        now = time.monotonic()
+        self._rates.update_link(now, packets, nbytes)
+        factor, min_bps = self._alerter.surge_limits()
+        if factor:
+            change = self._rates.link_change(now, factor, min_bps)
+            if change:
+                self._alerter.check_surge([change], {})
+        logger.info("Window: %d probes (%s), %d packets, %d bytes", len(deltas),
+                    ",".join(sorted(d.probe for d in deltas)), packets, nbytes)
+        self._report(interval)
+        m.reset()
+
+    @staticmethod
+    def _sketch_fill(deltas: list[IntervalDelta]) -> list[tuple]:
+        """Estimates for top hosts of some probes from the sketches of the others."""
+        records = []
+        for hosts_of, pkts_c, bytes_c, kind in (
+                (lambda d: d.src_hosts, SKETCH_SRC_PACKETS, SKETCH_SRC_BYTES, FLOW_REC_HH_SRC),
+                (lambda d: d.dst_hosts, SKETCH_DST_PACKETS, SKETCH_DST_BYTES, FLOW_REC_HH_DST)):
+            listed = [{ip: b for ip, _, b in hosts_of(d)} for d in deltas]
+            candidates = set().union(*listed)
+            for d, mine in zip(deltas, listed):
+                if not d.sketch:
+                    continue
+                cap = min(mine.values()) if mine else None
+                for ip in candidates - mine.keys():
+                    b = sketch_estimate(d, bytes_c, ip)
+                    if cap is not None:
+                        b = min(b, cap)
+                    if not b:
+                        continue
+                    p = sketch_estimate(d, pkts_c, ip)
+                    src, dst = (ip, 0) if kind == FLOW_REC_HH_SRC else (0, ip)
+                    records.append((kind, src, dst, 0, 0, 0, p, b))
+        return records
+
+    # ---- Network ----
+
+    def start(self) -> None:
+        """Listen for probes; returns once the socket is bound."""
+        agg = self
+
+        class Handler(socketserver.StreamRequestHandler):
+            def handle(self):
+                peer = "%s:%d" % self.client_address[:2]
+                logger.info("Probe connected from %s", peer)
+                try:
+                    while True:
+                        payload = read_frame(self.rfile)
+                        if payload is None:
+                            break
+                        agg.submit(decode(payload))
+                except ValueError as e:
+                    logger.warning("Dropping connection from %s: %s", peer, e)
+                except OSError as e:
+                    logger.info("Connection from %s ended: %s", peer, e)
+
+        self._enricher.start()
+        socketserver.ThreadingTCPServer.allow_reuse_address = True
+        self._server = socketserver.ThreadingTCPServer(self._listen, Handler)
+        self._server.daemon_threads = True
+        self._server_thread = threading.Thread(target=self._server.serve_forever, name="agg-listen", daemon=True)
+        self._server_thread.start()
+        self._started = True
+        logger.info("Aggregator listening on %s:%d", self._listen[0], self.port)
+
+    def run(self) -> None:
+        while not self._stop_event.is_set():
+            self._stop_event.wait(COORDINATOR_POLL)
+            self.poll()
+
+    def request_stop(self) -> None:
+        """Signal-safe: run() returns after its current poll."""
+        self._stop_event.set()
+
+    def stop(self) -> None:
+        if self._stopped:
+            return
+        self._stopped = True
+        self._stop_event.set()
+        if self._server:
+            if self._started:
+                self._server.shutdown()
+            self._server.server_close()
+            self._server = None
+        # Whatever is still pending goes out as a last (partial) window
+        self.poll(time.monotonic() + REPORT_INTERVAL)
+        if self._merge:
+            self._merge.close()
+            self._merge = None
+        self._enricher.stop()
+        logger.info("Aggregator stopped")
+
+
+def main() -> None:
+    log_level = os.environ.get("LOG_LEVEL", "INFO").upper()
+    logging.basicConfig(
+        level=getattr(logging, log_level, logging.INFO),
+        format="%(asctime)s %(name)s %(levelname)s %(message)s",
+    )
+
+    multiproc_probe._load_flow_merge()
+    if not multiproc_probe._flow_merge_lib:
+        logger.error("flow_merge.so not found — compile with: gcc -O2 -shared -fPIC -o flow_merge.so flow_merge.c")
+        sys.exit(1)
+
+    listen = os.environ.get("AGGREGATOR_LISTEN", f"0.0.0.0:{AGG_PORT}")
+    addr, _, port = listen.rpartition(":")
+    try:
+        aggregator = Aggregator(addr or "0.0.0.0", int(port))
+    except ValueError:
+        logger.error("Invalid AGGREGATOR_LISTEN %r (addr:port)", listen)
+        sys.exit(1)
+
+    def handle_signal(signum, frame):
+        logger.info("Received signal %d, shutting down", signum)
+        aggregator.request_stop()
+
+    signal.signal(signal.SIGTERM, handle_signal)
+    signal.signal(signal.SIGINT, handle_signal)
+
+    try:
+        aggregator.start()
+        aggregator.run()
+    except Exception:
+        logger.exception("Fatal error in aggregator")
+        sys.exit(1)
+    finally:
+        aggregator.stop()
+
+
+if __name__ == "__main__":
+    main()
@@ -37,6 +37,38 @@ def pps_to_human(pps: float) -> str:
     return f"{pps:.1f} Gpps"
 
 
+TCP_FLAG_NAMES = ("FIN", "SYN", "RST", "PSH", "ACK", "URG", "ECE", "CWR")
+PROTO_NAMES = {1: "icmp", 6: "tcp", 17: "udp", 47: "gre", 50: "esp", 58: "icmpv6", 132: "sctp"}
+
+
+def proto_name(proto: int) -> str:
+    return PROTO_NAMES.get(proto, f"proto-{proto}")
+
+
+def tcp_flags_str(flags: int) -> str:
+    return "|".join(n for i, n in enumerate(TCP_FLAG_NAMES) if flags >> i & 1) or "-"
+
+
+def classify_flow(flow: dict) -> str:
+    """Label a top flow from its extended counters (PROBE_EXT_COUNTERS):
+    "syn-flood", "udp-flood", "bulk", or "" when unknown or unremarkable."""
+    ext = flow.get("ext")
+    packets = flow.get("packets", 0)
+    if not ext or packets <= 0:
+        return ""
+    hist = ext.get("len_hist", [])
+    small = sum(hist[:2])   # < 128 bytes
+    large = sum(hist[5:])   # >= 1024 bytes
+    proto = flow.get("key", ("?", "?", 0))[2]
+    if proto == 6 and ext.get("syn", 0) * 2 >= packets:
+        return "syn-flood"
+    if proto == 17 and small * 2 >= packets:
+        return "udp-flood"
+    if proto == 6 and ext.get("tcp_flags", 0) & 0x10 and large * 2 >= packets:
+        return "bulk"
+    return ""
+
+
 def _env_float(name: str, default: float) -> float:
     raw = os.environ.get(name, "")
     if not raw:
@@ -49,7 +81,9 @@ def _env_float(name: str, default: float) -> float:
 
 
 class FlowAlerter:
-    def __init__(self):
+    def __init__(self, scope: str = ""):
+        # Prefixes subjects and Slack messages ("GLOBAL" at the aggregator, the probe ID behind one)
+        self._scope = scope
         self._sns_topic_arn = os.environ.get("SNS_TOPIC_ARN", "")
         self._slack_webhook_url = os.environ.get("SLACK_WEBHOOK_URL", "")
         self._threshold_bps = _env_float("ALERT_THRESHOLD_BPS", 1e9)
@@ -60,6 +94,10 @@ class FlowAlerter:
         self._host_threshold_bps = _env_float("ALERT_HOST_BPS", 0)  # 0 = disabled
         self._host_threshold_pps = _env_float("ALERT_HOST_PPS", 0)
         self._host_cooldowns: dict[str, float] = {}  # ip -> last_alert_time
+        # Rate-of-change vs EWMA baseline (rate_engine.py): factor 0 = disabled
+        self._surge_factor = _env_float("ALERT_SURGE_FACTOR", 0)
+        self._surge_min_bps = _env_float("ALERT_SURGE_MIN_BPS", 1e8)
+        self._surge_cooldowns: dict[tuple[str, str], float] = {}  # (key, kind) -> last_alert_time
         self._region = os.environ.get("AWS_REGION", "us-east-1")
         self._sns_client = boto3.client("sns", region_name=self._region) if self._sns_topic_arn else None
         # Async send queue — prevents SNS/Slack blocking the coordinator hot path
@@ -117,9 +155,16 @@ class FlowAlerter:
         top_sources: list[dict],
         top_dests: list[dict],
         top_flows: list[dict],
+        top_subnets: Optional[dict[str, list[tuple[str, int]]]] = None,
+        top_ports: Optional[list[dict]] = None,
+        top_services: Optional[list[dict]] = None,
+        protocols: Optional[dict[int, int]] = None,
     ) -> bool:
         """Detail check (called every 5s report). Sends Top-N follow-up if pending,
-        or a full alert if threshold newly crossed."""
+        or a full alert if threshold newly crossed. top_subnets maps a label
+        such as "src /24" to (subnet, bytes) rows, largest first; top_ports
+        and top_services are destination port / dst_ip:port rows, protocols
+        maps IP protocol number to bytes."""
         if interval_sec <= 0:
             return False
 
@@ -131,7 +176,8 @@ class FlowAlerter:
         if self._pending_detail and breached:
             # Follow-up to fast alert — always send (bypasses cooldown)
             self._pending_detail = False
-            message = self._format_alert(bps, pps, top_sources[:5], top_dests[:5], top_flows[:5])
+            message = self._format_alert(bps, pps, top_sources[:5], top_dests[:5], top_flows[:5], top_subnets,
+                                         top_ports, top_services, protocols)
             subject = f"[DETAIL] Traffic Alert: {bps_to_human(bps)} / {pps_to_human(pps)}"
 
             logger.warning("DETAIL ALERT follow-up: %s", subject)
@@ -153,7 +199,8 @@ class FlowAlerter:
             return False
 
         self._last_alert_time = now
-        message = self._format_alert(bps, pps, top_sources[:5], top_dests[:5], top_flows[:5])
+        message = self._format_alert(bps, pps, top_sources[:5], top_dests[:5], top_flows[:5], top_subnets,
+                                     top_ports, top_services, protocols)
         subject = f"Traffic Alert: {bps_to_human(bps)} / {pps_to_human(pps)}"
 
         logger.warning("ALERT triggered: %s", subject)
@@ -191,16 +238,11 @@ class FlowAlerter:
         alerted: list[str] = []
 
         for ip, (pkts, byt, direction) in all_ips.items():
+            if not self.host_breached(pkts, byt, interval_sec):
+                continue
             bps = byt * 8 / interval_sec
             pps = pkts / interval_sec
 
-            if self._host_threshold_bps > 0 and bps > self._host_threshold_bps:
-                pass  # breached
-            elif self._host_threshold_pps > 0 and pps > self._host_threshold_pps:
-                pass  # breached
-            else:
-                continue
-
             last = self._host_cooldowns.get(ip, 0)
             if now - last < self._cooldown_sec:
                 continue
@@ -228,6 +270,78 @@ class FlowAlerter:
 
         return alerted
 
+    def check_surge(self, changes: list[dict], enriched: dict[str, dict]) -> list[str]:
+        """Rate-of-change alerts from RateEngine.link_change() / host_surges()
+        rows: a link or host well above its baseline ("surge"), or the link
+        well below it ("drop", e.g. a failed DX path). Cooldown is per key and
+        kind. Returns the keys alerted."""
+        now = time.time()
+        alerted: list[str] = []
+        for c in changes:
+            ck = (c["key"], c["kind"])
+            if now - self._surge_cooldowns.get(ck, 0) < self._cooldown_sec:
+                continue
+            self._surge_cooldowns[ck] = now
+            alerted.append(c["key"])
+
+            if c["key"] == "link":
+                who = "link"
+            else:
+                info = enriched.get(c["key"], {})
+                who = f"{c['key']} ({info.get('name') or info.get('instance_id') or c['key']})"
+            subject = f"[{c['kind'].upper()}] Traffic Alert: {who} {bps_to_human(c['bps'])}"
+            message = (
+                f"=== VGW Traffic Rate {'Surge' if c['kind'] == 'surge' else 'Drop'} ===\n"
+                f"{'Link' if c['key'] == 'link' else 'Host'}: {who}\n"
+                f"Rate: {bps_to_human(c['bps'])} / {pps_to_human(c['pps'])}\n"
+                f"Baseline: {bps_to_human(c['baseline_bps'])} / {pps_to_human(c['baseline_pps'])}\n"
+                f"Factor: {self._surge_factor:g}x"
+            )
+            if c["key"] != "link":
+                message += f"\nDirection: {c['direction']}"
+
+            logger.warning("%s ALERT: %s", c["kind"].upper(), subject)
+
+            if self._sns_topic_arn:
+                self._send_sns(message, subject)
+            if self._slack_webhook_url:
+                self._send_slack(message)
+
+        return alerted
+
+    def state(self) -> dict:
+        """Cooldowns still running (wall clock), so a restarted probe does not repeat their alerts."""
+        since = time.time() - self._cooldown_sec
+        return {"last": self._last_alert_time, "pending_detail": self._pending_detail,
+                "hosts": {ip: t for ip, t in self._host_cooldowns.items() if t > since},
+                "surges": [[key, kind, t] for (key, kind), t in self._surge_cooldowns.items() if t > since]}
+
+    def restore(self, state: dict) -> None:
+        """Take over the cooldowns of a state() from an earlier process."""
+        self._last_alert_time = max(self._last_alert_time, float(state.get("last", 0)))
+        self._pending_detail = self._pending_detail or bool(state.get("pending_detail"))
+        self._host_cooldowns.update({ip: float(t) for ip, t in state.get("hosts", {}).items()})
+        self._surge_cooldowns.update({(key, kind): float(t) for key, kind, t in state.get("surges", [])})
+
+    def surge_limits(self) -> tuple[float, float]:
+        """(factor, min_bps) for rate-of-change detection; factor 0 = disabled."""
+        return self._surge_factor, self._surge_min_bps
+
+    def host_limits(self, interval_sec: float) -> tuple[Optional[float], Optional[float]]:
+        """Per-host (packets, bytes) a host may reach in interval_sec before
+        check_host would fire; None where that threshold is disabled."""
+        max_pkts = self._host_threshold_pps * interval_sec if self._host_threshold_pps > 0 else None
+        max_bytes = self._host_threshold_bps * interval_sec / 8 if self._host_threshold_bps > 0 else None
+        return max_pkts, max_bytes
+
+    def host_breached(self, packets: int, bytes_: int, interval_sec: float) -> bool:
+        """True if one host's counters over interval_sec exceed a per-host threshold."""
+        if interval_sec <= 0:
+            return False
+        if self._host_threshold_bps > 0 and bytes_ * 8 / interval_sec > self._host_threshold_bps:
+            return True
+        return self._host_threshold_pps > 0 and packets / interval_sec > self._host_threshold_pps
+
     def _format_alert(
         self,
         bps: float,
@@ -235,6 +349,10 @@ class FlowAlerter:
         top_sources: list[dict],
         top_dests: list[dict],
         top_flows: list[dict],
+        top_subnets: Optional[dict[str, list[tuple[str, int]]]] = None,
+        top_ports: Optional[list[dict]] = None,
+        top_services: Optional[list[dict]] = None,
+        protocols: Optional[dict[int, int]] = None,
     ) -> str:
         lines = [
             "=== VGW Traffic Mirror Alert ===",
@@ -255,14 +373,49 @@ class FlowAlerter:
             label = info.get("name") or info.get("instance_id") or d.get("ip", "?")
             lines.append(f"  {d.get('ip', '?'):>15s}  {bytes_to_human(d.get('bytes', 0)):>10s}  ({label})")
 
+        if top_ports:
+            lines.append("")
+            lines.append("--- Top Destination Ports ---")
+            for p in top_ports[:5]:
+                lines.append(f"  {proto_name(p['proto']) + '/' + str(p['port']):>15s}  {bytes_to_human(p['bytes']):>10s}")
+        if top_services:
+            lines.append("")
+            lines.append("--- Top Services ---")
+            for sv in top_services[:5]:
+                info = sv.get("info", {})
+                label = info.get("name") or info.get("instance_id") or sv["ip"]
+                lines.append(f"  {sv['ip']:>15s}  {proto_name(sv['proto'])}/{sv['port']:<5d}  "
+                             f"{bytes_to_human(sv['bytes']):>10s}  ({label})")
+        total = sum((protocols or {}).values())
+        if total:
+            mix = sorted(protocols.items(), key=lambda kv: kv[1], reverse=True)
+            lines.append("")
+            lines.append("Protocols: " + ", ".join(f"{proto_name(p)} {b * 100 / total:.1f}%" for p, b in mix[:5]))
+
         lines.append("")
         lines.append("--- Top Flows ---")
         for f in top_flows:
             key = f.get("key", ("?", "?", 0, 0, 0))
-            lines.append(
+            line = (
                 f"  {key[0]}:{key[3]} -> {key[1]}:{key[4]} proto={key[2]}  "
                 f"{bytes_to_human(f.get('bytes', 0))}"
             )
+            ext = f.get("ext")
+            if ext:
+                line += f"  flags={tcp_flags_str(ext['tcp_flags'])} syn={ext['syn']} rst={ext['rst']}"
+                duration = (ext["last_ns"] - ext["first_ns"]) / 1e9
+                line += f" seen={duration:.1f}s"
+                label = classify_flow(f)
+                if label:
+                    line += f"  [{label}]"
+            lines.append(line)
+
+        rows = {label: nets for label, nets in (top_subnets or {}).items() if nets}
+        if rows:
+            lines.append("")
+            lines.append("--- Top Subnets ---")
+            for label, nets in rows.items():
+                lines.append(f"  {label:<8s}  " + ", ".join(f"{net} {bytes_to_human(b)}" for net, b in nets[:3]))
 
         return "\n".join(lines)
 
@@ -288,9 +441,13 @@ class FlowAlerter:
     def _send_sns(self, message: str, subject: str) -> None:
         if not self._sns_client:
             return
+        if self._scope:
+            subject = f"[{self._scope}] {subject}"
         self._enqueue_send(self._do_send_sns, message, subject)
 
     def _send_slack(self, message: str) -> None:
+        if self._scope:
+            message = f"[{self._scope}] {message}"
         self._enqueue_send(self._do_send_slack, message)
 
     def _do_send_sns(self, message: str, subject: str) -> None:
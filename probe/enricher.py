@@ -1,92 +1,291 @@
+import json
 import logging
 import os
+import socket
+import struct
 import threading
 import time
-from typing import Optional
+from typing import Iterable, Optional
 
 import boto3
 from botocore.exceptions import ClientError
 
 logger = logging.getLogger(__name__)
 
+# Netmask per prefix length, host byte order
+_MASKS = tuple((0xFFFFFFFF << (32 - n)) & 0xFFFFFFFF for n in range(33))
+_MISS: dict = {}
+CACHE_MAX_AGE = 86400   # seconds: an older enrichment cache is not loaded
+
+
+def _ip_int(ip: str) -> int:
+    """Dotted quad -> host-order int."""
+    return struct.unpack("!I", socket.inet_aton(ip))[0]
+
+
+def _parse_cidr(cidr: str) -> tuple[int, int]:
+    """'a.b.c.d/n' (or a bare address, /32) -> (host-order network, n)."""
+    addr, _, plen = cidr.strip().partition("/")
+    n = int(plen) if plen else 32
+    if not 0 <= n <= 32:
+        raise ValueError(f"bad prefix length in {cidr!r}")
+    return _ip_int(addr) & _MASKS[n], n
+
+
+class PrefixTable:
+    """
+    Immutable longest-prefix-match table: IPv4 prefix -> info dict.
+
+    One dict per prefix length present, keyed by the masked host-order
+    address. A lookup probes the lengths longest first, so it costs one dict
+    get per distinct length (/32 plus a handful of subnet, VPC and on-prem
+    sizes) whatever the number of entries. Never modified after __init__:
+    readers share it without a lock and IPEnricher swaps in a new one.
+    """
+
+    __slots__ = ("_levels", "size")
+
+    def __init__(self, entries: Iterable[tuple[int, int, dict]] = ()):
+        """entries: (host-order network, prefix length, info); on duplicates the first one wins."""
+        by_len: dict[int, dict[int, dict]] = {}
+        for net, plen, info in entries:
+            by_len.setdefault(plen, {}).setdefault(net & _MASKS[plen], info)
+        self._levels = tuple((_MASKS[n], by_len[n]) for n in sorted(by_len, reverse=True))
+        self.size = sum(len(level) for level in by_len.values())
+
+    def lookup(self, addr: int) -> Optional[dict]:
+        """Info of the longest prefix containing host-order addr, or None."""
+        for mask, level in self._levels:
+            info = level.get(addr & mask)
+            if info is not None:
+                return info
+        return None
+
 
 class IPEnricher:
-    def __init__(self):
+    """
+    IP -> owner metadata, refreshed every 60s in a background thread.
+
+    Exact /32 entries come from EC2 instances and ENIs (ELB, NAT gateway,
+    endpoint and other ENIs without an instance); CIDR entries from
+    ONPREM_CIDRS and the VPC's subnets and CIDR blocks, so any address in a
+    known range gets at least a label. The most specific entry wins.
+
+    With cache_path, every successful refresh is also written there, and
+    start() serves lookups from that file (if it matches the region and VPC)
+    instead of waiting for the first refresh, which then runs in the
+    background: a restarted probe enriches its first report without a
+    blocking round of describe_* calls.
+    """
+
+    def __init__(self, cache_path: str = ""):
         self._region = os.environ.get("AWS_REGION", "us-east-1")
         self._vpc_id = os.environ.get("VPC_ID", "")
+        self._onprem_cidrs = [c.strip() for c in os.environ.get("ONPREM_CIDRS", "").split(",") if c.strip()]
         self._ec2 = boto3.client("ec2", region_name=self._region)
-        self._cache: dict[str, dict] = {}
-        self._lock = threading.Lock()
+        self._table = PrefixTable()
+        # Last good entries per optional source, reused when its API call fails
+        self._extra: dict[str, list[tuple[int, int, dict]]] = {}
         self._running = False
         self._thread: Optional[threading.Thread] = None
+        self._cache_path = cache_path
 
     def start(self) -> None:
         self._running = True
-        self._refresh()
-        self._thread = threading.Thread(target=self._refresh_loop, daemon=True)
+        cached = self._load_cache()
+        if not cached:
+            self._refresh()
+        self._thread = threading.Thread(target=self._refresh_loop, args=(0 if cached else 60,), daemon=True)
         self._thread.start()
         logger.info("IPEnricher started (region=%s, vpc=%s)", self._region, self._vpc_id)
 
     def stop(self) -> None:
         self._running = False
 
-    def _refresh_loop(self) -> None:
+    def _refresh_loop(self, delay: float = 60) -> None:
         while self._running:
-            time.sleep(60)
+            time.sleep(delay)
+            delay = 60
             if self._running:
                 self._refresh()
 
+    def _filters(self) -> list[dict]:
+        return [{"Name": "vpc-id", "Values": [self._vpc_id]}] if self._vpc_id else []
+
+    def _instances(self) -> list[tuple[int, int, dict]]:
+        entries = []
+        paginator = self._ec2.get_paginator("describe_instances")
+        for page in paginator.paginate(Filters=self._filters()):
+            for reservation in page["Reservations"]:
+                for instance in reservation["Instances"]:
+                    tags = {t["Key"]: t["Value"] for t in instance.get("Tags", [])}
+                    info = {
+                        "instance_id": instance["InstanceId"],
+                        "name": tags.get("Name", ""),
+                        "asg": tags.get("aws:autoscaling:groupName", ""),
+                        "owner": tags.get("Owner", ""),
+                    }
+                    for nic in instance.get("NetworkInterfaces", []):
+                        for addr in nic.get("PrivateIpAddresses", []):
+                            ip = addr.get("PrivateIpAddress")
+                            if ip:
+                                entries.append((_ip_int(ip), 32, info))
+        return entries
+
+    def _enis(self) -> list[tuple[int, int, dict]]:
+        """ENIs not attached to an instance: ELB, NAT gateway, VPC endpoint, Lambda, ..."""
+        entries = []
+        paginator = self._ec2.get_paginator("describe_network_interfaces")
+        for page in paginator.paginate(Filters=self._filters()):
+            for eni in page["NetworkInterfaces"]:
+                if eni.get("Attachment", {}).get("InstanceId"):
+                    continue
+                tags = {t["Key"]: t["Value"] for t in eni.get("TagSet", [])}
+                info = {
+                    "eni_id": eni["NetworkInterfaceId"],
+                    "name": tags.get("Name") or eni.get("Description", ""),
+                    "interface_type": eni.get("InterfaceType", ""),
+                    "owner": tags.get("Owner", ""),
+                }
+                for addr in eni.get("PrivateIpAddresses", []):
+                    ip = addr.get("PrivateIpAddress")
+                    if ip:
+                        entries.append((_ip_int(ip), 32, info))
+        return entries
+
+    def _subnets(self) -> list[tuple[int, int, dict]]:
+        entries = []
+        for page in self._ec2.get_paginator("describe_subnets").paginate(Filters=self._filters()):
+            for subnet in page["Subnets"]:
+                tags = {t["Key"]: t["Value"] for t in subnet.get("Tags", [])}
+                cidr = subnet["CidrBlock"]
+                entries.append((*_parse_cidr(cidr), {
+                    "subnet_id": subnet["SubnetId"],
+                    "name": tags.get("Name") or subnet["SubnetId"],
+                    "cidr": cidr,
+                    "az": subnet.get("AvailabilityZone", ""),
+                }))
+        return entries
+
+    def _vpcs(self) -> list[tuple[int, int, dict]]:
+        entries = []
+        kwargs = {"VpcIds": [self._vpc_id]} if self._vpc_id else {}
+        for page in self._ec2.get_paginator("describe_vpcs").paginate(**kwargs):
+            for vpc in page["Vpcs"]:
+                tags = {t["Key"]: t["Value"] for t in vpc.get("Tags", [])}
+                for assoc in vpc.get("CidrBlockAssociationSet") or [{"CidrBlock": vpc["CidrBlock"]}]:
+                    cidr = assoc["CidrBlock"]
+                    entries.append((*_parse_cidr(cidr), {
+                        "vpc_id": vpc["VpcId"],
+                        "name": tags.get("Name") or vpc["VpcId"],
+                        "cidr": cidr,
+                    }))
+        return entries
+
+    def _onprem(self) -> list[tuple[int, int, dict]]:
+        entries = []
+        for cidr in self._onprem_cidrs:
+            try:
+                entries.append((*_parse_cidr(cidr), {"name": "on-prem", "cidr": cidr}))
+            except (OSError, ValueError):
+                logger.warning("IPEnricher: ignoring bad ONPREM_CIDRS entry %r", cidr)
+        return entries
+
     def _refresh(self) -> None:
         try:
-            filters = []
-            if self._vpc_id:
-                filters.append({"Name": "vpc-id", "Values": [self._vpc_id]})
-
-            paginator = self._ec2.get_paginator("describe_instances")
-            new_cache: dict[str, dict] = {}
-
-            for page in paginator.paginate(Filters=filters):
-                for reservation in page["Reservations"]:
-                    for instance in reservation["Instances"]:
-                        instance_id = instance["InstanceId"]
-                        tags = {t["Key"]: t["Value"] for t in instance.get("Tags", [])}
-                        name = tags.get("Name", "")
-                        asg = tags.get("aws:autoscaling:groupName", "")
-                        owner = tags.get("Owner", "")
-
-                        for nic in instance.get("NetworkInterfaces", []):
-                            for addr in nic.get("PrivateIpAddresses", []):
-                                ip = addr.get("PrivateIpAddress")
-                                if ip:
-                                    new_cache[ip] = {
-                                        "instance_id": instance_id,
-                                        "name": name,
-                                        "asg": asg,
-                                        "owner": owner,
-                                    }
-
-            with self._lock:
-                self._cache = new_cache
-            logger.info("IPEnricher refreshed: %d IPs cached", len(new_cache))
-
+            instances = self._instances()
         except Exception as e:
             logger.warning("IPEnricher refresh failed, keeping stale cache: %s", e)
+            return
+
+        # ENIs, subnets and VPCs only add labels: without the IAM permission
+        # (or on a failed call) keep their last good entries
+        for source, fetch in (("enis", self._enis), ("subnets", self._subnets), ("vpcs", self._vpcs)):
+            try:
+                self._extra[source] = fetch()
+            except Exception as e:
+                logger.warning("IPEnricher: %s lookup failed, keeping stale entries: %s", source, e)
+
+        table = self._build(instances)
+        logger.info("IPEnricher refreshed: %d prefixes (%d instance IPs)", table.size, len(instances))
+        self._save_cache(instances)
+
+    def _build(self, instances: list[tuple[int, int, dict]]) -> PrefixTable:
+        # Sources in priority order for equal prefixes: instances over bare
+        # ENIs, configured on-prem labels over subnet and VPC data
+        table = PrefixTable([
+            *instances, *self._extra.get("enis", ()), *self._onprem(),
+            *self._extra.get("subnets", ()), *self._extra.get("vpcs", ()),
+        ])
+        self._table = table     # single reference store: readers see the old or the new table
+        return table
+
+    def _save_cache(self, instances: list[tuple[int, int, dict]]) -> None:
+        if not self._cache_path:
+            return
+        cache = {"saved": time.time(), "region": self._region, "vpc_id": self._vpc_id,
+                 "instances": instances, "extra": self._extra}
+        tmp = self._cache_path + ".tmp"
+        try:
+            os.makedirs(os.path.dirname(tmp) or ".", exist_ok=True)
+            with open(tmp, "w") as f:
+                json.dump(cache, f, separators=(",", ":"))
+            os.replace(tmp, self._cache_path)  # a reader sees the previous cache or this one
+        except (OSError, TypeError, ValueError) as e:
+            logger.warning("IPEnricher: cannot write cache %s: %s", self._cache_path, e)
+
+    def _load_cache(self) -> bool:
+        """Build the table from cache_path. False if there is none or it does
+        not apply (another region or VPC, older than CACHE_MAX_AGE)."""
+        if not self._cache_path:
+            return False
+        try:
+            with open(self._cache_path) as f:
+                cache = json.load(f)
+            age = time.time() - cache["saved"]
+            if cache["region"] != self._region or cache["vpc_id"] != self._vpc_id or not 0 <= age <= CACHE_MAX_AGE:
+                logger.info("IPEnricher: cache %s does not apply (%.0fs old, region %s, vpc %s), not loaded",
+                            self._cache_path, age, cache["region"], cache["vpc_id"])
+                return False
+            instances = [(net, plen, info) for net, plen, info in cache["instances"]]
+            extra = {source: [(net, plen, info) for net, plen, info in rows] for source, rows in cache["extra"].items()}
+        except FileNotFoundError:
+            return False
+        except (OSError, ValueError, KeyError, TypeError, AttributeError) as e:
+            logger.warning("IPEnricher: ignoring unreadable cache %s: %s", self._cache_path, e)
+            return False
+        self._extra = extra
+        table = self._build(instances)
+        logger.info("IPEnricher: %d prefixes from a %.0fs old cache, refreshing in the background", table.size, age)
+        return True
 
     def enrich(self, ip: str) -> dict:
-        with self._lock:
-            info = self._cache.get(ip)
+        try:
+            info = self._table.lookup(_ip_int(ip))
+        except OSError:
+            info = None
         if info:
             return {"ip": ip, **info}
         return {"ip": ip}
 
     def enrich_many(self, ips: list[str]) -> list[dict]:
-        with self._lock:
-            cache_snapshot = dict(self._cache)
+        table = self._table
         results = []
         for ip in ips:
-            info = cache_snapshot.get(ip)
-            if info:
-                results.append({"ip": ip, **info})
-            else:
-                results.append({"ip": ip})
+            try:
+                info = table.lookup(_ip_int(ip))
+            except OSError:
+                info = None
+            results.append({"ip": ip, **info} if info else {"ip": ip})
         return results
+
+    def enrich_raw(self, ips: Iterable[int]) -> list[dict]:
+        """
+        Info dicts for raw u32 IPs as the C side stores them (network byte
+        order bytes in a native int, e.g. flow_merge keys and host events),
+        without building address strings. Shared and read-only; {} when
+        nothing matches.
+        """
+        lookup = self._table.lookup
+        ntohl = socket.ntohl
+        return [lookup(ntohl(ip)) or _MISS for ip in ips]
@@ -1,81 +1,83 @@
+/*
+ * ctypes entry points over vxlan_parse.h, the parser the capture loop uses.
+ * Results are in host byte order.
+ *
+ * Compile: gcc -O2 -shared -fPIC -o fast_parse.so fast_parse.c
+ */
 #include <stdint.h>
 #include <string.h>
 #include <arpa/inet.h>
 
+#include "vxlan_parse.h"
+
 struct flow_result {
     uint32_t src_ip;
     uint32_t dst_ip;
     uint8_t  protocol;
-    uint8_t  _pad1;
+    uint8_t  valid;         /* parse_vxlan_batch(): 1 = parsed, 0 = fields are meaningless */
     uint16_t src_port;
     uint16_t dst_port;
     uint16_t pkt_len;
 };
 
-#define VXLAN_HDR_LEN  8
-#define ETH_HDR_LEN    14
-#define ETH_P_IP       0x0800
-#define IP_MIN_HDR_LEN 20
-
-static inline uint16_t read_u16(const uint8_t *p)
+static void batch_result(const struct vxlan_batch *b, int i, struct flow_result *r)
 {
-    return (uint16_t)(p[0] << 8 | p[1]);
+    r->src_ip   = ntohl(b->src_ip[i]);
+    r->dst_ip   = ntohl(b->dst_ip[i]);
+    r->protocol = b->proto[i];
+    r->valid    = b->ok[i];
+    r->src_port = b->src_port[i];
+    r->dst_port = b->dst_port[i];
+    r->pkt_len  = b->ip_len[i];
 }
 
-static inline uint32_t read_u32(const uint8_t *p)
-{
-    return (uint32_t)(p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3]);
-}
+/* IPv6 flow from parse_vxlan_packet6(); addresses stay in network byte order */
+struct flow_result6 {
+    uint8_t  src_ip[16];
+    uint8_t  dst_ip[16];
+    uint8_t  protocol;
+    uint8_t  _pad;
+    uint16_t src_port;
+    uint16_t dst_port;
+    uint16_t pkt_len;
+};
 
 int parse_vxlan_packet(const uint8_t *data, int data_len, struct flow_result *result)
 {
-    int offset = 0;
-
-    /* VXLAN header: 8 bytes */
-    if (data_len < VXLAN_HDR_LEN + ETH_HDR_LEN + IP_MIN_HDR_LEN)
-        return -1;
-    offset += VXLAN_HDR_LEN;
-
-    /* Ethernet header: 14 bytes, check IPv4 ethertype */
-    uint16_t ethertype = read_u16(data + offset + 12);
-    if (ethertype != ETH_P_IP)
-        return -1;
-    offset += ETH_HDR_LEN;
-
-    /* IP header */
-    const uint8_t *ip = data + offset;
-    uint8_t ver_ihl = ip[0];
-    if ((ver_ihl >> 4) != 4)
+    struct vxlan_batch b;
+    if (!vxlan_parse_one(data, data_len, &b, 0))
         return -1;
+    batch_result(&b, 0, result);
+    return 0;
+}
 
-    int ihl = (ver_ihl & 0x0F) * 4;
-    if (ihl < IP_MIN_HDR_LEN)
-        return -1;
-    if (offset + ihl > data_len)
+int parse_vxlan_packet6(const uint8_t *data, int data_len, struct flow_result6 *result)
+{
+    struct vxlan_v6 v;
+    if (!vxlan_parse_v6(data, data_len, &v))
         return -1;
+    memcpy(result->src_ip, v.src_ip, 16);
+    memcpy(result->dst_ip, v.dst_ip, 16);
+    result->protocol = v.proto;
+    result->_pad     = 0;
+    result->src_port = v.src_port;
+    result->dst_port = v.dst_port;
+    result->pkt_len  = v.ip_len;
+    return 0;
+}
 
-    result->pkt_len  = read_u16(ip + 2);
-    result->protocol = ip[9];
-    result->src_ip   = read_u32(ip + 12);
-    result->dst_ip   = read_u32(ip + 16);
-
-    /* TCP or UDP: extract ports */
-    if (result->protocol == IPPROTO_TCP || result->protocol == IPPROTO_UDP) {
-        int l4_offset = offset + ihl;
-        if (l4_offset + 4 > data_len) {
-            result->src_port = 0;
-            result->dst_port = 0;
-        } else {
-            const uint8_t *l4 = data + l4_offset;
-            result->src_port = read_u16(l4);
-            result->dst_port = read_u16(l4 + 2);
-        }
-    } else {
-        result->src_port = 0;
-        result->dst_port = 0;
+/* Parse n packets into out[0..n); out[i].valid marks the ones parsed. Returns their count. */
+int parse_vxlan_batch(const uint8_t **pkts, const int *lens, int n, struct flow_result *out)
+{
+    static __thread struct vxlan_batch b;
+    int parsed = 0;
+    for (int base = 0; base < n; base += VXLAN_BATCH) {
+        int m = n - base < VXLAN_BATCH ? n - base : VXLAN_BATCH;
+        parsed += vxlan_parse_batch(pkts + base, lens + base, m, &b);
+        for (int i = 0; i < m; i++)
+            batch_result(&b, i, &out[base + i]);
     }
-
-    return 0;
+    return parsed;
 }
 
 void ip_to_str(uint32_t ip, char *buf, int buf_len)
@@ -2,333 +2,3210 @@
  * High-performance VXLAN capture + parse + aggregate in C.
  * Uses recvmmsg() to batch-receive packets, eliminating Python per-packet overhead.
  *
- * Compile: gcc -O2 -shared -fPIC -o fast_recv.so fast_recv.c
+ * Two flow tables are kept per context (active + standby). The capture thread
+ * only ever writes the active one; cap_swap() flips them atomically and
+ * cap_drain() empties the retired table, so draining never pauses recvmmsg().
+ *
+ * Optional sampling (cap_set_sampling) drops work before it is done: packet
+ * 1-in-N skips parsing entirely, and flow-hash sampling keeps or skips whole
+ * 5-tuples before the table lookup.
+ *
+ * Backends (cap_create_ex): a SO_REUSEPORT UDP socket read with recvmmsg(),
+ * or an AF_XDP socket on one NIC RX queue fed by the steering program that
+ * xdp_attach() loads (xdp_prog.h). AF_XDP parses frames in place in the
+ * UMEM, skipping the kernel UDP stack and the copy into pktbufs.
+ * CAP_BACKEND_XDP_COUNT moves the parse and count into the kernel as well:
+ * an XDP program aggregates into per-CPU BPF hash maps and the capture
+ * thread drains them in batches into the active flow table, so cap_swap()
+ * /cap_drain() and everything downstream are unchanged.
+ *
+ * Placement: cap_config.cpu pins the capture thread, and the socket group can
+ * be opened up front (cap_open_socket) and steered by a classic BPF program
+ * (cap_attach_steering) to the socket of the RX CPU or by inner 5-tuple, so
+ * a flow's packets and counters stay on one core.
+ *
+ * With cap_config.udp_gro the socket backend receives UDP_GRO super-datagrams
+ * (same-sized mirror packets coalesced by the kernel into one skb) into 64K
+ * buffers and splits them by the UDP_GRO cmsg segment size, so one recvmmsg()
+ * entry carries up to 64 packets.
+ *
+ * Mirror sources: cap_set_vni_filter() drops packets whose VNI is not in the
+ * configured set before any table work, and cap_config.track_sources keys
+ * flows by the outer source IP as well (a per-context source id in the
+ * key's spare bytes) and emits per-source totals with every drain.
+ *
+ * Inner frames may carry 802.1Q/QinQ tags. IPv6 flows are counted in a
+ * separate table (ht6_entry, 64 bytes) allocated at the first IPv6 packet
+ * and drained into a ring of their own (cap_attach_ring6()), so the IPv4
+ * key, entry size and cache behaviour are untouched.
+ *
+ * cap_config.ext_counters adds per-flow TCP flags, SYN/RST counts, first/last
+ * seen and a packet-length histogram in a slot-parallel array (flow_ext),
+ * exported through a third ring (cap_attach_ring_ext()); without it the
+ * 32-byte entries and the record_flush() loops are exactly as before.
+ *
+ * cap_config.host_bps / host_pps turn on a per-host pre-check: every parsed
+ * IPv4 packet is counted per source and destination IP over short windows
+ * (host_window_ms), and the first crossing of a threshold in a window is
+ * pushed at once as a host_event into a ring of its own
+ * (cap_attach_events()), without waiting for the next cap_drain().
+ *
+ * cap_attach_stats() gives the context a shared-memory struct cap_stats
+ * (flow_ring.h) that every cap_drain() republishes: traffic and parse-reject
+ * counters, receive batch fill, flow slot probe distances, drain time, table
+ * load and the socket's SO_MEMINFO queue. The capture thread only bumps
+ * plain counters (rejects are classified on the failure path, one histogram
+ * slot per receive call); probe distances are measured at drain time.
+ *
+ * CAP_BACKEND_PCAP replays a capture file (pcap_reader.h) through the same
+ * record_packet() / cap_swap() / cap_drain() path: frames are parsed in
+ * place in the mapped file, as fast as possible or paced by capture
+ * timestamps, and several contexts can split one file by inner 5-tuple
+ * hash (pcap_shard of pcap_shards). With replay_epoch_ms the capture
+ * thread stops at every epoch boundary of capture time until
+ * cap_replay_step() lets it on, so each flush interval holds exactly one
+ * epoch of the capture, and every time the capture path reads (host
+ * windows, host events, ext_counters stamps) is the capture's own.
+ *
+ * Compile: gcc -O2 -shared -fPIC -o fast_recv.so fast_recv.c -lpthread
  */
 
 #define _GNU_SOURCE
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <poll.h>
 #include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/random.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
+#include <net/if.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <linux/filter.h>
+#include <linux/sock_diag.h>
+
+#include "flow_ring.h"
+#include "xdp_prog.h"
+#include "vxlan_parse.h"
+#include "pcap_reader.h"
+
+#ifndef AF_XDP
+#define AF_XDP          44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP         283
+#endif
 
 /* ---- Configuration ---- */
-#define BATCH_SIZE      256
+#define BATCH_SIZE      256         /* recvmmsg() vlen (blocking/busy-poll) and AF_XDP batch */
+#define BATCH_MAX       1024        /* recvmmsg() buffers: adaptive batches grow up to this */
+#define BATCH_MIN       16
+#define GRO_BATCH       64          /* recvmmsg() vlen with UDP_GRO: one super-datagram each */
+#define GRO_BUF_SIZE    65536
+
+#ifndef UDP_GRO
+#define UDP_GRO         104
+#endif
+#ifndef SO_MEMINFO
+#define SO_MEMINFO      55
+#endif
 #define MAX_PKT_SIZE    2048
-#define HT_SIZE         (1 << 20)   /* 1048576 slots — supports 500K flows at ~48% load factor */
-#define HT_MASK         (HT_SIZE - 1)
-#define MAX_FLOWS       500000      /* 40Gbps DX can produce 200K+ unique flows easily */
-#define FLUSH_BUF_MAX   500000
-
-/* ---- VXLAN parsing constants ---- */
-#define VXLAN_HDR       8
-#define ETH_HDR         14
-#define IP_MIN_HDR      20
-#define ETH_P_IP        0x0800
-
-/* ---- Hash table entry (32 bytes, aligned) ---- */
-struct ht_entry {
+#define CAP_DEFAULT_FLOWS       65536       /* initial table capacity (cap_config.max_flows) */
+#define CAP_DEFAULT_FLOW_LIMIT  (1 << 21)   /* growth ceiling; 40Gbps DX can produce 200K+ flows easily */
+#define HUGE_PAGE_SIZE          (2u << 20)
+
+/* ---- AF_XDP configuration ---- */
+#define XSK_FRAME_SIZE  2048
+#define XSK_NUM_FRAMES  4096
+#define XSK_FILL_SIZE   XSK_NUM_FRAMES  /* every frame can be posted at once */
+#define XSK_RX_SIZE     2048
+#define XSK_COMP_SIZE   64              /* RX only, but bind() requires one */
+
+/* ---- Capture backends (struct cap_config.backend) ---- */
+#define CAP_BACKEND_SOCKET  0           /* UDP socket + recvmmsg() */
+#define CAP_BACKEND_AF_XDP  1           /* AF_XDP RX ring on one NIC queue */
+#define CAP_BACKEND_XDP_COUNT 2         /* in-kernel aggregation, whole interface */
+#define CAP_BACKEND_PCAP    3           /* replay of a pcap / pcapng file (pcap_path) */
+
+#define CAP_PCAP_PATH_MAX   256
+#define REPLAY_PARK_US      20          /* poll while parked at an epoch boundary */
+#define REPLAY_PACE_MAX_US  1000        /* longest pacing sleep, so cap_stop() stays prompt */
+
+/* ---- In-kernel aggregation (CAP_BACKEND_XDP_COUNT) ---- */
+#define XDPC_POLL_MS    100             /* kernel map drain interval */
+#define XDPC_GRACE_US   1000            /* wait after flipping maps for in-flight programs */
+#define XDPC_BATCH      1024            /* entries per lookup_and_delete batch */
+
+/* ---- Mirror sources (cap_config.track_sources, cap_set_vni_filter()) ---- */
+#define CAP_MAX_SOURCES 1024            /* outer source IPs given their own id; later ones share id 0 */
+#define SRC_SLOTS       2048            /* outer IP -> id lookup, open addressing */
+#define CAP_MAX_VNIS    16
+
+/* ---- Host threshold pre-check (cap_config.host_bps / host_pps) ---- */
+#define HOST_BITS       14
+#define HOST_SLOTS      (1 << HOST_BITS)    /* src/dst IPs per window, open addressing */
+#define HOST_PROBE      16                  /* slots tried before a packet goes uncounted */
+#define CAP_DEFAULT_HOST_WINDOW_MS  100
+#define HOST_WINDOW_MAX_MS          10000   /* keeps a window's packet count within 32 bits */
+
+/* ---- Socket receive modes (struct cap_config.rx_mode) ---- */
+#define CAP_RX_BLOCKING 0               /* recvmmsg(MSG_WAITFORONE), 100ms SO_RCVTIMEO */
+#define CAP_RX_BUSY_POLL 1              /* SO_BUSY_POLL + SO_PREFER_BUSY_POLL, MSG_DONTWAIT spin */
+#define CAP_RX_ADAPTIVE 2               /* blocking, batch size and coalescing wait follow queue depth */
+#define ADAPT_WAIT_STEP_US 50           /* coalescing wait added per shallow batch */
+#define ADAPT_WAIT_MAX_US 1000
+
+/* ---- SO_REUSEPORT steering (cap_attach_steering()) ---- */
+#define CAP_STEER_CPU   1               /* socket of the CPU that ran the RX softirq */
+#define CAP_STEER_FLOW  2               /* hash of the inner 5-tuple */
+#define STEER_MAX_SOCKS 1024
+
+#define XDP_MODE_NATIVE 1               /* driver XDP (ENA) */
+#define XDP_MODE_GENERIC 2              /* skb XDP: works everywhere, copies */
+
+/*
+ * cap_create_ex() parameters; start from cap_config_init() defaults.
+ * Mirrored by _CCapConfig in multiproc_probe.py (checked via cap_config_size()).
+ */
+struct cap_config {
+    int      port;                  /* UDP port (VXLAN 4789) */
+    int      rcvbuf;                /* socket backend: SO_RCVBUF bytes */
+    int      backend;               /* CAP_BACKEND_* */
+    int      queue_id;              /* AF_XDP: NIC RX queue to bind */
+    uint32_t xsk_map_id;            /* AF_XDP: XSKMAP id from xdp_get_map_id() */
+    char     ifname[IF_NAMESIZE];   /* AF_XDP / XDP_COUNT: interface, e.g. "eth0" */
+    int      max_flows;             /* initial flow table capacity */
+    int      max_flows_limit;       /* tables double up to this many flows, then drop */
+    int      hugepages;             /* back flow tables with 2MB hugepages (hugetlbfs, else THP) */
+    int      cpu;                   /* pin the cap_start() thread to this CPU, -1 = unpinned */
+    int      sock_fd;               /* socket backend: cap_open_socket() fd to use (owned
+                                       from then on), -1 = open one */
+    int      rx_mode;               /* socket backend: CAP_RX_* */
+    int      busy_poll_us;          /* CAP_RX_BUSY_POLL: SO_BUSY_POLL microseconds */
+    int      udp_gro;               /* socket backend: receive coalesced UDP_GRO datagrams */
+    int      track_sources;         /* key flows by mirror source (outer src IP) too */
+    int      ext_counters;          /* keep flow_ext counters per flow (not XDP_COUNT) */
+    uint64_t host_bps;              /* per-host bits/s that raises a host_event, 0 = off */
+    uint64_t host_pps;              /* per-host packets/s, 0 = off (not XDP_COUNT) */
+    int      host_window_ms;        /* host_bps / host_pps counting window, 1..HOST_WINDOW_MAX_MS */
+    char     pcap_path[CAP_PCAP_PATH_MAX];  /* PCAP: capture file to replay */
+    int      pcap_shard;            /* PCAP: replay only flows whose inner 5-tuple hash */
+    int      pcap_shards;           /*   falls in shard pcap_shard of pcap_shards (1 = all) */
+    double   replay_speed;          /* PCAP: 0 = as fast as possible, 1 = capture pace, N = N times faster */
+    int      replay_epoch_ms;       /* PCAP: stop at every epoch of capture time for
+                                       cap_replay_step(), 0 = run to the end of the file */
+};
+
+/* 5-tuple key, compared and hashed as two 64-bit words (16 bytes) */
+struct ht_key {
     uint32_t src_ip;
     uint32_t dst_ip;
     uint16_t src_port;
     uint16_t dst_port;
     uint8_t  proto;
-    uint8_t  occupied;
-    uint16_t _pad;
+    uint8_t  _pad;
+    uint16_t source;            /* mirror source id (track_sources), else 0 */
+};
+
+/*
+ * ---- Hash table entry (32 bytes, aligned): key + counters in one half cache line ----
+ * packets == 0 marks an empty slot (every stored flow has at least one), so
+ * a probe step is one 16-byte key compare and a hit never leaves the line.
+ */
+struct ht_entry {
+    struct ht_key key;
     uint64_t packets;
     uint64_t bytes;
 };
 
-/* ---- Flush output record (32 bytes) ---- */
-struct flow_record {
-    uint32_t src_ip;
-    uint32_t dst_ip;
+/*
+ * ---- Extended counters (cap_config.ext_counters): ext[i] belongs to entries[i] ----
+ * One cache line per slot, so an update is one more miss at most. first_ns
+ * == 0 marks a slot not yet touched since the last drain.
+ */
+struct flow_ext {
+    uint64_t first_ns;
+    uint64_t last_ns;
+    uint32_t syn;
+    uint32_t rst;
+    uint32_t len_hist[FLOW_EXT_BUCKETS];
+    uint8_t  tcp_flags;
+} __attribute__((aligned(64)));
+
+#define TCP_FIN 0x01
+#define TCP_SYN 0x02
+#define TCP_RST 0x04
+#define TCP_ACK 0x10
+
+/*
+ * ---- Flow table (one of the active/standby pair) ----
+ * Sized at runtime: a power-of-two slot array kept at most half full.
+ * When max_flows is reached the capture thread doubles it in place
+ * (table_grow(), rehashing from the insertion log) until limit; only then
+ * are new flows dropped.
+ */
+struct hh_sketch;
+
+#define PAGES_PLAIN     0
+#define PAGES_THP       1               /* madvise(MADV_HUGEPAGE) */
+#define PAGES_HUGETLB   2               /* MAP_HUGETLB, needs vm.nr_hugepages */
+
+/*
+ * ---- IPv6 flow table: fixed FLOW6_SLOTS, at most half full ----
+ * Flows beyond that (or past the probe limit) count towards the overflow
+ * totals only: IPv6 has no sketch candidates.
+ */
+#define FLOW6_SLOTS     (1 << 16)       /* 4 MB of entries per flow_table */
+#define FLOW6_MAX       (FLOW6_SLOTS / 2)
+
+struct ht6_key {
+    uint8_t  src_ip[16];
+    uint8_t  dst_ip[16];
     uint16_t src_port;
     uint16_t dst_port;
     uint8_t  proto;
-    uint8_t  _pad1;
-    uint16_t _pad2;
+    uint8_t  _pad;
+    uint16_t source;
+};
+
+struct ht6_entry {
+    struct ht6_key key;
+    uint64_t packets;           /* 0 = empty slot */
+    uint64_t bytes;
+} __attribute__((aligned(64)));
+
+struct flow6_table {
+    struct ht6_entry entries[FLOW6_SLOTS];
+    uint32_t used[FLOW6_MAX];   /* insertion log, as flow_table.used */
+    int num_flows;
+};
+
+struct flow_table {
+    struct ht_entry *entries;   /* mask + 1 slots */
+    uint32_t *used;             /* insertion log: slot index of every occupied entry */
+    uint32_t mask;
+    int max_flows;              /* capacity of used[]: grow beyond this */
+    int limit;                  /* max_flows ceiling */
+    int hugepages;              /* cap_config.hugepages request */
+    int pages;                  /* PAGES_* actually obtained for entries */
+    size_t map_len;             /* mmap length of entries */
+    int ext_on;                 /* ext_counters: allocate ext with entries */
+    struct flow_ext *ext;       /* mask + 1 slots, NULL unless ext_on */
+    size_t ext_map_len;
+    uint64_t seed;              /* hash_key() seed, for rehashing */
+    int num_flows;              /* entries in used[] */
+    uint64_t dropped_flows;     /* new flows rejected because table full */
+    uint64_t probe_failures;    /* flows skipped due to max probe length exceeded */
+    struct hh_sketch *hh;       /* overflow sketch, allocated at the first skipped flow */
+    struct src_count *src;      /* track_sources: packets/bytes by source id */
+    struct flow6_table *v6;     /* IPv6 flows, allocated at the first one */
+};
+
+struct src_count {
     uint64_t packets;
     uint64_t bytes;
 };
 
+/*
+ * Source ids for outer source IPs, assigned by the capture thread on first
+ * sight and kept for the context's life, so ids mean the same in both
+ * tables. ip[] is written before n is published: cap_drain() reads ids
+ * 1..n from the other thread.
+ */
+struct src_map {
+    uint32_t    slot_ip[SRC_SLOTS];     /* network order, 0 = empty */
+    uint16_t    slot_id[SRC_SLOTS];
+    uint32_t    ip[CAP_MAX_SOURCES + 1];
+    atomic_int  n;
+    uint32_t    last_ip;                /* one-entry cache: batches come mostly from one source */
+    uint16_t    last_id;
+};
+
+/*
+ * ---- Per-host window counters (cap_config.host_bps / host_pps) ----
+ * Written by the capture thread only. A slot whose epoch is not the current
+ * window's is free, so a new window starts without clearing the table;
+ * when the 16-bit epoch wraps the table is zeroed once.
+ */
+struct host_slot {
+    uint32_t ip;                /* network order */
+    uint16_t epoch;
+    uint8_t  fired;             /* 1 << HOST_EV_SRC / HOST_EV_DST: event sent this window */
+    uint8_t  _pad;
+    uint32_t packets[2];        /* indexed by HOST_EV_SRC / HOST_EV_DST */
+    uint64_t bytes[2];
+};
+
+struct host_table {
+    struct host_slot slot[HOST_SLOTS];
+    uint16_t epoch;             /* current window, never 0 */
+    uint16_t window_ms;
+    uint64_t window_ns;
+    uint64_t start_ns;          /* CLOCK_MONOTONIC_COARSE start of the current window */
+    uint64_t limit_packets;     /* per window; UINT64_MAX = threshold off */
+    uint64_t limit_bytes;
+    uint64_t events;            /* host_event records produced */
+    uint64_t uncounted;         /* packet directions not counted: HOST_PROBE slots taken */
+};
+
+/* ---- AF_XDP socket state (one NIC queue) ---- */
+struct xsk_ring {
+    uint32_t *producer;
+    uint32_t *consumer;
+    void     *desc;
+    uint32_t  mask;
+    void     *map;
+    size_t    map_len;
+};
+
+struct xsk_state {
+    int      fd;
+    int      map_fd;            /* XSKMAP this socket is registered in */
+    int      in_map;
+    uint32_t queue_id;
+    uint8_t *umem;              /* XSK_NUM_FRAMES * XSK_FRAME_SIZE */
+    struct xsk_ring rx, fill, comp;
+};
+
+/* ---- In-kernel aggregation state (program + maps owned by this context) ---- */
+struct xdpc_state {
+    int link_fd, prog_fd;
+    int ctrl_fd;                /* ARRAY[0]: index of the flow map the program writes */
+    int stats_fd;               /* PERCPU_ARRAY[0]: struct xdp_count_stats */
+    int flows_fd[2];            /* PERCPU_HASH: xdp_flow_key → xdp_flow_val */
+    uint32_t active;
+    int mode;                   /* XDP_MODE_* */
+    int ncpus;                  /* possible CPUs: per-CPU values come back in this many slots */
+    struct xdp_flow_key *keys;  /* XDPC_BATCH */
+    struct xdp_flow_val *vals;  /* XDPC_BATCH * ncpus */
+    struct xdp_count_stats *cpu_stats;  /* ncpus */
+    struct xdp_count_stats base;        /* kernel totals at the last cap_run()/cap_start() */
+    uint64_t dropped_seen;              /* kernel dropped_flows already charged to a table */
+};
+
+/* ---- Capture file replay state (CAP_BACKEND_PCAP) ---- */
+struct replay_state {
+    struct pcap_file file;
+    int      port;
+    int      shard, shards;
+    double   speed;
+    uint64_t epoch_ns;          /* 0 = not stepped */
+    uint64_t origin_ns;         /* capture time of the first frame: epoch 0 starts here */
+    int      started;
+    struct pcap_pkt next;       /* frame read but held back at the epoch gate or by pacing */
+    int      held;
+    _Atomic uint32_t allowed;   /* epochs the capture thread may replay (cap_replay_step()) */
+    _Atomic uint32_t parked;    /* epochs done: the thread holds at this boundary */
+    _Atomic int eof;
+    int      malformed;         /* the file ended in a truncated or corrupt record */
+    uint64_t wall0_ns;          /* CLOCK_MONOTONIC at which origin_ns is replayed (pacing) */
+    uint64_t park_ns;           /* CLOCK_MONOTONIC parked since, 0 = running */
+    uint64_t now_ns;            /* capture time of the last frame replayed */
+    uint64_t frames;            /* VXLAN frames replayed into this context */
+    uint64_t skipped;           /* frames that are not VXLAN to port (counted by shard 0) */
+};
+
 /* ---- Capture context ---- */
 typedef struct {
-    int sock_fd;
+    int sock_fd;                /* socket backend, -1 when AF_XDP / XDP_COUNT / PCAP is in use */
+    int cpu;                    /* cap_config.cpu */
+    int pinned_cpu;             /* CPU the capture thread is pinned to, -1 = none */
+    struct xsk_state *xsk;      /* AF_XDP backend, NULL otherwise */
+    struct xdpc_state *xdpc;    /* XDP_COUNT backend, NULL otherwise */
+    struct replay_state *replay;    /* PCAP backend, NULL otherwise */
     volatile int running;
-    int num_flows;
-    struct ht_entry table[HT_SIZE];
+    /* double-buffered flow tables: capture writes *active, drain owns the other */
+    struct flow_table tables[2];
+    _Atomic(struct flow_table *) active;
+    _Atomic(struct flow_table *) busy;  /* table the capture thread is writing, or NULL */
+    pthread_t thread;
+    int thread_started;
     /* recvmmsg buffers */
-    struct mmsghdr msgs[BATCH_SIZE];
-    struct iovec   iovecs[BATCH_SIZE];
-    uint8_t        pktbufs[BATCH_SIZE][MAX_PKT_SIZE];
-    /* flush output */
-    struct flow_record flush_buf[FLUSH_BUF_MAX];
+    struct mmsghdr msgs[BATCH_MAX];
+    struct iovec   iovecs[BATCH_MAX];
+    uint8_t        pktbufs[BATCH_MAX][MAX_PKT_SIZE];
+    int            rx_mode;     /* CAP_RX_* in effect */
+    int            batch;       /* current recvmmsg() vlen */
+    int            wait_us;     /* CAP_RX_ADAPTIVE: coalescing sleep before the next batch */
+    /* batch-fill statistics (cap_get_batch_stats()) */
+    uint64_t       rx_calls;    /* receive calls, including empty ones */
+    uint64_t       rx_empty;    /* calls that returned no packets */
+    uint64_t       rx_full;     /* calls that filled the whole batch */
+    uint64_t       rx_pkts;
+    uint64_t       rx_dgrams;   /* recvmmsg() entries (< rx_pkts with UDP_GRO) */
+    int            batch_max;   /* BATCH_MAX, or GRO_BATCH with UDP_GRO */
+    uint8_t       *gro_buf;     /* GRO_BATCH x GRO_BUF_SIZE, NULL unless UDP_GRO is on */
+    char           gro_ctrl[GRO_BATCH][CMSG_SPACE(sizeof(int))];
+    /* packets queued for record_flush(), and its parse output */
+    const uint8_t     *pend[VXLAN_BATCH];
+    int                pend_len[VXLAN_BATCH];
+    uint32_t           pend_src[VXLAN_BATCH];  /* outer source IP, 0 if not tracked */
+    int                npend;
+    struct vxlan_batch parsed;
+    /* mirror sources */
+    struct src_map    *sources;     /* NULL unless track_sources */
+    struct sockaddr_in names[BATCH_MAX];   /* recvmmsg() msg_name, track_sources only */
+    uint32_t           vnis[CAP_MAX_VNIS];
+    int                nvnis;       /* 0 = accept every VNI */
+    uint64_t           vni_dropped; /* parsed packets whose VNI is not in vnis[] */
+    /* flush output: shared-memory ring when attached, else flush_buf */
+    struct flow_ring  *ring;
+    uint64_t           ring_drops;  /* records lost because the ring was full */
+    struct flow_record *flush_buf;  /* allocated on first ring-less drain, grown to fit */
+    int                flush_cap;
+    struct flow_ring  *ring6;       /* IPv6 records, else flush6_buf */
+    struct flow_record6 *flush6_buf;
+    int                flush6_cap;
+    int                flushed6;    /* IPv6 records exported by the last cap_drain() */
+    struct flow_ring  *ring_ext;    /* ext_counters records, else flush_ext_buf */
+    struct flow_record_ext *flush_ext_buf;
+    int                flush_ext_cap;
+    int                flushed_ext; /* ext records exported by the last cap_drain() */
+    struct host_table *hosts;       /* NULL unless host_bps / host_pps */
+    struct flow_ring  *ring_ev;     /* host_event records, pushed by the capture thread */
+    /* sampling (cap_set_sampling): set before cap_start() */
+    uint64_t hash_seed;         /* hash_key() seed, random per context */
+    uint64_t sample_threshold;  /* keep a flow if sample_hash() < threshold; 1 << 32 keeps all */
+    uint32_t pkt_every;         /* keep 1 packet in pkt_every (1 = all) */
+    uint32_t pkt_skip;          /* packets left to skip before the next kept one */
+    double   sample_rate;       /* effective rate: flow rate / pkt_every */
     uint64_t total_pkts;
     uint64_t total_bytes;
     uint64_t total_parsed;
-    /* drop counters for capacity monitoring */
-    uint64_t dropped_flows;     /* new flows rejected because table full */
-    uint64_t probe_failures;    /* flows skipped due to max linear-probe exceeded */
+    uint64_t total_sampled;     /* parsed packets that passed flow sampling */
+    /* drop counters for capacity monitoring (copied from the last drained table) */
+    uint64_t dropped_flows;
+    uint64_t probe_failures;
+    /* struct cap_stats sources: rejects and batch_hist from the capture thread, the rest from cap_drain() */
+    struct cap_stats *stats;    /* shared-memory block, NULL unless cap_attach_stats() */
+    uint64_t rejects[STATS_REJ_REASONS];
+    uint64_t batch_hist[STATS_BATCH_BUCKETS];
+    uint64_t probe_hist[STATS_PROBE_BUCKETS];
+    uint64_t probe_sum;
+    uint64_t drain_hist[STATS_DRAIN_BUCKETS];
+    uint64_t drain_ns;
+    uint64_t drains;
+    uint64_t dropped_total;
+    uint64_t probe_fail_total;
 } capture_ctx_t;
 
-/* ---- FNV-1a hash on 13-byte key ---- */
-static inline uint32_t hash_key(uint32_t sip, uint32_t dip, uint8_t proto,
-                                 uint16_t sport, uint16_t dport)
-{
-    uint32_t h = 2166136261u;
-    const uint8_t *p;
+/*
+ * ---- Flow hash: the 13-byte key as two words, wyhash-style mixing ----
+ * Two 64x64→128 multiplies instead of 13 dependent FNV-1a byte steps, and
+ * every key bit reaches the low (slot) bits, so addresses that differ only
+ * in their last octet or ports do not cluster into long probe chains.
+ */
+#define HASH_P0 0xa0761d6478bd642full
+#define HASH_P1 0xe7037ed1a0b428dbull
+#define SAMPLE_SEED 0x8ebc6af09c88c6e3ull   /* fixed: workers and probes agree on sampled flows */
 
-    p = (const uint8_t *)&sip;
-    h = (h ^ p[0]) * 16777619u; h = (h ^ p[1]) * 16777619u;
-    h = (h ^ p[2]) * 16777619u; h = (h ^ p[3]) * 16777619u;
+static inline uint64_t hash_mum(uint64_t a, uint64_t b)
+{
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
 
-    p = (const uint8_t *)&dip;
-    h = (h ^ p[0]) * 16777619u; h = (h ^ p[1]) * 16777619u;
-    h = (h ^ p[2]) * 16777619u; h = (h ^ p[3]) * 16777619u;
+/*
+ * The key as two words, built from the fields rather than reloaded from
+ * memory: a key just assembled on the stack would otherwise stall on
+ * store forwarding. On little-endian this is exactly the struct layout.
+ */
+static inline uint64_t key_word0(const struct ht_key *k)
+{
+    return (uint64_t)k->src_ip | (uint64_t)k->dst_ip << 32;
+}
 
-    h = (h ^ proto) * 16777619u;
+static inline uint64_t key_word1(const struct ht_key *k)
+{
+    return (uint64_t)k->src_port | (uint64_t)k->dst_port << 16 | (uint64_t)k->proto << 32
+         | (uint64_t)k->source << 48;
+}
 
-    p = (const uint8_t *)&sport;
-    h = (h ^ p[0]) * 16777619u; h = (h ^ p[1]) * 16777619u;
+static inline uint64_t hash_words(uint64_t seed, const struct ht_key *k)
+{
+    return hash_mum(HASH_P1 ^ 13, hash_mum(key_word0(k) ^ HASH_P1, key_word1(k) ^ seed));
+}
 
-    p = (const uint8_t *)&dport;
-    h = (h ^ p[0]) * 16777619u; h = (h ^ p[1]) * 16777619u;
+/* Table slot hash, seeded per context (hash_seed_init) so slot order is not predictable */
+static inline uint64_t hash_key(uint64_t seed, const struct ht_key *k)
+{
+    return hash_words(seed, k);
+}
 
-    return h;
+static uint64_t hash_seed_init(void)
+{
+    uint64_t seed;
+    if (getrandom(&seed, sizeof(seed), 0) != sizeof(seed)) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        seed = (uint64_t)ts.tv_nsec ^ ((uint64_t)ts.tv_sec << 32) ^ ((uint64_t)getpid() << 16);
+    }
+    return seed ^ hash_mum(seed ^ HASH_P0, HASH_P1);
 }
 
-/* ---- Inline VXLAN parse + aggregate ---- */
-static inline void parse_and_record(capture_ctx_t *ctx, const uint8_t *data, int len)
+/*
+ * Sampling decision hash (32 bits): unseeded, so the same 5-tuple is kept
+ * or skipped by every worker and every probe. Only computed when sampling.
+ */
+static inline uint32_t sample_hash(const struct ht_key *k)
 {
-    /* Minimum: VXLAN(8) + ETH(14) + IP(20) = 42 */
-    if (len < VXLAN_HDR + ETH_HDR + IP_MIN_HDR)
-        return;
+    return (uint32_t)(hash_words(SAMPLE_SEED, k) >> 32);
+}
 
-    /* Ethernet ethertype check */
-    uint16_t etype = (uint16_t)(data[VXLAN_HDR + 12] << 8 | data[VXLAN_HDR + 13]);
-    if (etype != ETH_P_IP)
-        return;
+/* IPv6 key hash: the 40 key bytes as five words, chained through hash_mum() */
+static inline uint64_t hash6(uint64_t seed, const struct ht6_key *k)
+{
+    uint64_t w[5];
+    memcpy(w, k, sizeof(w));
+    uint64_t h = hash_mum(w[0] ^ HASH_P1, w[1] ^ seed);
+    h = hash_mum(h ^ w[2], w[3] ^ HASH_P0);
+    return hash_mum(h ^ w[4], HASH_P1 ^ 37);
+}
 
-    const uint8_t *ip = data + VXLAN_HDR + ETH_HDR;
-    int ihl = (ip[0] & 0x0F) * 4;
-    if (ihl < IP_MIN_HDR || VXLAN_HDR + ETH_HDR + ihl > len)
-        return;
+static inline int key_eq(const struct ht_key *a, const struct ht_key *b)
+{
+    return ((key_word0(a) ^ key_word0(b)) | (key_word1(a) ^ key_word1(b))) == 0;
+}
 
-    uint16_t total_len = (uint16_t)(ip[2] << 8 | ip[3]);
-    uint8_t  proto     = ip[9];
-    uint32_t src_ip, dst_ip;
-    memcpy(&src_ip, ip + 12, 4);
-    memcpy(&dst_ip, ip + 16, 4);
+/* ---- Flow table storage ---- */
 
-    uint16_t sport = 0, dport = 0;
-    if (proto == 6 || proto == 17) {
-        int l4off = VXLAN_HDR + ETH_HDR + ihl;
-        if (l4off + 4 <= len) {
-            sport = (uint16_t)(data[l4off] << 8 | data[l4off + 1]);
-            dport = (uint16_t)(data[l4off + 2] << 8 | data[l4off + 3]);
+/* Zeroed anonymous memory for `len` bytes; *pages reports what backs it */
+static void *table_map(size_t *len, int hugepages, int *pages)
+{
+    void *p = MAP_FAILED;
+    *pages = PAGES_PLAIN;
+    if (hugepages && *len >= HUGE_PAGE_SIZE) {
+        size_t hlen = (*len + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+        p = mmap(NULL, hlen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            *len = hlen;
+            *pages = PAGES_HUGETLB;
+            return p;
         }
     }
+    p = mmap(NULL, *len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+    if (hugepages && madvise(p, *len, MADV_HUGEPAGE) == 0)
+        *pages = PAGES_THP;
+    return p;
+}
 
-    ctx->total_parsed++;
+/* Release the slot array and insertion log; the IPv6 table and the rest stay */
+static void table_unmap(struct flow_table *t)
+{
+    if (t->entries)
+        munmap(t->entries, t->map_len);
+    if (t->ext)
+        munmap(t->ext, t->ext_map_len);
+    free(t->used);
+    t->entries = NULL;
+    t->ext = NULL;
+    t->used = NULL;
+}
 
-    /* Hash table lookup + insert */
-    uint32_t h = hash_key(src_ip, dst_ip, proto, sport, dport);
-    uint32_t idx = h & HT_MASK;
+static void table_free(struct flow_table *t)
+{
+    table_unmap(t);
+    free(t->v6);
+    t->v6 = NULL;
+}
 
-    for (int probe = 0; probe < 64; probe++) {
-        struct ht_entry *e = &ctx->table[idx];
-        if (!e->occupied) {
-            /* Empty slot: insert new flow */
-            if (ctx->num_flows >= MAX_FLOWS) {
-                ctx->dropped_flows++;
-                return;
-            }
-            e->src_ip   = src_ip;
-            e->dst_ip   = dst_ip;
-            e->src_port = sport;
-            e->dst_port = dport;
-            e->proto    = proto;
-            e->occupied = 1;
-            e->packets  = 1;
-            e->bytes    = total_len;
-            ctx->num_flows++;
-            return;
-        }
-        if (e->src_ip == src_ip && e->dst_ip == dst_ip &&
-            e->proto == proto && e->src_port == sport && e->dst_port == dport) {
-            /* Existing flow: update */
-            e->packets++;
-            e->bytes += total_len;
-            return;
-        }
-        idx = (idx + 1) & HT_MASK;
+/* (Re)allocate an empty table for max_flows flows. Returns 0, or -1 on ENOMEM. */
+static int table_alloc(struct flow_table *t, int max_flows)
+{
+    uint32_t slots = 16;
+    while (slots < 2u * (uint32_t)max_flows)
+        slots <<= 1;
+    size_t len = (size_t)slots * sizeof(struct ht_entry);
+    int pages;
+    struct ht_entry *entries = table_map(&len, t->hugepages, &pages);
+    uint32_t *used = malloc((size_t)max_flows * sizeof(uint32_t));
+    size_t ext_len = (size_t)slots * sizeof(struct flow_ext);
+    int ext_pages;
+    struct flow_ext *ext = t->ext_on ? table_map(&ext_len, t->hugepages, &ext_pages) : NULL;
+    if (!entries || !used || (t->ext_on && !ext)) {
+        if (entries) munmap(entries, len);
+        if (ext) munmap(ext, ext_len);
+        free(used);
+        return -1;
     }
-    /* Max probes exceeded, skip this flow */
-    ctx->probe_failures++;
+    table_unmap(t);
+    t->entries = entries;
+    t->ext = ext;
+    t->ext_map_len = ext_len;
+    t->used = used;
+    t->mask = slots - 1;
+    t->map_len = len;
+    t->pages = pages;
+    t->max_flows = max_flows;
+    t->num_flows = 0;
+    return 0;
 }
 
-/* ---- Public API ---- */
-
-capture_ctx_t* cap_create(int port, int rcvbuf)
+static int table_init(struct flow_table *t, int max_flows, int limit, int hugepages, uint64_t seed)
 {
-    capture_ctx_t *ctx = calloc(1, sizeof(capture_ctx_t));
-    if (!ctx) return NULL;
+    memset(t, 0, sizeof(*t));
+    t->limit = limit;
+    t->hugepages = hugepages;
+    t->seed = seed;
+    return table_alloc(t, max_flows);
+}
 
-    ctx->sock_fd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (ctx->sock_fd < 0) { free(ctx); return NULL; }
+/*
+ * Double the table, moving every logged flow (insertion order is kept, just
+ * with new slot numbers). Runs on whichever thread owns the table. Returns
+ * 0, or -1 at the limit or on ENOMEM, in which case the table is untouched.
+ */
+static __attribute__((noinline, cold)) int table_grow(struct flow_table *t)
+{
+    if (t->max_flows >= t->limit)
+        return -1;
+    int max_flows = t->max_flows > t->limit / 2 ? t->limit : t->max_flows * 2;
 
-    int one = 1;
-    setsockopt(ctx->sock_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
-    if (setsockopt(ctx->sock_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
-        close(ctx->sock_fd); free(ctx); return NULL;
-    }
-    if (setsockopt(ctx->sock_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) < 0) {
-        /* Non-fatal: kernel may cap the value, log via cap_get_rcvbuf() */
+    struct flow_table bigger = *t;
+    bigger.entries = NULL;
+    bigger.ext = NULL;
+    bigger.used = NULL;
+    if (table_alloc(&bigger, max_flows) < 0)
+        return -1;
+    for (int i = 0; i < t->num_flows; i++) {
+        const struct ht_entry *e = &t->entries[t->used[i]];
+        uint32_t idx = (uint32_t)hash_key(t->seed, &e->key) & bigger.mask;
+        while (bigger.entries[idx].packets)
+            idx = (idx + 1) & bigger.mask;
+        bigger.entries[idx] = *e;
+        if (t->ext)
+            bigger.ext[idx] = t->ext[t->used[i]];
+        bigger.used[i] = idx;
     }
+    bigger.num_flows = t->num_flows;
+    table_unmap(t);
+    *t = bigger;
+    return 0;
+}
 
-    /* Set socket recv timeout — more reliable than recvmmsg timeout */
-    struct timeval tv = { .tv_sec = 0, .tv_usec = 100000 }; /* 100ms */
-    setsockopt(ctx->sock_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+/*
+ * ---- Overflow sketch ----
+ * Traffic of flows the exact table cannot take (at max_flows_limit, or past
+ * the probe limit) is counted here instead of vanishing, so a scan or a
+ * spoofed-source flood still shows up. One tier per key kind (5-tuple, src
+ * IP), each a Count-Min sketch (conservative update) that bounds any key's
+ * packets/bytes from above, plus the HH_K keys with the largest
+ * estimates counted exactly from the moment they were admitted, with the
+ * CM estimate at admission as their error. cap_drain() exports candidates
+ * as FLOW_REC_HH_* records (flow_ring.h) followed by one FLOW_REC_OVERFLOW
+ * record with the overflow totals.
+ * The CM is cache-line blocked: all of a key's counters sit in one line, so
+ * an update costs one miss per tier rather than HH_DEPTH.
+ */
+#define HH_DEPTH    4       /* CM counters per key, each picked from its own pair in the line */
+#define HH_LINES    1024    /* CM lines per tier */
+#define HH_SAT      UINT32_MAX  /* saturated CM counter: no bound */
+#define HH_K        64      /* candidates per kind */
+#define HH_INDEX    256     /* candidate hash index slots, power of two */
+#define HH_MAX_RECORDS (HH_KINDS * HH_K + 1)
 
-    struct sockaddr_in addr = {0};
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    addr.sin_addr.s_addr = INADDR_ANY;
-    if (bind(ctx->sock_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-        close(ctx->sock_fd);
-        free(ctx);
-        return NULL;
-    }
+/* Distinct seeds per tier so src/dst keys do not share CM cells with 5-tuples */
+#define HH_SRC_SALT 0x5bd1e9955bd1e995ULL
+#define HH_DST_SALT 0x27d4eb2f165667c5ULL
 
-    /* Setup recvmmsg buffers */
-    for (int i = 0; i < BATCH_SIZE; i++) {
-        ctx->iovecs[i].iov_base = ctx->pktbufs[i];
-        ctx->iovecs[i].iov_len  = MAX_PKT_SIZE;
-        ctx->msgs[i].msg_hdr.msg_iov    = &ctx->iovecs[i];
-        ctx->msgs[i].msg_hdr.msg_iovlen = 1;
-        ctx->msgs[i].msg_hdr.msg_name    = NULL;
-        ctx->msgs[i].msg_hdr.msg_namelen = 0;
+enum { HH_FLOW = 0, HH_SRC, HH_DST, HH_KINDS };
+
+struct hh_cand {
+    struct ht_key key;
+    uint64_t hash;
+    uint64_t packets, bytes;            /* observed since admission: lower bound */
+    uint64_t err_packets, err_bytes;    /* CM estimate at admission */
+};
+
+struct hh_line {
+    uint32_t packets[2 * HH_DEPTH];     /* row r of a key: cell 2r or 2r + 1 */
+    uint32_t bytes[2 * HH_DEPTH];
+} __attribute__((aligned(64)));
+
+struct hh_tier {
+    struct hh_line cm[HH_LINES];
+    struct hh_cand cand[HH_K];
+    uint64_t upper[HH_K];               /* packets + err_packets per candidate, scanned for the min */
+    uint8_t index[HH_INDEX];            /* candidate + 1, 0 = empty; linear probing */
+    int n;                              /* candidates in use */
+    int min;                            /* once full: candidate with the smallest upper bound */
+};
+
+struct hh_sketch {
+    struct hh_tier tier[HH_KINDS];
+    uint64_t packets, bytes;            /* all overflow traffic */
+};
+
+static inline uint32_t hh_home(uint64_t h)
+{
+    return (uint32_t)(h >> 48) & (HH_INDEX - 1);
+}
+
+static void hh_find_min(struct hh_tier *s)
+{
+    int m = 0;
+    for (int i = 1; i < s->n; i++)
+        if (s->upper[i] < s->upper[m])
+            m = i;
+    s->min = m;
+}
+
+/* Remove candidate ci from the index, shifting later probes back into the hole */
+static void hh_index_remove(struct hh_tier *s, int ci)
+{
+    const uint32_t mask = HH_INDEX - 1;
+    uint32_t i = hh_home(s->cand[ci].hash);
+    while (s->index[i] != ci + 1)
+        i = (i + 1) & mask;
+    for (uint32_t j = (i + 1) & mask; s->index[j]; j = (j + 1) & mask) {
+        uint32_t home = hh_home(s->cand[s->index[j] - 1].hash);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            s->index[i] = s->index[j];
+            i = j;
+        }
     }
+    s->index[i] = 0;
+}
 
-    ctx->running = 0;
-    return ctx;
+static inline const struct hh_line *hh_line_of(const struct hh_tier *s, uint64_t h)
+{
+    return &s->cm[(h >> 20) & (HH_LINES - 1)];
 }
 
-int cap_get_rcvbuf(capture_ctx_t *ctx)
+static inline int hh_cell(uint64_t h, int r)
 {
-    int val = 0;
-    socklen_t len = sizeof(val);
-    getsockopt(ctx->sock_fd, SOL_SOCKET, SO_RCVBUF, &val, &len);
-    return val;
+    return 2 * r + (int)((h >> (40 + r)) & 1);
 }
 
-int cap_run(capture_ctx_t *ctx, int duration_ms)
+static inline void hh_estimate(const struct hh_tier *s, uint64_t h, uint64_t *packets, uint64_t *bytes)
 {
-    ctx->running = 1;
-    ctx->total_pkts = 0;
-    ctx->total_bytes = 0;
-    ctx->total_parsed = 0;
+    const struct hh_line *l = hh_line_of(s, h);
+    uint32_t p = HH_SAT, b = HH_SAT;
+    for (int r = 0; r < HH_DEPTH; r++) {
+        int c = hh_cell(h, r);
+        p = l->packets[c] < p ? l->packets[c] : p;
+        b = l->bytes[c] < b ? l->bytes[c] : b;
+    }
+    *packets = p;
+    *bytes = b;
+}
 
-    struct timespec start, now;
-    clock_gettime(CLOCK_MONOTONIC, &start);
-    long deadline_ns = (long)duration_ms * 1000000L;
+static inline uint32_t hh_sat_add(uint64_t a, uint64_t b)
+{
+    return a + b >= HH_SAT ? HH_SAT : (uint32_t)(a + b);
+}
 
-    while (ctx->running) {
-        /* Reset iov lengths */
-        for (int i = 0; i < BATCH_SIZE; i++)
-            ctx->iovecs[i].iov_len = MAX_PKT_SIZE;
-
-        int n = recvmmsg(ctx->sock_fd, ctx->msgs, BATCH_SIZE, MSG_WAITFORONE, NULL);
-        if (n <= 0) {
-            if (errno == EAGAIN || errno == EINTR || errno == ETIMEDOUT)
-                goto check_time;
-            break;
-        }
+static void hh_tier_add(struct hh_tier *s, uint64_t h, const struct ht_key *k,
+                        uint64_t packets, uint64_t bytes)
+{
+    uint64_t est_p, est_b;
+    hh_estimate(s, h, &est_p, &est_b);
+    /* Conservative update: raise each row only as far as the new estimate */
+    struct hh_line *l = (struct hh_line *)hh_line_of(s, h);
+    uint32_t np = hh_sat_add(est_p, packets), nb = hh_sat_add(est_b, bytes);
+    for (int r = 0; r < HH_DEPTH; r++) {
+        int c = hh_cell(h, r);
+        /* Branch-free max: these compares are data dependent and mispredict */
+        l->packets[c] = l->packets[c] > np ? l->packets[c] : np;
+        l->bytes[c] = l->bytes[c] > nb ? l->bytes[c] : nb;
+    }
 
-        for (int i = 0; i < n; i++) {
-            int pktlen = ctx->msgs[i].msg_len;
-            ctx->total_pkts++;
-            ctx->total_bytes += pktlen;
-            parse_and_record(ctx, ctx->pktbufs[i], pktlen);
+    uint32_t slot = hh_home(h);
+    for (; s->index[slot]; slot = (slot + 1) & (HH_INDEX - 1)) {
+        int ci = s->index[slot] - 1;
+        struct hh_cand *c = &s->cand[ci];
+        if (c->hash == h && key_eq(&c->key, k)) {
+            c->packets += packets;
+            c->bytes += bytes;
+            s->upper[ci] += packets;
+            if (s->n == HH_K && ci == s->min)
+                hh_find_min(s);
+            return;
         }
+    }
 
-check_time:
-        clock_gettime(CLOCK_MONOTONIC, &now);
-        long elapsed = (now.tv_sec - start.tv_sec) * 1000000000L +
-                       (now.tv_nsec - start.tv_nsec);
-        if (elapsed >= deadline_ns)
-            break;
+    /* Untracked: admit while there is room, or over the smallest candidate */
+    int ci;
+    if (s->n < HH_K) {
+        ci = s->n++;
+    } else {
+        if (est_p + packets <= s->upper[s->min])
+            return;
+        ci = s->min;
+        hh_index_remove(s, ci);
+        for (slot = hh_home(h); s->index[slot]; slot = (slot + 1) & (HH_INDEX - 1))
+            ;
     }
+    struct hh_cand *c = &s->cand[ci];
+    c->key = *k;
+    c->hash = h;
+    c->packets = packets;
+    c->bytes = bytes;
+    c->err_packets = est_p;
+    c->err_bytes = est_b;
+    s->upper[ci] = est_p + packets;
+    s->index[slot] = (uint8_t)(ci + 1);
+    if (s->n == HH_K)
+        hh_find_min(s);
+}
 
-    return (int)ctx->total_pkts;
+/*
+ * Account a flow the exact table had no room for. Not inlined, and the key
+ * is passed by value: taking its address would make table_add()'s callers
+ * spill the key to the stack on every packet.
+ */
+static __attribute__((noinline)) void table_overflow(struct flow_table *t, uint64_t h,
+                                                     struct ht_key key,
+                                                     uint64_t packets, uint64_t bytes)
+{
+    const struct ht_key *k = &key;
+    if (!t->hh && !(t->hh = calloc(1, sizeof(*t->hh))))
+        return;
+    struct hh_sketch *s = t->hh;
+    s->packets += packets;
+    s->bytes += bytes;
+    hh_tier_add(&s->tier[HH_FLOW], h, k, packets, bytes);
+
+    struct ht_key ip = { .src_ip = k->src_ip };
+    hh_tier_add(&s->tier[HH_SRC], hash_key(t->seed ^ HH_SRC_SALT, &ip), &ip, packets, bytes);
+    ip = (struct ht_key){ .dst_ip = k->dst_ip };
+    hh_tier_add(&s->tier[HH_DST], hash_key(t->seed ^ HH_DST_SALT, &ip), &ip, packets, bytes);
 }
 
-void cap_stop(capture_ctx_t *ctx)
+/* Relative error of a lower bound, for flow_record.err_q16; -1 when it does not fit */
+static inline int hh_err_q16(uint64_t lower, uint64_t upper)
 {
-    ctx->running = 0;
+    if (lower == 0)
+        return -1;
+    uint64_t q = ((upper - lower) * 65536 + lower - 1) / lower;
+    return q > 0xffff ? -1 : (int)q;
 }
 
 /*
- * Flush: copy occupied entries to flush_buf, reset table.
- * Returns count of flows. Caller reads flush_buf via cap_get_flush_buf().
+ * Write a table's sketch candidates and overflow totals to out[]
+ * (HH_MAX_RECORDS) and reset the sketch. Candidates whose error is not
+ * below their guaranteed count, or admitted at a saturated CM counter, are
+ * left out. Returns records written.
  */
-int cap_flush(capture_ctx_t *ctx)
+static int hh_export(struct hh_sketch *s, struct flow_record *out)
 {
-    int count = 0;
-    for (int i = 0; i < HT_SIZE && count < FLUSH_BUF_MAX; i++) {
-        struct ht_entry *e = &ctx->table[i];
-        if (e->occupied) {
-            struct flow_record *r = &ctx->flush_buf[count];
-            r->src_ip   = e->src_ip;
-            r->dst_ip   = e->dst_ip;
-            r->src_port = e->src_port;
-            r->dst_port = e->dst_port;
-            r->proto    = e->proto;
-            r->_pad1    = 0;
-            r->_pad2    = 0;
-            r->packets  = e->packets;
-            r->bytes    = e->bytes;
-            count++;
+    if (!s || s->packets == 0)
+        return 0;
+    int n = 0;
+    for (int kind = 0; kind < HH_KINDS; kind++) {
+        const struct hh_tier *tier = &s->tier[kind];
+        for (int i = 0; i < tier->n; i++) {
+            const struct hh_cand *c = &tier->cand[i];
+            if (c->err_packets >= HH_SAT || c->err_bytes >= HH_SAT)
+                continue;
+            uint64_t up, ub;
+            hh_estimate(tier, c->hash, &up, &ub);
+            if (up > tier->upper[i]) up = tier->upper[i];
+            if (ub > c->bytes + c->err_bytes) ub = c->bytes + c->err_bytes;
+            int qp = hh_err_q16(c->packets, up);
+            int qb = hh_err_q16(c->bytes, ub);
+            if (qp < 0 || qb < 0)
+                continue;
+            struct flow_record *r = &out[n++];
+            r->src_ip   = c->key.src_ip;
+            r->dst_ip   = c->key.dst_ip;
+            r->src_port = c->key.src_port;
+            r->dst_port = c->key.dst_port;
+            r->proto    = c->key.proto;
+            r->kind     = FLOW_REC_HH_FLOW + kind;
+            r->err_q16  = (uint16_t)(qp > qb ? qp : qb);
+            r->packets  = c->packets;
+            r->bytes    = c->bytes;
         }
     }
+    out[n++] = (struct flow_record){ .kind = FLOW_REC_OVERFLOW, .packets = s->packets, .bytes = s->bytes };
+    memset(s, 0, sizeof(*s));
+    return n;
+}
+
+/*
+ * ---- Hash table lookup + insert: add packets/bytes to a 5-tuple ----
+ * Returns the flow's slot, or TABLE_NO_SLOT if it went to the overflow sketch.
+ */
+#define TABLE_NO_SLOT UINT32_MAX
 
-    /* Reset table and drop counters */
-    memset(ctx->table, 0, sizeof(ctx->table));
-    ctx->num_flows = 0;
-    ctx->dropped_flows = 0;
-    ctx->probe_failures = 0;
+static inline uint32_t table_add(struct flow_table *t, uint64_t h, const struct ht_key *k,
+                                 uint64_t packets, uint64_t bytes)
+{
+retry:;
+    uint32_t idx = (uint32_t)h & t->mask;
 
-    return count;
+    for (int probe = 0; probe < 64; probe++) {
+        struct ht_entry *e = &t->entries[idx];
+        if (e->packets == 0) {
+            /* Empty slot: insert new flow, growing the table first if it is at capacity */
+            if (t->num_flows >= t->max_flows) {
+                if (table_grow(t) == 0)
+                    goto retry;
+                t->dropped_flows++;
+                table_overflow(t, h, *k, packets, bytes);
+                return TABLE_NO_SLOT;
+            }
+            e->key     = *k;
+            e->packets = packets;
+            e->bytes   = bytes;
+            t->used[t->num_flows++] = idx;
+            return idx;
+        }
+        if (key_eq(&e->key, k)) {
+            /* Existing flow: update */
+            e->packets += packets;
+            e->bytes += bytes;
+            return idx;
+        }
+        idx = (idx + 1) & t->mask;
+    }
+    /* Max probes exceeded, skip this flow */
+    t->probe_failures++;
+    table_overflow(t, h, *k, packets, bytes);
+    return TABLE_NO_SLOT;
 }
 
-struct flow_record* cap_get_flush_buf(capture_ctx_t *ctx)
+/* IPv6 traffic the table could not take: overflow totals, no candidates */
+static __attribute__((noinline, cold)) void table_overflow6(struct flow_table *t, uint64_t bytes)
 {
-    return ctx->flush_buf;
+    if (!t->hh && !(t->hh = calloc(1, sizeof(*t->hh))))
+        return;
+    t->hh->packets++;
+    t->hh->bytes += bytes;
 }
 
-uint64_t cap_get_total_pkts(capture_ctx_t *ctx) { return ctx->total_pkts; }
-uint64_t cap_get_total_bytes(capture_ctx_t *ctx) { return ctx->total_bytes; }
-uint64_t cap_get_total_parsed(capture_ctx_t *ctx) { return ctx->total_parsed; }
-int cap_get_num_flows(capture_ctx_t *ctx) { return ctx->num_flows; }
-uint64_t cap_get_dropped_flows(capture_ctx_t *ctx) { return ctx->dropped_flows; }
-uint64_t cap_get_probe_failures(capture_ctx_t *ctx) { return ctx->probe_failures; }
-
-void cap_destroy(capture_ctx_t *ctx)
+/* Add one IPv6 packet */
+static void table6_add(struct flow_table *t, const struct ht6_key *k, uint64_t bytes)
 {
-    if (ctx) {
-        if (ctx->sock_fd >= 0) close(ctx->sock_fd);
-        free(ctx);
+    struct flow6_table *v6 = t->v6;
+    if (!v6 && !(v6 = t->v6 = calloc(1, sizeof(*v6)))) {
+        t->dropped_flows++;
+        table_overflow6(t, bytes);
+        return;
+    }
+    uint32_t idx = (uint32_t)hash6(t->seed, k) & (FLOW6_SLOTS - 1);
+    for (int probe = 0; probe < 64; probe++) {
+        struct ht6_entry *e = &v6->entries[idx];
+        if (e->packets == 0) {
+            if (v6->num_flows >= FLOW6_MAX) {
+                t->dropped_flows++;
+                table_overflow6(t, bytes);
+                return;
+            }
+            e->key     = *k;
+            e->packets = 1;
+            e->bytes   = bytes;
+            v6->used[v6->num_flows++] = idx;
+            return;
+        }
+        if (memcmp(&e->key, k, sizeof(*k)) == 0) {
+            e->packets++;
+            e->bytes += bytes;
+            return;
+        }
+        idx = (idx + 1) & (FLOW6_SLOTS - 1);
     }
+    t->probe_failures++;
+    table_overflow6(t, bytes);
 }
 
-/* Utility: IP u32 (network byte order in struct) to string */
-void ip_to_str(uint32_t ip_raw, char *buf, int buflen)
+/*
+ * ---- Batched VXLAN parse + aggregate ----
+ * record_packet() queues packets that survive 1-in-N sampling; every
+ * VXLAN_BATCH of them, and at the end of each receive batch, record_flush()
+ * parses the queue in one vxlan_parse_batch() pass and adds the flows.
+ * Once the table holds more flows than fit in cache (PREFETCH_MIN_FLOWS),
+ * keys are hashed and their buckets prefetched for the whole batch first,
+ * so each table_add() miss overlaps with the others'; below that the extra
+ * pass costs more than it hides.
+ */
+#define PREFETCH_MIN_FLOWS 8192
+
+static inline struct ht_key batch_key(const struct vxlan_batch *b, int i)
 {
-    /* ip_raw is stored as memcpy from packet (network byte order) */
-    inet_ntop(AF_INET, &ip_raw, buf, (socklen_t)buflen);
+    return (struct ht_key){ .src_ip = b->src_ip[i], .dst_ip = b->dst_ip[i],
+                            .src_port = b->src_port[i], .dst_port = b->dst_port[i],
+                            .proto = b->proto[i] };
 }
+
+/* Clear ok[] and v6[] for packets whose VNI is not in the filter set */
+static void batch_vni_filter(capture_ctx_t *ctx, struct vxlan_batch *b, int n)
+{
+    uint64_t dropped = 0;
+    for (int i = 0; i < n; i++) {
+        int match = 0;
+        for (int j = 0; j < ctx->nvnis; j++)
+            match |= b->vni[i] == ctx->vnis[j];
+        dropped += (b->ok[i] | b->v6[i]) & !match;
+        b->ok[i] &= (uint8_t)match;
+        b->v6[i] &= (uint8_t)match;
+    }
+    ctx->vni_dropped += dropped;
+}
+
+/* Id of an outer source IP, assigning the next free one on first sight */
+static uint16_t source_id(struct src_map *m, uint32_t ip)
+{
+    if (ip == m->last_ip)
+        return m->last_id;
+    uint32_t slot = (ip * 0x9e3779b1u) >> 21;   /* SRC_SLOTS = 2^11 */
+    while (m->slot_ip[slot] && m->slot_ip[slot] != ip)
+        slot = (slot + 1) & (SRC_SLOTS - 1);
+    uint16_t id = 0;
+    if (m->slot_ip[slot]) {
+        id = m->slot_id[slot];
+    } else {
+        int n = atomic_load_explicit(&m->n, memory_order_relaxed);
+        if (ip && n < CAP_MAX_SOURCES) {
+            id = (uint16_t)(n + 1);
+            m->ip[id] = ip;
+            m->slot_ip[slot] = ip;
+            m->slot_id[slot] = id;
+            atomic_store_explicit(&m->n, id, memory_order_release);
+        }
+    }
+    m->last_ip = ip;
+    m->last_id = id;
+    return id;
+}
+
+/* The batch's IPv6 packets: scalar parse, then the IPv6 table */
+static __attribute__((noinline)) void record_v6(capture_ctx_t *ctx, struct flow_table *t,
+                                                const struct vxlan_batch *b, int n)
+{
+    int sampling = ctx->sample_threshold <= UINT32_MAX;
+    for (int i = 0; i < n; i++) {
+        struct vxlan_v6 r;
+        if (!b->v6[i])
+            continue;
+        if (!vxlan_parse_v6(ctx->pend[i], ctx->pend_len[i], &r)) {
+            ctx->rejects[STATS_REJ_IPV6]++;
+            continue;
+        }
+        ctx->total_parsed++;
+        struct ht6_key k = { .src_port = r.src_port, .dst_port = r.dst_port, .proto = r.proto };
+        memcpy(k.src_ip, r.src_ip, 16);
+        memcpy(k.dst_ip, r.dst_ip, 16);
+        if (sampling && (uint32_t)(hash6(SAMPLE_SEED, &k) >> 32) >= ctx->sample_threshold)
+            continue;
+        ctx->total_sampled++;
+        if (ctx->sources) {
+            k.source = source_id(ctx->sources, ctx->pend_src[i]);
+            t->src[k.source].packets++;
+            t->src[k.source].bytes += r.ip_len;
+        }
+        table6_add(t, &k, r.ip_len);
+    }
+}
+
+/* len_hist bucket of an IP total length: 0 below 64 bytes, one per power of two up to 1024 */
+static inline int ext_bucket(uint16_t len)
+{
+    int lg = 31 - __builtin_clz((uint32_t)len | 1);
+    return lg < 6 ? 0 : lg > 10 ? FLOW_EXT_BUCKETS - 1 : lg - 5;
+}
+
+static inline void ext_update(struct flow_ext *x, uint8_t f, uint16_t len, uint64_t now)
+{
+    x->first_ns = x->first_ns ? x->first_ns : now;
+    x->last_ns = now;
+    x->tcp_flags |= f;
+    x->syn += (f & (TCP_SYN | TCP_ACK)) == TCP_SYN;
+    x->rst += (f & TCP_RST) != 0;
+    x->len_hist[ext_bucket(len)]++;
+}
+
+/*
+ * Clock for the packets being recorded: read live, or when replaying a file
+ * the capture time of the last frame replayed.
+ */
+static inline uint64_t batch_clock_ns(const capture_ctx_t *ctx, clockid_t id)
+{
+    if (ctx->replay)
+        return ctx->replay->now_ns;
+    struct timespec ts;
+    clock_gettime(id, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void host_event(capture_ctx_t *ctx, const struct host_slot *s, int dir, int reason)
+{
+    struct host_event ev = {
+        .ip = s->ip, .dir = (uint8_t)dir, .reason = (uint8_t)reason,
+        .window_ms = ctx->hosts->window_ms,
+        .packets = s->packets[dir], .bytes = s->bytes[dir],
+        .ts_ns = batch_clock_ns(ctx, CLOCK_REALTIME),
+    };
+    ctx->hosts->events++;
+    if (ctx->ring_ev)
+        flow_ring_push(ctx->ring_ev, &ev, 1);
+}
+
+static inline void host_add(capture_ctx_t *ctx, struct host_table *h, uint32_t ip, int dir,
+                            uint32_t packets, uint64_t bytes)
+{
+    uint32_t base = (ip * 0x9e3779b1u) >> (32 - HOST_BITS);
+    struct host_slot *s;
+    for (int p = 0;; p++) {
+        s = &h->slot[(base + p) & (HOST_SLOTS - 1)];
+        if (s->epoch != h->epoch) {
+            *s = (struct host_slot){ .ip = ip, .epoch = h->epoch };
+            break;
+        }
+        if (s->ip == ip)
+            break;
+        if (p == HOST_PROBE - 1) {
+            h->uncounted++;
+            return;
+        }
+    }
+    s->packets[dir] += packets;
+    s->bytes[dir] += bytes;
+    int over = (s->bytes[dir] > h->limit_bytes ? HOST_EV_BPS : 0) |
+               (s->packets[dir] > h->limit_packets ? HOST_EV_PPS : 0);
+    if (over && !(s->fired & 1 << dir)) {
+        s->fired |= (uint8_t)(1 << dir);
+        host_event(ctx, s, dir, over);
+    }
+}
+
+/*
+ * Host pre-check over the batch's IPv4 packets, after the VNI filter and
+ * before flow sampling, so a host's counts do not depend on which of its
+ * flows are sampled. Packet 1-in-N is scaled back up here. One clock read
+ * per batch; windows start at the first batch past the previous one's end.
+ */
+static __attribute__((noinline)) void host_count(capture_ctx_t *ctx, const struct vxlan_batch *b, int n)
+{
+    struct host_table *h = ctx->hosts;
+    uint64_t now = batch_clock_ns(ctx, CLOCK_MONOTONIC_COARSE);
+    if (now - h->start_ns >= h->window_ns) {
+        if (++h->epoch == 0) {
+            memset(h->slot, 0, sizeof(h->slot));
+            h->epoch = 1;
+        }
+        h->start_ns = now;
+    }
+    uint32_t every = ctx->pkt_every;
+    for (int i = 0; i < n; i++) {
+        if (!b->ok[i])
+            continue;
+        uint64_t bytes = (uint64_t)b->ip_len[i] * every;
+        host_add(ctx, h, b->src_ip[i], HOST_EV_SRC, every, bytes);
+        host_add(ctx, h, b->dst_ip[i], HOST_EV_DST, every, bytes);
+    }
+}
+
+/*
+ * Why the batch parser turned packets down (neither ok[] nor v6[] set), off
+ * the common path: only called for batches that have such packets.
+ */
+static __attribute__((noinline, cold)) void count_rejects(capture_ctx_t *ctx, const struct vxlan_batch *b, int n)
+{
+    for (int i = 0; i < n; i++) {
+        if (b->ok[i] | b->v6[i])
+            continue;
+        const uint8_t *p = ctx->pend[i];
+        int len = ctx->pend_len[i], reason = STATS_REJ_SHORT;
+        if (len >= VXLAN_MIN_LEN) {
+            uint16_t type;
+            int off = vxlan_l3(p, &type);
+            if (type != ETH_P_IP)
+                reason = STATS_REJ_ETHERTYPE;
+            else if (off + IP_MIN_HDR <= len)
+                reason = STATS_REJ_IPV4;
+        }
+        ctx->rejects[reason]++;
+    }
+}
+
+/*
+ * Parse the n queued packets into ctx->parsed, drop filtered VNIs, run the
+ * host pre-check, record the IPv6 ones and, when tracking sources, fill
+ * sid[]. Returns t->src when tracking, else NULL.
+ */
+static inline struct src_count *record_parse(capture_ctx_t *ctx, struct flow_table *t, int n,
+                                             uint16_t *sid)
+{
+    struct vxlan_batch *b = &ctx->parsed;
+    ctx->npend = 0;
+    int parsed = vxlan_parse_batch(ctx->pend, ctx->pend_len, n, b);
+    ctx->total_parsed += parsed;
+    if (parsed + b->nv6 < n)
+        count_rejects(ctx, b, n);
+    if (ctx->nvnis)
+        batch_vni_filter(ctx, b, n);
+    if (ctx->hosts)
+        host_count(ctx, b, n);
+    if (b->nv6)
+        record_v6(ctx, t, b, n);
+    struct src_count *srcs = ctx->sources ? t->src : NULL;
+    if (srcs)
+        for (int i = 0; i < n; i++)
+            sid[i] = b->ok[i] ? source_id(ctx->sources, ctx->pend_src[i]) : 0;
+    return srcs;
+}
+
+/*
+ * record_flush() with ext_counters: the same sampling and table_add(), then
+ * the flow's flow_ext. One clock read per batch stamps every packet in it;
+ * TCP flags are read here, from the still-queued packets, so the batch
+ * parser and the plain loops carry nothing for it.
+ */
+static __attribute__((noinline)) void record_ext(capture_ctx_t *ctx, struct flow_table *t)
+{
+    struct vxlan_batch *b = &ctx->parsed;
+    uint16_t sid[VXLAN_BATCH];
+    int n = ctx->npend, m = 0;
+    struct src_count *srcs = record_parse(ctx, t, n, sid);
+
+    uint64_t now = batch_clock_ns(ctx, CLOCK_REALTIME_COARSE);
+    int sampling = ctx->sample_threshold <= UINT32_MAX;
+    for (int i = 0; i < n; i++) {
+        struct ht_key k = batch_key(b, i);
+        if (!b->ok[i] || (sampling && sample_hash(&k) >= ctx->sample_threshold))
+            continue;
+        m++;
+        if (srcs) {
+            k.source = sid[i];
+            srcs[k.source].packets++;
+            srcs[k.source].bytes += b->ip_len[i];
+        }
+        uint32_t idx = table_add(t, hash_key(ctx->hash_seed, &k), &k, 1, b->ip_len[i]);
+        if (idx != TABLE_NO_SLOT)
+            ext_update(&t->ext[idx], vxlan_tcp_flags(ctx->pend[i], ctx->pend_len[i]), b->ip_len[i], now);
+    }
+    ctx->total_sampled += m;
+}
+
+static void record_flush(capture_ctx_t *ctx, struct flow_table *t)
+{
+    if (t->ext) {
+        record_ext(ctx, t);
+        return;
+    }
+    struct vxlan_batch *b = &ctx->parsed;
+    uint16_t sid[VXLAN_BATCH];
+    int n = ctx->npend, m = 0;
+    struct src_count *srcs = record_parse(ctx, t, n, sid);
+
+    /* Flow sampling: same 5-tuple, same decision, so flows are kept or skipped whole */
+    int sampling = ctx->sample_threshold <= UINT32_MAX;
+
+    if (t->num_flows < PREFETCH_MIN_FLOWS) {
+        for (int i = 0; i < n; i++) {
+            struct ht_key k = batch_key(b, i);
+            if (!b->ok[i] || (sampling && sample_hash(&k) >= ctx->sample_threshold))
+                continue;
+            m++;
+            if (srcs) {
+                k.source = sid[i];
+                srcs[k.source].packets++;
+                srcs[k.source].bytes += b->ip_len[i];
+            }
+            table_add(t, hash_key(ctx->hash_seed, &k), &k, 1, b->ip_len[i]);
+        }
+        ctx->total_sampled += m;
+        return;
+    }
+
+    struct ht_key keys[VXLAN_BATCH];
+    uint64_t hashes[VXLAN_BATCH];
+    uint16_t bytes[VXLAN_BATCH];
+    for (int i = 0; i < n; i++) {
+        struct ht_key k = batch_key(b, i);
+        int keep = b->ok[i];
+        if (sampling)
+            keep &= sample_hash(&k) < ctx->sample_threshold;
+        if (srcs) {
+            k.source = sid[i];
+            srcs[k.source].packets += keep;
+            srcs[k.source].bytes += keep ? b->ip_len[i] : 0;
+        }
+        keys[m] = k;
+        hashes[m] = hash_key(ctx->hash_seed, &k);
+        bytes[m] = b->ip_len[i];
+        __builtin_prefetch(&t->entries[(uint32_t)hashes[m] & t->mask], 1);
+        m += keep;
+    }
+    ctx->total_sampled += m;
+    for (int i = 0; i < m; i++)
+        table_add(t, hashes[i], &keys[i], 1, bytes[i]);
+}
+
+/* Queue one packet; outer_ip is its mirror source (network order), 0 if unknown */
+static inline void record_packet(capture_ctx_t *ctx, struct flow_table *t,
+                                 const uint8_t *data, int len, uint32_t outer_ip)
+{
+    ctx->total_pkts++;
+    ctx->total_bytes += len;
+    if (ctx->pkt_skip) {
+        ctx->pkt_skip--;
+        return;
+    }
+    ctx->pkt_skip = ctx->pkt_every - 1;
+    ctx->pend[ctx->npend] = data;
+    ctx->pend_len[ctx->npend] = len;
+    ctx->pend_src[ctx->npend] = outer_ip;
+    if (++ctx->npend == VXLAN_BATCH)
+        record_flush(ctx, t);
+}
+
+/*
+ * Publish which table the capture thread is about to write. The re-check of
+ * ctx->active closes the race with cap_swap(): either the swapper sees
+ * busy == old and waits, or we see the new active pointer and retry.
+ */
+static inline struct flow_table *table_enter(capture_ctx_t *ctx)
+{
+    struct flow_table *t;
+    do {
+        t = atomic_load(&ctx->active);
+        atomic_store(&ctx->busy, t);
+    } while (t != atomic_load(&ctx->active));
+    return t;
+}
+
+static inline void table_leave(capture_ctx_t *ctx)
+{
+    atomic_store(&ctx->busy, NULL);
+}
+
+/* ---- AF_XDP backend: UMEM + fill/RX rings over raw if_xdp.h ---- */
+
+static int xsk_map_ring(int fd, struct xsk_ring *r, const struct xdp_ring_offset *off,
+                        uint32_t size, size_t desc_size, uint64_t pgoff)
+{
+    r->map_len = off->desc + (size_t)size * desc_size;
+    r->map = mmap(NULL, r->map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, (off_t)pgoff);
+    if (r->map == MAP_FAILED) {
+        r->map = NULL;
+        return -1;
+    }
+    r->producer = (uint32_t *)((uint8_t *)r->map + off->producer);
+    r->consumer = (uint32_t *)((uint8_t *)r->map + off->consumer);
+    r->desc     = (uint8_t *)r->map + off->desc;
+    r->mask     = size - 1;
+    return 0;
+}
+
+static void xsk_close(struct xsk_state *x)
+{
+    if (!x)
+        return;
+    if (x->in_map)
+        bpf_map_delete_raw(x->map_fd, &x->queue_id);
+    if (x->map_fd >= 0) close(x->map_fd);
+    if (x->rx.map)   munmap(x->rx.map, x->rx.map_len);
+    if (x->fill.map) munmap(x->fill.map, x->fill.map_len);
+    if (x->comp.map) munmap(x->comp.map, x->comp.map_len);
+    if (x->fd >= 0) close(x->fd);
+    if (x->umem) munmap(x->umem, (size_t)XSK_NUM_FRAMES * XSK_FRAME_SIZE);
+    free(x);
+}
+
+/*
+ * Bind an AF_XDP socket to cfg->ifname / cfg->queue_id and register it in the
+ * XSKMAP created by xdp_attach(). Returns NULL on any failure (no XDP on the
+ * driver, queue out of range, no privileges...) so the caller can fall back.
+ */
+static struct xsk_state *xsk_open(const struct cap_config *cfg)
+{
+    unsigned int ifindex = if_nametoindex(cfg->ifname);
+    if (!ifindex || !cfg->xsk_map_id || cfg->queue_id < 0)
+        return NULL;
+
+    struct xsk_state *x = calloc(1, sizeof(*x));
+    if (!x)
+        return NULL;
+    x->fd = -1;
+    x->map_fd = -1;
+    x->queue_id = (uint32_t)cfg->queue_id;
+
+    x->umem = mmap(NULL, (size_t)XSK_NUM_FRAMES * XSK_FRAME_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (x->umem == MAP_FAILED) {
+        x->umem = NULL;
+        goto fail;
+    }
+    x->fd = socket(AF_XDP, SOCK_RAW, 0);
+    if (x->fd < 0)
+        goto fail;
+
+    struct xdp_umem_reg reg = {
+        .addr = (uint64_t)(uintptr_t)x->umem,
+        .len = (uint64_t)XSK_NUM_FRAMES * XSK_FRAME_SIZE,
+        .chunk_size = XSK_FRAME_SIZE,
+        .headroom = 0,
+    };
+    int fill_size = XSK_FILL_SIZE, comp_size = XSK_COMP_SIZE, rx_size = XSK_RX_SIZE;
+    if (setsockopt(x->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0 ||
+        setsockopt(x->fd, SOL_XDP, XDP_UMEM_FILL_RING, &fill_size, sizeof(fill_size)) < 0 ||
+        setsockopt(x->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &comp_size, sizeof(comp_size)) < 0 ||
+        setsockopt(x->fd, SOL_XDP, XDP_RX_RING, &rx_size, sizeof(rx_size)) < 0)
+        goto fail;
+
+    struct xdp_mmap_offsets off;
+    socklen_t optlen = sizeof(off);
+    if (getsockopt(x->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) < 0 ||
+        xsk_map_ring(x->fd, &x->rx, &off.rx, XSK_RX_SIZE, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) ||
+        xsk_map_ring(x->fd, &x->fill, &off.fr, XSK_FILL_SIZE, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING) ||
+        xsk_map_ring(x->fd, &x->comp, &off.cr, XSK_COMP_SIZE, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING))
+        goto fail;
+
+    /* Hand every frame to the kernel up front */
+    uint64_t *fill = x->fill.desc;
+    for (uint32_t i = 0; i < XSK_NUM_FRAMES; i++)
+        fill[i] = (uint64_t)i * XSK_FRAME_SIZE;
+    __atomic_store_n(x->fill.producer, XSK_NUM_FRAMES, __ATOMIC_RELEASE);
+
+    /* sxdp_flags = 0: zero-copy if the driver supports it, else copy mode */
+    struct sockaddr_xdp sxdp = {
+        .sxdp_family = AF_XDP,
+        .sxdp_ifindex = ifindex,
+        .sxdp_queue_id = x->queue_id,
+    };
+    if (bind(x->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) < 0)
+        goto fail;
+
+    x->map_fd = bpf_map_get_fd_by_id_raw(cfg->xsk_map_id);
+    if (x->map_fd < 0 || bpf_map_update_raw(x->map_fd, &x->queue_id, &x->fd, BPF_ANY) < 0)
+        goto fail;
+    x->in_map = 1;
+    return x;
+
+fail:
+    xsk_close(x);
+    return NULL;
+}
+
+/* Offset of the VXLAN header in an outer Ethernet/IPv4/UDP frame, or -1 */
+static inline int xsk_payload_offset(const uint8_t *frame, uint32_t len)
+{
+    if (len < ETH_HDR + IP_MIN_HDR + UDP_HDR || frame[12] != 0x08 || frame[13] != 0x00)
+        return -1;
+    int ihl = (frame[ETH_HDR] & 0x0F) * 4;
+    if (ihl < IP_MIN_HDR || frame[ETH_HDR + 9] != 17 || (uint32_t)(ETH_HDR + ihl + UDP_HDR) > len)
+        return -1;
+    return ETH_HDR + ihl + UDP_HDR;
+}
+
+/* ---- In-kernel aggregation backend: XDP program + per-CPU maps ---- */
+
+static char xdp_log[16384];             /* verifier / attach errors, see xdp_get_log() */
+
+/* Attach as native (driver) XDP, else generic; returns the link fd or -1 */
+static int xdp_link(int prog_fd, int ifindex, int *mode)
+{
+    int fd = bpf_xdp_link_raw(prog_fd, ifindex, XDP_FLAGS_DRV_MODE);
+    *mode = XDP_MODE_NATIVE;
+    if (fd < 0) {
+        fd = bpf_xdp_link_raw(prog_fd, ifindex, XDP_FLAGS_SKB_MODE);
+        *mode = XDP_MODE_GENERIC;
+    }
+    return fd;
+}
+
+/* Possible CPUs, the slot count of per-CPU map values ("0-3,8-11" → 8) */
+static int num_possible_cpus(void)
+{
+    FILE *f = fopen("/sys/devices/system/cpu/possible", "r");
+    if (!f)
+        return -1;
+    int n = 0, lo, hi;
+    char sep;
+    while (fscanf(f, "%d", &lo) == 1) {
+        hi = lo;
+        if (fscanf(f, "%c", &sep) == 1 && sep == '-') {
+            if (fscanf(f, "%d", &hi) != 1)
+                break;
+            if (fscanf(f, "%c", &sep) != 1)
+                sep = 0;
+        }
+        n += hi - lo + 1;
+        if (sep != ',')
+            break;
+    }
+    fclose(f);
+    return n > 0 ? n : -1;
+}
+
+static void xdpc_close(struct xdpc_state *x)
+{
+    if (!x)
+        return;
+    if (x->link_fd >= 0) close(x->link_fd);
+    if (x->prog_fd >= 0) close(x->prog_fd);
+    if (x->ctrl_fd >= 0) close(x->ctrl_fd);
+    if (x->stats_fd >= 0) close(x->stats_fd);
+    for (int i = 0; i < 2; i++)
+        if (x->flows_fd[i] >= 0) close(x->flows_fd[i]);
+    free(x->keys);
+    free(x->vals);
+    free(x->cpu_stats);
+    free(x);
+}
+
+/*
+ * Load xdp_count_prog() and attach it to cfg->ifname. The flow maps hold up
+ * to cfg->max_flows_limit keys each and allocate on insert, so idle capacity
+ * costs no per-CPU memory. Returns NULL on failure (old kernel, no XDP, another
+ * program already attached...) with the reason in xdp_get_log().
+ */
+static struct xdpc_state *xdpc_open(const struct cap_config *cfg)
+{
+    xdp_log[0] = 0;
+    int ifindex = (int)if_nametoindex(cfg->ifname);
+    int ncpus = num_possible_cpus();
+    if (!ifindex || ncpus < 1) {
+        snprintf(xdp_log, sizeof(xdp_log), "bad interface %s or CPU count %d", cfg->ifname, ncpus);
+        return NULL;
+    }
+
+    struct xdpc_state *x = calloc(1, sizeof(*x));
+    if (!x)
+        return NULL;
+    x->link_fd = x->prog_fd = x->ctrl_fd = x->stats_fd = -1;
+    x->flows_fd[0] = x->flows_fd[1] = -1;
+    x->ncpus = ncpus;
+    x->keys = malloc(XDPC_BATCH * sizeof(*x->keys));
+    x->vals = malloc((size_t)XDPC_BATCH * ncpus * sizeof(*x->vals));
+    x->cpu_stats = malloc((size_t)ncpus * sizeof(*x->cpu_stats));
+    if (!x->keys || !x->vals || !x->cpu_stats)
+        goto fail;
+
+    x->ctrl_fd = bpf_map_create_raw(BPF_MAP_TYPE_ARRAY, sizeof(uint32_t), sizeof(uint32_t), 1, 0);
+    x->stats_fd = bpf_map_create_raw(BPF_MAP_TYPE_PERCPU_ARRAY, sizeof(uint32_t),
+                                     sizeof(struct xdp_count_stats), 1, 0);
+    for (int i = 0; i < 2; i++)
+        x->flows_fd[i] = bpf_map_create_raw(BPF_MAP_TYPE_PERCPU_HASH, sizeof(struct xdp_flow_key),
+                                            sizeof(struct xdp_flow_val), (uint32_t)cfg->max_flows_limit,
+                                            BPF_F_NO_PREALLOC);
+    if (x->ctrl_fd < 0 || x->stats_fd < 0 || x->flows_fd[0] < 0 || x->flows_fd[1] < 0) {
+        snprintf(xdp_log, sizeof(xdp_log), "map create: %s", strerror(errno));
+        goto fail;
+    }
+
+    struct bpf_asm a;
+    if (xdp_count_prog(&a, cfg->port, x->ctrl_fd, x->stats_fd, x->flows_fd) < 0) {
+        snprintf(xdp_log, sizeof(xdp_log), "program too large");
+        goto fail;
+    }
+    x->prog_fd = bpf_prog_load_raw(BPF_PROG_TYPE_XDP, a.insn, a.n, xdp_log, sizeof(xdp_log));
+    if (x->prog_fd < 0)
+        goto fail;
+    x->link_fd = xdp_link(x->prog_fd, ifindex, &x->mode);
+    if (x->link_fd < 0) {
+        snprintf(xdp_log, sizeof(xdp_log), "XDP attach to %s: %s", cfg->ifname, strerror(errno));
+        goto fail;
+    }
+    return x;
+
+fail:
+    xdpc_close(x);
+    return NULL;
+}
+
+/* ---- Capture file replay (CAP_BACKEND_PCAP): open / close ---- */
+
+static struct replay_state *replay_open(const struct cap_config *cfg)
+{
+    if (cfg->pcap_shards < 1 || cfg->pcap_shard < 0 || cfg->pcap_shard >= cfg->pcap_shards ||
+        !(cfg->replay_speed >= 0) || cfg->replay_epoch_ms < 0 ||
+        !memchr(cfg->pcap_path, 0, sizeof(cfg->pcap_path)))
+        return NULL;
+    struct replay_state *r = calloc(1, sizeof(*r));
+    if (!r)
+        return NULL;
+    if (pcap_open(&r->file, cfg->pcap_path) < 0) {
+        free(r);
+        return NULL;
+    }
+    r->port = cfg->port;
+    r->shard = cfg->pcap_shard;
+    r->shards = cfg->pcap_shards;
+    r->speed = cfg->replay_speed;
+    r->epoch_ns = (uint64_t)cfg->replay_epoch_ms * 1000000ull;
+    atomic_init(&r->allowed, r->epoch_ns ? 0 : UINT32_MAX);
+    atomic_init(&r->parked, 0);
+    atomic_init(&r->eof, 0);
+    return r;
+}
+
+static void replay_close(struct replay_state *r)
+{
+    if (r) {
+        pcap_close(&r->file);
+        free(r);
+    }
+}
+
+static inline uint64_t replay_mono_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static inline void replay_sleep_ns(uint64_t ns)
+{
+    struct timespec ts = { 0, (long)ns };
+    nanosleep(&ts, NULL);
+}
+
+/* Sum the per-CPU kernel counters */
+static int xdpc_read_stats(struct xdpc_state *x, struct xdp_count_stats *out)
+{
+    uint32_t zero = 0;
+    memset(out, 0, sizeof(*out));
+    if (bpf_map_lookup_raw(x->stats_fd, &zero, x->cpu_stats) < 0)
+        return -1;
+    for (int c = 0; c < x->ncpus; c++) {
+        out->pkts          += x->cpu_stats[c].pkts;
+        out->bytes         += x->cpu_stats[c].bytes;
+        out->parsed        += x->cpu_stats[c].parsed;
+        out->dropped_flows += x->cpu_stats[c].dropped_flows;
+    }
+    return 0;
+}
+
+/* Start of a cap_run()/cap_start() window: counters are relative to this */
+static void xdpc_reset_totals(struct xdpc_state *x)
+{
+    xdpc_read_stats(x, &x->base);
+}
+
+/*
+ * Point the program at the other flow map, then move everything the retired
+ * one holds into the active flow table, XDPC_BATCH keys per syscall.
+ * Returns flows merged, or -1 if the control map cannot be updated.
+ */
+static int xdpc_harvest(capture_ctx_t *ctx)
+{
+    struct xdpc_state *x = ctx->xdpc;
+    uint32_t zero = 0, next = x->active ^ 1;
+    if (bpf_map_update_raw(x->ctrl_fd, &zero, &next, BPF_ANY) < 0)
+        return -1;
+    int retired = x->flows_fd[x->active];
+    x->active = next;
+    /* XDP runs to completion inside one NAPI poll; let programs that read the old index finish */
+    struct timespec grace = { 0, XDPC_GRACE_US * 1000L };
+    nanosleep(&grace, NULL);
+
+    int merged = 0;
+    uint64_t token = 0;
+    void *in = NULL;
+    for (;;) {
+        uint32_t count = XDPC_BATCH;
+        int rc = bpf_map_lookup_and_delete_batch_raw(retired, in, &token, x->keys, x->vals, &count);
+        struct flow_table *t = table_enter(ctx);
+        for (uint32_t i = 0; i < count; i++) {
+            const struct xdp_flow_key *xk = &x->keys[i];
+            struct ht_key k = {
+                .src_ip = xk->src_ip, .dst_ip = xk->dst_ip,
+                .src_port = xk->src_port, .dst_port = xk->dst_port, .proto = xk->proto,
+            };
+            const struct xdp_flow_val *v = &x->vals[(size_t)i * x->ncpus];
+            uint64_t packets = 0, bytes = 0;
+            for (int c = 0; c < x->ncpus; c++) {
+                packets += v[c].packets;
+                bytes   += v[c].bytes;
+            }
+            if (packets == 0)
+                continue;               /* packets == 0 marks an empty table slot */
+            table_add(t, hash_key(ctx->hash_seed, &k), &k, packets, bytes);
+        }
+        table_leave(ctx);
+        merged += (int)count;
+        if (rc < 0)
+            break;                      /* ENOENT: map walked; anything else retries next poll */
+        in = &token;
+    }
+
+    struct xdp_count_stats s;
+    if (xdpc_read_stats(x, &s) == 0) {
+        ctx->total_pkts    = s.pkts - x->base.pkts;
+        ctx->total_bytes   = s.bytes - x->base.bytes;
+        ctx->total_parsed  = s.parsed - x->base.parsed;
+        ctx->total_sampled = ctx->total_parsed;
+        if (s.dropped_flows != x->dropped_seen) {
+            struct flow_table *t = table_enter(ctx);
+            t->dropped_flows += s.dropped_flows - x->dropped_seen;
+            table_leave(ctx);
+            x->dropped_seen = s.dropped_flows;
+        }
+    }
+    return merged;
+}
+
+/* Bound SO_REUSEPORT UDP socket: all workers' sockets form one group */
+static int sock_open(int port, int rcvbuf)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+        return -1;
+
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) < 0) {
+        /* Non-fatal: kernel may cap the value, log via cap_get_rcvbuf() */
+    }
+
+    /* Set socket recv timeout — more reliable than recvmmsg timeout */
+    struct timeval tv = { .tv_sec = 0, .tv_usec = 100000 }; /* 100ms */
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = INADDR_ANY;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Busy polling: recvmmsg() spins on the NIC queue for up to `us` instead of
+ * sleeping for the softirq, and SO_PREFER_BUSY_POLL keeps the kernel from
+ * also polling it from interrupts. Needs CAP_NET_ADMIN above
+ * net.core.busy_read. Returns 0, or -1 (socket unchanged) if unsupported.
+ */
+static int sock_busy_poll(int fd, int us)
+{
+    int one = 1;
+    if (us <= 0 || setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &us, sizeof(us)) < 0)
+        return -1;
+#ifdef SO_PREFER_BUSY_POLL
+    setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one, sizeof(one));
+#endif
+#ifdef SO_BUSY_POLL_BUDGET
+    int budget = BATCH_SIZE;
+    setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL_BUDGET, &budget, sizeof(budget));
+#endif
+    (void)one;
+    return 0;
+}
+
+/*
+ * UDP_GRO: point the first GRO_BATCH entries at 64K buffers with room for
+ * the segment-size cmsg. Best effort: without kernel support (< 5.0) or
+ * memory the context keeps receiving plain datagrams.
+ */
+static void sock_gro(capture_ctx_t *ctx)
+{
+    int one = 1;
+    size_t len = (size_t)GRO_BATCH * GRO_BUF_SIZE;
+    uint8_t *buf = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED)
+        return;
+    if (setsockopt(ctx->sock_fd, IPPROTO_UDP, UDP_GRO, &one, sizeof(one)) < 0) {
+        munmap(buf, len);
+        return;
+    }
+    ctx->gro_buf = buf;
+    for (int i = 0; i < GRO_BATCH; i++) {
+        ctx->iovecs[i].iov_base = buf + (size_t)i * GRO_BUF_SIZE;
+        ctx->iovecs[i].iov_len  = GRO_BUF_SIZE;
+        ctx->msgs[i].msg_hdr.msg_control    = ctx->gro_ctrl[i];
+        ctx->msgs[i].msg_hdr.msg_controllen = sizeof(ctx->gro_ctrl[i]);
+    }
+    ctx->batch = ctx->batch_max = GRO_BATCH;
+}
+
+/* ---- SO_REUSEPORT steering ---- */
+
+/*
+ * Classic BPF for SO_ATTACH_REUSEPORT_CBPF: it returns an index into the
+ * reuseport group, i.e. the order in which the sockets were bound. Run with
+ * the UDP header pulled, so packet offsets start at the VXLAN header.
+ */
+#define STEER_INNER_IP  (VXLAN_HDR + ETH_HDR)
+
+/* CPU mode: cpus[i] -> socket i, any other CPU by cpu % n */
+static int steer_cpu_prog(struct sock_filter *f, const int *cpus, int n)
+{
+    int len = 0;
+    f[len++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+    for (int i = 0; i < n; i++) {
+        f[len++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (uint32_t)cpus[i], 0, 1);
+        f[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, (uint32_t)i);
+    }
+    f[len++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (uint32_t)n);
+    f[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+    return len;
+}
+
+/*
+ * Flow mode: multiplicative hash of the inner src/dst IP, ports and protocol,
+ * so each 5-tuple always lands in one worker's table. Short or non-IPv4
+ * frames fail a load, which returns socket 0.
+ */
+static int steer_flow_prog(struct sock_filter *f, int n)
+{
+    const struct sock_filter prog[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, STEER_INNER_IP + 12),   /* src_ip */
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, STEER_INNER_IP + 16),   /* dst_ip */
+        BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+        BPF_STMT(BPF_ST, 0),
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, STEER_INNER_IP + 9),    /* proto */
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_LD | BPF_MEM, 0),
+        BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+        BPF_STMT(BPF_ST, 0),
+        BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, STEER_INNER_IP),       /* X = IHL * 4 */
+        BPF_STMT(BPF_LD | BPF_W | BPF_IND, STEER_INNER_IP),        /* src/dst port */
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_LD | BPF_MEM, 0),
+        BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+        BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, 0x9e3779b1u),
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+        BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (uint32_t)n),
+        BPF_STMT(BPF_RET | BPF_A, 0),
+    };
+    memcpy(f, prog, sizeof(prog));
+    return (int)(sizeof(prog) / sizeof(prog[0]));
+}
+
+/* ---- Public API ---- */
+
+/*
+ * Open one socket of a reuseport group for cap_config.sock_fd. Opening them
+ * all up front, in worker order, fixes each socket's group index for
+ * cap_attach_steering(). Returns the fd, or -1.
+ */
+int cap_open_socket(int port, int rcvbuf)
+{
+    return sock_open(port, rcvbuf);
+}
+
+/*
+ * Steer the reuseport group of `fd` (n sockets, opened in worker order):
+ * CAP_STEER_CPU sends each packet to socket i where cpus[i] took the RX
+ * softirq, CAP_STEER_FLOW by inner 5-tuple hash (cpus unused). Applies to
+ * the whole group. Returns 0, or -1 with errno set.
+ */
+int cap_attach_steering(int fd, int mode, const int *cpus, int n)
+{
+    struct sock_filter f[2 * STEER_MAX_SOCKS + 3];
+    int len;
+    if (n < 1 || n > STEER_MAX_SOCKS) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (mode == CAP_STEER_CPU && cpus)
+        len = steer_cpu_prog(f, cpus, n);
+    else if (mode == CAP_STEER_FLOW)
+        len = steer_flow_prog(f, n);
+    else {
+        errno = EINVAL;
+        return -1;
+    }
+    struct sock_fprog prog = { .len = (unsigned short)len, .filter = f };
+    return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+}
+
+void cap_config_init(struct cap_config *cfg)
+{
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->port = 4789;
+    cfg->rcvbuf = 128 * 1024 * 1024;
+    cfg->backend = CAP_BACKEND_SOCKET;
+    cfg->max_flows = CAP_DEFAULT_FLOWS;
+    cfg->max_flows_limit = CAP_DEFAULT_FLOW_LIMIT;
+    cfg->cpu = -1;
+    cfg->sock_fd = -1;
+    cfg->rx_mode = CAP_RX_BLOCKING;
+    cfg->busy_poll_us = 50;
+    cfg->udp_gro = 0;
+    cfg->track_sources = 0;
+    cfg->ext_counters = 0;
+    cfg->host_bps = 0;
+    cfg->host_pps = 0;
+    cfg->host_window_ms = CAP_DEFAULT_HOST_WINDOW_MS;
+    cfg->pcap_shard = 0;
+    cfg->pcap_shards = 1;
+    cfg->replay_speed = 0;
+    cfg->replay_epoch_ms = 0;
+}
+
+int cap_config_size(void) { return (int)sizeof(struct cap_config); }
+
+void cap_destroy(capture_ctx_t *ctx);
+
+/*
+ * Create a capture context. CAP_BACKEND_AF_XDP and CAP_BACKEND_XDP_COUNT
+ * fall back to the UDP socket path when they cannot be set up;
+ * cap_get_backend() reports which one is in use. CAP_BACKEND_PCAP has no
+ * fallback: NULL if the file cannot be read.
+ */
+capture_ctx_t* cap_create_ex(const struct cap_config *cfg)
+{
+    capture_ctx_t *ctx = NULL;
+    if (cfg->max_flows < 1 || cfg->max_flows_limit < cfg->max_flows || cfg->max_flows_limit > (1 << 30))
+        goto fail;
+    if ((cfg->host_bps || cfg->host_pps) &&
+        (cfg->host_window_ms < 1 || cfg->host_window_ms > HOST_WINDOW_MAX_MS))
+        goto fail;
+    ctx = calloc(1, sizeof(capture_ctx_t));
+    if (!ctx) goto fail;
+
+    ctx->hash_seed = hash_seed_init();
+    for (int i = 0; i < 2; i++) {
+        if (table_init(&ctx->tables[i], cfg->max_flows, cfg->max_flows_limit,
+                       cfg->hugepages, ctx->hash_seed) < 0) {
+            table_free(&ctx->tables[0]);
+            table_free(&ctx->tables[1]);
+            free(ctx);
+            goto fail;
+        }
+    }
+
+    ctx->sock_fd = -1;
+    ctx->cpu = cfg->cpu;
+    ctx->pinned_cpu = -1;
+    if (cfg->backend == CAP_BACKEND_AF_XDP) {
+        ctx->xsk = xsk_open(cfg);
+    } else if (cfg->backend == CAP_BACKEND_XDP_COUNT) {
+        ctx->xdpc = xdpc_open(cfg);
+    } else if (cfg->backend == CAP_BACKEND_PCAP) {
+        ctx->replay = replay_open(cfg);
+        if (!ctx->replay) {
+            table_free(&ctx->tables[0]);
+            table_free(&ctx->tables[1]);
+            free(ctx);
+            goto fail;
+        }
+    }
+    if (ctx->xsk || ctx->xdpc || ctx->replay) {
+        if (cfg->sock_fd >= 0)
+            close(cfg->sock_fd);
+    } else {
+        ctx->sock_fd = cfg->sock_fd >= 0 ? cfg->sock_fd : sock_open(cfg->port, cfg->rcvbuf);
+        if (ctx->sock_fd < 0) {
+            table_free(&ctx->tables[0]);
+            table_free(&ctx->tables[1]);
+            free(ctx);
+            return NULL;
+        }
+    }
+
+    ctx->rx_mode = CAP_RX_BLOCKING;
+    ctx->batch = BATCH_SIZE;
+    ctx->batch_max = BATCH_MAX;
+    if (ctx->sock_fd >= 0 && cfg->rx_mode == CAP_RX_BUSY_POLL)
+        ctx->rx_mode = sock_busy_poll(ctx->sock_fd, cfg->busy_poll_us) == 0 ? CAP_RX_BUSY_POLL
+                                                                           : CAP_RX_BLOCKING;
+    else if (ctx->sock_fd >= 0 && cfg->rx_mode == CAP_RX_ADAPTIVE)
+        ctx->rx_mode = CAP_RX_ADAPTIVE;
+
+    /* Setup recvmmsg buffers */
+    for (int i = 0; i < BATCH_MAX; i++) {
+        ctx->iovecs[i].iov_base = ctx->pktbufs[i];
+        ctx->iovecs[i].iov_len  = MAX_PKT_SIZE;
+        ctx->msgs[i].msg_hdr.msg_iov    = &ctx->iovecs[i];
+        ctx->msgs[i].msg_hdr.msg_iovlen = 1;
+        ctx->msgs[i].msg_hdr.msg_name    = NULL;
+        ctx->msgs[i].msg_hdr.msg_namelen = 0;
+    }
+    if (ctx->sock_fd >= 0 && cfg->udp_gro)
+        sock_gro(ctx);
+    if (cfg->track_sources && !ctx->xdpc) {
+        ctx->sources = calloc(1, sizeof(*ctx->sources));
+        for (int i = 0; i < 2; i++)
+            ctx->tables[i].src = calloc(CAP_MAX_SOURCES + 1, sizeof(struct src_count));
+        if (!ctx->sources || !ctx->tables[0].src || !ctx->tables[1].src) {
+            cap_destroy(ctx);
+            return NULL;
+        }
+        for (int i = 0; i < BATCH_MAX; i++) {
+            ctx->msgs[i].msg_hdr.msg_name    = &ctx->names[i];
+            ctx->msgs[i].msg_hdr.msg_namelen = sizeof(ctx->names[i]);
+        }
+    }
+    if (cfg->ext_counters && !ctx->xdpc) {
+        /* Reallocate both (still empty) tables with their ext arrays */
+        for (int i = 0; i < 2; i++) {
+            ctx->tables[i].ext_on = 1;
+            if (table_alloc(&ctx->tables[i], ctx->tables[i].max_flows) < 0) {
+                cap_destroy(ctx);
+                return NULL;
+            }
+        }
+    }
+
+    if ((cfg->host_bps || cfg->host_pps) && !ctx->xdpc) {
+        struct host_table *h = calloc(1, sizeof(*h));
+        if (!h) {
+            cap_destroy(ctx);
+            return NULL;
+        }
+        h->epoch = 1;
+        h->window_ms = (uint16_t)cfg->host_window_ms;
+        h->window_ns = (uint64_t)cfg->host_window_ms * 1000000ull;
+        h->limit_packets = cfg->host_pps ? cfg->host_pps * cfg->host_window_ms / 1000 : UINT64_MAX;
+        h->limit_bytes = cfg->host_bps ? cfg->host_bps * cfg->host_window_ms / 8000 : UINT64_MAX;
+        ctx->hosts = h;
+    }
+
+    atomic_init(&ctx->active, &ctx->tables[0]);
+    atomic_init(&ctx->busy, NULL);
+    ctx->sample_threshold = 1ull << 32;
+    ctx->pkt_every = 1;
+    ctx->sample_rate = 1.0;
+    ctx->running = 0;
+    return ctx;
+
+fail:
+    if (cfg->sock_fd >= 0)
+        close(cfg->sock_fd);
+    return NULL;
+}
+
+capture_ctx_t* cap_create(int port, int rcvbuf)
+{
+    struct cap_config cfg;
+    cap_config_init(&cfg);
+    cfg.port = port;
+    cfg.rcvbuf = rcvbuf;
+    return cap_create_ex(&cfg);
+}
+
+int cap_get_backend(capture_ctx_t *ctx)
+{
+    if (ctx->xdpc)
+        return CAP_BACKEND_XDP_COUNT;
+    if (ctx->replay)
+        return CAP_BACKEND_PCAP;
+    return ctx->xsk ? CAP_BACKEND_AF_XDP : CAP_BACKEND_SOCKET;
+}
+
+/*
+ * Sampling: keep flows whose hash falls under flow_rate (0 < rate <= 1) and,
+ * of those, 1 packet in pkt_every. Effective rate is flow_rate / pkt_every;
+ * it is published in the attached ring header and by cap_get_sample_rate()
+ * so the consumer can scale counters back up.
+ * Returns 0, or -1 for invalid arguments, while a cap_start() thread runs,
+ * or for XDP_COUNT, where the kernel counts every packet.
+ */
+int cap_set_sampling(capture_ctx_t *ctx, double flow_rate, int pkt_every)
+{
+    if (ctx->thread_started || !(flow_rate > 0.0 && flow_rate <= 1.0) || pkt_every < 1)
+        return -1;
+    if (ctx->xdpc)
+        return (flow_rate == 1.0 && pkt_every == 1) ? 0 : -1;
+    ctx->sample_threshold = (uint64_t)(flow_rate * 4294967296.0);
+    if (ctx->sample_threshold == 0)
+        ctx->sample_threshold = 1;
+    ctx->pkt_every = (uint32_t)pkt_every;
+    ctx->pkt_skip = 0;
+    ctx->sample_rate = flow_rate / pkt_every;
+    if (ctx->ring)
+        ctx->ring->sample_rate = ctx->sample_rate;
+    if (ctx->ring6)
+        ctx->ring6->sample_rate = ctx->sample_rate;
+    if (ctx->ring_ext)
+        ctx->ring_ext->sample_rate = ctx->sample_rate;
+    return 0;
+}
+
+/*
+ * Accept only VXLAN packets whose VNI is one of vnis[0..n); n = 0 accepts all.
+ * Must be called before cap_start(). Socket backends only.
+ */
+int cap_set_vni_filter(capture_ctx_t *ctx, const uint32_t *vnis, int n)
+{
+    if (ctx->thread_started || n < 0 || n > CAP_MAX_VNIS)
+        return -1;
+    if (ctx->xdpc)
+        return n == 0 ? 0 : -1;
+    for (int i = 0; i < n; i++)
+        ctx->vnis[i] = vnis[i] & 0xFFFFFF;
+    ctx->nvnis = n;
+    return 0;
+}
+
+int cap_get_rcvbuf(capture_ctx_t *ctx)
+{
+    int val = 0;
+    if (ctx->sock_fd < 0)
+        return 0;
+    socklen_t len = sizeof(val);
+    getsockopt(ctx->sock_fd, SOL_SOCKET, SO_RCVBUF, &val, &len);
+    return val;
+}
+
+/*
+ * CAP_RX_ADAPTIVE controller, after each batch: a full batch means the
+ * socket is deep, so double the batch and stop coalescing; a batch under a
+ * quarter full means it is shallow, so halve it and wait a little longer
+ * before the next call, letting packets pile up instead of paying a syscall
+ * for each few.
+ */
+static inline void adapt_batch(capture_ctx_t *ctx, int n)
+{
+    if (n >= ctx->batch) {
+        ctx->batch = ctx->batch * 2 > ctx->batch_max ? ctx->batch_max : ctx->batch * 2;
+        ctx->wait_us = 0;
+    } else if (n < ctx->batch / 4) {
+        ctx->batch = ctx->batch / 2 < BATCH_MIN ? BATCH_MIN : ctx->batch / 2;
+        if (n > 0 && ctx->wait_us < ADAPT_WAIT_MAX_US)
+            ctx->wait_us += ADAPT_WAIT_STEP_US;
+    }
+}
+
+/*
+ * Split received UDP_GRO entries into packets. Each entry is one datagram or
+ * a run of equal gso_size segments (the last may be shorter), as announced
+ * by its UDP_GRO cmsg. Returns packets.
+ */
+static int gro_records(capture_ctx_t *ctx, struct flow_table *t, int n)
+{
+    int pkts = 0;
+    for (int i = 0; i < n; i++) {
+        struct msghdr *mh = &ctx->msgs[i].msg_hdr;
+        const uint8_t *data = ctx->iovecs[i].iov_base;
+        int len = (int)ctx->msgs[i].msg_len, seg = len;
+        for (struct cmsghdr *c = CMSG_FIRSTHDR(mh); c; c = CMSG_NXTHDR(mh, c))
+            if (c->cmsg_level == IPPROTO_UDP && c->cmsg_type == UDP_GRO)
+                memcpy(&seg, CMSG_DATA(c), sizeof(seg));
+        mh->msg_controllen = sizeof(ctx->gro_ctrl[i]);  /* the kernel shrank it */
+        if (seg <= 0)
+            seg = len;
+        uint32_t outer = ctx->names[i].sin_addr.s_addr;
+        for (int off = 0; off < len; off += seg, pkts++)
+            record_packet(ctx, t, data + off, len - off < seg ? len - off : seg, outer);
+    }
+    return pkts;
+}
+
+/* Power-of-two histogram slot: 0 for n <= 0, then 1, 2-3, 4-7, ..., capped at the last one */
+static inline int log2_bucket(uint64_t n, int buckets)
+{
+    int b = n ? 64 - __builtin_clzll(n) : 0;
+    return b < buckets ? b : buckets - 1;
+}
+
+static inline int batch_bucket(int n)
+{
+    return log2_bucket(n > 0 ? (uint64_t)n : 0, STATS_BATCH_BUCKETS);
+}
+
+/* One recvmmsg() batch into the active table. Returns packets, 0 on timeout, -1 on error. */
+static int sock_batch(capture_ctx_t *ctx)
+{
+    /* iov_len is never written back by the kernel, so buffers need no reset */
+    if (ctx->wait_us) {
+        struct timespec ts = { 0, ctx->wait_us * 1000L };
+        nanosleep(&ts, NULL);
+    }
+    int flags = ctx->rx_mode == CAP_RX_BUSY_POLL ? MSG_DONTWAIT : MSG_WAITFORONE;
+    int n = recvmmsg(ctx->sock_fd, ctx->msgs, (unsigned)ctx->batch, flags, NULL);
+    ctx->rx_calls++;
+    ctx->batch_hist[batch_bucket(n)]++;
+    if (n <= 0) {
+        ctx->rx_empty++;
+        if (ctx->rx_mode == CAP_RX_ADAPTIVE)
+            ctx->wait_us = 0;   /* idle: block in recvmmsg() instead */
+        return (errno == EAGAIN || errno == EINTR || errno == ETIMEDOUT) ? 0 : -1;
+    }
+    ctx->rx_dgrams += n;
+    if (n == ctx->batch)
+        ctx->rx_full++;
+    if (ctx->rx_mode == CAP_RX_ADAPTIVE)
+        adapt_batch(ctx, n);
+
+    struct flow_table *t = table_enter(ctx);
+    int pkts = n;
+    if (ctx->gro_buf)
+        pkts = gro_records(ctx, t, n);
+    else
+        for (int i = 0; i < n; i++)
+            record_packet(ctx, t, ctx->pktbufs[i], ctx->msgs[i].msg_len,
+                          ctx->names[i].sin_addr.s_addr);   /* 0 unless msg_name is set */
+    record_flush(ctx, t);
+    table_leave(ctx);
+    ctx->rx_pkts += pkts;
+    return pkts;
+}
+
+/*
+ * One AF_XDP RX batch: parse frames in place in the UMEM, then return them
+ * to the fill ring. Returns packets, 0 on timeout, -1 on error.
+ */
+static int xsk_batch(capture_ctx_t *ctx)
+{
+    struct xsk_state *x = ctx->xsk;
+    uint32_t cons = *x->rx.consumer;
+    uint32_t avail = __atomic_load_n(x->rx.producer, __ATOMIC_ACQUIRE) - cons;
+    if (avail == 0) {
+        struct pollfd pfd = { .fd = x->fd, .events = POLLIN };
+        int rc = poll(&pfd, 1, 100);    /* 100ms, same as the socket SO_RCVTIMEO */
+        if (rc < 0)
+            return errno == EINTR ? 0 : -1;
+        avail = __atomic_load_n(x->rx.producer, __ATOMIC_ACQUIRE) - cons;
+        if (avail == 0) {
+            ctx->rx_calls++;
+            ctx->rx_empty++;
+            ctx->batch_hist[0]++;
+            return 0;
+        }
+    }
+    if (avail > BATCH_SIZE)
+        avail = BATCH_SIZE;
+    ctx->rx_calls++;
+    ctx->batch_hist[batch_bucket((int)avail)]++;
+    ctx->rx_pkts += avail;
+    ctx->rx_dgrams += avail;
+    if (avail == BATCH_SIZE)
+        ctx->rx_full++;
+
+    const struct xdp_desc *descs = x->rx.desc;
+    uint64_t *fill = x->fill.desc;
+    uint32_t fprod = *x->fill.producer;
+
+    struct flow_table *t = table_enter(ctx);
+    for (uint32_t i = 0; i < avail; i++) {
+        const struct xdp_desc *d = &descs[(cons + i) & x->rx.mask];
+        const uint8_t *frame = x->umem + d->addr;
+        int off = xsk_payload_offset(frame, d->len);
+        if (off >= 0) {
+            uint32_t outer;
+            memcpy(&outer, frame + ETH_HDR + 12, 4);
+            record_packet(ctx, t, frame + off, (int)d->len - off, outer);
+        }
+        fill[(fprod + i) & x->fill.mask] = d->addr & ~(uint64_t)(XSK_FRAME_SIZE - 1);
+    }
+    record_flush(ctx, t);   /* before the frames go back to the kernel */
+    table_leave(ctx);
+
+    __atomic_store_n(x->rx.consumer, cons + avail, __ATOMIC_RELEASE);
+    __atomic_store_n(x->fill.producer, fprod + avail, __ATOMIC_RELEASE);
+    return (int)avail;
+}
+
+/*
+ * XDP_COUNT: no per-packet work here; sleep one poll interval, then drain
+ * the kernel maps. Returns flows merged, or -1 on error.
+ */
+static int xdpc_batch(capture_ctx_t *ctx, long remain_ns)
+{
+    long ns = XDPC_POLL_MS * 1000000L;
+    if (remain_ns > 0 && remain_ns < ns)
+        ns = remain_ns;
+    struct timespec ts = { ns / 1000000000L, ns % 1000000000L };
+    nanosleep(&ts, NULL);
+    return xdpc_harvest(ctx);
+}
+
+/* ---- Capture file replay (CAP_BACKEND_PCAP): the capture loop ---- */
+
+/*
+ * Shard of a VXLAN payload: the inner 5-tuple (IPv6 addresses folded to 32
+ * bits) under a fixed seed, so every context agrees and a flow's packets
+ * all land in one. The seed is not SAMPLE_SEED, whose top bits decide flow
+ * sampling. Packets the parser would reject go to shard 0.
+ */
+static uint32_t replay_shard(const uint8_t *p, int len, int shards)
+{
+    struct ht_key k = { 0 };
+    if (len >= VXLAN_MIN_LEN) {
+        uint16_t type;
+        int off = vxlan_l3(p, &type);
+        struct vxlan_v6 v6;
+        if (type == ETH_P_IP && off + IP_MIN_HDR <= len) {
+            const uint8_t *ip = p + off;
+            int l4 = off + (ip[0] & 0x0F) * 4;
+            memcpy(&k.src_ip, ip + 12, 4);
+            memcpy(&k.dst_ip, ip + 16, 4);
+            k.proto = ip[9];
+            if ((k.proto == 6 || k.proto == 17) && l4 + 4 <= len) {
+                k.src_port = vxlan_be16(p + l4);
+                k.dst_port = vxlan_be16(p + l4 + 2);
+            }
+        } else if (type == ETH_P_IPV6 && vxlan_parse_v6(p, len, &v6)) {
+            uint32_t w[8];
+            memcpy(w, v6.src_ip, 16);
+            memcpy(w + 4, v6.dst_ip, 16);
+            k.src_ip = w[0] ^ w[1] ^ w[2] ^ w[3];
+            k.dst_ip = w[4] ^ w[5] ^ w[6] ^ w[7];
+            k.src_port = v6.src_port;
+            k.dst_port = v6.dst_port;
+            k.proto = v6.proto;
+        }
+    }
+    return (uint32_t)(((uint64_t)(uint32_t)hash_words(HASH_P0, &k) * (uint64_t)shards) >> 32);
+}
+
+/*
+ * Up to BATCH_SIZE frames of the file into the active table, straight from
+ * the mapping. A frame past the epoch gate or not yet due (replay_speed) is
+ * held for the next call; the gate is checked before the shard filter, so
+ * every shard stops at the same point of the capture. Returns VXLAN frames
+ * recorded, -1 at the end of the file.
+ */
+static int replay_batch(capture_ctx_t *ctx)
+{
+    struct replay_state *r = ctx->replay;
+    uint32_t allowed = atomic_load_explicit(&r->allowed, memory_order_acquire);
+    uint64_t wait_ns = 0;
+    int n = 0, gated = 0, end = 0;
+
+    struct flow_table *t = table_enter(ctx);
+    for (int i = 0; i < BATCH_SIZE; i++) {
+        if (!r->held) {
+            int rc = pcap_next(&r->file, &r->next);
+            if (rc <= 0) {
+                r->malformed = rc < 0;
+                end = 1;
+                break;
+            }
+            r->held = 1;
+            if (!r->started) {
+                r->started = 1;
+                r->origin_ns = r->now_ns = r->next.ts_ns;
+                r->wall0_ns = replay_mono_ns();
+            }
+        }
+        uint64_t at = r->next.ts_ns > r->origin_ns ? r->next.ts_ns - r->origin_ns : 0;
+        if (r->epoch_ns && at / r->epoch_ns >= allowed) {
+            gated = 1;
+            break;
+        }
+        if (r->park_ns) {
+            /* Time spent parked is not capture time: pace from where we stopped */
+            r->wall0_ns += replay_mono_ns() - r->park_ns;
+            r->park_ns = 0;
+        }
+        if (r->speed > 0) {
+            uint64_t due = r->wall0_ns + (uint64_t)((double)at / r->speed);
+            uint64_t now = replay_mono_ns();
+            if (now < due) {
+                wait_ns = due - now;
+                break;
+            }
+        }
+        r->held = 0;
+        if (r->next.ts_ns > r->now_ns)
+            r->now_ns = r->next.ts_ns;
+        int len;
+        uint32_t outer;
+        int off = pcap_vxlan(&r->next, r->port, &len, &outer);
+        if (off < 0) {
+            r->skipped += r->shard == 0;
+            continue;
+        }
+        const uint8_t *p = r->next.data + off;
+        if (r->shards > 1 && replay_shard(p, len, r->shards) != (uint32_t)r->shard)
+            continue;
+        record_packet(ctx, t, p, len, outer);
+        n++;
+    }
+    record_flush(ctx, t);
+    table_leave(ctx);
+
+    r->frames += n;
+    ctx->rx_calls++;
+    ctx->rx_empty += n == 0;
+    ctx->batch_hist[batch_bucket(n)]++;
+    ctx->rx_pkts += n;
+    ctx->rx_dgrams += n;
+    if (n == BATCH_SIZE)
+        ctx->rx_full++;
+    if (end) {
+        atomic_store_explicit(&r->eof, 1, memory_order_release);
+        return -1;
+    }
+    if (gated) {
+        if (!r->park_ns)
+            r->park_ns = replay_mono_ns();
+        /* After table_leave(): a cap_swap() from here on sees every frame before the boundary */
+        atomic_store_explicit(&r->parked, allowed, memory_order_release);
+        replay_sleep_ns(REPLAY_PARK_US * 1000ull);
+    } else if (wait_ns) {
+        replay_sleep_ns(wait_ns < REPLAY_PACE_MAX_US * 1000ull ? wait_ns : REPLAY_PACE_MAX_US * 1000ull);
+    }
+    return n;
+}
+
+/*
+ * Receive loop shared by cap_run() and the cap_start() thread.
+ * deadline_ns <= 0 means run until cap_stop().
+ */
+static void capture_loop(capture_ctx_t *ctx, long deadline_ns)
+{
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    long remain = deadline_ns;
+    int full_streak = 0;
+    while (ctx->running) {
+        int n = ctx->xdpc ? xdpc_batch(ctx, remain) : ctx->replay ? replay_batch(ctx)
+              : ctx->xsk ? xsk_batch(ctx) : sock_batch(ctx);
+        if (n < 0)
+            break;
+
+        if (deadline_ns <= 0)
+            continue;
+        /* Under load packet batches come back full: read the clock every 16th only.
+         * Not for XDP_COUNT (n is flows per 100ms harvest) or replay (it may park). */
+        if (n >= BATCH_MIN && !ctx->xdpc && !ctx->replay && ++full_streak < 16)
+            continue;
+        full_streak = 0;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long elapsed = (now.tv_sec - start.tv_sec) * 1000000000L +
+                       (now.tv_nsec - start.tv_nsec);
+        if (elapsed >= deadline_ns)
+            break;
+        remain = deadline_ns - elapsed;
+    }
+    /* Whatever the kernel counted up to now belongs to this run */
+    if (ctx->xdpc)
+        xdpc_harvest(ctx);
+}
+
+int cap_run(capture_ctx_t *ctx, int duration_ms)
+{
+    ctx->running = 1;
+    ctx->total_pkts = 0;
+    ctx->total_bytes = 0;
+    ctx->total_parsed = 0;
+    ctx->total_sampled = 0;
+    if (ctx->xdpc)
+        xdpc_reset_totals(ctx->xdpc);
+
+    capture_loop(ctx, (long)duration_ms * 1000000L);
+
+    return (int)ctx->total_pkts;
+}
+
+static void *capture_thread(void *arg)
+{
+    capture_loop((capture_ctx_t *)arg, 0);
+    return NULL;
+}
+
+/*
+ * Start continuous capture on a background thread. Counters accumulate from
+ * this call until cap_stop(); tables are rotated with cap_swap()/cap_drain().
+ * Returns 0 on success, -1 if already running or the thread cannot start.
+ */
+int cap_start(capture_ctx_t *ctx)
+{
+    if (ctx->thread_started)
+        return -1;
+    ctx->running = 1;
+    ctx->total_pkts = 0;
+    ctx->total_bytes = 0;
+    ctx->total_parsed = 0;
+    ctx->total_sampled = 0;
+    if (ctx->xdpc)
+        xdpc_reset_totals(ctx->xdpc);
+    if (pthread_create(&ctx->thread, NULL, capture_thread, ctx) != 0) {
+        ctx->running = 0;
+        return -1;
+    }
+    ctx->thread_started = 1;
+
+    /* Best effort: an offline or disallowed CPU leaves the thread unpinned */
+    ctx->pinned_cpu = -1;
+    if (ctx->cpu >= 0 && ctx->cpu < CPU_SETSIZE) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(ctx->cpu, &set);
+        if (pthread_setaffinity_np(ctx->thread, sizeof(set), &set) == 0)
+            ctx->pinned_cpu = ctx->cpu;
+    }
+    return 0;
+}
+
+/* Stop capture; joins the cap_start() thread if one is running. */
+void cap_stop(capture_ctx_t *ctx)
+{
+    ctx->running = 0;
+    if (ctx->thread_started) {
+        pthread_join(ctx->thread, NULL);
+        ctx->thread_started = 0;
+    }
+}
+
+/*
+ * Swap: make the standby table active and return the retired one.
+ * Waits only for the in-flight batch (if any) to finish with the old table;
+ * the capture thread never blocks. The standby must already be drained,
+ * i.e. every cap_swap() is followed by cap_drain() on its result.
+ * Single swapper only (the worker's flush loop).
+ */
+struct flow_table *cap_swap(capture_ctx_t *ctx)
+{
+    struct flow_table *old = atomic_load(&ctx->active);
+    struct flow_table *fresh = (old == &ctx->tables[0]) ? &ctx->tables[1] : &ctx->tables[0];
+
+    /* Match a table that grew last interval here, off the capture thread
+     * (fresh is drained and idle); on ENOMEM it just grows when needed */
+    if (fresh->max_flows < old->max_flows)
+        table_alloc(fresh, old->max_flows);
+
+    atomic_store(&ctx->active, fresh);
+    while (atomic_load(&ctx->busy) == old)
+        sched_yield();
+
+    return old;
+}
+
+static inline void slot_reset(struct flow_table *t, uint32_t idx)
+{
+    memset(&t->entries[idx], 0, sizeof(struct ht_entry));
+}
+
+static inline void fill_record(struct flow_record *r, struct flow_table *t, uint32_t idx)
+{
+    const struct ht_entry *e = &t->entries[idx];
+    r->src_ip   = e->key.src_ip;
+    r->dst_ip   = e->key.dst_ip;
+    r->src_port = e->key.src_port;
+    r->dst_port = e->key.dst_port;
+    r->proto    = e->key.proto;
+    r->kind     = FLOW_REC_EXACT;
+    r->source   = e->key.source;
+    r->packets  = e->packets;
+    r->bytes    = e->bytes;
+    slot_reset(t, idx);
+}
+
+#define SRC_CHUNK 64
+
+static inline void fill_record6(struct flow_record6 *r, struct flow6_table *v6, uint32_t idx)
+{
+    struct ht6_entry *e = &v6->entries[idx];
+    memcpy(r->src_ip, e->key.src_ip, 16);
+    memcpy(r->dst_ip, e->key.dst_ip, 16);
+    r->src_port = e->key.src_port;
+    r->dst_port = e->key.dst_port;
+    r->proto    = e->key.proto;
+    r->kind     = FLOW_REC_EXACT;
+    r->source   = e->key.source;
+    memset(r->_pad, 0, sizeof(r->_pad));
+    r->packets  = e->packets;
+    r->bytes    = e->bytes;
+    memset(e, 0, sizeof(*e));
+}
+
+/* Export and reset the IPv6 table, into ring6 or flush6_buf. Returns records exported. */
+static int drain_v6(capture_ctx_t *ctx, struct flow6_table *v6)
+{
+    int count = v6->num_flows, i = 0;
+    if (ctx->ring6) {
+        while (i < count) {
+            uint64_t first;
+            uint64_t room = flow_ring_writable(ctx->ring6, &first);
+            if (room == 0)
+                break;
+            if (room > (uint64_t)(count - i))
+                room = count - i;
+            struct flow_record6 *out = (struct flow_record6 *)flow_ring_slots(ctx->ring6) + first;
+            for (uint64_t j = 0; j < room; j++)
+                fill_record6(&out[j], v6, v6->used[i + j]);
+            flow_ring_publish(ctx->ring6, room);
+            i += (int)room;
+        }
+        ctx->ring6->dropped += count - i;
+    } else {
+        if (count > ctx->flush6_cap) {
+            struct flow_record6 *buf = realloc(ctx->flush6_buf, (size_t)count * sizeof(*buf));
+            if (buf) {
+                ctx->flush6_buf = buf;
+                ctx->flush6_cap = count;
+            }
+        }
+        for (; i < count && i < ctx->flush6_cap; i++)
+            fill_record6(&ctx->flush6_buf[i], v6, v6->used[i]);
+    }
+    ctx->ring_drops += count - i;
+    for (int k = i; k < count; k++)
+        memset(&v6->entries[v6->used[k]], 0, sizeof(struct ht6_entry));
+    v6->num_flows = 0;
+    return i;
+}
+
+static inline void fill_record_ext(struct flow_record_ext *r, struct flow_table *t, uint32_t idx)
+{
+    const struct ht_entry *e = &t->entries[idx];
+    struct flow_ext *x = &t->ext[idx];
+    r->src_ip    = e->key.src_ip;
+    r->dst_ip    = e->key.dst_ip;
+    r->src_port  = e->key.src_port;
+    r->dst_port  = e->key.dst_port;
+    r->proto     = e->key.proto;
+    r->tcp_flags = x->tcp_flags;
+    r->source    = e->key.source;
+    r->first_ns  = x->first_ns;
+    r->last_ns   = x->last_ns;
+    r->syn       = x->syn;
+    r->rst       = x->rst;
+    memcpy(r->len_hist, x->len_hist, sizeof(r->len_hist));
+    memset(x, 0, sizeof(*x));
+}
+
+/*
+ * Export and reset the extended counters of every logged flow, into
+ * ring_ext or flush_ext_buf. Runs before the main export, which clears
+ * the keys. Returns records exported.
+ */
+static int drain_ext(capture_ctx_t *ctx, struct flow_table *t)
+{
+    int count = t->num_flows, i = 0;
+    if (ctx->ring_ext) {
+        while (i < count) {
+            uint64_t first;
+            uint64_t room = flow_ring_writable(ctx->ring_ext, &first);
+            if (room == 0)
+                break;
+            if (room > (uint64_t)(count - i))
+                room = count - i;
+            struct flow_record_ext *out = (struct flow_record_ext *)flow_ring_slots(ctx->ring_ext) + first;
+            for (uint64_t j = 0; j < room; j++)
+                fill_record_ext(&out[j], t, t->used[i + j]);
+            flow_ring_publish(ctx->ring_ext, room);
+            i += (int)room;
+        }
+        ctx->ring_ext->dropped += count - i;
+    } else {
+        if (count > ctx->flush_ext_cap) {
+            struct flow_record_ext *buf = realloc(ctx->flush_ext_buf, (size_t)count * sizeof(*buf));
+            if (buf) {
+                ctx->flush_ext_buf = buf;
+                ctx->flush_ext_cap = count;
+            }
+        }
+        for (; i < count && i < ctx->flush_ext_cap; i++)
+            fill_record_ext(&ctx->flush_ext_buf[i], t, t->used[i]);
+    }
+    ctx->ring_drops += count - i;
+    for (int k = i; k < count; k++)
+        memset(&t->ext[t->used[k]], 0, sizeof(struct flow_ext));
+    return i;
+}
+
+/*
+ * Append n summary records (sketch, per-source) after the i already drained.
+ * Returns the new drained count.
+ */
+static int drain_extra(capture_ctx_t *ctx, const struct flow_record *recs, int n, int i)
+{
+    if (n == 0)
+        return i;
+    if (ctx->ring) {
+        int done = flow_ring_push(ctx->ring, recs, n);
+        ctx->ring_drops += n - done;
+        return i + done;
+    }
+    if (i + n > ctx->flush_cap) {
+        struct flow_record *buf = realloc(ctx->flush_buf, (size_t)(i + n) * sizeof(*buf));
+        if (!buf)
+            return i;
+        ctx->flush_buf = buf;
+        ctx->flush_cap = i + n;
+    }
+    memcpy(&ctx->flush_buf[i], recs, (size_t)n * sizeof(*recs));
+    return i + n;
+}
+
+/* Probe distance of every flow in t (slot minus hash slot), before the drain clears them */
+static void stats_probes(capture_ctx_t *ctx, const struct flow_table *t)
+{
+    for (int k = 0; k < t->num_flows; k++) {
+        uint32_t idx = t->used[k];
+        uint32_t d = (idx - (uint32_t)hash_key(t->seed, &t->entries[idx].key)) & t->mask;
+        ctx->probe_hist[log2_bucket(d, STATS_PROBE_BUCKETS)]++;
+        ctx->probe_sum += d;
+    }
+}
+
+/* Copy the counters into the shared block; t is the table just drained */
+static void stats_publish(capture_ctx_t *ctx, const struct flow_table *t, int flows)
+{
+    struct cap_stats *s = ctx->stats;
+    uint32_t mem[SK_MEMINFO_VARS] = { 0 };
+    socklen_t len = sizeof(mem);
+    int meminfo = ctx->sock_fd >= 0 && getsockopt(ctx->sock_fd, SOL_SOCKET, SO_MEMINFO, mem, &len) == 0;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    cap_stats_begin(s);
+    s->updated_ns = (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+    s->pkts = ctx->total_pkts;
+    s->bytes = ctx->total_bytes;
+    s->parsed = ctx->total_parsed;
+    s->sampled = ctx->total_sampled;
+    memcpy(s->rejects, ctx->rejects, sizeof(s->rejects));
+    s->rejects[STATS_REJ_VNI] = ctx->vni_dropped;
+    s->rx_calls = ctx->rx_calls;
+    s->rx_full = ctx->rx_full;
+    s->rx_entries = ctx->rx_dgrams;
+    memcpy(s->batch_hist, ctx->batch_hist, sizeof(s->batch_hist));
+    memcpy(s->probe_hist, ctx->probe_hist, sizeof(s->probe_hist));
+    s->probe_sum = ctx->probe_sum;
+    memcpy(s->drain_hist, ctx->drain_hist, sizeof(s->drain_hist));
+    s->drain_ns = ctx->drain_ns;
+    s->drains = ctx->drains;
+    s->dropped_flows = ctx->dropped_total;
+    s->probe_failures = ctx->probe_fail_total;
+    s->ring_drops = ctx->ring_drops;
+    s->flows = (uint64_t)flows;
+    s->capacity = (uint64_t)t->max_flows;
+    if (meminfo) {
+        s->sock_rmem = mem[SK_MEMINFO_RMEM_ALLOC];
+        s->sock_rcvbuf = mem[SK_MEMINFO_RCVBUF];
+        s->sock_drops = mem[SK_MEMINFO_DROPS];
+    }
+    cap_stats_end(s);
+}
+
+/*
+ * Drain: export a retired table's entries and reset it. Records go straight
+ * into the attached ring (see cap_attach_ring()), otherwise to flush_buf.
+ * Walks the insertion log only, so cost is O(flows seen), not O(table size):
+ * every slot not listed in used[] is already zero.
+ * Flows the table had to skip follow as overflow sketch records (see
+ * hh_export()). IPv6 flows go to ring6 / flush6_buf (cap_get_flushed6()
+ * counts them), extended counters to ring_ext / flush_ext_buf
+ * (cap_get_flushed_ext()). Returns count of IPv4 records exported; records that did not fit
+ * in the ring are counted by cap_get_ring_drops(). cap_get_dropped_flows()
+ * and cap_get_probe_failures() report this table's drops.
+ */
+int cap_drain(capture_ctx_t *ctx, struct flow_table *t)
+{
+    int count = t->num_flows;
+    int i = 0;
+    struct timespec t0;
+    if (ctx->stats) {
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        stats_probes(ctx, t);
+    }
+
+    ctx->flushed_ext = t->ext ? drain_ext(ctx, t) : 0;
+    if (ctx->ring) {
+        while (i < count) {
+            uint64_t first;
+            uint64_t room = flow_ring_writable(ctx->ring, &first);
+            if (room == 0)
+                break;
+            if (room > (uint64_t)(count - i))
+                room = count - i;
+            struct flow_record *out = (struct flow_record *)flow_ring_slots(ctx->ring) + first;
+            for (uint64_t j = 0; j < room; j++)
+                fill_record(&out[j], t, t->used[i + j]);
+            flow_ring_publish(ctx->ring, room);
+            i += (int)room;
+        }
+        if (i < count) {
+            ctx->ring->dropped += count - i;
+            ctx->ring_drops += count - i;
+            for (int k = i; k < count; k++)
+                slot_reset(t, t->used[k]);
+        }
+    } else {
+        if (count > ctx->flush_cap) {
+            struct flow_record *buf = realloc(ctx->flush_buf, (size_t)count * sizeof(*buf));
+            if (buf) {
+                ctx->flush_buf = buf;
+                ctx->flush_cap = count;
+            }
+        }
+        for (; i < count && i < ctx->flush_cap; i++)
+            fill_record(&ctx->flush_buf[i], t, t->used[i]);
+        for (int k = i; k < count; k++)
+            slot_reset(t, t->used[k]);
+    }
+
+    ctx->flushed6 = t->v6 ? drain_v6(ctx, t->v6) : 0;
+    if (t->hh) {
+        struct flow_record hh[HH_MAX_RECORDS];
+        i = drain_extra(ctx, hh, hh_export(t->hh, hh), i);
+    }
+    if (t->src) {
+        /* Per-source totals, SRC_CHUNK records at a time */
+        struct flow_record src[SRC_CHUNK];
+        int nsrc = atomic_load_explicit(&ctx->sources->n, memory_order_acquire), n = 0;
+        for (int id = 0; id <= nsrc; id++) {
+            if (!t->src[id].packets)
+                continue;
+            src[n++] = (struct flow_record){ .src_ip = ctx->sources->ip[id], .kind = FLOW_REC_SOURCE,
+                                             .source = (uint16_t)id, .packets = t->src[id].packets,
+                                             .bytes = t->src[id].bytes };
+            t->src[id] = (struct src_count){ 0, 0 };
+            if (n == SRC_CHUNK) {
+                i = drain_extra(ctx, src, n, i);
+                n = 0;
+            }
+        }
+        i = drain_extra(ctx, src, n, i);
+    }
+
+    ctx->dropped_flows  = t->dropped_flows;
+    ctx->probe_failures = t->probe_failures;
+    ctx->dropped_total += t->dropped_flows;
+    ctx->probe_fail_total += t->probe_failures;
+
+    /* Reset drop counters */
+    t->num_flows = 0;
+    t->dropped_flows = 0;
+    t->probe_failures = 0;
+
+    if (ctx->stats) {
+        struct timespec t1;
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        uint64_t ns = (uint64_t)((t1.tv_sec - t0.tv_sec) * 1000000000L + (t1.tv_nsec - t0.tv_nsec));
+        ctx->drain_hist[log2_bucket(ns >> 14, STATS_DRAIN_BUCKETS)]++;
+        ctx->drain_ns += ns;
+        ctx->drains++;
+        stats_publish(ctx, t, count);
+    }
+    return i;
+}
+
+/*
+ * Flush: swap + drain in one call. Safe both after cap_run() returns and
+ * while a cap_start() thread is capturing.
+ */
+int cap_flush(capture_ctx_t *ctx)
+{
+    return cap_drain(ctx, cap_swap(ctx));
+}
+
+/*
+ * Send drained flows to a shared-memory ring formatted by ring_init()
+ * instead of flush_buf. Returns 0, or -1 if mem is not a flow_record ring.
+ */
+int cap_attach_ring(capture_ctx_t *ctx, void *mem)
+{
+    struct flow_ring *r = mem;
+    if (!r || r->magic != FLOW_RING_MAGIC || r->rec_size != sizeof(struct flow_record))
+        return -1;
+    ctx->ring = r;
+    r->sample_rate = ctx->sample_rate;
+    return 0;
+}
+
+/* As cap_attach_ring(), for the IPv6 records: mem is formatted by ring_init6() */
+int cap_attach_ring6(capture_ctx_t *ctx, void *mem)
+{
+    struct flow_ring *r = mem;
+    if (!r || r->magic != FLOW_RING_MAGIC || r->rec_size != sizeof(struct flow_record6))
+        return -1;
+    ctx->ring6 = r;
+    r->sample_rate = ctx->sample_rate;
+    return 0;
+}
+
+/* As cap_attach_ring(), for the ext_counters records: mem is formatted by ring_init_ext() */
+int cap_attach_ring_ext(capture_ctx_t *ctx, void *mem)
+{
+    struct flow_ring *r = mem;
+    if (!r || r->magic != FLOW_RING_MAGIC || r->rec_size != sizeof(struct flow_record_ext))
+        return -1;
+    ctx->ring_ext = r;
+    r->sample_rate = ctx->sample_rate;
+    return 0;
+}
+
+/*
+ * Push host_event records into mem, formatted by ring_init_events(), as the
+ * capture thread raises them. Returns 0, or -1 if mem is not a host_event
+ * ring or the host pre-check is off (no thresholds, or XDP_COUNT).
+ */
+int cap_attach_events(capture_ctx_t *ctx, void *mem)
+{
+    struct flow_ring *r = mem;
+    if (!ctx->hosts || !r || r->magic != FLOW_RING_MAGIC || r->rec_size != sizeof(struct host_event))
+        return -1;
+    ctx->ring_ev = r;
+    return 0;
+}
+
+struct flow_record* cap_get_flush_buf(capture_ctx_t *ctx)
+{
+    return ctx->flush_buf;
+}
+
+struct flow_record6* cap_get_flush6_buf(capture_ctx_t *ctx) { return ctx->flush6_buf; }
+int cap_get_flushed6(capture_ctx_t *ctx) { return ctx->flushed6; }
+struct flow_record_ext* cap_get_flush_ext_buf(capture_ctx_t *ctx) { return ctx->flush_ext_buf; }
+int cap_get_flushed_ext(capture_ctx_t *ctx) { return ctx->flushed_ext; }
+int cap_get_ext_counters(capture_ctx_t *ctx) { return ctx->tables[0].ext != NULL; }
+int cap_get_host_check(capture_ctx_t *ctx) { return ctx->hosts != NULL; }
+uint64_t cap_get_host_events(capture_ctx_t *ctx) { return ctx->hosts ? ctx->hosts->events : 0; }
+uint64_t cap_get_host_uncounted(capture_ctx_t *ctx) { return ctx->hosts ? ctx->hosts->uncounted : 0; }
+
+uint64_t cap_get_total_pkts(capture_ctx_t *ctx) { return ctx->total_pkts; }
+uint64_t cap_get_total_bytes(capture_ctx_t *ctx) { return ctx->total_bytes; }
+uint64_t cap_get_total_parsed(capture_ctx_t *ctx) { return ctx->total_parsed; }
+uint64_t cap_get_total_sampled(capture_ctx_t *ctx) { return ctx->total_sampled; }
+double cap_get_sample_rate(capture_ctx_t *ctx) { return ctx->sample_rate; }
+int cap_get_num_flows(capture_ctx_t *ctx) { return atomic_load(&ctx->active)->num_flows; }
+uint64_t cap_get_dropped_flows(capture_ctx_t *ctx) { return ctx->dropped_flows; }
+uint64_t cap_get_probe_failures(capture_ctx_t *ctx) { return ctx->probe_failures; }
+uint64_t cap_get_ring_drops(capture_ctx_t *ctx) { return ctx->ring_drops; }
+int cap_get_flow_capacity(capture_ctx_t *ctx) { return atomic_load(&ctx->active)->max_flows; }
+int cap_get_table_pages(capture_ctx_t *ctx) { return ctx->tables[0].pages; }
+int cap_get_pinned_cpu(capture_ctx_t *ctx) { return ctx->pinned_cpu; }
+int cap_get_rx_mode(capture_ctx_t *ctx) { return ctx->rx_mode; }
+
+/*
+ * Publish counters into a block formatted by stats_init() (shared memory) at
+ * every cap_drain(), starting now. Returns 0, or -1 if mem is not one.
+ */
+int cap_attach_stats(capture_ctx_t *ctx, void *mem)
+{
+    struct cap_stats *s = mem;
+    if (!s || s->magic != CAP_STATS_MAGIC || s->size != sizeof(*s))
+        return -1;
+    ctx->stats = s;
+    stats_publish(ctx, atomic_load(&ctx->active), 0);
+    return 0;
+}
+
+/*
+ * Batch-fill statistics since cap_create(): out[0] receive calls, out[1]
+ * empty calls, out[2] full batches, out[3] packets, out[4] current batch
+ * size, out[5] current adaptive coalescing wait (us), out[6] recvmmsg()
+ * entries (fewer than packets when UDP_GRO coalesces).
+ */
+void cap_get_batch_stats(capture_ctx_t *ctx, uint64_t *out)
+{
+    out[0] = ctx->rx_calls;
+    out[1] = ctx->rx_empty;
+    out[2] = ctx->rx_full;
+    out[3] = ctx->rx_pkts;
+    out[4] = (uint64_t)ctx->batch;
+    out[5] = (uint64_t)ctx->wait_us;
+    out[6] = ctx->rx_dgrams;
+}
+
+/*
+ * Replay: let the capture thread on to the end of epoch `epochs` (counted
+ * from 1 at the first frame) and wait up to timeout_ms for it to get there.
+ * Returns 1 when it holds at that boundary, so the next cap_swap() takes
+ * exactly the capture up to it; 2 at the end of the file (everything
+ * replayed is in the active table); 0 on timeout; -1 unless the context
+ * replays a file with replay_epoch_ms.
+ */
+int cap_replay_step(capture_ctx_t *ctx, uint32_t epochs, int timeout_ms)
+{
+    struct replay_state *r = ctx->replay;
+    if (!r || !r->epoch_ns)
+        return -1;
+    atomic_store_explicit(&r->allowed, epochs, memory_order_release);
+    for (long waited = 0;; waited += REPLAY_PARK_US) {
+        if (atomic_load_explicit(&r->eof, memory_order_acquire))
+            return 2;
+        if (atomic_load_explicit(&r->parked, memory_order_acquire) >= epochs)
+            return 1;
+        if (waited >= timeout_ms * 1000L)
+            return 0;
+        replay_sleep_ns(REPLAY_PARK_US * 1000ull);
+    }
+}
+
+/*
+ * Replay progress: out[0] VXLAN frames replayed, out[1] frames skipped (not
+ * VXLAN to the port; shard 0 only), out[2] capture time of the last frame
+ * (ns), out[3] capture time of the first, out[4] 1 if the file ended in a
+ * malformed record, out[5] 1 at the end of the file. Zeros unless replaying.
+ */
+void cap_get_replay_stats(capture_ctx_t *ctx, uint64_t *out)
+{
+    struct replay_state *r = ctx->replay;
+    memset(out, 0, 6 * sizeof(*out));
+    if (!r)
+        return;
+    out[0] = r->frames;
+    out[1] = r->skipped;
+    out[2] = r->now_ns;
+    out[3] = r->origin_ns;
+    out[4] = (uint64_t)r->malformed;
+    out[5] = (uint64_t)atomic_load_explicit(&r->eof, memory_order_acquire);
+}
+
+int cap_get_udp_gro(capture_ctx_t *ctx) { return ctx->gro_buf != NULL; }
+uint64_t cap_get_vni_dropped(capture_ctx_t *ctx) { return ctx->vni_dropped; }
+int cap_get_num_sources(capture_ctx_t *ctx)
+{
+    return ctx->sources ? atomic_load_explicit(&ctx->sources->n, memory_order_acquire) : 0;
+}
+
+void cap_destroy(capture_ctx_t *ctx)
+{
+    if (ctx) {
+        cap_stop(ctx);
+        if (ctx->sock_fd >= 0) close(ctx->sock_fd);
+        xsk_close(ctx->xsk);
+        xdpc_close(ctx->xdpc);
+        replay_close(ctx->replay);
+        if (ctx->gro_buf) munmap(ctx->gro_buf, (size_t)GRO_BATCH * GRO_BUF_SIZE);
+        for (int i = 0; i < 2; i++) {
+            table_free(&ctx->tables[i]);
+            free(ctx->tables[i].hh);
+            free(ctx->tables[i].src);
+        }
+        free(ctx->flush_buf);
+        free(ctx->flush6_buf);
+        free(ctx->flush_ext_buf);
+        free(ctx->sources);
+        free(ctx->hosts);
+        free(ctx);
+    }
+}
+
+/* Utility: IP u32 (network byte order in struct) to string */
+void ip_to_str(uint32_t ip_raw, char *buf, int buflen)
+{
+    /* ip_raw is stored as memcpy from packet (network byte order) */
+    inet_ntop(AF_INET, &ip_raw, buf, (socklen_t)buflen);
+}
+
+/* ---- Flow ring setup for the coordinator (see flow_ring.h) ---- */
+
+uint64_t ring_init(void *mem, uint64_t size)
+{
+    return flow_ring_init(mem, size, sizeof(struct flow_record));
+}
+
+uint64_t ring_init6(void *mem, uint64_t size)
+{
+    return flow_ring_init(mem, size, sizeof(struct flow_record6));
+}
+
+uint64_t ring_init_ext(void *mem, uint64_t size)
+{
+    return flow_ring_init(mem, size, sizeof(struct flow_record_ext));
+}
+
+int stats_init(void *mem, uint64_t size) { return cap_stats_init(mem, size); }
+int stats_read(void *mem, void *out) { return cap_stats_read(mem, out); }
+int stats_size(void) { return (int)sizeof(struct cap_stats); }
+
+uint64_t ring_init_events(void *mem, uint64_t size)
+{
+    return flow_ring_init(mem, size, sizeof(struct host_event));
+}
+
+int ring_push(void *ring, const struct flow_record *recs, int n) { return flow_ring_push(ring, recs, n); }
+int ring_pop(void *ring, void *out, int max) { return flow_ring_pop(ring, out, max); }
+uint64_t ring_get_dropped(void *ring) { return ((struct flow_ring *)ring)->dropped; }
+double ring_get_sample_rate(void *ring) { return ((struct flow_ring *)ring)->sample_rate; }
+
+/* Replay lock-step (flow_ring.replay_hold / replay_done) */
+uint32_t ring_get_replay_hold(void *ring)
+{
+    return atomic_load_explicit(&((struct flow_ring *)ring)->replay_hold, memory_order_acquire);
+}
+
+void ring_set_replay_hold(void *ring, uint32_t epochs)
+{
+    atomic_store_explicit(&((struct flow_ring *)ring)->replay_hold, epochs, memory_order_release);
+}
+
+uint32_t ring_get_replay_done(void *ring)
+{
+    return atomic_load_explicit(&((struct flow_ring *)ring)->replay_done, memory_order_acquire);
+}
+
+void ring_set_replay_done(void *ring, uint32_t epochs)
+{
+    atomic_store_explicit(&((struct flow_ring *)ring)->replay_done, epochs, memory_order_release);
+}
+
+/* ---- XDP steering program for the AF_XDP backend (see xdp_prog.h) ---- */
+
+struct xdp_handle {
+    int map_fd;
+    int prog_fd;
+    int link_fd;
+    uint32_t map_id;
+    int mode;
+};
+
+void xdp_detach(struct xdp_handle *h)
+{
+    if (h) {
+        if (h->link_fd >= 0) close(h->link_fd);
+        if (h->prog_fd >= 0) close(h->prog_fd);
+        if (h->map_fd >= 0) close(h->map_fd);
+        free(h);
+    }
+}
+
+/*
+ * Load the VXLAN steering program and attach it to ifname (native mode,
+ * else generic). UDP to `port` on RX queue q goes to the AF_XDP socket in
+ * XSKMAP[q]; queues without one, and all other traffic, pass to the stack.
+ * Called once by the coordinator; workers register their sockets through
+ * cap_config.xsk_map_id. The program stays attached until xdp_detach() or
+ * process exit. Returns NULL on failure; see xdp_get_log().
+ */
+struct xdp_handle *xdp_attach(const char *ifname, int port, int nqueues)
+{
+    xdp_log[0] = 0;
+    int ifindex = (int)if_nametoindex(ifname);
+    if (!ifindex || nqueues < 1) {
+        snprintf(xdp_log, sizeof(xdp_log), "bad interface %s or queue count %d", ifname, nqueues);
+        return NULL;
+    }
+
+    struct xdp_handle *h = calloc(1, sizeof(*h));
+    if (!h)
+        return NULL;
+    h->prog_fd = h->link_fd = -1;
+    h->map_fd = bpf_map_create_raw(BPF_MAP_TYPE_XSKMAP, sizeof(uint32_t), sizeof(int), nqueues, 0);
+    if (h->map_fd < 0) {
+        snprintf(xdp_log, sizeof(xdp_log), "XSKMAP create: %s", strerror(errno));
+        goto fail;
+    }
+
+    struct bpf_asm a;
+    if (xdp_redirect_prog(&a, port, h->map_fd) < 0)
+        goto fail;
+    h->prog_fd = bpf_prog_load_raw(BPF_PROG_TYPE_XDP, a.insn, a.n, xdp_log, sizeof(xdp_log));
+    if (h->prog_fd < 0)
+        goto fail;
+
+    h->link_fd = xdp_link(h->prog_fd, ifindex, &h->mode);
+    if (h->link_fd < 0) {
+        snprintf(xdp_log, sizeof(xdp_log), "XDP attach to %s: %s", ifname, strerror(errno));
+        goto fail;
+    }
+    h->map_id = bpf_map_id_raw(h->map_fd);
+    return h;
+
+fail:
+    xdp_detach(h);
+    return NULL;
+}
+
+uint32_t xdp_get_map_id(struct xdp_handle *h) { return h->map_id; }
+int cap_get_xdp_mode(capture_ctx_t *ctx) { return ctx->xdpc ? ctx->xdpc->mode : 0; }
+int xdp_get_mode(struct xdp_handle *h) { return h->mode; }
+const char *xdp_get_log(void) { return xdp_log; }
@@ -0,0 +1,438 @@
+/*
+ * Header-only flow record export for the coordinator merge (flow_merge.c):
+ * every exact IPv4 / IPv6 flow_record a worker flushes (one per flow per
+ * CAP_FLUSH_INTERVAL) is written out while its ring is merged, straight
+ * from the ring slots, as
+ *
+ *   - IPFIX (RFC 7011) over UDP: records batched into messages of up to
+ *     EXPORT_IPFIX_MTU bytes, templates 256 (IPv4) / 257 (IPv6) sent in the
+ *     first message and every EXPORT_TEMPLATE_REFRESH_S after; sends never
+ *     block, a full socket buffer only counts an error;
+ *   - an append-only columnar file mapped into memory (layout below), one
+ *     file per rotation period, opened and closed by the caller.
+ *
+ * Counts are scaled by the producing ring's sample rate, like the reports.
+ * Records carry no timestamp of their own: a batch is stamped with the wall
+ * clock at merge time (flowEnd) and flowEnd - interval_ms (flowStart).
+ * Sketch candidates and overflow totals are not exported.
+ *
+ * Columnar file:
+ *   EXPORT_FILE_HDR bytes  struct export_file_hdr
+ *   blocks                 each EXPORT_BLOCK_HDR bytes of struct export_block_hdr, then
+ *                          `capacity` rows per column, columns in this order,
+ *                          each starting on an 8-byte boundary:
+ *                            ts_s u32, src_ip u32 | 16 bytes, dst_ip u32 | 16 bytes,
+ *                            src_port u16, dst_port u16, proto u8, packets u64, bytes u64
+ *                          IPs in network byte order, ports in host byte order.
+ * IPv4 and IPv6 rows go to blocks of their own (family 4 / 6), interleaved
+ * in the file as they fill. A block's `rows` is stored after its column
+ * values, so a reader of a live or truncated file only sees whole rows.
+ * Blocks are page-aligned and mapped one at a time per family.
+ */
+#ifndef FLOW_EXPORT_H
+#define FLOW_EXPORT_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "flow_ring.h"
+
+#define EXPORT_IPFIX_MTU            1400    /* IPFIX message size: one unfragmented UDP datagram */
+#define EXPORT_TEMPLATE_REFRESH_S   60
+#define EXPORT_TPL_V4               256
+#define EXPORT_TPL_V6               257
+#define EXPORT_FILE_MAGIC           0x43465844u     /* "DXFC" */
+#define EXPORT_BLOCK_MAGIC          0x4b4c4244u     /* "DBLK" */
+#define EXPORT_FILE_VERSION         1
+#define EXPORT_FILE_HDR             4096
+#define EXPORT_BLOCK_HDR            64
+#define EXPORT_BLOCK_ROWS           16384
+
+/* Export counters, as read by merge_export_stats() */
+enum {
+    EXPORT_ST_RECORDS = 0,      /* flow records exported, to one sink or both */
+    EXPORT_ST_IPFIX_MSGS,       /* IPFIX messages sent */
+    EXPORT_ST_IPFIX_ERRORS,     /* messages lost: send failed or would block */
+    EXPORT_ST_FILE_ROWS,        /* rows written to columnar files */
+    EXPORT_ST_FILE_ERRORS,      /* rows lost: file could not grow or be mapped */
+    EXPORT_ST_COUNT
+};
+
+struct export_file_hdr {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t header_size;       /* EXPORT_FILE_HDR: first block offset */
+    uint32_t block_hdr_size;    /* EXPORT_BLOCK_HDR */
+    uint64_t created_ms;        /* CLOCK_REALTIME */
+    uint32_t interval_ms;       /* rows cover [ts_s - interval, ts_s] */
+    uint32_t _pad;
+};
+
+struct export_block_hdr {
+    uint32_t magic;
+    uint32_t family;            /* 4 or 6 */
+    uint32_t capacity;          /* rows the columns are sized for */
+    _Atomic uint32_t rows;      /* rows written, stored after their values */
+    uint32_t first_s;
+    uint32_t last_s;
+    uint64_t next;              /* byte size of the whole block (offset to the next one) */
+};
+
+_Static_assert(sizeof(struct export_block_hdr) <= EXPORT_BLOCK_HDR, "export block header too large");
+
+/* One family's open block */
+struct export_block {
+    uint8_t *map;               /* NULL = none open */
+    size_t   size;
+    uint32_t capacity;
+    size_t   col[8];            /* column offsets from map */
+};
+
+struct flow_export {
+    /* IPFIX */
+    int      sock;              /* -1 = off */
+    uint32_t domain;
+    uint32_t seq;               /* data records sent before the current message */
+    uint32_t msg_records;
+    uint64_t template_s;        /* export time of the last template set, 0 = never */
+    uint8_t  msg[EXPORT_IPFIX_MTU];
+    int      msg_len;           /* 0 = no message started */
+    int      set_off;           /* offset of the open data set header, 0 = none */
+    uint16_t set_tpl;
+    /* Columnar file */
+    int      fd;                /* -1 = off */
+    uint64_t file_size;
+    struct export_block blk[2]; /* [IPv4, IPv6] */
+    /* Both */
+    uint32_t interval_ms;
+    uint64_t stats[EXPORT_ST_COUNT];
+};
+
+static inline uint64_t export_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static inline void export_put16(uint8_t *p, uint16_t v) { v = htons(v); memcpy(p, &v, 2); }
+static inline void export_put32(uint8_t *p, uint32_t v) { v = htonl(v); memcpy(p, &v, 4); }
+static inline void export_put64(uint8_t *p, uint64_t v)
+{
+    export_put32(p, (uint32_t)(v >> 32));
+    export_put32(p + 4, (uint32_t)v);
+}
+
+static inline void export_init(struct flow_export *e)
+{
+    memset(e, 0, sizeof(*e));
+    e->sock = -1;
+    e->fd = -1;
+    e->interval_ms = 1000;
+}
+
+/* ---- IPFIX ---- */
+
+/* (information element, length) of each template; IPs are the first two */
+static const uint16_t export_tpl_v4[][2] = {
+    {8, 4}, {12, 4}, {7, 2}, {11, 2}, {4, 1}, {2, 8}, {1, 8}, {152, 8}, {153, 8},
+};
+static const uint16_t export_tpl_v6[][2] = {
+    {27, 16}, {28, 16}, {7, 2}, {11, 2}, {4, 1}, {2, 8}, {1, 8}, {152, 8}, {153, 8},
+};
+#define EXPORT_TPL_FIELDS   9
+#define EXPORT_REC_V4       45
+#define EXPORT_REC_V6       69
+
+static inline void ipfix_close_set(struct flow_export *e)
+{
+    if (e->set_off) {
+        export_put16(e->msg + e->set_off + 2, (uint16_t)(e->msg_len - e->set_off));
+        e->set_off = 0;
+    }
+}
+
+static inline void ipfix_send(struct flow_export *e)
+{
+    if (!e->msg_len)
+        return;
+    ipfix_close_set(e);
+    export_put16(e->msg + 2, (uint16_t)e->msg_len);
+    if (send(e->sock, e->msg, e->msg_len, MSG_DONTWAIT) == e->msg_len)
+        e->stats[EXPORT_ST_IPFIX_MSGS]++;
+    else
+        e->stats[EXPORT_ST_IPFIX_ERRORS]++;
+    e->seq += e->msg_records;   /* lost messages show up as a sequence gap at the collector */
+    e->msg_records = 0;
+    e->msg_len = 0;
+}
+
+static inline void ipfix_template(uint8_t *p, int *len, uint16_t id, const uint16_t (*f)[2])
+{
+    export_put16(p + *len, id);
+    export_put16(p + *len + 2, EXPORT_TPL_FIELDS);
+    *len += 4;
+    for (int i = 0; i < EXPORT_TPL_FIELDS; i++, *len += 4) {
+        export_put16(p + *len, f[i][0]);
+        export_put16(p + *len + 2, f[i][1]);
+    }
+}
+
+static inline void ipfix_begin(struct flow_export *e, uint64_t now_ms)
+{
+    uint32_t now_s = (uint32_t)(now_ms / 1000);
+    export_put16(e->msg, 10);
+    export_put32(e->msg + 4, now_s);
+    export_put32(e->msg + 8, e->seq);
+    export_put32(e->msg + 12, e->domain);
+    e->msg_len = 16;
+    if (!e->template_s || now_s - e->template_s >= EXPORT_TEMPLATE_REFRESH_S) {
+        int start = e->msg_len;
+        export_put16(e->msg + start, 2);        /* template set */
+        e->msg_len += 4;
+        ipfix_template(e->msg, &e->msg_len, EXPORT_TPL_V4, export_tpl_v4);
+        ipfix_template(e->msg, &e->msg_len, EXPORT_TPL_V6, export_tpl_v6);
+        export_put16(e->msg + start + 2, (uint16_t)(e->msg_len - start));
+        e->template_s = now_s;
+    }
+}
+
+/* Room for one record of template tpl (rec bytes) in the current message, opening a data set as needed */
+static inline uint8_t *ipfix_reserve(struct flow_export *e, uint16_t tpl, int rec, uint64_t now_ms)
+{
+    int need = rec + (e->set_off && e->set_tpl == tpl ? 0 : 4);
+    if (e->msg_len && e->msg_len + need > EXPORT_IPFIX_MTU)
+        ipfix_send(e);
+    if (!e->msg_len)
+        ipfix_begin(e, now_ms);
+    if (!e->set_off || e->set_tpl != tpl) {
+        ipfix_close_set(e);
+        e->set_off = e->msg_len;
+        e->set_tpl = tpl;
+        export_put16(e->msg + e->msg_len, tpl);
+        e->msg_len += 4;
+    }
+    uint8_t *p = e->msg + e->msg_len;
+    e->msg_len += rec;
+    e->msg_records++;
+    return p;
+}
+
+static inline void ipfix_record(struct flow_export *e, int v6, const void *src, const void *dst,
+                                uint16_t sport, uint16_t dport, uint8_t proto,
+                                uint64_t packets, uint64_t bytes, uint64_t now_ms)
+{
+    int alen = v6 ? 16 : 4;
+    uint8_t *p = ipfix_reserve(e, v6 ? EXPORT_TPL_V6 : EXPORT_TPL_V4, v6 ? EXPORT_REC_V6 : EXPORT_REC_V4, now_ms);
+    memcpy(p, src, alen);
+    memcpy(p + alen, dst, alen);
+    p += 2 * alen;
+    export_put16(p, sport);
+    export_put16(p + 2, dport);
+    p[4] = proto;
+    export_put64(p + 5, packets);
+    export_put64(p + 13, bytes);
+    export_put64(p + 21, now_ms - e->interval_ms);
+    export_put64(p + 29, now_ms);
+}
+
+/* Connect the UDP socket to host:port. Returns 0, or -1 (export stays off). */
+static inline int export_ipfix_open(struct flow_export *e, const char *host, int port, uint32_t domain)
+{
+    char service[8];
+    struct addrinfo hints = {.ai_socktype = SOCK_DGRAM}, *res = NULL;
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(host, service, &hints, &res) != 0)
+        return -1;
+    int fd = socket(res->ai_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0)
+        return -1;
+    e->sock = fd;
+    e->domain = domain;
+    e->template_s = 0;
+    return 0;
+}
+
+static inline void export_ipfix_close(struct flow_export *e)
+{
+    if (e->sock < 0)
+        return;
+    ipfix_send(e);
+    close(e->sock);
+    e->sock = -1;
+}
+
+/* ---- Columnar file ---- */
+
+static inline size_t export_align(size_t n, size_t a) { return (n + a - 1) & ~(a - 1); }
+
+/* Column offsets of a block of `cap` rows; returns the page-aligned block size */
+static inline size_t export_block_layout(int v6, uint32_t cap, size_t *col)
+{
+    static const uint8_t width4[] = {4, 4, 4, 2, 2, 1, 8, 8};
+    static const uint8_t width6[] = {4, 16, 16, 2, 2, 1, 8, 8};
+    const uint8_t *w = v6 ? width6 : width4;
+    size_t off = EXPORT_BLOCK_HDR;
+    for (int c = 0; c < 8; c++) {
+        col[c] = off;
+        off = export_align(off + (size_t)w[c] * cap, 8);
+    }
+    return export_align(off, (size_t)sysconf(_SC_PAGESIZE));
+}
+
+static inline void export_block_close(struct export_block *b)
+{
+    if (b->map) {
+        munmap(b->map, b->size);
+        b->map = NULL;
+    }
+}
+
+/* Append and map a new empty block for family v6. Returns 0 or -1. */
+static inline int export_block_open(struct flow_export *e, int v6, uint32_t first_s)
+{
+    struct export_block *b = &e->blk[v6];
+    export_block_close(b);
+    b->capacity = EXPORT_BLOCK_ROWS;
+    b->size = export_block_layout(v6, b->capacity, b->col);
+    if (ftruncate(e->fd, (off_t)(e->file_size + b->size)) != 0)
+        return -1;
+    void *map = mmap(NULL, b->size, PROT_READ | PROT_WRITE, MAP_SHARED, e->fd, (off_t)e->file_size);
+    if (map == MAP_FAILED)
+        return -1;
+    b->map = map;
+    e->file_size += b->size;
+    struct export_block_hdr *h = map;
+    h->family = v6 ? 6 : 4;
+    h->capacity = b->capacity;
+    h->first_s = h->last_s = first_s;
+    h->next = b->size;
+    atomic_store_explicit(&h->rows, 0, memory_order_relaxed);
+    h->magic = EXPORT_BLOCK_MAGIC;
+    return 0;
+}
+
+static inline void file_record(struct flow_export *e, int v6, const void *src, const void *dst,
+                               uint16_t sport, uint16_t dport, uint8_t proto,
+                               uint64_t packets, uint64_t bytes, uint32_t now_s)
+{
+    struct export_block *b = &e->blk[v6];
+    struct export_block_hdr *h = (struct export_block_hdr *)b->map;
+    uint32_t i = h ? atomic_load_explicit(&h->rows, memory_order_relaxed) : 0;
+    if (!h || i == b->capacity) {
+        if (export_block_open(e, v6, now_s) != 0) {
+            e->stats[EXPORT_ST_FILE_ERRORS]++;
+            return;
+        }
+        h = (struct export_block_hdr *)b->map;
+        i = 0;
+    }
+    int alen = v6 ? 16 : 4;
+    uint8_t *m = b->map;
+    memcpy(m + b->col[0] + 4 * (size_t)i, &now_s, 4);
+    memcpy(m + b->col[1] + (size_t)alen * i, src, alen);
+    memcpy(m + b->col[2] + (size_t)alen * i, dst, alen);
+    memcpy(m + b->col[3] + 2 * (size_t)i, &sport, 2);
+    memcpy(m + b->col[4] + 2 * (size_t)i, &dport, 2);
+    m[b->col[5] + i] = proto;
+    memcpy(m + b->col[6] + 8 * (size_t)i, &packets, 8);
+    memcpy(m + b->col[7] + 8 * (size_t)i, &bytes, 8);
+    h->last_s = now_s;
+    atomic_store_explicit(&h->rows, i + 1, memory_order_release);
+    e->stats[EXPORT_ST_FILE_ROWS]++;
+}
+
+/* Create path and write the file header. Returns 0, or -1 (also if path exists: an earlier process's file is never truncated). */
+static inline int export_file_open(struct flow_export *e, const char *path)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -1;
+    struct export_file_hdr h = {
+        .magic = EXPORT_FILE_MAGIC, .version = EXPORT_FILE_VERSION,
+        .header_size = EXPORT_FILE_HDR, .block_hdr_size = EXPORT_BLOCK_HDR,
+        .created_ms = export_now_ms(), .interval_ms = e->interval_ms,
+    };
+    if (ftruncate(fd, EXPORT_FILE_HDR) != 0 || pwrite(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h)) {
+        close(fd);
+        return -1;
+    }
+    e->fd = fd;
+    e->file_size = EXPORT_FILE_HDR;
+    return 0;
+}
+
+static inline void export_file_close(struct flow_export *e)
+{
+    if (e->fd < 0)
+        return;
+    export_block_close(&e->blk[0]);
+    export_block_close(&e->blk[1]);
+    close(e->fd);
+    e->fd = -1;
+}
+
+/* ---- Ring slices ---- */
+
+static inline uint64_t export_scale(uint64_t n, double inv)
+{
+    return inv == 1.0 ? n : (uint64_t)((double)n * inv + 0.5);
+}
+
+/* Export the exact records among n consecutive ring slots of flow_record (v6 = 0) or flow_record6 */
+static inline void export_slots(struct flow_export *e, const struct flow_ring *r, const uint8_t *slots,
+                                uint64_t n, int v6, uint64_t now_ms)
+{
+    double inv = r->sample_rate > 0 && r->sample_rate < 1.0 ? 1.0 / r->sample_rate : 1.0;
+    uint32_t now_s = (uint32_t)(now_ms / 1000);
+    for (uint64_t i = 0; i < n; i++) {
+        const void *src, *dst;
+        uint16_t sport, dport;
+        uint8_t proto;
+        uint64_t packets, bytes;
+        if (v6) {
+            const struct flow_record6 *f = (const void *)(slots + i * r->rec_size);
+            if (f->kind != FLOW_REC_EXACT)
+                continue;
+            src = f->src_ip;  dst = f->dst_ip;
+            sport = f->src_port;  dport = f->dst_port;  proto = f->proto;
+            packets = f->packets;  bytes = f->bytes;
+        } else {
+            const struct flow_record *f = (const void *)(slots + i * r->rec_size);
+            if (f->kind != FLOW_REC_EXACT)
+                continue;
+            src = &f->src_ip;  dst = &f->dst_ip;
+            sport = f->src_port;  dport = f->dst_port;  proto = f->proto;
+            packets = f->packets;  bytes = f->bytes;
+        }
+        packets = export_scale(packets, inv);
+        bytes = export_scale(bytes, inv);
+        if (e->sock >= 0)
+            ipfix_record(e, v6, src, dst, sport, dport, proto, packets, bytes, now_ms);
+        if (e->fd >= 0)
+            file_record(e, v6, src, dst, sport, dport, proto, packets, bytes, now_s);
+        e->stats[EXPORT_ST_RECORDS]++;
+    }
+}
+
+static inline int export_active(const struct flow_export *e)
+{
+    return e && (e->sock >= 0 || e->fd >= 0);
+}
+
+#endif /* FLOW_EXPORT_H */
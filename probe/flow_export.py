@@ -0,0 +1,194 @@
+"""
+Flow export files: rotation, S3 upload and reading.
+
+Writing happens in C: with FlowMerge.export_file() set, every exact flow
+record the coordinator consumes goes from the worker ring into an
+append-only, memory-mapped columnar file (flow_export.h), one row per flow
+per worker flush, without becoming a Python object. This module only opens
+a new file per rotation period, hands closed ones to a background thread
+that uploads them to S3 (EXPORT_S3_BUCKET) and deletes them, and reads
+files back for forensics.
+
+File layout (flow_export.h): a 4096-byte header, then blocks of one address
+family each, every block a 64-byte header followed by its columns:
+ts_s u32, src_ip, dst_ip (u32 or 16 bytes, network order), src_port u16,
+dst_port u16, proto u8, packets u64, bytes u64.
+"""
+
+import logging
+import mmap
+import os
+import queue
+import struct
+import threading
+import time
+from dataclasses import dataclass
+from typing import Iterator, Optional
+
+import boto3
+
+logger = logging.getLogger(__name__)
+
+FILE_MAGIC = 0x43465844  # "DXFC", matches EXPORT_FILE_MAGIC in flow_export.h
+BLOCK_MAGIC = 0x4B4C4244  # "DBLK"
+FILE_VERSION = 1
+IPFIX_PORT = 4739
+ROTATE_SEC = 3600
+SUFFIX = ".dxf"
+
+_FILE_HDR = struct.Struct("=IIIIQII")  # magic, version, header_size, block_hdr_size, created_ms, interval_ms, pad
+_BLOCK_HDR = struct.Struct("=IIIIIIQ")  # magic, family, capacity, rows, first_s, last_s, next
+_COLUMNS = (  # name, struct format, width (IPv4), width (IPv6)
+    ("ts_s", "I", 4, 4),
+    ("src_ip", "I", 4, 16),
+    ("dst_ip", "I", 4, 16),
+    ("src_port", "H", 2, 2),
+    ("dst_port", "H", 2, 2),
+    ("proto", "B", 1, 1),
+    ("packets", "Q", 8, 8),
+    ("bytes", "Q", 8, 8),
+)
+
+
+def _align(n: int, a: int) -> int:
+    return (n + a - 1) & ~(a - 1)
+
+
+@dataclass
+class FlowBlock:
+    family: int  # 4 or 6
+    first_s: int
+    last_s: int
+    columns: dict  # name -> list of values; IPv6 addresses as 16-byte strings
+
+    def __len__(self) -> int:
+        return len(self.columns["ts_s"])
+
+    def rows(self) -> Iterator[tuple]:
+        """(ts_s, src_ip, dst_ip, src_port, dst_port, proto, packets, bytes), IPs raw as in FlowMerge rows."""
+        return zip(*(self.columns[name] for name, *_ in _COLUMNS))
+
+
+def read_file(path: str) -> Iterator[FlowBlock]:
+    """Blocks of a columnar export file, complete or still being written."""
+    with open(path, "rb") as f:
+        size = os.fstat(f.fileno()).st_size
+        if size < _FILE_HDR.size:
+            raise ValueError(f"{path}: too short for a flow export file")
+        with mmap.mmap(f.fileno(), 0, prot=mmap.PROT_READ) as m:
+            magic, version, off, block_hdr, *_ = _FILE_HDR.unpack_from(m, 0)
+            if magic != FILE_MAGIC or version != FILE_VERSION:
+                raise ValueError(f"{path}: not a flow export file (magic {magic:#x}, version {version})")
+            while off + block_hdr <= size:
+                magic, family, capacity, rows, first_s, last_s, nxt = _BLOCK_HDR.unpack_from(m, off)
+                if magic != BLOCK_MAGIC or family not in (4, 6) or not nxt:
+                    break
+                columns = {}
+                col = off + block_hdr
+                for name, fmt, w4, w6 in _COLUMNS:
+                    width = w6 if family == 6 else w4
+                    raw = m[col:col + width * rows]
+                    if family == 6 and width == 16:
+                        columns[name] = [raw[i:i + 16] for i in range(0, len(raw), 16)]
+                    else:
+                        columns[name] = list(memoryview(raw).cast(fmt))
+                    col = _align(col + width * capacity, 8)
+                yield FlowBlock(family, first_s, last_s, columns)
+                off += nxt
+
+
+class ExportFiles:
+    """
+    One columnar export file per rotate_sec period (aligned to the wall
+    clock, hourly by default) in directory, named
+    flows-<probe>-<UTC start>.dxf: the period start, or for a process's
+    first file the time it was opened, so a probe restarted within a period
+    starts a new file instead of replacing the one before it (a name already
+    taken gets a -<n> suffix). Closed files are uploaded to
+    s3://bucket/<prefix><probe>/YYYY/MM/DD/<name> and removed locally; with
+    no bucket they stay in directory.
+    """
+
+    def __init__(self, directory: str, probe_id: str, rotate_sec: int = ROTATE_SEC,
+                 s3_bucket: str = "", s3_prefix: str = "flows/"):
+        self._dir = directory
+        self._probe = probe_id
+        self._rotate = max(60, int(rotate_sec))
+        self._bucket = s3_bucket
+        self._prefix = s3_prefix
+        self._period: Optional[int] = None
+        self.path: Optional[str] = None
+        self._uploads: queue.Queue = queue.Queue()
+        self._uploader: Optional[threading.Thread] = None
+        self.uploaded = 0
+
+    def path_for(self, start: int, n: int = 0) -> str:
+        stamp = time.strftime("%Y%m%dT%H%M%SZ", time.gmtime(start))
+        suffix = f"-{n}" if n else ""
+        return os.path.join(self._dir, f"flows-{self._probe}-{stamp}{suffix}{SUFFIX}")
+
+    def tick(self, merge, now: Optional[float] = None) -> Optional[str]:
+        """Start the period's file when it changes. Returns the new path, or None."""
+        now = time.time() if now is None else now
+        period = int(now) // self._rotate * self._rotate
+        if period == self._period:
+            return None
+        start = period
+        if self._period is None:
+            os.makedirs(self._dir, exist_ok=True)
+            start = int(now)
+        self._period = period
+        old, path = self.path, self.path_for(start)
+        n = 0
+        while os.path.exists(path):
+            n += 1
+            path = self.path_for(start, n)
+        if merge.export_file(path):
+            self.path = path
+            logger.info("Exporting flows to %s", path)
+        else:
+            self.path = None
+            logger.error("Cannot create flow export file %s, file export paused", path)
+        if old:
+            self._upload(old)
+        return self.path
+
+    def close(self, merge, timeout: float = 30.0) -> None:
+        """Close the current file and wait (up to timeout) for pending uploads."""
+        merge.export_file(None)
+        if self.path:
+            self._upload(self.path)
+            self.path = None
+        if self._uploader:
+            self._uploads.put(None)
+            self._uploader.join(timeout)
+            self._uploader = None
+
+    def _upload(self, path: str) -> None:
+        if not self._bucket:
+            return
+        if not self._uploader:
+            self._uploader = threading.Thread(target=self._upload_loop, name="flow-upload", daemon=True)
+            self._uploader.start()
+        self._uploads.put(path)
+
+    def _s3_key(self, path: str) -> str:
+        name = os.path.basename(path)
+        stamp = name[len(f"flows-{self._probe}-"):]
+        return f"{self._prefix}{self._probe}/{stamp[0:4]}/{stamp[4:6]}/{stamp[6:8]}/{name}"
+
+    def _upload_loop(self) -> None:
+        s3 = boto3.client("s3")
+        while True:
+            path = self._uploads.get()
+            if path is None:
+                return
+            key = self._s3_key(path)
+            try:
+                s3.upload_file(path, self._bucket, key)
+                os.remove(path)
+                self.uploaded += 1
+                logger.info("Uploaded %s to s3://%s/%s", path, self._bucket, key)
+            except Exception as e:
+                # Left on disk: the next start does not retry it, an operator can
+                logger.error("Upload of %s to s3://%s failed, keeping it: %s", path, self._bucket, e)
@@ -0,0 +1,1059 @@
+/*
+ * Coordinator-side merge + Top-K engine.
+ * Consumes worker flow_record rings (flow_ring.h) into one merged flow table
+ * (IPv6 flow_record6 rings into a second one, flow_record_ext rings into a
+ * table of extended counters looked up by 5-tuple),
+ * keeps running totals incrementally and answers Top-K queries with a
+ * bounded min-heap, so the Python coordinator only ever touches K rows.
+ *
+ * Subnets and services: merge_rollup() folds the per-host table into /24,
+ * /16 and configured-CIDR tables (merge_set_prefixes()) and the flow table
+ * into per-(dst_ip, dst_port, proto) services, in one pass over each at
+ * report time, so merging records costs nothing extra for them.
+ * Destination ports and protocols are counted while merging, in flat
+ * arrays indexed by port and protocol number (merge_top_ports(),
+ * merge_protos()).
+ *
+ * merge_host_sketch() summarises the whole host table as count-min
+ * sketches for a multi-probe aggregator, which only receives the top
+ * hosts exactly (agg_protocol.py).
+ *
+ * Flow export: with merge_export_ipfix() / merge_export_file() set, every
+ * exact record consumed from a ring is also written out as IPFIX or into a
+ * columnar file (flow_export.h) from the ring slots, before it is merged.
+ *
+ * Warm restart: merge_save() writes the window merged so far into a
+ * memory-mapped snapshot file and merge_load() adds one back, so a
+ * restarted coordinator carries on with its predecessor's report window.
+ *
+ * Compile: gcc -O2 -shared -fPIC -o flow_merge.so flow_merge.c
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "flow_ring.h"
+#include "flow_export.h"
+
+/* ---- Configuration ---- */
+#define TABLE_INIT_CAP  (1 << 16)
+#define MERGE_MAX_CIDRS 64          /* merge_set_prefixes() limit */
+#define SKETCH_MAX_DEPTH 8          /* merge_host_sketch() limits */
+#define SKETCH_MAX_WIDTH (1 << 16)
+#define SNAP_MAGIC      0x534D5844u /* "DXMS", merge_save() files */
+#define SNAP_VERSION    1
+
+/* ---- Merge tables ---- */
+enum {
+    MT_FLOWS = 0,   /* key: struct merge_flow_key  vals: packets, bytes */
+    MT_HOSTS,       /* key: u32 ip                 vals: src_pkts, src_bytes, dst_pkts, dst_bytes */
+    MT_SOURCES,     /* key: u32 mirror source ip   vals: packets, bytes */
+    MT_FLOWS6,      /* key: struct merge_flow6_key vals: packets, bytes */
+    MT_FLOW_EXT,    /* key: struct merge_flow_key  vals: EXT_* */
+    MT_NET24,       /* key: u32 /24 network        vals: as MT_HOSTS (merge_rollup()) */
+    MT_NET16,       /* key: u32 /16 network        vals: as MT_HOSTS (merge_rollup()) */
+    MT_CIDRS,       /* key: struct merge_cidr_key  vals: as MT_HOSTS (merge_rollup()) */
+    MT_SERVICES,    /* key: struct merge_service_key vals: packets, bytes (merge_rollup()) */
+    MT_COUNT
+};
+
+/* 5-tuple key, zero padded so keys compare/hash as raw bytes (16 bytes) */
+struct merge_flow_key {
+    uint32_t src_ip;
+    uint32_t dst_ip;
+    uint16_t src_port;
+    uint16_t dst_port;
+    uint8_t  proto;
+    uint8_t  _pad[3];
+};
+
+/* MT_FLOW_EXT counters: sums, except flags (OR), first (min) and last (max) */
+enum {
+    EXT_SYN = 0,
+    EXT_RST,
+    EXT_FLAGS,
+    EXT_FIRST_NS,
+    EXT_LAST_NS,
+    EXT_HIST,       /* FLOW_EXT_BUCKETS columns */
+    EXT_NVALS = EXT_HIST + FLOW_EXT_BUCKETS
+};
+
+/* IPv6 5-tuple key, zero padded (40 bytes) */
+struct merge_flow6_key {
+    uint8_t  src_ip[16];
+    uint8_t  dst_ip[16];
+    uint16_t src_port;
+    uint16_t dst_port;
+    uint8_t  proto;
+    uint8_t  _pad[3];
+};
+
+/* Configured CIDR (8 bytes): network in network byte order, prefix length */
+struct merge_cidr_key {
+    uint32_t net;
+    uint32_t len;
+};
+
+/* Destination service: dst_ip (network byte order), dst_port, proto (8 bytes) */
+struct merge_service_key {
+    uint32_t ip;
+    uint16_t port;
+    uint8_t  proto;
+    uint8_t  _pad;
+};
+
+/* merge_top_ports() output row (24 bytes) */
+struct merge_port_row {
+    uint16_t port;
+    uint8_t  proto;
+    uint8_t  _pad[5];
+    uint64_t packets;
+    uint64_t bytes;
+};
+
+/*
+ * Open-addressing aggregate table with fixed-size byte keys and nvals u64
+ * counters per entry. Grows by doubling; reset walks the insertion log.
+ */
+struct agg_table {
+    uint8_t  *ctrl;         /* 1 = occupied */
+    uint8_t  *keys;         /* capacity * key_size */
+    uint64_t *vals;         /* capacity * nvals */
+    uint32_t *used;         /* insertion log: slot of every occupied entry */
+    uint32_t  key_size;
+    uint32_t  nvals;
+    uint32_t  capacity;     /* power of two */
+    uint32_t  count;
+};
+
+typedef struct {
+    struct agg_table tables[MT_COUNT];
+    uint64_t total_pkts;
+    uint64_t total_bytes;
+    uint64_t records;       /* flow_records merged since reset */
+    uint64_t dropped;       /* records lost to allocation failure */
+    struct merge_cidr_key cidrs[MERGE_MAX_CIDRS];
+    uint32_t cidr_mask[MERGE_MAX_CIDRS];    /* network byte order */
+    int      ncidrs;
+    uint64_t ports[2][65536][2];    /* [TCP, UDP][dst_port]: packets, bytes */
+    uint64_t protos[256][2];        /* [IP protocol]: packets, bytes */
+    struct flow_export *exp;        /* NULL until a merge_export_*() call */
+} merge_ctx_t;
+
+/* ---- Hashing (64-bit finalizer over 8-byte words) ---- */
+static inline uint64_t mix64(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static inline uint64_t hash_bytes(const uint8_t *key, uint32_t len)
+{
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ len;
+    uint32_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, key + i, 8);
+        h = mix64(h ^ w);
+    }
+    if (i < len) {
+        uint64_t w = 0;
+        memcpy(&w, key + i, len - i);
+        h = mix64(h ^ w);
+    }
+    return h;
+}
+
+/* ---- agg_table ---- */
+static int table_alloc(struct agg_table *t, uint32_t capacity)
+{
+    t->ctrl = calloc(capacity, 1);
+    t->keys = calloc(capacity, t->key_size);
+    t->vals = calloc((size_t)capacity * t->nvals, sizeof(uint64_t));
+    t->used = malloc((size_t)capacity * sizeof(uint32_t));
+    if (!t->ctrl || !t->keys || !t->vals || !t->used) {
+        free(t->ctrl); free(t->keys); free(t->vals); free(t->used);
+        return -1;
+    }
+    t->capacity = capacity;
+    t->count = 0;
+    return 0;
+}
+
+static int table_init(struct agg_table *t, uint32_t key_size, uint32_t nvals)
+{
+    memset(t, 0, sizeof(*t));
+    t->key_size = key_size;
+    t->nvals = nvals;
+    return table_alloc(t, TABLE_INIT_CAP);
+}
+
+static void table_free(struct agg_table *t)
+{
+    free(t->ctrl); free(t->keys); free(t->vals); free(t->used);
+    memset(t, 0, sizeof(*t));
+}
+
+static inline uint32_t table_find_slot(const struct agg_table *t, const void *key, int *found)
+{
+    uint32_t mask = t->capacity - 1;
+    uint32_t idx = (uint32_t)hash_bytes(key, t->key_size) & mask;
+    while (t->ctrl[idx]) {
+        if (memcmp(t->keys + (size_t)idx * t->key_size, key, t->key_size) == 0) {
+            *found = 1;
+            return idx;
+        }
+        idx = (idx + 1) & mask;
+    }
+    *found = 0;
+    return idx;
+}
+
+/* Double capacity and reinsert via the insertion log: O(count). */
+static int table_grow(struct agg_table *t)
+{
+    struct agg_table old = *t;
+    if (table_alloc(t, old.capacity * 2) != 0) {
+        *t = old;
+        return -1;
+    }
+    for (uint32_t i = 0; i < old.count; i++) {
+        uint32_t src = old.used[i];
+        int found;
+        uint32_t dst = table_find_slot(t, old.keys + (size_t)src * t->key_size, &found);
+        t->ctrl[dst] = 1;
+        memcpy(t->keys + (size_t)dst * t->key_size, old.keys + (size_t)src * t->key_size, t->key_size);
+        memcpy(t->vals + (size_t)dst * t->nvals, old.vals + (size_t)src * t->nvals, t->nvals * sizeof(uint64_t));
+        t->used[t->count++] = dst;
+    }
+    free(old.ctrl); free(old.keys); free(old.vals); free(old.used);
+    return 0;
+}
+
+/* Find or insert key; returns its counters (zeroed when new), NULL on OOM. */
+static inline uint64_t *table_upsert(struct agg_table *t, const void *key)
+{
+    int found;
+    uint32_t idx = table_find_slot(t, key, &found);
+    if (!found) {
+        if ((uint64_t)(t->count + 1) * 4 > (uint64_t)t->capacity * 3) {
+            if (table_grow(t) != 0)
+                return NULL;
+            idx = table_find_slot(t, key, &found);
+        }
+        t->ctrl[idx] = 1;
+        memcpy(t->keys + (size_t)idx * t->key_size, key, t->key_size);
+        t->used[t->count++] = idx;
+    }
+    return t->vals + (size_t)idx * t->nvals;
+}
+
+static void table_reset(struct agg_table *t)
+{
+    for (uint32_t i = 0; i < t->count; i++) {
+        uint32_t idx = t->used[i];
+        t->ctrl[idx] = 0;
+        memset(t->vals + (size_t)idx * t->nvals, 0, t->nvals * sizeof(uint64_t));
+    }
+    t->count = 0;
+}
+
+static inline int table_row_size(const struct agg_table *t)
+{
+    return (int)(t->key_size + t->nvals * sizeof(uint64_t));
+}
+
+/* Row = key bytes followed by the nvals counters (packed, native order). */
+static inline void table_write_row(const struct agg_table *t, uint32_t idx, uint8_t *out)
+{
+    memcpy(out, t->keys + (size_t)idx * t->key_size, t->key_size);
+    memcpy(out + t->key_size, t->vals + (size_t)idx * t->nvals, t->nvals * sizeof(uint64_t));
+}
+
+/* ---- Top-K min-heap over (value, slot) ---- */
+struct heap_item {
+    uint64_t val;
+    uint32_t idx;
+};
+
+static inline void heap_sift_down(struct heap_item *h, int n, int i)
+{
+    for (;;) {
+        int l = 2 * i + 1, r = l + 1, m = i;
+        if (l < n && h[l].val < h[m].val) m = l;
+        if (r < n && h[r].val < h[m].val) m = r;
+        if (m == i)
+            return;
+        struct heap_item tmp = h[i]; h[i] = h[m]; h[m] = tmp;
+        i = m;
+    }
+}
+
+static inline void heap_sift_up(struct heap_item *h, int i)
+{
+    while (i > 0) {
+        int p = (i - 1) / 2;
+        if (h[p].val <= h[i].val)
+            return;
+        struct heap_item tmp = h[i]; h[i] = h[p]; h[p] = tmp;
+        i = p;
+    }
+}
+
+/* Keep the k largest values seen so far in the n-entry heap h */
+static inline void heap_offer(struct heap_item *h, int *n, int k, uint64_t v, uint32_t idx)
+{
+    if (*n < k) {
+        h[*n].val = v;
+        h[*n].idx = idx;
+        heap_sift_up(h, (*n)++);
+    } else if (v > h[0].val) {
+        h[0].val = v;
+        h[0].idx = idx;
+        heap_sift_down(h, *n, 0);
+    }
+}
+
+/*
+ * Select the k entries with the largest non-zero vals[col] in O(count log k)
+ * and write them as rows, largest first. Returns rows written.
+ */
+static int table_top(const struct agg_table *t, int col, int k, uint8_t *out)
+{
+    if (k <= 0 || col < 0 || (uint32_t)col >= t->nvals)
+        return 0;
+    struct heap_item *h = malloc((size_t)k * sizeof(*h));
+    if (!h)
+        return 0;
+
+    int n = 0;
+    for (uint32_t i = 0; i < t->count; i++) {
+        uint32_t idx = t->used[i];
+        uint64_t v = t->vals[(size_t)idx * t->nvals + col];
+        if (v)
+            heap_offer(h, &n, k, v, idx);
+    }
+
+    /* Pop smallest to the back: rows come out largest first */
+    int rows = n;
+    int row_size = table_row_size(t);
+    while (n > 0) {
+        table_write_row(t, h[0].idx, out + (size_t)(n - 1) * row_size);
+        h[0] = h[--n];
+        heap_sift_down(h, n, 0);
+    }
+    free(h);
+    return rows;
+}
+
+/* ---- Merge ---- */
+
+/* Flat destination port / protocol counters: no lookup, one add per counter */
+static inline void merge_port(merge_ctx_t *m, uint8_t proto, uint16_t dst_port, uint64_t packets, uint64_t bytes)
+{
+    m->protos[proto][0] += packets;
+    m->protos[proto][1] += bytes;
+    if (proto == 6 || proto == 17) {
+        uint64_t *v = m->ports[proto == 17][dst_port];
+        v[0] += packets;
+        v[1] += bytes;
+    }
+}
+
+/* Overflow sketch records (flow_ring.h FLOW_REC_*) each feed a single table */
+static void merge_sketch_record(merge_ctx_t *m, const struct flow_record *r)
+{
+    uint64_t *v;
+    switch (r->kind) {
+    case FLOW_REC_HH_FLOW: {
+        struct merge_flow_key fk = {
+            .src_ip = r->src_ip, .dst_ip = r->dst_ip,
+            .src_port = r->src_port, .dst_port = r->dst_port,
+            .proto = r->proto,
+        };
+        v = table_upsert(&m->tables[MT_FLOWS], &fk);
+        if (v) { v[0] += r->packets;  v[1] += r->bytes; }
+        merge_port(m, r->proto, r->dst_port, r->packets, r->bytes);
+        break;
+    }
+    case FLOW_REC_HH_SRC:
+        v = table_upsert(&m->tables[MT_HOSTS], &r->src_ip);
+        if (v) { v[0] += r->packets;  v[1] += r->bytes; }
+        break;
+    case FLOW_REC_HH_DST:
+        v = table_upsert(&m->tables[MT_HOSTS], &r->dst_ip);
+        if (v) { v[2] += r->packets;  v[3] += r->bytes; }
+        break;
+    case FLOW_REC_SOURCE:
+        v = table_upsert(&m->tables[MT_SOURCES], &r->src_ip);
+        if (v) { v[0] += r->packets;  v[1] += r->bytes; }
+        break;
+    case FLOW_REC_OVERFLOW:
+        m->total_pkts  += r->packets;
+        m->total_bytes += r->bytes;
+        break;
+    default:
+        return;
+    }
+    m->records++;
+}
+
+static inline void merge_record(merge_ctx_t *m, const struct flow_record *r)
+{
+    if (__builtin_expect(r->kind != FLOW_REC_EXACT, 0)) {
+        merge_sketch_record(m, r);
+        return;
+    }
+    struct merge_flow_key fk = {
+        .src_ip = r->src_ip, .dst_ip = r->dst_ip,
+        .src_port = r->src_port, .dst_port = r->dst_port,
+        .proto = r->proto,
+    };
+    /* Update each entry before the next upsert: an insert may grow (move) the table */
+    uint64_t *v = table_upsert(&m->tables[MT_FLOWS], &fk);
+    if (!v) {
+        m->dropped++;
+        return;
+    }
+    v[0] += r->packets;  v[1] += r->bytes;
+    merge_port(m, r->proto, r->dst_port, r->packets, r->bytes);
+
+    v = table_upsert(&m->tables[MT_HOSTS], &r->src_ip);
+    if (v) { v[0] += r->packets;  v[1] += r->bytes; }
+    v = table_upsert(&m->tables[MT_HOSTS], &r->dst_ip);
+    if (v) { v[2] += r->packets;  v[3] += r->bytes; }
+
+    m->total_pkts  += r->packets;
+    m->total_bytes += r->bytes;
+    m->records++;
+}
+
+/* IPv6 flows: own flow table, counted in the totals; hosts stay IPv4-only */
+static inline void merge_record6(merge_ctx_t *m, const struct flow_record6 *r)
+{
+    if (r->kind != FLOW_REC_EXACT)
+        return;
+    struct merge_flow6_key fk = {
+        .src_port = r->src_port, .dst_port = r->dst_port, .proto = r->proto,
+    };
+    memcpy(fk.src_ip, r->src_ip, 16);
+    memcpy(fk.dst_ip, r->dst_ip, 16);
+    uint64_t *v = table_upsert(&m->tables[MT_FLOWS6], &fk);
+    if (!v) {
+        m->dropped++;
+        return;
+    }
+    v[0] += r->packets;  v[1] += r->bytes;
+    merge_port(m, r->proto, r->dst_port, r->packets, r->bytes);
+    m->total_pkts  += r->packets;
+    m->total_bytes += r->bytes;
+    m->records++;
+}
+
+/* Extended counters of one worker's flow for one interval */
+static inline void merge_record_ext(merge_ctx_t *m, const struct flow_record_ext *r)
+{
+    struct merge_flow_key fk = {
+        .src_ip = r->src_ip, .dst_ip = r->dst_ip,
+        .src_port = r->src_port, .dst_port = r->dst_port,
+        .proto = r->proto,
+    };
+    uint64_t *v = table_upsert(&m->tables[MT_FLOW_EXT], &fk);
+    if (!v) {
+        m->dropped++;
+        return;
+    }
+    v[EXT_SYN]   += r->syn;
+    v[EXT_RST]   += r->rst;
+    v[EXT_FLAGS] |= r->tcp_flags;
+    if (!v[EXT_FIRST_NS] || r->first_ns < v[EXT_FIRST_NS])
+        v[EXT_FIRST_NS] = r->first_ns;
+    if (r->last_ns > v[EXT_LAST_NS])
+        v[EXT_LAST_NS] = r->last_ns;
+    for (int b = 0; b < FLOW_EXT_BUCKETS; b++)
+        v[EXT_HIST + b] += r->len_hist[b];
+}
+
+/* ---- Public API ---- */
+
+merge_ctx_t *merge_create(void)
+{
+    merge_ctx_t *m = calloc(1, sizeof(merge_ctx_t));
+    if (!m)
+        return NULL;
+    if (table_init(&m->tables[MT_FLOWS], sizeof(struct merge_flow_key), 2) != 0 ||
+        table_init(&m->tables[MT_HOSTS], sizeof(uint32_t), 4) != 0 ||
+        table_init(&m->tables[MT_SOURCES], sizeof(uint32_t), 2) != 0 ||
+        table_init(&m->tables[MT_FLOWS6], sizeof(struct merge_flow6_key), 2) != 0 ||
+        table_init(&m->tables[MT_FLOW_EXT], sizeof(struct merge_flow_key), EXT_NVALS) != 0 ||
+        table_init(&m->tables[MT_NET24], sizeof(uint32_t), 4) != 0 ||
+        table_init(&m->tables[MT_NET16], sizeof(uint32_t), 4) != 0 ||
+        table_init(&m->tables[MT_CIDRS], sizeof(struct merge_cidr_key), 4) != 0 ||
+        table_init(&m->tables[MT_SERVICES], sizeof(struct merge_service_key), 2) != 0) {
+        for (int i = 0; i < MT_COUNT; i++)
+            table_free(&m->tables[i]);
+        free(m);
+        return NULL;
+    }
+    return m;
+}
+
+void merge_destroy(merge_ctx_t *m)
+{
+    if (m) {
+        for (int i = 0; i < MT_COUNT; i++)
+            table_free(&m->tables[i]);
+        if (m->exp) {
+            export_ipfix_close(m->exp);
+            export_file_close(m->exp);
+            free(m->exp);
+        }
+        free(m);
+    }
+}
+
+/* Merge n records from a flat flow_record array (e.g. a worker's flush_buf). */
+void merge_add(merge_ctx_t *m, const struct flow_record *recs, int n)
+{
+    for (int i = 0; i < n; i++)
+        merge_record(m, &recs[i]);
+}
+
+/* Drain everything currently readable from a worker ring. Returns records merged. */
+uint64_t merge_consume_ring(merge_ctx_t *m, void *ring)
+{
+    struct flow_ring *r = ring;
+    uint64_t total = 0, now_ms = 0;
+    for (;;) {
+        uint64_t first;
+        uint64_t n = flow_ring_readable(r, &first);
+        if (n == 0)
+            break;
+        const uint8_t *slots = flow_ring_slots(r) + first * r->rec_size;
+        if (export_active(m->exp))
+            export_slots(m->exp, r, slots, n, 0, now_ms ? now_ms : (now_ms = export_now_ms()));
+        for (uint64_t i = 0; i < n; i++)
+            merge_record(m, (const struct flow_record *)(slots + i * r->rec_size));
+        flow_ring_consume(r, n);
+        total += n;
+    }
+    return total;
+}
+
+void merge_add6(merge_ctx_t *m, const struct flow_record6 *recs, int n)
+{
+    for (int i = 0; i < n; i++)
+        merge_record6(m, &recs[i]);
+}
+
+/* As merge_consume_ring(), for a worker's IPv6 ring (ring_init6()) */
+uint64_t merge_consume_ring6(merge_ctx_t *m, void *ring)
+{
+    struct flow_ring *r = ring;
+    uint64_t total = 0, now_ms = 0;
+    for (;;) {
+        uint64_t first;
+        uint64_t n = flow_ring_readable(r, &first);
+        if (n == 0)
+            break;
+        const uint8_t *slots = flow_ring_slots(r) + first * r->rec_size;
+        if (export_active(m->exp))
+            export_slots(m->exp, r, slots, n, 1, now_ms ? now_ms : (now_ms = export_now_ms()));
+        for (uint64_t i = 0; i < n; i++)
+            merge_record6(m, (const struct flow_record6 *)(slots + i * r->rec_size));
+        flow_ring_consume(r, n);
+        total += n;
+    }
+    return total;
+}
+
+void merge_add_ext(merge_ctx_t *m, const struct flow_record_ext *recs, int n)
+{
+    for (int i = 0; i < n; i++)
+        merge_record_ext(m, &recs[i]);
+}
+
+/* As merge_consume_ring(), for a worker's extended counter ring (ring_init_ext()) */
+uint64_t merge_consume_ring_ext(merge_ctx_t *m, void *ring)
+{
+    struct flow_ring *r = ring;
+    uint64_t total = 0;
+    for (;;) {
+        uint64_t first;
+        uint64_t n = flow_ring_readable(r, &first);
+        if (n == 0)
+            break;
+        const uint8_t *slots = flow_ring_slots(r) + first * r->rec_size;
+        for (uint64_t i = 0; i < n; i++)
+            merge_record_ext(m, (const struct flow_record_ext *)(slots + i * r->rec_size));
+        flow_ring_consume(r, n);
+        total += n;
+    }
+    return total;
+}
+
+/* ---- Flow export (flow_export.h) ---- */
+
+static struct flow_export *merge_exporter(merge_ctx_t *m)
+{
+    if (!m->exp && (m->exp = malloc(sizeof(*m->exp))))
+        export_init(m->exp);
+    return m->exp;
+}
+
+/* IPFIX to host:port with this observation domain; host NULL or "" stops it. Returns 0 or -1. */
+int merge_export_ipfix(merge_ctx_t *m, const char *host, int port, uint32_t domain)
+{
+    struct flow_export *e = merge_exporter(m);
+    if (!e)
+        return -1;
+    export_ipfix_close(e);
+    if (!host || !*host)
+        return 0;
+    return export_ipfix_open(e, host, port, domain);
+}
+
+/* Close the current columnar file and start path (NULL: just close). Returns 0 or -1. */
+int merge_export_file(merge_ctx_t *m, const char *path)
+{
+    struct flow_export *e = merge_exporter(m);
+    if (!e)
+        return -1;
+    export_file_close(e);
+    if (!path || !*path)
+        return 0;
+    return export_file_open(e, path);
+}
+
+/* Time one worker record covers (the workers' flush interval), for flowStart and file headers */
+void merge_export_interval(merge_ctx_t *m, uint32_t ms)
+{
+    struct flow_export *e = merge_exporter(m);
+    if (e)
+        e->interval_ms = ms;
+}
+
+/* Send the partly filled IPFIX message, once per consume round */
+void merge_export_flush(merge_ctx_t *m)
+{
+    if (m->exp && m->exp->sock >= 0)
+        ipfix_send(m->exp);
+}
+
+/* EXPORT_ST_* counters into out[EXPORT_ST_COUNT] */
+void merge_export_stats(merge_ctx_t *m, uint64_t *out)
+{
+    for (int i = 0; i < EXPORT_ST_COUNT; i++)
+        out[i] = m->exp ? m->exp->stats[i] : 0;
+}
+
+/* Running totals since the last reset: O(1). out[0] = packets, out[1] = bytes. */
+void merge_totals(merge_ctx_t *m, uint64_t *out)
+{
+    out[0] = m->total_pkts;
+    out[1] = m->total_bytes;
+}
+
+int merge_count(merge_ctx_t *m, int table)
+{
+    if (table < 0 || table >= MT_COUNT)
+        return 0;
+    return (int)m->tables[table].count;
+}
+
+int merge_row_size(merge_ctx_t *m, int table)
+{
+    if (table < 0 || table >= MT_COUNT)
+        return 0;
+    return table_row_size(&m->tables[table]);
+}
+
+/* Top-k rows of a table by counter column `col`, largest first. */
+int merge_top(merge_ctx_t *m, int table, int col, int k, void *out)
+{
+    if (table < 0 || table >= MT_COUNT)
+        return 0;
+    return table_top(&m->tables[table], col, k, out);
+}
+
+/* Row of the entry with this key (key_size bytes, zero padded). Returns 1, or 0 if absent. */
+int merge_lookup(merge_ctx_t *m, int table, const void *key, void *out)
+{
+    if (table < 0 || table >= MT_COUNT)
+        return 0;
+    const struct agg_table *t = &m->tables[table];
+    int found;
+    uint32_t idx = table_find_slot(t, key, &found);
+    if (!found)
+        return 0;
+    table_write_row(t, idx, out);
+    return 1;
+}
+
+/*
+ * Host rows where either direction exceeds a limit: packets > max_pkts or
+ * bytes > max_bytes (pass UINT64_MAX to disable one). Writes up to max_rows.
+ */
+int merge_hosts_over(merge_ctx_t *m, uint64_t max_pkts, uint64_t max_bytes, void *out, int max_rows)
+{
+    const struct agg_table *t = &m->tables[MT_HOSTS];
+    int row_size = table_row_size(t);
+    int rows = 0;
+    for (uint32_t i = 0; i < t->count && rows < max_rows; i++) {
+        uint32_t idx = t->used[i];
+        const uint64_t *v = t->vals + (size_t)idx * t->nvals;
+        if (v[0] > max_pkts || v[1] > max_bytes || v[2] > max_pkts || v[3] > max_bytes)
+            table_write_row(t, idx, (uint8_t *)out + (size_t)rows++ * row_size);
+    }
+    return rows;
+}
+
+/*
+ * CIDRs for merge_rollup(): nets[i] (network byte order, host bits ignored)
+ * / lens[i], 0..32. Replaces the previous set. Returns 0, or -1 if n is out
+ * of range or a length is invalid.
+ */
+int merge_set_prefixes(merge_ctx_t *m, const uint32_t *nets, const int *lens, int n)
+{
+    if (n < 0 || n > MERGE_MAX_CIDRS)
+        return -1;
+    for (int i = 0; i < n; i++)
+        if (lens[i] < 0 || lens[i] > 32)
+            return -1;
+    for (int i = 0; i < n; i++) {
+        m->cidr_mask[i] = lens[i] ? htonl(~0u << (32 - lens[i])) : 0;
+        m->cidrs[i].net = nets[i] & m->cidr_mask[i];
+        m->cidrs[i].len = (uint32_t)lens[i];
+    }
+    m->ncidrs = n;
+    return 0;
+}
+
+static inline void rollup_add(struct agg_table *t, const void *key, const uint64_t *hv)
+{
+    uint64_t *v = table_upsert(t, key);
+    if (v) { v[0] += hv[0];  v[1] += hv[1];  v[2] += hv[2];  v[3] += hv[3]; }
+}
+
+/*
+ * Rebuild MT_NET24, MT_NET16 and MT_CIDRS from the host table: every host's
+ * src and dst counters are added to its /24, its /16 and each configured
+ * CIDR containing it. Then MT_SERVICES from the IPv4 flow table, by
+ * (dst_ip, dst_port, proto). O(hosts + flows); call before querying them.
+ * Returns the number of rows built.
+ */
+int merge_rollup(merge_ctx_t *m)
+{
+    struct agg_table *net24 = &m->tables[MT_NET24], *net16 = &m->tables[MT_NET16];
+    struct agg_table *cidrs = &m->tables[MT_CIDRS];
+    table_reset(net24);
+    table_reset(net16);
+    table_reset(cidrs);
+    const struct agg_table *hosts = &m->tables[MT_HOSTS];
+    const uint32_t mask24 = htonl(0xFFFFFF00u), mask16 = htonl(0xFFFF0000u);
+    for (uint32_t i = 0; i < hosts->count; i++) {
+        uint32_t idx = hosts->used[i];
+        uint32_t ip;
+        memcpy(&ip, hosts->keys + (size_t)idx * hosts->key_size, sizeof(ip));
+        const uint64_t *hv = hosts->vals + (size_t)idx * hosts->nvals;
+        uint32_t net = ip & mask24;
+        rollup_add(net24, &net, hv);
+        net = ip & mask16;
+        rollup_add(net16, &net, hv);
+        for (int c = 0; c < m->ncidrs; c++)
+            if ((ip & m->cidr_mask[c]) == m->cidrs[c].net)
+                rollup_add(cidrs, &m->cidrs[c], hv);
+    }
+
+    struct agg_table *services = &m->tables[MT_SERVICES];
+    table_reset(services);
+    const struct agg_table *flows = &m->tables[MT_FLOWS];
+    for (uint32_t i = 0; i < flows->count; i++) {
+        uint32_t idx = flows->used[i];
+        const struct merge_flow_key *fk = (const void *)(flows->keys + (size_t)idx * flows->key_size);
+        struct merge_service_key sk = { .ip = fk->dst_ip, .port = fk->dst_port, .proto = fk->proto };
+        uint64_t *v = table_upsert(services, &sk);
+        if (v) {
+            v[0] += flows->vals[(size_t)idx * flows->nvals];
+            v[1] += flows->vals[(size_t)idx * flows->nvals + 1];
+        }
+    }
+    return (int)(net24->count + net16->count + cidrs->count + services->count);
+}
+
+/*
+ * Top-k TCP/UDP destination ports by bytes, largest first, as
+ * struct merge_port_row. A scan of the flat arrays: O(65536 * 2).
+ */
+int merge_top_ports(merge_ctx_t *m, int k, void *out)
+{
+    if (k <= 0)
+        return 0;
+    struct heap_item *h = malloc((size_t)k * sizeof(*h));
+    if (!h)
+        return 0;
+    int n = 0;
+    for (uint32_t i = 0; i < 2 * 65536; i++) {
+        uint64_t v = m->ports[i >> 16][i & 0xFFFF][1];
+        if (v)
+            heap_offer(h, &n, k, v, i);
+    }
+    int rows = n;
+    struct merge_port_row *r = out;
+    while (n > 0) {
+        uint32_t i = h[0].idx;
+        r[n - 1] = (struct merge_port_row){
+            .port = (uint16_t)(i & 0xFFFF), .proto = i >> 16 ? 17 : 6,
+            .packets = m->ports[i >> 16][i & 0xFFFF][0], .bytes = m->ports[i >> 16][i & 0xFFFF][1],
+        };
+        h[0] = h[--n];
+        heap_sift_down(h, n, 0);
+    }
+    free(h);
+    return rows;
+}
+
+/*
+ * Count-min sketches of the host table: one per host counter (src packets,
+ * src bytes, dst packets, dst bytes), each depth rows of width (power of
+ * two) u64 cells, written counter-major to out (4 * depth * width). Row r
+ * adds a host's counter at column mix64(ip ^ (r + 1) * 0x9e3779b97f4a7c15)
+ * & (width - 1), ip as the raw u32 key; agg_protocol.sketch_column() is
+ * the same function. Sketches of different probes add cell by cell.
+ * O(hosts * depth). Returns 0, or -1 on a bad depth / width.
+ */
+int merge_host_sketch(merge_ctx_t *m, int depth, int width, uint64_t *out)
+{
+    if (depth < 1 || depth > SKETCH_MAX_DEPTH || width < 1 || width > SKETCH_MAX_WIDTH || (width & (width - 1)))
+        return -1;
+    const size_t plane = (size_t)depth * (size_t)width;
+    memset(out, 0, 4 * plane * sizeof(uint64_t));
+    const struct agg_table *t = &m->tables[MT_HOSTS];
+    for (uint32_t i = 0; i < t->count; i++) {
+        uint32_t idx = t->used[i];
+        uint32_t ip;
+        memcpy(&ip, t->keys + (size_t)idx * t->key_size, sizeof(ip));
+        const uint64_t *v = t->vals + (size_t)idx * t->nvals;
+        for (int r = 0; r < depth; r++) {
+            size_t cell = (size_t)r * (size_t)width
+                + (mix64(ip ^ ((uint64_t)(r + 1) * 0x9e3779b97f4a7c15ULL)) & (uint64_t)(width - 1));
+            for (int c = 0; c < 4; c++)
+                out[c * plane + cell] += v[c];
+        }
+    }
+    return 0;
+}
+
+/* Packets and bytes by IP protocol number: out[2 * proto], out[2 * proto + 1], 256 protocols */
+void merge_protos(merge_ctx_t *m, uint64_t *out)
+{
+    memcpy(out, m->protos, sizeof(m->protos));
+}
+
+uint64_t merge_get_dropped(merge_ctx_t *m) { return m->dropped; }
+
+/* ---- Warm restart snapshot ---- */
+
+/*
+ * Snapshot layout, native byte order (read back on the same host): the
+ * header, nports merge_port_row for the non-zero destination port counters,
+ * then MT_FLOWS .. MT_FLOW_EXT, each a merge_snap_table and its rows as
+ * merge_top() writes them. Roll-up tables are not saved: merge_rollup()
+ * rebuilds them from these.
+ */
+#define SNAP_TABLES     (MT_FLOW_EXT + 1)
+
+struct merge_snap_hdr {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t ntables;
+    uint32_t nports;
+    uint64_t total_pkts;
+    uint64_t total_bytes;
+    uint64_t records;
+    uint64_t protos[256][2];
+};
+
+struct merge_snap_table {
+    uint32_t table;
+    uint32_t key_size;
+    uint32_t nvals;
+    uint32_t count;
+};
+
+static inline int port_used(const merge_ctx_t *m, uint32_t i)
+{
+    return m->ports[i >> 16][i & 0xFFFF][0] || m->ports[i >> 16][i & 0xFFFF][1];
+}
+
+/* Write the tables, totals and port / protocol counters to path (replaced). Returns 0 or -1. */
+int merge_save(merge_ctx_t *m, const char *path)
+{
+    uint32_t nports = 0;
+    for (uint32_t i = 0; i < 2 * 65536; i++)
+        nports += port_used(m, i);
+    size_t size = sizeof(struct merge_snap_hdr) + (size_t)nports * sizeof(struct merge_port_row);
+    for (int t = 0; t < SNAP_TABLES; t++)
+        size += sizeof(struct merge_snap_table) + (size_t)m->tables[t].count * table_row_size(&m->tables[t]);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -1;
+    /* Blocks allocated up front: a full disk fails here, not as SIGBUS on a store */
+    uint8_t *map = MAP_FAILED;
+    if (posix_fallocate(fd, 0, (off_t)size) == 0)
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        unlink(path);
+        return -1;
+    }
+
+    struct merge_snap_hdr *h = (void *)map;
+    h->magic = SNAP_MAGIC;
+    h->version = SNAP_VERSION;
+    h->ntables = SNAP_TABLES;
+    h->nports = nports;
+    h->total_pkts = m->total_pkts;
+    h->total_bytes = m->total_bytes;
+    h->records = m->records;
+    memcpy(h->protos, m->protos, sizeof(m->protos));
+    struct merge_port_row *pr = (void *)(h + 1);
+    for (uint32_t i = 0; i < 2 * 65536; i++)
+        if (port_used(m, i))
+            *pr++ = (struct merge_port_row){
+                .port = (uint16_t)(i & 0xFFFF), .proto = i >> 16 ? 17 : 6,
+                .packets = m->ports[i >> 16][i & 0xFFFF][0], .bytes = m->ports[i >> 16][i & 0xFFFF][1],
+            };
+    uint8_t *p = (uint8_t *)pr;
+    for (int t = 0; t < SNAP_TABLES; t++) {
+        const struct agg_table *tb = &m->tables[t];
+        struct merge_snap_table st = { .table = t, .key_size = tb->key_size, .nvals = tb->nvals, .count = tb->count };
+        memcpy(p, &st, sizeof(st));
+        p += sizeof(st);
+        int row_size = table_row_size(tb);
+        for (uint32_t i = 0; i < tb->count; i++, p += row_size)
+            table_write_row(tb, tb->used[i], p);
+    }
+    munmap(map, size);
+    return 0;
+}
+
+/* Whole snapshot within size and matching this build's tables: 0, else -1 */
+static int snap_check(const merge_ctx_t *m, const uint8_t *map, size_t size)
+{
+    const struct merge_snap_hdr *h = (const void *)map;
+    if (h->magic != SNAP_MAGIC || h->version != SNAP_VERSION || h->ntables != SNAP_TABLES ||
+        h->nports > 2 * 65536)
+        return -1;
+    size_t off = sizeof(*h) + (size_t)h->nports * sizeof(struct merge_port_row);
+    for (int t = 0; t < SNAP_TABLES; t++) {
+        struct merge_snap_table st;
+        if (off > size || size - off < sizeof(st))
+            return -1;
+        memcpy(&st, map + off, sizeof(st));
+        off += sizeof(st);
+        const struct agg_table *tb = &m->tables[t];
+        if (st.table != (uint32_t)t || st.key_size != tb->key_size || st.nvals != tb->nvals ||
+            (uint64_t)st.count * table_row_size(tb) > size - off)
+            return -1;
+        off += (size_t)st.count * table_row_size(tb);
+    }
+    return off == size ? 0 : -1;
+}
+
+/*
+ * Add a merge_save() file to the current window: counters summed as if its
+ * records had been consumed here (extended counters combined as in
+ * merge_record_ext()). Returns table rows added, or -1 if path is missing,
+ * truncated or from another layout; nothing is added then.
+ */
+int merge_load(merge_ctx_t *m, const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    struct stat st;
+    uint8_t *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(struct merge_snap_hdr))
+        map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+    size_t size = (size_t)st.st_size;
+    if (snap_check(m, map, size) != 0) {
+        munmap(map, size);
+        return -1;
+    }
+
+    const struct merge_snap_hdr *h = (const void *)map;
+    m->total_pkts += h->total_pkts;
+    m->total_bytes += h->total_bytes;
+    m->records += h->records;
+    for (int i = 0; i < 256; i++) {
+        m->protos[i][0] += h->protos[i][0];
+        m->protos[i][1] += h->protos[i][1];
+    }
+    const struct merge_port_row *pr = (const void *)(h + 1);
+    for (uint32_t i = 0; i < h->nports; i++, pr++) {
+        uint64_t *v = m->ports[pr->proto == 17][pr->port];
+        v[0] += pr->packets;
+        v[1] += pr->bytes;
+    }
+
+    const uint8_t *p = (const uint8_t *)pr;
+    int rows = 0;
+    for (int t = 0; t < SNAP_TABLES; t++) {
+        struct merge_snap_table sec;
+        memcpy(&sec, p, sizeof(sec));
+        p += sizeof(sec);
+        struct agg_table *tb = &m->tables[t];
+        const int row_size = table_row_size(tb);
+        for (uint32_t i = 0; i < sec.count; i++, p += row_size) {
+            uint64_t add[EXT_NVALS];
+            memcpy(add, p + tb->key_size, tb->nvals * sizeof(uint64_t));
+            uint64_t *v = table_upsert(tb, p);
+            if (!v) {
+                m->dropped++;
+                continue;
+            }
+            if (t == MT_FLOW_EXT) {
+                v[EXT_SYN]   += add[EXT_SYN];
+                v[EXT_RST]   += add[EXT_RST];
+                v[EXT_FLAGS] |= add[EXT_FLAGS];
+                if (!v[EXT_FIRST_NS] || (add[EXT_FIRST_NS] && add[EXT_FIRST_NS] < v[EXT_FIRST_NS]))
+                    v[EXT_FIRST_NS] = add[EXT_FIRST_NS];
+                if (add[EXT_LAST_NS] > v[EXT_LAST_NS])
+                    v[EXT_LAST_NS] = add[EXT_LAST_NS];
+                for (int b = 0; b < FLOW_EXT_BUCKETS; b++)
+                    v[EXT_HIST + b] += add[EXT_HIST + b];
+            } else {
+                for (uint32_t c = 0; c < tb->nvals; c++)
+                    v[c] += add[c];
+            }
+            rows++;
+        }
+    }
+    munmap(map, size);
+    return rows;
+}
+
+/* Start a new report window: O(entries in use). */
+void merge_reset(merge_ctx_t *m)
+{
+    for (int i = 0; i < MT_COUNT; i++)
+        table_reset(&m->tables[i]);
+    m->total_pkts = 0;
+    m->total_bytes = 0;
+    m->records = 0;
+    memset(m->ports, 0, sizeof(m->ports));
+    memset(m->protos, 0, sizeof(m->protos));
+}
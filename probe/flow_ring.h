@@ -0,0 +1,354 @@
+/*
+ * Shared-memory SPSC ring of flow records: one per worker.
+ * Producer: the worker's cap_drain() in fast_recv.so (host events: its
+ * capture thread).
+ * Consumer: the coordinator process.
+ *
+ * Layout: struct flow_ring header (FLOW_RING_HDR bytes), then `capacity`
+ * fixed-size record slots. head/tail are free-running counters; the slot
+ * index is counter & (capacity - 1).
+ *
+ * Also here: struct cap_stats, the per-worker counters block in shared
+ * memory, republished by every cap_drain() under a sequence counter.
+ */
+#ifndef FLOW_RING_H
+#define FLOW_RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdatomic.h>
+
+/* ---- Flush output record (32 bytes) ---- */
+struct flow_record {
+    uint32_t src_ip;
+    uint32_t dst_ip;
+    uint16_t src_port;
+    uint16_t dst_port;
+    uint8_t  proto;
+    uint8_t  kind;          /* FLOW_REC_* */
+    union {
+        uint16_t err_q16;   /* FLOW_REC_HH_*: true count <= packets/bytes * (1 + err_q16 / 65536) */
+        uint16_t source;    /* FLOW_REC_EXACT / _SOURCE: worker-local mirror source id, 0 = untracked */
+    };
+    uint64_t packets;
+    uint64_t bytes;
+};
+
+/*
+ * flow_record.kind. Sketch candidates (HH_*) carry counts that are exact
+ * lower bounds; their traffic is also in the interval's FLOW_REC_OVERFLOW
+ * record, which is the only one of them that counts towards totals.
+ */
+#define FLOW_REC_EXACT      0   /* exact flow table entry */
+#define FLOW_REC_HH_FLOW    1   /* overflow sketch candidate: 5-tuple */
+#define FLOW_REC_HH_SRC     2   /* overflow sketch candidate: src_ip only */
+#define FLOW_REC_HH_DST     3   /* overflow sketch candidate: dst_ip only */
+#define FLOW_REC_OVERFLOW   4   /* all traffic the flow table could not take: packets/bytes only */
+#define FLOW_REC_SOURCE     5   /* per mirror source totals: src_ip = outer source IP, source = its id */
+
+/*
+ * ---- IPv6 flush record (64 bytes) ----
+ * IPv6 flows come from a table of their own and travel in a second ring
+ * per worker (rec_size 64), so IPv4 records keep their 32-byte slots.
+ * kind is FLOW_REC_EXACT; overflow traffic goes into the IPv4 ring's
+ * FLOW_REC_OVERFLOW record.
+ */
+struct flow_record6 {
+    uint8_t  src_ip[16];
+    uint8_t  dst_ip[16];
+    uint16_t src_port;
+    uint16_t dst_port;
+    uint8_t  proto;
+    uint8_t  kind;
+    uint16_t source;        /* as flow_record.source */
+    uint8_t  _pad[8];
+    uint64_t packets;
+    uint64_t bytes;
+};
+
+_Static_assert(sizeof(struct flow_record6) == 64, "flow_record6 must be 64 bytes");
+
+/*
+ * ---- Extended per-flow counters (64 bytes) ----
+ * With cap_config.ext_counters every FLOW_REC_EXACT IPv4 flow is also
+ * exported as one of these, same 5-tuple and interval, into a third ring
+ * per worker (rec_size 64). Timestamps are CLOCK_REALTIME (capture time
+ * when replaying a file) at batch granularity; len_hist buckets the inner
+ * IP total length by powers of two.
+ */
+#define FLOW_EXT_BUCKETS    6   /* < 64, < 128, < 256, < 512, < 1024, >= 1024 bytes */
+
+struct flow_record_ext {
+    uint32_t src_ip;
+    uint32_t dst_ip;
+    uint16_t src_port;
+    uint16_t dst_port;
+    uint8_t  proto;
+    uint8_t  tcp_flags;     /* OR of every packet's TCP flags */
+    uint16_t source;        /* as flow_record.source */
+    uint64_t first_ns;      /* first and last batch the flow was seen in */
+    uint64_t last_ns;
+    uint32_t syn;           /* packets with SYN set and ACK clear */
+    uint32_t rst;           /* packets with RST set */
+    uint32_t len_hist[FLOW_EXT_BUCKETS];
+};
+
+_Static_assert(sizeof(struct flow_record_ext) == 64, "flow_record_ext must be 64 bytes");
+
+/*
+ * ---- Host threshold event (32 bytes) ----
+ * With cap_config.host_bps / host_pps set, the capture thread counts every
+ * parsed IPv4 packet per source and per destination IP over windows of
+ * host_window_ms and pushes one of these into a small ring per worker
+ * (rec_size 32) the moment a host crosses a threshold, once per host,
+ * direction and window. packets/bytes are the window's counts at that
+ * moment, already scaled by packet sampling.
+ */
+#define HOST_EV_SRC         0   /* host_event.dir: ip is the source */
+#define HOST_EV_DST         1
+#define HOST_EV_BPS         1   /* host_event.reason bits */
+#define HOST_EV_PPS         2
+
+struct host_event {
+    uint32_t ip;            /* network byte order */
+    uint8_t  dir;           /* HOST_EV_SRC / HOST_EV_DST */
+    uint8_t  reason;        /* HOST_EV_BPS | HOST_EV_PPS */
+    uint16_t window_ms;
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t ts_ns;         /* CLOCK_REALTIME of the crossing (replay: capture time) */
+};
+
+_Static_assert(sizeof(struct host_event) == 32, "host_event must be 32 bytes");
+
+#define FLOW_RING_MAGIC 0x464c5752u     /* "FLWR" */
+#define FLOW_RING_HDR   256             /* header size, keeps slots cache-aligned */
+
+struct flow_ring {
+    uint32_t magic;
+    uint32_t rec_size;
+    uint64_t capacity;                  /* slots, power of two */
+    uint64_t dropped;                   /* records the producer could not fit */
+    double   sample_rate;               /* producer's effective sampling rate, 0 = not reported */
+    /* capture file replay (CAP_BACKEND_PCAP): the coordinator lets the worker
+     * replay replay_hold epochs, the worker reports the epochs it has flushed */
+    _Atomic uint32_t replay_hold;       /* consumer */
+    _Atomic uint32_t replay_done;       /* producer */
+    uint8_t  _pad0[64 - 40];
+    _Atomic uint64_t head;              /* next slot to write (producer) */
+    uint8_t  _pad1[64 - 8];
+    _Atomic uint64_t tail;              /* next slot to read (consumer) */
+    uint8_t  _pad2[64 - 8];
+};
+
+_Static_assert(sizeof(struct flow_ring) <= FLOW_RING_HDR, "flow_ring header too large");
+
+static inline uint8_t *flow_ring_slots(struct flow_ring *r)
+{
+    return (uint8_t *)r + FLOW_RING_HDR;
+}
+
+/*
+ * Format `size` bytes at mem as an empty ring. Capacity is rounded down to
+ * a power of two. Returns capacity, or 0 if the region is too small.
+ */
+static inline uint64_t flow_ring_init(void *mem, size_t size, uint32_t rec_size)
+{
+    if (size < FLOW_RING_HDR + rec_size)
+        return 0;
+    uint64_t cap = 1;
+    while ((cap << 1) * rec_size <= size - FLOW_RING_HDR)
+        cap <<= 1;
+
+    struct flow_ring *r = mem;
+    memset(r, 0, FLOW_RING_HDR);
+    r->rec_size = rec_size;
+    r->capacity = cap;
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    r->magic = FLOW_RING_MAGIC;
+    return cap;
+}
+
+/*
+ * Producer: number of slots writable without wrapping; *first is set to the
+ * slot index to fill. Records become visible at flow_ring_publish().
+ */
+static inline uint64_t flow_ring_writable(struct flow_ring *r, uint64_t *first)
+{
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    uint64_t idx = head & (r->capacity - 1);
+    uint64_t room = r->capacity - (head - tail);
+    if (room > r->capacity - idx)
+        room = r->capacity - idx;
+    *first = idx;
+    return room;
+}
+
+static inline void flow_ring_publish(struct flow_ring *r, uint64_t n)
+{
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    atomic_store_explicit(&r->head, head + n, memory_order_release);
+}
+
+/*
+ * Producer: copy up to n records in. Returns records written; the
+ * remainder is added to r->dropped.
+ */
+static inline int flow_ring_push(struct flow_ring *r, const void *recs, int n)
+{
+    const uint8_t *src = recs;
+    int done = 0;
+    while (done < n) {
+        uint64_t first;
+        uint64_t room = flow_ring_writable(r, &first);
+        if (room == 0)
+            break;
+        if (room > (uint64_t)(n - done))
+            room = n - done;
+        memcpy(flow_ring_slots(r) + first * r->rec_size, src + (size_t)done * r->rec_size,
+               room * r->rec_size);
+        flow_ring_publish(r, room);
+        done += (int)room;
+    }
+    if (done < n)
+        r->dropped += n - done;
+    return done;
+}
+
+/*
+ * Consumer: number of records readable without wrapping; *first is set to
+ * the slot index of the first one. Call flow_ring_consume() when done.
+ */
+static inline uint64_t flow_ring_readable(struct flow_ring *r, uint64_t *first)
+{
+    uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    uint64_t idx = tail & (r->capacity - 1);
+    uint64_t avail = head - tail;
+    if (avail > r->capacity - idx)
+        avail = r->capacity - idx;
+    *first = idx;
+    return avail;
+}
+
+static inline void flow_ring_consume(struct flow_ring *r, uint64_t n)
+{
+    uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    atomic_store_explicit(&r->tail, tail + n, memory_order_release);
+}
+
+/*
+ * Consumer: copy up to max records out and release their slots. Returns
+ * records copied. For rings read record by record (host events); flow
+ * rings are merged in place.
+ */
+static inline int flow_ring_pop(struct flow_ring *r, void *out, int max)
+{
+    uint8_t *dst = out;
+    int done = 0;
+    while (done < max) {
+        uint64_t first;
+        uint64_t avail = flow_ring_readable(r, &first);
+        if (avail == 0)
+            break;
+        if (avail > (uint64_t)(max - done))
+            avail = max - done;
+        memcpy(dst + (size_t)done * r->rec_size, flow_ring_slots(r) + first * r->rec_size,
+               avail * r->rec_size);
+        flow_ring_consume(r, avail);
+        done += (int)avail;
+    }
+    return done;
+}
+
+/* ---- Worker stats block (struct cap_stats) ---- */
+#define CAP_STATS_MAGIC     0x53544154u /* "STAT" */
+
+#define STATS_REJ_SHORT     0   /* shorter than VXLAN + Ethernet (+ tags) + IPv4 header */
+#define STATS_REJ_ETHERTYPE 1   /* inner frame neither IPv4 nor IPv6 (ARP, LLDP, ...) */
+#define STATS_REJ_IPV4      2   /* IHL < 5 or options past the end of the packet */
+#define STATS_REJ_IPV6      3   /* not version 6, or the extension header chain is cut off */
+#define STATS_REJ_VNI       4   /* parsed, but the VNI is not in the filter set */
+#define STATS_REJ_REASONS   5
+
+#define STATS_BATCH_BUCKETS 12  /* packets per receive call: 0, 1, 2-3, 4-7, ... 512-1023, >= 1024 */
+#define STATS_PROBE_BUCKETS 7   /* flow slot distance from its hash slot: 0, 1, 2-3, ... 32-63 */
+#define STATS_DRAIN_BUCKETS 12  /* cap_drain() time: < 2^14 ns (16us), < 2^15 ns, ... >= 2^24 ns (17ms) */
+
+/*
+ * Counters since cap_create() (histograms are cumulative too), except the
+ * gauges flows .. sock_rcvbuf. Written by one thread, the worker's
+ * cap_drain(); readers copy it with cap_stats_read() and never block it.
+ */
+struct cap_stats {
+    uint32_t magic;
+    uint32_t size;              /* sizeof(struct cap_stats) */
+    _Atomic uint64_t seq;       /* odd while an update is in progress */
+    uint64_t updated_ns;        /* CLOCK_REALTIME of the last update */
+    uint64_t pkts;              /* received */
+    uint64_t bytes;
+    uint64_t parsed;            /* IPv4 + IPv6 flow packets */
+    uint64_t sampled;           /* parsed packets that passed flow sampling */
+    uint64_t rejects[STATS_REJ_REASONS];
+    uint64_t rx_calls;          /* receive calls (recvmmsg / AF_XDP polls), including empty ones */
+    uint64_t rx_full;           /* calls that filled the whole batch */
+    uint64_t rx_entries;        /* entries received: recvmmsg messages / AF_XDP descriptors */
+    uint64_t batch_hist[STATS_BATCH_BUCKETS];  /* entries per receive call */
+    uint64_t probe_hist[STATS_PROBE_BUCKETS];  /* every drained IPv4 flow */
+    uint64_t probe_sum;
+    uint64_t drain_hist[STATS_DRAIN_BUCKETS];
+    uint64_t drain_ns;          /* total time in cap_drain() */
+    uint64_t drains;
+    uint64_t dropped_flows;     /* new flows turned away: table full */
+    uint64_t probe_failures;    /* flows turned away: probe limit */
+    uint64_t ring_drops;        /* records lost to a full ring */
+    uint64_t flows;             /* gauge: flows in the last drained table */
+    uint64_t capacity;          /* gauge: its max_flows */
+    uint64_t sock_rmem;         /* gauge: SO_MEMINFO receive queue bytes, socket backend only */
+    uint64_t sock_rcvbuf;       /* gauge: SO_MEMINFO receive buffer limit */
+    uint64_t sock_drops;        /* SO_MEMINFO drops: packets the kernel could not queue */
+};
+
+static inline int cap_stats_init(void *mem, size_t size)
+{
+    if (size < sizeof(struct cap_stats))
+        return 0;
+    memset(mem, 0, sizeof(struct cap_stats));
+    struct cap_stats *s = mem;
+    s->magic = CAP_STATS_MAGIC;
+    s->size = sizeof(struct cap_stats);
+    return 1;
+}
+
+/* Writer: bracket the stores with begin/end; readers retry across them */
+static inline void cap_stats_begin(struct cap_stats *s)
+{
+    atomic_store_explicit(&s->seq, atomic_load_explicit(&s->seq, memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static inline void cap_stats_end(struct cap_stats *s)
+{
+    atomic_fetch_add_explicit(&s->seq, 1, memory_order_release);
+}
+
+/* Reader: a consistent copy into out. Returns 1, or 0 if the writer kept it busy. */
+static inline int cap_stats_read(struct cap_stats *s, struct cap_stats *out)
+{
+    for (int tries = 0; tries < 1000; tries++) {
+        uint64_t seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+        if (seq & 1)
+            continue;
+        memcpy(out, s, sizeof(*out));
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&s->seq, memory_order_relaxed) == seq)
+            return 1;
+    }
+    return 0;
+}
+
+#endif /* FLOW_RING_H */
@@ -0,0 +1,146 @@
+"""
+Prometheus text exposition of the workers' struct cap_stats blocks.
+
+Each worker's cap_drain() republishes its counters into a shared-memory
+block (flow_ring.h) once per CAP_FLUSH_INTERVAL; the coordinator copies them
+out under the block's seqlock and renders them here on every scrape, so a
+scrape never touches the capture threads. MetricsServer serves the text from
+a daemon thread (PROBE_METRICS_PORT).
+"""
+
+import logging
+import threading
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from typing import Callable, Optional
+
+logger = logging.getLogger(__name__)
+
+# Order of cap_stats.rejects[], matches STATS_REJ_* in flow_ring.h
+REJECT_REASONS = ("short", "ethertype", "ipv4", "ipv6", "vni")
+CONTENT_TYPE = "text/plain; version=0.0.4; charset=utf-8"
+
+# name, help, cap_stats field
+_COUNTERS = (
+    ("dx_probe_packets_total", "Packets received", "pkts"),
+    ("dx_probe_bytes_total", "Bytes received", "bytes"),
+    ("dx_probe_parsed_total", "Packets parsed into IPv4 / IPv6 flows", "parsed"),
+    ("dx_probe_sampled_total", "Parsed packets kept by flow sampling", "sampled"),
+    ("dx_probe_rx_calls_total", "Receive calls, including empty ones", "rx_calls"),
+    ("dx_probe_rx_full_total", "Receive calls that filled the whole batch", "rx_full"),
+    ("dx_probe_dropped_flows_total", "New flows turned away, flow table full", "dropped_flows"),
+    ("dx_probe_probe_failures_total", "New flows turned away, probe limit reached", "probe_failures"),
+    ("dx_probe_ring_drops_total", "Flow records lost to a full coordinator ring", "ring_drops"),
+    ("dx_probe_socket_drops_total", "Packets the kernel could not queue on the socket (SO_MEMINFO)", "sock_drops"),
+)
+_GAUGES = (
+    ("dx_probe_table_flows", "Flows in the last drained table", "flows"),
+    ("dx_probe_table_capacity", "Capacity of the last drained table", "capacity"),
+    ("dx_probe_socket_rmem_bytes", "Socket receive queue at the last drain (SO_MEMINFO)", "sock_rmem"),
+    ("dx_probe_socket_rcvbuf_bytes", "Socket receive buffer limit (SO_MEMINFO)", "sock_rcvbuf"),
+)
+
+
+def _le(bound: float) -> str:
+    return "+Inf" if bound == float("inf") else f"{bound:g}"
+
+
+def _histogram(lines: list[str], name: str, worker: str, counts, bounds, total: float) -> None:
+    """Log2 bucket counts -> cumulative Prometheus buckets; bounds[i] is bucket i's upper bound."""
+    cum = 0
+    for n, bound in zip(counts, bounds):
+        cum += n
+        lines.append(f'{name}_bucket{{worker="{worker}",le="{_le(bound)}"}} {cum}')
+    lines.append(f'{name}_sum{{worker="{worker}"}} {total:g}')
+    lines.append(f'{name}_count{{worker="{worker}"}} {cum}')
+
+
+def render(workers: list[Optional[dict]]) -> str:
+    """Text for one scrape: workers[i] is worker i's cap_stats as a dict, None if unreadable."""
+    inf = float("inf")
+    lines: list[str] = []
+
+    def family(name: str, kind: str, help_: str) -> None:
+        lines.append(f"# HELP {name} {help_}")
+        lines.append(f"# TYPE {name} {kind}")
+
+    live = [(str(i), s) for i, s in enumerate(workers) if s]
+    family("dx_probe_worker_up", "gauge", "1 when the worker's stats block was read")
+    for i, s in enumerate(workers):
+        lines.append(f'dx_probe_worker_up{{worker="{i}"}} {int(bool(s))}')
+    family("dx_probe_stats_timestamp_seconds", "gauge", "Wall clock time of the worker's last stats update")
+    for w, s in live:
+        lines.append(f'dx_probe_stats_timestamp_seconds{{worker="{w}"}} {s["updated_ns"] / 1e9:.3f}')
+
+    for name, help_, field in _COUNTERS:
+        family(name, "counter", help_)
+        lines.extend(f'{name}{{worker="{w}"}} {s[field]}' for w, s in live)
+    family("dx_probe_parse_rejects_total", "counter", "Packets not turned into flows, by reason")
+    for w, s in live:
+        for reason, n in zip(REJECT_REASONS, s["rejects"]):
+            lines.append(f'dx_probe_parse_rejects_total{{worker="{w}",reason="{reason}"}} {n}')
+    for name, help_, field in _GAUGES:
+        family(name, "gauge", help_)
+        lines.extend(f'{name}{{worker="{w}"}} {s[field]}' for w, s in live)
+
+    # Bucket i of the log2 histograms holds values < 2^i (0 in bucket 0), the last one the rest
+    family("dx_probe_rx_batch_entries", "histogram", "Entries per receive call (recvmmsg messages / AF_XDP descriptors)")
+    for w, s in live:
+        n = len(s["batch_hist"])
+        _histogram(lines, "dx_probe_rx_batch_entries", w, s["batch_hist"],
+                   [(1 << i) - 1 for i in range(n - 1)] + [inf], s["rx_entries"])
+    family("dx_probe_flow_probe_distance", "histogram", "Drained flows by slot distance from their hash slot")
+    for w, s in live:
+        n = len(s["probe_hist"])
+        _histogram(lines, "dx_probe_flow_probe_distance", w, s["probe_hist"],
+                   [(1 << i) - 1 for i in range(n - 1)] + [inf], s["probe_sum"])
+    family("dx_probe_drain_seconds", "histogram", "Time to drain a retired flow table into the rings")
+    for w, s in live:
+        n = len(s["drain_hist"])
+        _histogram(lines, "dx_probe_drain_seconds", w, s["drain_hist"],
+                   [(1 << (14 + i)) / 1e9 for i in range(n - 1)] + [inf], s["drain_ns"] / 1e9)
+    return "\n".join(lines) + "\n"
+
+
+class MetricsServer:
+    """GET /metrics -> collect(), on a ThreadingHTTPServer in a daemon thread."""
+
+    def __init__(self, addr: str, port: int, collect: Callable[[], str]):
+        collect_ = collect
+
+        class Handler(BaseHTTPRequestHandler):
+            def do_GET(self):
+                if self.path.split("?")[0] not in ("/", "/metrics"):
+                    self.send_error(404)
+                    return
+                try:
+                    body = collect_().encode()
+                except Exception:
+                    logger.exception("metrics collection failed")
+                    self.send_error(500)
+                    return
+                self.send_response(200)
+                self.send_header("Content-Type", CONTENT_TYPE)
+                self.send_header("Content-Length", str(len(body)))
+                self.end_headers()
+                self.wfile.write(body)
+
+            def log_message(self, fmt, *args):
+                logger.debug("metrics %s - %s", self.address_string(), fmt % args)
+
+        self._server = ThreadingHTTPServer((addr, port), Handler)
+        self._server.daemon_threads = True
+        self._thread: Optional[threading.Thread] = None
+
+    @property
+    def port(self) -> int:
+        return self._server.server_address[1]
+
+    def start(self) -> None:
+        self._thread = threading.Thread(target=self._server.serve_forever, name="metrics", daemon=True)
+        self._thread.start()
+
+    def stop(self) -> None:
+        if self._thread:
+            self._server.shutdown()
+            self._thread = None
+        self._server.server_close()
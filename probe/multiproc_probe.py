@@ -1,17 +1,20 @@
 #!/usr/bin/env python3
 """Multi-process VXLAN probe with SO_REUSEPORT kernel load balancing."""
 
+import contextlib
 import ctypes
+import ipaddress
+import json
 import logging
 import multiprocessing
 import os
-import queue
 import signal
 import socket
 import struct
 import sys
 import time
-from collections import defaultdict
+import zlib
+from multiprocessing import shared_memory
 from typing import Optional
 
 # Ensure probe directory is on sys.path for enricher/alerter imports
@@ -20,7 +23,12 @@ if _probe_dir not in sys.path:
     sys.path.insert(0, _probe_dir)
 
 from enricher import IPEnricher
-from alerter import FlowAlerter
+from rate_engine import RateEngine
+from alerter import FlowAlerter, proto_name
+from metrics import MetricsServer, render as render_metrics
+from agg_protocol import (AGG_PORT, MAX_PROBE_NAME, SKETCH_DEPTH, SKETCH_WIDTH, DeltaUplink, IntervalDelta,
+                          encode as encode_delta)
+from flow_export import IPFIX_PORT, ROTATE_SEC, ExportFiles
 
 logger = logging.getLogger("multiproc_probe")
 
@@ -28,39 +36,199 @@ logger = logging.getLogger("multiproc_probe")
 # Protocol constants
 # ---------------------------------------------------------------------------
 ETHERTYPE_IPV4 = 0x0800
+ETHERTYPE_IPV6 = 0x86DD
+ETHERTYPES_VLAN = (0x8100, 0x88A8)  # 802.1Q, 802.1ad (QinQ outer)
 PROTO_TCP = 6
 PROTO_UDP = 17
 VXLAN_HDR_LEN = 8
 ETH_HDR_LEN = 14
 IP_HDR_MIN_LEN = 20
+VLAN_HDR_LEN = 4
+IP6_HDR_LEN = 40
+IP6_EXT_HDRS = (0, 43, 44, 51, 60)  # Hop-by-Hop, Routing, Fragment, AH, Destination Options
+IP6_MAX_EXT = 8
 
 FlowKey = tuple[str, str, int, int, int]  # src_ip, dst_ip, proto, src_port, dst_port
+RawFlowKey = tuple[int, int, int, int, int]  # same, IPs as raw u32 (network byte order in memory)
 
 REPORT_INTERVAL = 5.0  # seconds — full report with Top-N
 CAP_FLUSH_INTERVAL = 1.0  # seconds — worker flush cycle (controls detection latency)
-COORDINATOR_POLL = 0.5  # seconds — coordinator queue poll interval
+COORDINATOR_POLL = 0.5  # seconds — coordinator ring poll interval
+HOST_EVENT_POLL = 0.1  # seconds — host_event ring poll interval, when per-host thresholds are set
 BIND_ADDR = "0.0.0.0"
 BIND_PORT = 4789
 RCVBUF_SIZE = 128 * 1024 * 1024  # 128 MB
+CAP_BACKEND_SOCKET = 0  # matches CAP_BACKEND_* in fast_recv.c
+CAP_BACKEND_AF_XDP = 1
+CAP_BACKEND_XDP_COUNT = 2
+CAP_BACKEND_PCAP = 3  # capture file replay
+REPLAY_POLL = 0.005  # seconds — replay lock-step poll, worker and coordinator
+CAP_STEER_CPU = 1  # matches CAP_STEER_* in fast_recv.c: socket of the RX CPU
+CAP_STEER_FLOW = 2  # inner 5-tuple hash
+CAP_RX_MODES = {"blocking": 0, "busy_poll": 1, "adaptive": 2}  # matches CAP_RX_* in fast_recv.c
+RING_RECORDS = 1 << 20  # per-worker shared-memory ring slots (32 MB), > 2 full flushes
+RING6_RECORDS = 1 << 16  # per-worker IPv6 ring slots (4 MB), 2 full IPv6 tables
+RING_EXT_RECORDS = RING_RECORDS  # per-worker extended counter ring slots (64 MB), one per IPv4 flow
+FLOW_RING_HDR = 256  # matches FLOW_RING_HDR in flow_ring.h
+FLOW_REC_EXACT = 0  # flow_record.kind, matches FLOW_REC_* in flow_ring.h
+FLOW_REC_HH_FLOW = 1  # overflow sketch candidates: guaranteed counts + err_q16 bound
+FLOW_REC_HH_SRC = 2
+FLOW_REC_HH_DST = 3
+FLOW_REC_OVERFLOW = 4  # everything the worker's flow table could not hold
+FLOW_REC_SOURCE = 5  # per mirror source totals: src_ip = outer source IP
+CAP_MAX_VNIS = 16  # matches CAP_MAX_VNIS in fast_recv.c
+FLOW_EXT_BUCKETS = 6  # flow_record_ext.len_hist: < 64, < 128, < 256, < 512, < 1024, >= 1024 bytes
+HOST_EVENT_RECORDS = 4096  # per-worker host_event ring slots (128 KB)
+HOST_EV_SRC = 0  # host_event.dir, matches HOST_EV_* in flow_ring.h
+HOST_EV_DST = 1
+HOST_WINDOW_MAX_MS = 10000  # matches HOST_WINDOW_MAX_MS in fast_recv.c
+STATS_REJ_REASONS = 5  # struct cap_stats array sizes, match STATS_* in flow_ring.h
+STATS_BATCH_BUCKETS = 12
+STATS_PROBE_BUCKETS = 7
+STATS_DRAIN_BUCKETS = 12
+EXPORT_STATS = ("records", "ipfix_messages", "ipfix_errors", "file_rows", "file_errors")  # EXPORT_ST_* in flow_export.h
+SOCK_QUEUE_WARN = 0.5  # warn when a socket's receive queue is this full at drain time (drops start at 1.0)
+AGG_TOP_FLOWS = 500  # IPv4 flows per interval delta to the aggregator (agg_protocol.py)
+AGG_TOP_HOSTS = 256  # sources and destinations per interval delta, each
+STATE_VERSION = 1  # PROBE_STATE_DIR layout: coordinator.json, window.snap (FlowMerge.save()), enricher.json
+STATE_MAX_AGE = 60.0  # seconds — a stop longer ago than this is not resumed (window, rates, cooldowns)
 
 # ---------------------------------------------------------------------------
 # Try to load C libraries
 # ---------------------------------------------------------------------------
 _fast_recv_lib = None  # fast_recv.so: recvmmsg + parse + aggregate (preferred)
+_flow_merge_lib = None  # flow_merge.so: coordinator merge + Top-K
+
+
+class _CFlowRecordTag(ctypes.Union):
+    _fields_ = [
+        ("err_q16", ctypes.c_uint16),
+        ("source", ctypes.c_uint16),
+    ]
 
 
 class _CFlowRecord(ctypes.Structure):
     """Matches struct flow_record in fast_recv.c (32 bytes)."""
+    _anonymous_ = ("_tag",)
+    _fields_ = [
+        ("src_ip", ctypes.c_uint32),
+        ("dst_ip", ctypes.c_uint32),
+        ("src_port", ctypes.c_uint16),
+        ("dst_port", ctypes.c_uint16),
+        ("proto", ctypes.c_uint8),
+        ("kind", ctypes.c_uint8),
+        ("_tag", _CFlowRecordTag),
+        ("packets", ctypes.c_uint64),
+        ("bytes", ctypes.c_uint64),
+    ]
+
+
+class _CFlowRecord6(ctypes.Structure):
+    """Matches struct flow_record6 in flow_ring.h (64 bytes)."""
+    _fields_ = [
+        ("src_ip", ctypes.c_uint8 * 16),
+        ("dst_ip", ctypes.c_uint8 * 16),
+        ("src_port", ctypes.c_uint16),
+        ("dst_port", ctypes.c_uint16),
+        ("proto", ctypes.c_uint8),
+        ("kind", ctypes.c_uint8),
+        ("source", ctypes.c_uint16),
+        ("_pad", ctypes.c_uint8 * 8),
+        ("packets", ctypes.c_uint64),
+        ("bytes", ctypes.c_uint64),
+    ]
+
+
+class _CFlowRecordExt(ctypes.Structure):
+    """Matches struct flow_record_ext in flow_ring.h (64 bytes)."""
     _fields_ = [
         ("src_ip", ctypes.c_uint32),
         ("dst_ip", ctypes.c_uint32),
         ("src_port", ctypes.c_uint16),
         ("dst_port", ctypes.c_uint16),
         ("proto", ctypes.c_uint8),
-        ("_pad1", ctypes.c_uint8),
-        ("_pad2", ctypes.c_uint16),
+        ("tcp_flags", ctypes.c_uint8),
+        ("source", ctypes.c_uint16),
+        ("first_ns", ctypes.c_uint64),
+        ("last_ns", ctypes.c_uint64),
+        ("syn", ctypes.c_uint32),
+        ("rst", ctypes.c_uint32),
+        ("len_hist", ctypes.c_uint32 * FLOW_EXT_BUCKETS),
+    ]
+
+
+class _CHostEvent(ctypes.Structure):
+    """Matches struct host_event in flow_ring.h (32 bytes)."""
+    _fields_ = [
+        ("ip", ctypes.c_uint32),
+        ("dir", ctypes.c_uint8),
+        ("reason", ctypes.c_uint8),
+        ("window_ms", ctypes.c_uint16),
         ("packets", ctypes.c_uint64),
         ("bytes", ctypes.c_uint64),
+        ("ts_ns", ctypes.c_uint64),
+    ]
+
+
+class _CCapStats(ctypes.Structure):
+    """Matches struct cap_stats in flow_ring.h."""
+    _fields_ = [
+        ("magic", ctypes.c_uint32),
+        ("size", ctypes.c_uint32),
+        ("seq", ctypes.c_uint64),
+        ("updated_ns", ctypes.c_uint64),
+        ("pkts", ctypes.c_uint64),
+        ("bytes", ctypes.c_uint64),
+        ("parsed", ctypes.c_uint64),
+        ("sampled", ctypes.c_uint64),
+        ("rejects", ctypes.c_uint64 * STATS_REJ_REASONS),
+        ("rx_calls", ctypes.c_uint64),
+        ("rx_full", ctypes.c_uint64),
+        ("rx_entries", ctypes.c_uint64),
+        ("batch_hist", ctypes.c_uint64 * STATS_BATCH_BUCKETS),
+        ("probe_hist", ctypes.c_uint64 * STATS_PROBE_BUCKETS),
+        ("probe_sum", ctypes.c_uint64),
+        ("drain_hist", ctypes.c_uint64 * STATS_DRAIN_BUCKETS),
+        ("drain_ns", ctypes.c_uint64),
+        ("drains", ctypes.c_uint64),
+        ("dropped_flows", ctypes.c_uint64),
+        ("probe_failures", ctypes.c_uint64),
+        ("ring_drops", ctypes.c_uint64),
+        ("flows", ctypes.c_uint64),
+        ("capacity", ctypes.c_uint64),
+        ("sock_rmem", ctypes.c_uint64),
+        ("sock_rcvbuf", ctypes.c_uint64),
+        ("sock_drops", ctypes.c_uint64),
+    ]
+
+
+class _CCapConfig(ctypes.Structure):
+    """Matches struct cap_config in fast_recv.c."""
+    _fields_ = [
+        ("port", ctypes.c_int),
+        ("rcvbuf", ctypes.c_int),
+        ("backend", ctypes.c_int),
+        ("queue_id", ctypes.c_int),
+        ("xsk_map_id", ctypes.c_uint32),
+        ("ifname", ctypes.c_char * 16),
+        ("max_flows", ctypes.c_int),
+        ("max_flows_limit", ctypes.c_int),
+        ("hugepages", ctypes.c_int),
+        ("cpu", ctypes.c_int),
+        ("sock_fd", ctypes.c_int),
+        ("rx_mode", ctypes.c_int),
+        ("busy_poll_us", ctypes.c_int),
+        ("udp_gro", ctypes.c_int),
+        ("track_sources", ctypes.c_int),
+        ("ext_counters", ctypes.c_int),
+        ("host_bps", ctypes.c_uint64),
+        ("host_pps", ctypes.c_uint64),
+        ("host_window_ms", ctypes.c_int),
+        ("pcap_path", ctypes.c_char * 256),
+        ("pcap_shard", ctypes.c_int),
+        ("pcap_shards", ctypes.c_int),
+        ("replay_speed", ctypes.c_double),
+        ("replay_epoch_ms", ctypes.c_int),
     ]
 
 
@@ -70,7 +238,20 @@ class _CFlowResult(ctypes.Structure):
         ("src_ip", ctypes.c_uint32),
         ("dst_ip", ctypes.c_uint32),
         ("protocol", ctypes.c_uint8),
-        ("_pad1", ctypes.c_uint8),
+        ("valid", ctypes.c_uint8),
+        ("src_port", ctypes.c_uint16),
+        ("dst_port", ctypes.c_uint16),
+        ("pkt_len", ctypes.c_uint16),
+    ]
+
+
+class _CFlowResult6(ctypes.Structure):
+    """Matches struct flow_result6 in fast_parse.c."""
+    _fields_ = [
+        ("src_ip", ctypes.c_uint8 * 16),
+        ("dst_ip", ctypes.c_uint8 * 16),
+        ("protocol", ctypes.c_uint8),
+        ("_pad", ctypes.c_uint8),
         ("src_port", ctypes.c_uint16),
         ("dst_port", ctypes.c_uint16),
         ("pkt_len", ctypes.c_uint16),
@@ -86,20 +267,52 @@ def _load_fast_recv():
         lib = ctypes.CDLL(so_path)
         lib.cap_create.argtypes = [ctypes.c_int, ctypes.c_int]
         lib.cap_create.restype = ctypes.c_void_p
+        lib.cap_config_init.argtypes = [ctypes.POINTER(_CCapConfig)]
+        lib.cap_config_init.restype = None
+        lib.cap_config_size.argtypes = []
+        lib.cap_config_size.restype = ctypes.c_int
+        lib.cap_create_ex.argtypes = [ctypes.POINTER(_CCapConfig)]
+        lib.cap_create_ex.restype = ctypes.c_void_p
+        lib.cap_get_backend.argtypes = [ctypes.c_void_p]
+        lib.cap_get_backend.restype = ctypes.c_int
         lib.cap_get_rcvbuf.argtypes = [ctypes.c_void_p]
         lib.cap_get_rcvbuf.restype = ctypes.c_int
         lib.cap_run.argtypes = [ctypes.c_void_p, ctypes.c_int]
         lib.cap_run.restype = ctypes.c_int
         lib.cap_stop.argtypes = [ctypes.c_void_p]
         lib.cap_stop.restype = None
+        lib.cap_start.argtypes = [ctypes.c_void_p]
+        lib.cap_start.restype = ctypes.c_int
+        lib.cap_swap.argtypes = [ctypes.c_void_p]
+        lib.cap_swap.restype = ctypes.c_void_p
+        lib.cap_drain.argtypes = [ctypes.c_void_p, ctypes.c_void_p]
+        lib.cap_drain.restype = ctypes.c_int
         lib.cap_flush.argtypes = [ctypes.c_void_p]
         lib.cap_flush.restype = ctypes.c_int
         lib.cap_get_flush_buf.argtypes = [ctypes.c_void_p]
         lib.cap_get_flush_buf.restype = ctypes.POINTER(_CFlowRecord)
+        lib.cap_get_flush6_buf.argtypes = [ctypes.c_void_p]
+        lib.cap_get_flush6_buf.restype = ctypes.POINTER(_CFlowRecord6)
+        lib.cap_get_flushed6.argtypes = [ctypes.c_void_p]
+        lib.cap_get_flushed6.restype = ctypes.c_int
+        lib.cap_get_flush_ext_buf.argtypes = [ctypes.c_void_p]
+        lib.cap_get_flush_ext_buf.restype = ctypes.POINTER(_CFlowRecordExt)
+        lib.cap_get_flushed_ext.argtypes = [ctypes.c_void_p]
+        lib.cap_get_flushed_ext.restype = ctypes.c_int
+        lib.cap_get_ext_counters.argtypes = [ctypes.c_void_p]
+        lib.cap_get_ext_counters.restype = ctypes.c_int
         lib.cap_get_total_pkts.argtypes = [ctypes.c_void_p]
         lib.cap_get_total_pkts.restype = ctypes.c_uint64
         lib.cap_get_total_parsed.argtypes = [ctypes.c_void_p]
         lib.cap_get_total_parsed.restype = ctypes.c_uint64
+        lib.cap_get_total_sampled.argtypes = [ctypes.c_void_p]
+        lib.cap_get_total_sampled.restype = ctypes.c_uint64
+        lib.cap_set_sampling.argtypes = [ctypes.c_void_p, ctypes.c_double, ctypes.c_int]
+        lib.cap_set_sampling.restype = ctypes.c_int
+        lib.cap_get_sample_rate.argtypes = [ctypes.c_void_p]
+        lib.cap_get_sample_rate.restype = ctypes.c_double
+        lib.cap_get_num_flows.argtypes = [ctypes.c_void_p]
+        lib.cap_get_num_flows.restype = ctypes.c_int
         lib.cap_destroy.argtypes = [ctypes.c_void_p]
         lib.cap_destroy.restype = None
         lib.ip_to_str.argtypes = [ctypes.c_uint32, ctypes.c_char_p, ctypes.c_int]
@@ -108,14 +321,462 @@ def _load_fast_recv():
         lib.cap_get_dropped_flows.restype = ctypes.c_uint64
         lib.cap_get_probe_failures.argtypes = [ctypes.c_void_p]
         lib.cap_get_probe_failures.restype = ctypes.c_uint64
+        lib.cap_attach_ring.argtypes = [ctypes.c_void_p, ctypes.c_void_p]
+        lib.cap_attach_ring.restype = ctypes.c_int
+        lib.cap_attach_ring6.argtypes = [ctypes.c_void_p, ctypes.c_void_p]
+        lib.cap_attach_ring6.restype = ctypes.c_int
+        lib.cap_attach_ring_ext.argtypes = [ctypes.c_void_p, ctypes.c_void_p]
+        lib.cap_attach_ring_ext.restype = ctypes.c_int
+        lib.cap_attach_events.argtypes = [ctypes.c_void_p, ctypes.c_void_p]
+        lib.cap_attach_events.restype = ctypes.c_int
+        lib.cap_get_host_check.argtypes = [ctypes.c_void_p]
+        lib.cap_get_host_check.restype = ctypes.c_int
+        lib.cap_get_host_events.argtypes = [ctypes.c_void_p]
+        lib.cap_get_host_events.restype = ctypes.c_uint64
+        lib.cap_get_host_uncounted.argtypes = [ctypes.c_void_p]
+        lib.cap_get_host_uncounted.restype = ctypes.c_uint64
+        lib.cap_get_ring_drops.argtypes = [ctypes.c_void_p]
+        lib.cap_get_ring_drops.restype = ctypes.c_uint64
+        lib.cap_attach_stats.argtypes = [ctypes.c_void_p, ctypes.c_void_p]
+        lib.cap_attach_stats.restype = ctypes.c_int
+        lib.stats_init.argtypes = [ctypes.c_void_p, ctypes.c_uint64]
+        lib.stats_init.restype = ctypes.c_int
+        lib.stats_read.argtypes = [ctypes.c_void_p, ctypes.POINTER(_CCapStats)]
+        lib.stats_read.restype = ctypes.c_int
+        lib.stats_size.argtypes = []
+        lib.stats_size.restype = ctypes.c_int
+        lib.ring_init.argtypes = [ctypes.c_void_p, ctypes.c_uint64]
+        lib.ring_init.restype = ctypes.c_uint64
+        lib.ring_init6.argtypes = [ctypes.c_void_p, ctypes.c_uint64]
+        lib.ring_init6.restype = ctypes.c_uint64
+        lib.ring_init_ext.argtypes = [ctypes.c_void_p, ctypes.c_uint64]
+        lib.ring_init_ext.restype = ctypes.c_uint64
+        lib.ring_init_events.argtypes = [ctypes.c_void_p, ctypes.c_uint64]
+        lib.ring_init_events.restype = ctypes.c_uint64
+        lib.ring_push.argtypes = [ctypes.c_void_p, ctypes.POINTER(_CFlowRecord), ctypes.c_int]
+        lib.ring_push.restype = ctypes.c_int
+        lib.ring_pop.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_int]
+        lib.ring_pop.restype = ctypes.c_int
+        lib.ring_get_dropped.argtypes = [ctypes.c_void_p]
+        lib.ring_get_dropped.restype = ctypes.c_uint64
+        lib.ring_get_sample_rate.argtypes = [ctypes.c_void_p]
+        lib.ring_get_sample_rate.restype = ctypes.c_double
+        lib.xdp_attach.argtypes = [ctypes.c_char_p, ctypes.c_int, ctypes.c_int]
+        lib.xdp_attach.restype = ctypes.c_void_p
+        lib.xdp_detach.argtypes = [ctypes.c_void_p]
+        lib.xdp_detach.restype = None
+        lib.xdp_get_map_id.argtypes = [ctypes.c_void_p]
+        lib.xdp_get_map_id.restype = ctypes.c_uint32
+        lib.xdp_get_mode.argtypes = [ctypes.c_void_p]
+        lib.xdp_get_mode.restype = ctypes.c_int
+        lib.cap_get_xdp_mode.argtypes = [ctypes.c_void_p]
+        lib.cap_get_xdp_mode.restype = ctypes.c_int
+        lib.cap_get_flow_capacity.argtypes = [ctypes.c_void_p]
+        lib.cap_get_flow_capacity.restype = ctypes.c_int
+        lib.cap_get_table_pages.argtypes = [ctypes.c_void_p]
+        lib.cap_get_table_pages.restype = ctypes.c_int
+        lib.cap_get_pinned_cpu.argtypes = [ctypes.c_void_p]
+        lib.cap_get_pinned_cpu.restype = ctypes.c_int
+        lib.cap_get_rx_mode.argtypes = [ctypes.c_void_p]
+        lib.cap_get_rx_mode.restype = ctypes.c_int
+        lib.cap_get_batch_stats.argtypes = [ctypes.c_void_p, ctypes.POINTER(ctypes.c_uint64)]
+        lib.cap_get_batch_stats.restype = None
+        lib.cap_get_udp_gro.argtypes = [ctypes.c_void_p]
+        lib.cap_get_udp_gro.restype = ctypes.c_int
+        lib.cap_set_vni_filter.argtypes = [ctypes.c_void_p, ctypes.POINTER(ctypes.c_uint32), ctypes.c_int]
+        lib.cap_set_vni_filter.restype = ctypes.c_int
+        lib.cap_get_vni_dropped.argtypes = [ctypes.c_void_p]
+        lib.cap_get_vni_dropped.restype = ctypes.c_uint64
+        lib.cap_get_num_sources.argtypes = [ctypes.c_void_p]
+        lib.cap_get_num_sources.restype = ctypes.c_int
+        lib.cap_open_socket.argtypes = [ctypes.c_int, ctypes.c_int]
+        lib.cap_open_socket.restype = ctypes.c_int
+        lib.cap_attach_steering.argtypes = [ctypes.c_int, ctypes.c_int, ctypes.POINTER(ctypes.c_int), ctypes.c_int]
+        lib.cap_attach_steering.restype = ctypes.c_int
+        lib.cap_replay_step.argtypes = [ctypes.c_void_p, ctypes.c_uint32, ctypes.c_int]
+        lib.cap_replay_step.restype = ctypes.c_int
+        lib.cap_get_replay_stats.argtypes = [ctypes.c_void_p, ctypes.POINTER(ctypes.c_uint64)]
+        lib.cap_get_replay_stats.restype = None
+        lib.ring_get_replay_hold.argtypes = [ctypes.c_void_p]
+        lib.ring_get_replay_hold.restype = ctypes.c_uint32
+        lib.ring_set_replay_hold.argtypes = [ctypes.c_void_p, ctypes.c_uint32]
+        lib.ring_set_replay_hold.restype = None
+        lib.ring_get_replay_done.argtypes = [ctypes.c_void_p]
+        lib.ring_get_replay_done.restype = ctypes.c_uint32
+        lib.ring_set_replay_done.argtypes = [ctypes.c_void_p, ctypes.c_uint32]
+        lib.ring_set_replay_done.restype = None
+        lib.xdp_get_log.argtypes = []
+        lib.xdp_get_log.restype = ctypes.c_char_p
+        if lib.cap_config_size() != ctypes.sizeof(_CCapConfig):
+            raise OSError("struct cap_config size mismatch, rebuild fast_recv.so")
+        if lib.stats_size() != ctypes.sizeof(_CCapStats):
+            raise OSError("struct cap_stats size mismatch, rebuild fast_recv.so")
         _fast_recv_lib = lib
         logger.info("Loaded fast_recv.so from %s", so_path)
     except OSError as e:
         logger.warning("Failed to load fast_recv.so: %s – using Python recv loop", e)
 
 
+def _load_flow_merge():
+    global _flow_merge_lib
+    so_path = os.path.join(_probe_dir, "flow_merge.so")
+    if not os.path.isfile(so_path):
+        return
+    try:
+        lib = ctypes.CDLL(so_path)
+        lib.merge_create.argtypes = []
+        lib.merge_create.restype = ctypes.c_void_p
+        lib.merge_destroy.argtypes = [ctypes.c_void_p]
+        lib.merge_destroy.restype = None
+        lib.merge_add.argtypes = [ctypes.c_void_p, ctypes.POINTER(_CFlowRecord), ctypes.c_int]
+        lib.merge_add.restype = None
+        lib.merge_consume_ring.argtypes = [ctypes.c_void_p, ctypes.c_void_p]
+        lib.merge_consume_ring.restype = ctypes.c_uint64
+        lib.merge_add6.argtypes = [ctypes.c_void_p, ctypes.POINTER(_CFlowRecord6), ctypes.c_int]
+        lib.merge_add6.restype = None
+        lib.merge_consume_ring6.argtypes = [ctypes.c_void_p, ctypes.c_void_p]
+        lib.merge_consume_ring6.restype = ctypes.c_uint64
+        lib.merge_add_ext.argtypes = [ctypes.c_void_p, ctypes.POINTER(_CFlowRecordExt), ctypes.c_int]
+        lib.merge_add_ext.restype = None
+        lib.merge_consume_ring_ext.argtypes = [ctypes.c_void_p, ctypes.c_void_p]
+        lib.merge_consume_ring_ext.restype = ctypes.c_uint64
+        lib.merge_lookup.argtypes = [ctypes.c_void_p, ctypes.c_int, ctypes.c_void_p, ctypes.c_void_p]
+        lib.merge_lookup.restype = ctypes.c_int
+        lib.merge_totals.argtypes = [ctypes.c_void_p, ctypes.POINTER(ctypes.c_uint64)]
+        lib.merge_totals.restype = None
+        lib.merge_count.argtypes = [ctypes.c_void_p, ctypes.c_int]
+        lib.merge_count.restype = ctypes.c_int
+        lib.merge_row_size.argtypes = [ctypes.c_void_p, ctypes.c_int]
+        lib.merge_row_size.restype = ctypes.c_int
+        lib.merge_top.argtypes = [ctypes.c_void_p, ctypes.c_int, ctypes.c_int, ctypes.c_int, ctypes.c_void_p]
+        lib.merge_top.restype = ctypes.c_int
+        lib.merge_hosts_over.argtypes = [ctypes.c_void_p, ctypes.c_uint64, ctypes.c_uint64,
+                                         ctypes.c_void_p, ctypes.c_int]
+        lib.merge_hosts_over.restype = ctypes.c_int
+        lib.merge_set_prefixes.argtypes = [ctypes.c_void_p, ctypes.POINTER(ctypes.c_uint32),
+                                           ctypes.POINTER(ctypes.c_int), ctypes.c_int]
+        lib.merge_set_prefixes.restype = ctypes.c_int
+        lib.merge_rollup.argtypes = [ctypes.c_void_p]
+        lib.merge_rollup.restype = ctypes.c_int
+        lib.merge_top_ports.argtypes = [ctypes.c_void_p, ctypes.c_int, ctypes.c_void_p]
+        lib.merge_top_ports.restype = ctypes.c_int
+        lib.merge_host_sketch.argtypes = [ctypes.c_void_p, ctypes.c_int, ctypes.c_int, ctypes.POINTER(ctypes.c_uint64)]
+        lib.merge_host_sketch.restype = ctypes.c_int
+        lib.merge_protos.argtypes = [ctypes.c_void_p, ctypes.POINTER(ctypes.c_uint64)]
+        lib.merge_protos.restype = None
+        lib.merge_export_ipfix.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_int, ctypes.c_uint32]
+        lib.merge_export_ipfix.restype = ctypes.c_int
+        lib.merge_export_file.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
+        lib.merge_export_file.restype = ctypes.c_int
+        lib.merge_export_interval.argtypes = [ctypes.c_void_p, ctypes.c_uint32]
+        lib.merge_export_interval.restype = None
+        lib.merge_export_flush.argtypes = [ctypes.c_void_p]
+        lib.merge_export_flush.restype = None
+        lib.merge_export_stats.argtypes = [ctypes.c_void_p, ctypes.POINTER(ctypes.c_uint64)]
+        lib.merge_export_stats.restype = None
+        lib.merge_save.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
+        lib.merge_save.restype = ctypes.c_int
+        lib.merge_load.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
+        lib.merge_load.restype = ctypes.c_int
+        lib.merge_get_dropped.argtypes = [ctypes.c_void_p]
+        lib.merge_get_dropped.restype = ctypes.c_uint64
+        lib.merge_reset.argtypes = [ctypes.c_void_p]
+        lib.merge_reset.restype = None
+        _flow_merge_lib = lib
+        logger.info("Loaded flow_merge.so from %s", so_path)
+    except OSError as e:
+        logger.warning("Failed to load flow_merge.so: %s", e)
+
+
+def ip_to_str(ip_raw: int) -> str:
+    """Format a raw u32 IP from a flow_record (network byte order in memory)."""
+    return socket.inet_ntoa(struct.pack("=I", ip_raw))
+
+
+def ip6_to_str(ip_raw: bytes) -> str:
+    """Format a 16-byte IPv6 address from a flow_record6."""
+    return socket.inet_ntop(socket.AF_INET6, ip_raw)
+
+
+class FlowRing:
+    """Shared-memory SPSC ring of flow_record (flow_ring.h), one per worker;
+    with record=_CFlowRecord6 / _CFlowRecordExt, of the worker's IPv6 flows
+    or extended counters, and with record=_CHostEvent, of its host threshold
+    events (read with pop()).
+
+    The coordinator creates and owns the segment; the worker attaches by name
+    and its cap_drain() writes records straight into the slots, and the
+    coordinator's FlowMerge reads them in place, so flows never become
+    Python objects on either side.
+    """
+
+    _INIT = {_CFlowRecord: "ring_init", _CFlowRecord6: "ring_init6", _CFlowRecordExt: "ring_init_ext",
+             _CHostEvent: "ring_init_events"}
+
+    def __init__(self, records: int = RING_RECORDS, name: Optional[str] = None, record: type = _CFlowRecord):
+        self._owner = name is None
+        self.record = record
+        size = FLOW_RING_HDR + records * ctypes.sizeof(record)
+        self.shm = shared_memory.SharedMemory(name=name, create=self._owner, size=size if self._owner else 0)
+        self._anchor = ctypes.c_char.from_buffer(self.shm.buf)
+        self.addr = ctypes.addressof(self._anchor)
+        init = getattr(_fast_recv_lib, self._INIT[record])
+        if self._owner and not init(self.addr, size):
+            self.close()
+            raise ValueError(f"ring of {records} records does not fit {size} bytes")
+
+    @property
+    def name(self) -> str:
+        return self.shm.name
+
+    def dropped(self) -> int:
+        return _fast_recv_lib.ring_get_dropped(self.addr)
+
+    def sample_rate(self) -> float:
+        """Effective sampling rate the worker reported (0.0 if not attached yet)."""
+        return _fast_recv_lib.ring_get_sample_rate(self.addr)
+
+    # Capture file replay lock-step: the coordinator holds the worker at
+    # replay_hold epochs, the worker reports the epochs it has flushed
+    def replay_hold(self) -> int:
+        return _fast_recv_lib.ring_get_replay_hold(self.addr)
+
+    def set_replay_hold(self, epochs: int) -> None:
+        _fast_recv_lib.ring_set_replay_hold(self.addr, epochs)
+
+    def replay_done(self) -> int:
+        return _fast_recv_lib.ring_get_replay_done(self.addr)
+
+    def set_replay_done(self, epochs: int) -> None:
+        _fast_recv_lib.ring_set_replay_done(self.addr, epochs)
+
+    def pop(self, max_records: int = 256) -> list:
+        """Copy out and release up to max_records records."""
+        out = (self.record * max_records)()
+        n = _fast_recv_lib.ring_pop(self.addr, out, max_records)
+        return out[:n]
+
+    def close(self) -> None:
+        self._anchor = None
+        self.shm.close()
+        if self._owner:
+            self.shm.unlink()
+
+
+class WorkerStats:
+    """One worker's struct cap_stats block in shared memory. The coordinator
+    creates it; the worker attaches by name (cap_attach_stats) and its
+    cap_drain() republishes the counters every flush."""
+
+    def __init__(self, name: Optional[str] = None):
+        self._owner = name is None
+        size = ctypes.sizeof(_CCapStats)
+        self.shm = shared_memory.SharedMemory(name=name, create=self._owner, size=size if self._owner else 0)
+        self._anchor = ctypes.c_char.from_buffer(self.shm.buf)
+        self.addr = ctypes.addressof(self._anchor)
+        if self._owner:
+            _fast_recv_lib.stats_init(self.addr, size)
+
+    @property
+    def name(self) -> str:
+        return self.shm.name
+
+    def read(self) -> Optional[dict]:
+        """Consistent copy as {field: value} (arrays as lists); None before the
+        worker's first update or if it kept the block busy."""
+        out = _CCapStats()
+        if not _fast_recv_lib.stats_read(self.addr, ctypes.byref(out)) or not out.updated_ns:
+            return None
+        return {name: (list(v) if isinstance(v, ctypes.Array) else v)
+                for name, v in ((f, getattr(out, f)) for f, _ in _CCapStats._fields_)}
+
+    def close(self) -> None:
+        self._anchor = None
+        self.shm.close()
+        if self._owner:
+            self.shm.unlink()
+
+
+class FlowMerge:
+    """Coordinator merge engine (flow_merge.so): one merged flow table plus a
+    per-host src/dst table, running totals, and heap-based Top-K queries.
+
+    IPv6 flows are merged into a FLOWS6 table of their own and count towards
+    the totals; HOSTS and SOURCES stay IPv4. Extended counters (ext_counters
+    workers) go into FLOW_EXT, read per flow with flow_ext(). rollup() folds
+    HOSTS into NET24 / NET16 subnets and the CIDRS given to set_prefixes(),
+    and FLOWS into per-destination SERVICES. Destination ports and protocols
+    are counted during the merge in flat arrays (top_ports(), protocols()).
+
+    Rows come back as tuples with raw u32 IPs (16-byte strings in FLOWS6);
+    callers format only what they report.
+
+    With export_ipfix() / export_file() set, consume() also exports every
+    exact record from the ring slots in C; records never reach Python.
+
+    save() / load() carry the window merged so far over a restart, as a
+    memory-mapped snapshot file written and read back in C.
+    """
+
+    FLOWS = 0  # row: src_ip, dst_ip, src_port, dst_port, proto, packets, bytes
+    HOSTS = 1  # row: ip, src_packets, src_bytes, dst_packets, dst_bytes
+    SOURCES = 2  # row: mirror source ip, packets, bytes
+    FLOWS6 = 3  # row: src_ip, dst_ip (16-byte strings), src_port, dst_port, proto, packets, bytes
+    FLOW_EXT = 4  # row: 5-tuple as FLOWS, syn, rst, tcp_flags, first_ns, last_ns, len_hist x FLOW_EXT_BUCKETS
+    NET24 = 5  # row: /24 network, then counters as HOSTS (after rollup())
+    NET16 = 6  # row: /16 network, then counters as HOSTS
+    CIDRS = 7  # row: network, prefix length, then counters as HOSTS
+    SERVICES = 8  # row: dst_ip, dst_port, proto, packets, bytes (after rollup())
+    MAX_CIDRS = 64  # matches MERGE_MAX_CIDRS in flow_merge.c
+    _ROWS = {
+        FLOWS: struct.Struct("=IIHHB3xQQ"),
+        HOSTS: struct.Struct("=IQQQQ"),
+        SOURCES: struct.Struct("=IQQ"),
+        FLOWS6: struct.Struct("=16s16sHHB3xQQ"),
+        FLOW_EXT: struct.Struct("=IIHHB3x" + "Q" * (5 + FLOW_EXT_BUCKETS)),
+        NET24: struct.Struct("=IQQQQ"),
+        NET16: struct.Struct("=IQQQQ"),
+        CIDRS: struct.Struct("=IIQQQQ"),
+        SERVICES: struct.Struct("=IHBxQQ"),
+    }
+    _PORT_ROW = struct.Struct("=HB5xQQ")  # merge_top_ports(): dst_port, proto, packets, bytes
+    _FLOW_KEY = struct.Struct("=IIHHB3x")
+    _CONSUME = {_CFlowRecord: "merge_consume_ring", _CFlowRecord6: "merge_consume_ring6",
+                _CFlowRecordExt: "merge_consume_ring_ext"}
+    NO_LIMIT = (1 << 64) - 1
+
+    def __init__(self):
+        self._lib = _flow_merge_lib
+        self._ctx = self._lib.merge_create()
+        if not self._ctx:
+            raise MemoryError("merge_create failed")
+        for table, row in self._ROWS.items():
+            assert self._lib.merge_row_size(self._ctx, table) == row.size
+
+    def consume(self, ring: FlowRing) -> int:
+        return getattr(self._lib, self._CONSUME[ring.record])(self._ctx, ring.addr)
+
+    def add(self, records: list[tuple[int, int, int, int, int, int, int, int]]) -> None:
+        """Merge (kind, src_ip, dst_ip, src_port, dst_port, proto, packets, bytes)
+        flow_records built in Python; kinds as FLOW_REC_*."""
+        recs = (_CFlowRecord * len(records))()
+        for r, (kind, src, dst, sport, dport, proto, pkts, byt) in zip(recs, records):
+            r.kind, r.src_ip, r.dst_ip, r.src_port, r.dst_port, r.proto = kind, src, dst, sport, dport, proto
+            r.packets, r.bytes = pkts, byt
+        self._lib.merge_add(self._ctx, recs, len(records))
+
+    def totals(self) -> tuple[int, int]:
+        """(packets, bytes) merged since reset()."""
+        out = (ctypes.c_uint64 * 2)()
+        self._lib.merge_totals(self._ctx, out)
+        return out[0], out[1]
+
+    def count(self, table: int) -> int:
+        return self._lib.merge_count(self._ctx, table)
+
+    def top(self, table: int, col: int, k: int) -> list[tuple]:
+        """Top-k rows of table by counter column col (0-based after the key), largest first."""
+        row = self._ROWS[table]
+        buf = ctypes.create_string_buffer(row.size * k)
+        n = self._lib.merge_top(self._ctx, table, col, k, buf)
+        return list(row.iter_unpack(buf.raw[: n * row.size]))
+
+    def flow_ext(self, src_ip: int, dst_ip: int, src_port: int, dst_port: int, proto: int) -> Optional[dict]:
+        """Extended counters merged for one IPv4 flow (raw u32 IPs), or None."""
+        row = self._ROWS[self.FLOW_EXT]
+        buf = ctypes.create_string_buffer(row.size)
+        key = self._FLOW_KEY.pack(src_ip, dst_ip, src_port, dst_port, proto)
+        if not self._lib.merge_lookup(self._ctx, self.FLOW_EXT, key, buf):
+            return None
+        vals = row.unpack(buf.raw)[5:]
+        return {"syn": vals[0], "rst": vals[1], "tcp_flags": vals[2], "first_ns": vals[3],
+                "last_ns": vals[4], "len_hist": list(vals[5:])}
+
+    def hosts_over(self, max_packets: int, max_bytes: int, max_rows: int = 4096) -> list[tuple]:
+        """HOSTS rows where either direction exceeds max_packets or max_bytes."""
+        row = self._ROWS[self.HOSTS]
+        buf = ctypes.create_string_buffer(row.size * max_rows)
+        n = self._lib.merge_hosts_over(self._ctx, min(max_packets, self.NO_LIMIT),
+                                       min(max_bytes, self.NO_LIMIT), buf, max_rows)
+        return list(row.iter_unpack(buf.raw[: n * row.size]))
+
+    def set_prefixes(self, cidrs: list[tuple[int, int]]) -> bool:
+        """CIDRs as (raw u32 network, prefix length) for the CIDRS table."""
+        nets = (ctypes.c_uint32 * len(cidrs))(*(net for net, _ in cidrs))
+        lens = (ctypes.c_int * len(cidrs))(*(plen for _, plen in cidrs))
+        return self._lib.merge_set_prefixes(self._ctx, nets, lens, len(cidrs)) == 0
+
+    def rollup(self) -> int:
+        """Rebuild NET24 / NET16 / CIDRS from HOSTS and SERVICES from FLOWS. Returns rows built."""
+        return self._lib.merge_rollup(self._ctx)
+
+    def top_ports(self, k: int) -> list[tuple[int, int, int, int]]:
+        """Top-k TCP/UDP destination ports by bytes: (port, proto, packets, bytes)."""
+        buf = ctypes.create_string_buffer(self._PORT_ROW.size * k)
+        n = self._lib.merge_top_ports(self._ctx, k, buf)
+        return list(self._PORT_ROW.iter_unpack(buf.raw[: n * self._PORT_ROW.size]))
+
+    def host_sketch(self, depth: int, width: int) -> list[int]:
+        """Count-min sketches of HOSTS (src packets, src bytes, dst packets,
+        dst bytes), each depth x width cells, counter-major. [] on bad sizes."""
+        out = (ctypes.c_uint64 * (4 * depth * width))()
+        if self._lib.merge_host_sketch(self._ctx, depth, width, out) != 0:
+            return []
+        return list(out)
+
+    def export_ipfix(self, host: str, port: int, domain: int = 0) -> bool:
+        """Export every exact flow record consumed from here on as IPFIX to
+        host:port (flow_export.h); "" stops. False if the address is unusable."""
+        return self._lib.merge_export_ipfix(self._ctx, host.encode(), port, domain & 0xFFFFFFFF) == 0
+
+    def export_file(self, path: Optional[str]) -> bool:
+        """Close the current columnar export file and continue into path (None: close only).
+        False if path cannot be created; an existing file is left alone."""
+        return self._lib.merge_export_file(self._ctx, path.encode() if path else None) == 0
+
+    def export_interval(self, seconds: float) -> None:
+        """Time one consumed record covers: the workers' flush interval."""
+        self._lib.merge_export_interval(self._ctx, int(seconds * 1000))
+
+    def export_flush(self) -> None:
+        """Send the partly filled IPFIX message."""
+        self._lib.merge_export_flush(self._ctx)
+
+    def export_stats(self) -> dict[str, int]:
+        out = (ctypes.c_uint64 * len(EXPORT_STATS))()
+        self._lib.merge_export_stats(self._ctx, out)
+        return dict(zip(EXPORT_STATS, out))
+
+    def protocols(self) -> dict[int, tuple[int, int]]:
+        """IP protocol number -> (packets, bytes), protocols seen only."""
+        out = (ctypes.c_uint64 * 512)()
+        self._lib.merge_protos(self._ctx, out)
+        return {p: (out[2 * p], out[2 * p + 1]) for p in range(256) if out[2 * p]}
+
+    def save(self, path: str) -> bool:
+        """Snapshot the window so far (FLOWS to FLOW_EXT, totals, ports, protocols) into path."""
+        return self._lib.merge_save(self._ctx, path.encode()) == 0
+
+    def load(self, path: str) -> int:
+        """Add a save() snapshot to the window. Returns table rows added, or -1
+        (missing, truncated or incompatible file: nothing added)."""
+        return self._lib.merge_load(self._ctx, path.encode())
+
+    def reset(self) -> None:
+        self._lib.merge_reset(self._ctx)
+
+    def close(self) -> None:
+        if self._ctx:
+            self._lib.merge_destroy(self._ctx)
+            self._ctx = None
+
+
 def parse_vxlan_packet(data: bytes) -> Optional[tuple[FlowKey, int]]:
-    """Parse VXLAN-encapsulated packet, return (flow_key, inner_pkt_len) or None."""
+    """Parse VXLAN-encapsulated packet, return (flow_key, inner_pkt_len) or None.
+
+    Inner frames may carry up to two 802.1Q/802.1ad tags; IPv6 packets come
+    back with IPv6 address strings (see _parse_ipv6). Same rules as vxlan_parse.h.
+    """
     offset = 0
     remaining = len(data)
 
@@ -132,6 +793,17 @@ def parse_vxlan_packet(data: bytes) -> Optional[tuple[FlowKey, int]]:
     offset += ETH_HDR_LEN
     remaining -= ETH_HDR_LEN
 
+    # VLAN tags (4 bytes each): the real ethertype follows the last one
+    if len(data) >= VXLAN_HDR_LEN + ETH_HDR_LEN + IP_HDR_MIN_LEN:
+        for _ in range(2):
+            if ethertype not in ETHERTYPES_VLAN:
+                break
+            ethertype = struct.unpack_from("!H", data, offset + 2)[0]
+            offset += VLAN_HDR_LEN
+            remaining -= VLAN_HDR_LEN
+
+    if ethertype == ETHERTYPE_IPV6:
+        return _parse_ipv6(data, offset)
     if ethertype != ETHERTYPE_IPV4:
         return None
 
@@ -148,7 +820,6 @@ def parse_vxlan_packet(data: bytes) -> Optional[tuple[FlowKey, int]]:
     protocol = data[offset + 9]
     src_ip_bytes = data[offset + 12 : offset + 16]
     dst_ip_bytes = data[offset + 16 : offset + 20]
-
     src_ip = socket.inet_ntoa(src_ip_bytes)
     dst_ip = socket.inet_ntoa(dst_ip_bytes)
     pkt_len = total_length
@@ -165,17 +836,118 @@ def parse_vxlan_packet(data: bytes) -> Optional[tuple[FlowKey, int]]:
     return (src_ip, dst_ip, protocol, src_port, dst_port), pkt_len
 
 
+def _parse_ipv6(data: bytes, offset: int) -> Optional[tuple[FlowKey, int]]:
+    """IPv6 part of parse_vxlan_packet: skip extension headers to L4 (vxlan_parse_v6)."""
+    if len(data) < VXLAN_HDR_LEN + ETH_HDR_LEN + IP_HDR_MIN_LEN or offset + IP6_HDR_LEN > len(data):
+        return None
+    if data[offset] >> 4 != 6:
+        return None
+    payload_len = struct.unpack_from("!H", data, offset + 4)[0]
+    next_hdr = data[offset + 6]
+    src_ip = socket.inet_ntop(socket.AF_INET6, data[offset + 8 : offset + 24])
+    dst_ip = socket.inet_ntop(socket.AF_INET6, data[offset + 24 : offset + 40])
+    pos = offset + IP6_HDR_LEN
+    later_fragment = False
+    for _ in range(IP6_MAX_EXT):
+        if next_hdr not in IP6_EXT_HDRS:
+            break
+        if next_hdr == 44:
+            if pos + 8 > len(data):
+                return None
+            later_fragment = struct.unpack_from("!H", data, pos + 2)[0] & 0xFFF8 != 0
+            hdr_len = 8
+        else:
+            if pos + 2 > len(data):
+                return None
+            hdr_len = (data[pos + 1] + 2) * 4 if next_hdr == 51 else (data[pos + 1] + 1) * 8
+        next_hdr = data[pos]
+        pos += hdr_len
+        if pos > len(data):
+            return None
+
+    src_port = dst_port = 0
+    if not later_fragment and next_hdr in (PROTO_TCP, PROTO_UDP) and pos + 4 <= len(data):
+        src_port, dst_port = struct.unpack_from("!HH", data, pos)
+    return (src_ip, dst_ip, next_hdr, src_port, dst_port), (payload_len + IP6_HDR_LEN) & 0xFFFF
+
+
 # ---------------------------------------------------------------------------
 # Worker process — C fast path (recvmmsg + parse + aggregate in C)
 # ---------------------------------------------------------------------------
 
 def _worker_c(
     worker_idx: int,
-    result_queue: multiprocessing.Queue,
+    ring_name: str,
     stop_event: multiprocessing.Event,
     sample_rate: float,
+    pkt_sample_n: int = 1,
+    xdp_iface: str = "",
+    xsk_map_id: int = 0,
+    xdp_count: bool = False,
+    max_flows: int = 0,
+    max_flows_limit: int = 0,
+    hugepages: bool = False,
+    cpu: int = -1,
+    sock_fd: int = -1,
+    rx_mode: str = "blocking",
+    busy_poll_us: int = 0,
+    udp_gro: bool = False,
+    vnis: tuple = (),
+    track_sources: bool = False,
+    ring6_name: str = "",
+    ext_ring_name: str = "",
+    event_ring_name: str = "",
+    host_bps: int = 0,
+    host_pps: int = 0,
+    host_window_ms: int = 0,
+    stats_name: str = "",
+    pcap_path: str = "",
+    replay_speed: float = 0.0,
+    pcap_shards: int = 1,
 ):
-    """Worker using fast_recv.so: recvmmsg batch capture + C hash-table aggregation."""
+    """Worker using fast_recv.so: recvmmsg batch capture + C hash-table aggregation.
+
+    With xsk_map_id set (coordinator attached the XDP program), the worker
+    binds an AF_XDP socket on RX queue worker_idx of xdp_iface instead, and
+    falls back to the UDP socket if that fails. With xdp_count, the worker
+    loads the in-kernel aggregation program on xdp_iface and only drains its
+    maps; it too falls back to the UDP socket.
+
+    Flow tables start at max_flows entries and double up to max_flows_limit
+    (0 = fast_recv.c defaults), optionally on hugepages.
+
+    cpu >= 0 pins the C capture thread; sock_fd is this worker's socket of a
+    reuseport group the coordinator opened (and steers) up front.
+
+    rx_mode picks how the socket backend waits for packets: blocking
+    recvmmsg, busy_poll (spin on the NIC queue for busy_poll_us), or adaptive
+    (batch size and coalescing wait follow the queue depth). udp_gro has the
+    kernel coalesce same-sized datagrams, split again in C.
+
+    vnis restricts capture to those VXLAN VNIs (empty = all); track_sources
+    counts traffic per mirror source (outer source IP). Socket backends only.
+
+    IPv6 flows are drained into a second ring (ring6_name) of flow_record6.
+    With ext_ring_name, the worker keeps extended per-flow counters (TCP
+    flags, SYN/RST, first/last seen, length histogram) and drains them there.
+    With event_ring_name, the capture thread counts every host over windows
+    of host_window_ms and pushes a host_event there as soon as one exceeds
+    host_bps or host_pps, ahead of the next flush. With stats_name, every
+    flush also republishes the capture counters and histograms into that
+    WorkerStats block.
+
+    With pcap_path the worker replays that capture file instead of
+    receiving: the flows of shard worker_idx of pcap_shards (inner 5-tuple
+    hash), as fast as possible or replay_speed times the capture's pace. It
+    flushes once per CAP_FLUSH_INTERVAL of capture time, never past the
+    epochs the coordinator allows in the ring header, and exits at the end
+    of the file.
+
+    Capture runs continuously on a C thread (cap_start); every CAP_FLUSH_INTERVAL
+    this loop swaps in the standby table and drains the retired one straight
+    into the coordinator's shared-memory ring, so the socket is never left
+    unread and no per-flow Python work happens here.
+    """
     log_level = os.environ.get("LOG_LEVEL", "INFO").upper()
     logging.basicConfig(
         level=getattr(logging, log_level, logging.INFO),
@@ -187,61 +959,210 @@ def _worker_c(
     signal.signal(signal.SIGINT, signal.SIG_IGN)
 
     lib = _fast_recv_lib
-    ctx = lib.cap_create(BIND_PORT, RCVBUF_SIZE)
+    cfg = _CCapConfig()
+    lib.cap_config_init(ctypes.byref(cfg))
+    cfg.port = BIND_PORT
+    cfg.rcvbuf = RCVBUF_SIZE
+    if xsk_map_id:
+        cfg.backend = CAP_BACKEND_AF_XDP
+        cfg.ifname = xdp_iface.encode()
+        cfg.queue_id = worker_idx
+        cfg.xsk_map_id = xsk_map_id
+    elif xdp_count:
+        cfg.backend = CAP_BACKEND_XDP_COUNT
+        cfg.ifname = xdp_iface.encode()
+    elif pcap_path:
+        cfg.backend = CAP_BACKEND_PCAP
+        cfg.pcap_path = pcap_path.encode()
+        cfg.pcap_shard = worker_idx
+        cfg.pcap_shards = pcap_shards
+        cfg.replay_speed = replay_speed
+        cfg.replay_epoch_ms = int(CAP_FLUSH_INTERVAL * 1000)
+    if max_flows > 0:
+        cfg.max_flows = max_flows
+    if max_flows_limit > 0:
+        cfg.max_flows_limit = max(max_flows_limit, cfg.max_flows)
+    cfg.hugepages = int(hugepages)
+    cfg.cpu = cpu
+    cfg.sock_fd = sock_fd
+    cfg.rx_mode = CAP_RX_MODES.get(rx_mode, 0)
+    if busy_poll_us > 0:
+        cfg.busy_poll_us = busy_poll_us
+    cfg.udp_gro = int(udp_gro)
+    cfg.track_sources = int(track_sources)
+    cfg.ext_counters = int(bool(ext_ring_name))
+    if event_ring_name:
+        cfg.host_bps = host_bps
+        cfg.host_pps = host_pps
+        if host_window_ms > 0:
+            cfg.host_window_ms = host_window_ms
+    ctx = lib.cap_create_ex(ctypes.byref(cfg))
     if not ctx:
-        wlog.error("Worker-%d: cap_create failed", worker_idx)
+        if pcap_path:
+            wlog.error("Worker-%d: cannot replay %s (not a readable pcap / pcapng file)", worker_idx, pcap_path)
+        else:
+            wlog.error("Worker-%d: cap_create failed", worker_idx)
         return
 
-    rcvbuf = lib.cap_get_rcvbuf(ctx)
-    wlog.info("Worker-%d socket SO_RCVBUF=%d", worker_idx, rcvbuf)
-
-    ip_buf = ctypes.create_string_buffer(16)
-    duration_ms = int(CAP_FLUSH_INTERVAL * 1000)
-    cumulative_queue_drops = 0
-
-    try:
+    backend = lib.cap_get_backend(ctx)
+    if backend == CAP_BACKEND_AF_XDP:
+        wlog.info("Worker-%d AF_XDP on %s queue %d", worker_idx, xdp_iface, worker_idx)
+    elif backend == CAP_BACKEND_XDP_COUNT:
+        wlog.info("Worker-%d in-kernel aggregation on %s (%s mode)", worker_idx, xdp_iface,
+                  "native" if lib.cap_get_xdp_mode(ctx) == 1 else "generic")
+    elif backend == CAP_BACKEND_PCAP:
+        wlog.info("Worker-%d replaying %s, shard %d of %d, %s", worker_idx, pcap_path, worker_idx, pcap_shards,
+                  f"{replay_speed:g}x capture pace" if replay_speed > 0 else "as fast as possible")
+    else:
+        if xsk_map_id:
+            wlog.warning("Worker-%d: AF_XDP on %s queue %d unavailable, using UDP socket",
+                         worker_idx, xdp_iface, worker_idx)
+        elif xdp_count:
+            wlog.warning("Worker-%d: in-kernel aggregation on %s unavailable (%s), using UDP socket",
+                         worker_idx, xdp_iface, lib.xdp_get_log().decode(errors="replace").strip())
+        rcvbuf = lib.cap_get_rcvbuf(ctx)
+        wlog.info("Worker-%d socket SO_RCVBUF=%d", worker_idx, rcvbuf)
+        mode = lib.cap_get_rx_mode(ctx)
+        if mode != CAP_RX_MODES.get(rx_mode, 0):
+            wlog.warning("Worker-%d: %s receive unavailable (SO_BUSY_POLL needs CAP_NET_ADMIN), using blocking",
+                         worker_idx, rx_mode)
+        elif mode:
+            wlog.info("Worker-%d receive mode: %s", worker_idx, rx_mode)
+        if udp_gro and not lib.cap_get_udp_gro(ctx):
+            wlog.warning("Worker-%d: UDP_GRO unavailable, receiving single datagrams", worker_idx)
+    wlog.info("Worker-%d flow table: %d flows, grows to %d (%s pages)", worker_idx,
+              lib.cap_get_flow_capacity(ctx), cfg.max_flows_limit,
+              ("4K", "transparent huge", "2M huge")[lib.cap_get_table_pages(ctx)])
+
+    # Sample in C before the flow table; the effective rate is published in the ring header
+    if lib.cap_set_sampling(ctx, sample_rate, pkt_sample_n) != 0:
+        wlog.error("Worker-%d: invalid sampling rate=%.4f 1-in-%d, capturing all",
+                   worker_idx, sample_rate, pkt_sample_n)
+    elif sample_rate < 1.0 or pkt_sample_n > 1:
+        wlog.info("Worker-%d sampling: flow_rate=%.4f pkt=1-in-%d effective=%.6f",
+                  worker_idx, sample_rate, pkt_sample_n, lib.cap_get_sample_rate(ctx))
+
+    if vnis:
+        if lib.cap_set_vni_filter(ctx, (ctypes.c_uint32 * len(vnis))(*vnis), len(vnis)) != 0:
+            wlog.warning("Worker-%d: VNI filter unavailable on this backend, capturing all VNIs", worker_idx)
+        else:
+            wlog.info("Worker-%d VNI filter: %s", worker_idx, ",".join(map(str, vnis)))
+
+    if ext_ring_name and not lib.cap_get_ext_counters(ctx):
+        wlog.warning("Worker-%d: extended flow counters unavailable on this backend", worker_idx)
+    if event_ring_name and not lib.cap_get_host_check(ctx):
+        wlog.warning("Worker-%d: host threshold pre-check unavailable on this backend", worker_idx)
+
+    ring = FlowRing(name=ring_name)
+    ring6 = FlowRing(name=ring6_name, record=_CFlowRecord6) if ring6_name else None
+    ring_ext = FlowRing(name=ext_ring_name, record=_CFlowRecordExt) if ext_ring_name else None
+    ring_ev = FlowRing(name=event_ring_name, record=_CHostEvent) if event_ring_name else None
+    extra_rings = [r for r in (ring6, ring_ext, ring_ev) if r]
+    if (lib.cap_attach_ring(ctx, ring.addr) != 0 or (ring6 and lib.cap_attach_ring6(ctx, ring6.addr) != 0)
+            or (ring_ext and lib.cap_attach_ring_ext(ctx, ring_ext.addr) != 0)
+            or (ring_ev and lib.cap_get_host_check(ctx) and lib.cap_attach_events(ctx, ring_ev.addr) != 0)
+            or lib.cap_start(ctx) != 0):
+        wlog.error("Worker-%d: cap_attach_ring/cap_start failed", worker_idx)
+        lib.cap_destroy(ctx)
+        for r in [ring] + extra_rings:
+            r.close()
+        return
+    stats = WorkerStats(name=stats_name) if stats_name else None
+    if stats and lib.cap_attach_stats(ctx, stats.addr) != 0:
+        wlog.warning("Worker-%d: stats block %s rejected, no metrics from this worker", worker_idx, stats_name)
+    if cpu >= 0:
+        pinned = lib.cap_get_pinned_cpu(ctx)
+        if pinned == cpu:
+            wlog.info("Worker-%d capture thread pinned to CPU %d", worker_idx, cpu)
+        else:
+            wlog.warning("Worker-%d: could not pin capture thread to CPU %d", worker_idx, cpu)
+
+    last_ring_drops = 0
+    batch_stats = (ctypes.c_uint64 * 7)()
+
+    def log_batches(level: int) -> None:
+        # calls, empty, full, packets, current batch, coalescing wait (us), recvmmsg entries
+        lib.cap_get_batch_stats(ctx, batch_stats)
+        calls, empty, full, pkts, batch, wait_us, dgrams = batch_stats
+        busy = calls - empty
+        wlog.log(level, "Worker-%d batches: %d calls, %d empty, %d full, %.1f pkts/batch, "
+                 "%.1f pkts/entry (batch=%d wait=%dus)", worker_idx, calls, empty, full,
+                 pkts / busy if busy else 0.0, pkts / dgrams if dgrams else 0.0, batch, wait_us)
+
+    def flush(standby) -> None:
+        # Drain retired C hash table → shared-memory ring (capture keeps running)
+        count = lib.cap_drain(ctx, standby)
+
+        # Report drop stats periodically (every flush cycle)
+        dropped = lib.cap_get_dropped_flows(ctx)
+        probe_fail = lib.cap_get_probe_failures(ctx)
+        ring_drops = lib.cap_get_ring_drops(ctx)
+        if dropped > 0 or probe_fail > 0:
+            wlog.warning(
+                "Worker-%d DROP STATS: flow_table_full=%d probe_collisions=%d ring_drops=%d (overflow kept in sketch)",
+                worker_idx, dropped, probe_fail, ring_drops,
+            )
+        nonlocal last_ring_drops
+        if ring_drops > last_ring_drops:
+            wlog.warning("Worker-%d ring full, dropped %d flows (total_drops=%d)",
+                         worker_idx, ring_drops - last_ring_drops, ring_drops)
+            last_ring_drops = ring_drops
+
+        wlog.debug("Worker-%d: recv=%d parsed=%d sampled=%d flows=%d ipv6_flows=%d", worker_idx,
+                   lib.cap_get_total_pkts(ctx), lib.cap_get_total_parsed(ctx),
+                   lib.cap_get_total_sampled(ctx), count, lib.cap_get_flushed6(ctx))
+        if wlog.isEnabledFor(logging.DEBUG):
+            log_batches(logging.DEBUG)
+
+    def replay() -> None:
+        # One epoch (CAP_FLUSH_INTERVAL of capture time) per flush, as far as the coordinator allows
+        epoch = 0
         while not stop_event.is_set():
-            # Capture for CAP_FLUSH_INTERVAL seconds (C does recvmmsg + parse + aggregate)
-            total_pkts = lib.cap_run(ctx, duration_ms)
-
-            # Flush C hash table → flow_record array
-            count = lib.cap_flush(ctx)
-
-            # Report drop stats periodically (every flush cycle)
-            dropped = lib.cap_get_dropped_flows(ctx)
-            probe_fail = lib.cap_get_probe_failures(ctx)
-            if dropped > 0 or probe_fail > 0:
-                wlog.warning(
-                    "Worker-%d DROP STATS: flow_table_full=%d probe_collisions=%d queue_drops=%d",
-                    worker_idx, dropped, probe_fail, cumulative_queue_drops,
-                )
-
-            if count == 0:
+            if epoch >= ring.replay_hold():
+                time.sleep(REPLAY_POLL)
                 continue
+            step = lib.cap_replay_step(ctx, epoch + 1, 100)
+            if step <= 0:
+                continue
+            flush(lib.cap_swap(ctx))
+            epoch += 1
+            ring.set_replay_done(epoch)
+            if step == 2:  # end of file
+                return
 
-            parsed = lib.cap_get_total_parsed(ctx)
-            wlog.debug("Worker-%d: recv=%d parsed=%d flows=%d", worker_idx, total_pkts, parsed, count)
-
-            buf = lib.cap_get_flush_buf(ctx)
-            flows: dict = {}
-            for i in range(count):
-                r = buf[i]
-                lib.ip_to_str(r.src_ip, ip_buf, 16)
-                src = ip_buf.value.decode()
-                lib.ip_to_str(r.dst_ip, ip_buf, 16)
-                dst = ip_buf.value.decode()
-                pkts = int(r.packets)
-                byt = int(r.bytes)
-                flows[(src, dst, r.proto, r.src_port, r.dst_port)] = [pkts, byt]
-
-            try:
-                result_queue.put(flows, timeout=0.5)
-            except queue.Full:
-                cumulative_queue_drops += 1
-                wlog.warning("Worker-%d queue full, dropping %d flows (total_drops=%d)",
-                             worker_idx, count, cumulative_queue_drops)
+    replay_start = time.monotonic()
+    try:
+        if pcap_path:
+            replay()
+        else:
+            # Capture for CAP_FLUSH_INTERVAL seconds per window (C thread does recvmmsg + parse + aggregate)
+            while not stop_event.wait(CAP_FLUSH_INTERVAL):
+                flush(lib.cap_swap(ctx))
     finally:
+        lib.cap_stop(ctx)
+        flush(lib.cap_swap(ctx))
+        log_batches(logging.INFO)
+        if pcap_path:
+            # frames, skipped, last / first capture time (ns), malformed, end of file
+            rs = (ctypes.c_uint64 * 6)()
+            lib.cap_get_replay_stats(ctx, rs)
+            elapsed = time.monotonic() - replay_start
+            wlog.info("Worker-%d replayed %d frames (%d non-VXLAN skipped), %.1fs of capture in %.2fs: %.0f pps",
+                      worker_idx, rs[0], rs[1], (rs[2] - rs[3]) / 1e9, elapsed, rs[0] / elapsed if elapsed > 0 else 0.0)
+            if rs[4]:
+                wlog.warning("Worker-%d: %s ends in a truncated or malformed record", worker_idx, pcap_path)
+        if vnis:
+            wlog.info("Worker-%d VNI filter dropped %d packets", worker_idx, lib.cap_get_vni_dropped(ctx))
+        if track_sources:
+            wlog.info("Worker-%d mirror sources seen: %d", worker_idx, lib.cap_get_num_sources(ctx))
+        if ring_ev and lib.cap_get_host_check(ctx):
+            wlog.info("Worker-%d host events: %d raised, %d packet directions uncounted (table full)",
+                      worker_idx, lib.cap_get_host_events(ctx), lib.cap_get_host_uncounted(ctx))
         lib.cap_destroy(ctx)
+        for r in [ring] + extra_rings:
+            r.close()
+        if stats:
+            stats.close()
         wlog.info("Worker-%d exiting", worker_idx)
 
 
@@ -266,193 +1187,734 @@ def _read_udp_drops() -> int:
     return total
 
 
-class Coordinator:
-    def __init__(self, num_workers: int, sample_rate: float):
+def _parse_cpulist(text: str) -> set[int]:
+    """Parse a sysfs CPU list such as "0-3,8,10-11"."""
+    cpus: set[int] = set()
+    for part in text.strip().split(","):
+        if part:
+            lo, _, hi = part.partition("-")
+            cpus.update(range(int(lo), int(hi or lo) + 1))
+    return cpus
+
+
+def _worker_cpus(num_workers: int, iface: str) -> list[int]:
+    """CPU per worker: allowed CPUs on the NIC's NUMA node first, then the rest."""
+    allowed = sorted(os.sched_getaffinity(0))
+    local: set[int] = set()
+    try:
+        with open(f"/sys/class/net/{iface}/device/numa_node") as f:
+            node = int(f.read())
+        if node >= 0:
+            with open(f"/sys/devices/system/node/node{node}/cpulist") as f:
+                local = _parse_cpulist(f.read())
+    except (OSError, ValueError):
+        pass
+    ordered = [c for c in allowed if c in local] + [c for c in allowed if c not in local]
+    return [ordered[i % len(ordered)] for i in range(num_workers)]
+
+
+class MergeReporter:
+    """The REPORT_INTERVAL report over a FlowMerge: Top-N flows, hosts,
+    subnets, ports and services, enrichment, and the detail / host / surge
+    alert checks. Subclasses set _merge, _inv_rate (1 / effective sample rate),
+    _enricher, _alerter and _rates: the probe Coordinator over its workers'
+    rings, the Aggregator (aggregator.py) over every probe's interval deltas."""
+
+    _merge: Optional[FlowMerge]
+    _inv_rate: float
+    _enricher: IPEnricher
+    _alerter: FlowAlerter
+    _rates: RateEngine
+
+    def _clock(self) -> float:
+        """Time the rate windows run on (seconds): monotonic, unless replaying a capture."""
+        return time.monotonic()
+
+    def _report(self, interval: float = REPORT_INTERVAL) -> None:
+        m = self._merge
+        num_flows = m.count(FlowMerge.FLOWS) + m.count(FlowMerge.FLOWS6)
+        if not num_flows:
+            return
+
+        # Scale counters if sampling is active (only the K rows we report)
+        inv = self._inv_rate
+        scale = (lambda n: int(n * inv)) if inv != 1.0 else int
+
+        total_packets, total_bytes = (scale(n) for n in m.totals())
+
+        # Top-10 flows / sources / destinations by bytes: heap selection in C
+        rows = m.top(FlowMerge.FLOWS, 1, 10)
+        top_flows = [
+            {"key": (ip_to_str(src), ip_to_str(dst), proto, sport, dport), "packets": scale(p), "bytes": scale(b)}
+            for src, dst, sport, dport, proto, p, b in rows
+        ]
+        if m.count(FlowMerge.FLOW_EXT):
+            # Extended counters say what kind of traffic a top flow is (SYN flood, bulk, ...)
+            for f, row in zip(top_flows, rows):
+                ext = m.flow_ext(*row[:5])
+                if ext:
+                    ext["syn"], ext["rst"] = scale(ext["syn"]), scale(ext["rst"])
+                    ext["len_hist"] = [scale(n) for n in ext["len_hist"]]
+                    f["ext"] = ext
+        if m.count(FlowMerge.FLOWS6):
+            top_flows += [
+                {"key": (ip6_to_str(src), ip6_to_str(dst), proto, sport, dport), "packets": scale(p), "bytes": scale(b)}
+                for src, dst, sport, dport, proto, p, b in m.top(FlowMerge.FLOWS6, 1, 10)
+            ]
+            top_flows = sorted(top_flows, key=lambda f: f["bytes"], reverse=True)[:10]
+        top_src = [(ip_to_str(ip), [scale(sp), scale(sb)]) for ip, sp, sb, _, _ in m.top(FlowMerge.HOSTS, 1, 10)]
+        top_dst = [(ip_to_str(ip), [scale(dp), scale(db)]) for ip, _, _, dp, db in m.top(FlowMerge.HOSTS, 3, 10)]
+
+        # Top subnets: HOSTS rolled up to /24, /16 and the configured CIDRs in C, O(hosts)
+        top_subnets: dict[str, list[tuple[str, int]]] = {}
+        if m.rollup():
+            for label, table in (("/24", FlowMerge.NET24), ("/16", FlowMerge.NET16)):
+                top_subnets[f"src {label}"] = [(ip_to_str(net) + label, scale(sb))
+                                               for net, _, sb, _, _ in m.top(table, 1, 5)]
+                top_subnets[f"dst {label}"] = [(ip_to_str(net) + label, scale(db))
+                                               for net, _, _, _, db in m.top(table, 3, 5)]
+            if m.count(FlowMerge.CIDRS):
+                top_subnets["src cidr"] = [(f"{ip_to_str(net)}/{plen}", scale(sb))
+                                           for net, plen, _, sb, _, _ in m.top(FlowMerge.CIDRS, 1, 5)]
+                top_subnets["dst cidr"] = [(f"{ip_to_str(net)}/{plen}", scale(db))
+                                           for net, plen, _, _, _, db in m.top(FlowMerge.CIDRS, 3, 5)]
+
+        # Destination ports and protocols from the flat merge arrays; services (dst_ip:port) from rollup()
+        top_ports = [{"proto": proto, "port": port, "packets": scale(p), "bytes": scale(b)}
+                     for port, proto, p, b in m.top_ports(10)]
+        top_services = [{"ip": ip_to_str(ip), "proto": proto, "port": port, "packets": scale(p), "bytes": scale(b)}
+                        for ip, port, proto, p, b in m.top(FlowMerge.SERVICES, 1, 10)]
+        protocols = {proto: scale(b) for proto, (_, b) in m.protocols().items()}
+
+        # Host-alert candidates: only IPs over a per-host limit in either direction
+        max_pkts, max_bytes = self._alerter.host_limits(interval)
+        hot_src: dict[str, list[int]] = {}
+        hot_dst: dict[str, list[int]] = {}
+        if max_pkts is not None or max_bytes is not None:
+            no_limit = FlowMerge.NO_LIMIT
+            rows = m.hosts_over(
+                int(max_pkts / inv) if max_pkts is not None else no_limit,
+                int(max_bytes / inv) if max_bytes is not None else no_limit,
+            )
+            for ip, sp, sb, dp, db in rows:
+                ip_s = ip_to_str(ip)
+                if sp:
+                    hot_src[ip_s] = [scale(sp), scale(sb)]
+                if dp:
+                    hot_dst[ip_s] = [scale(dp), scale(db)]
+
+        # Enrich IPs (top-10 + any host-alert candidates)
+        all_ips = list({ip for ip, _ in top_src} | {ip for ip, _ in top_dst} | hot_src.keys() | hot_dst.keys()
+                       | {sv["ip"] for sv in top_services})
+        enriched = {e["ip"]: e for e in self._enricher.enrich_many(all_ips)}
+        for sv in top_services:
+            sv["info"] = enriched.get(sv["ip"], {})
+
+        top_sources = [{"ip": ip, "bytes": v[1], "info": enriched.get(ip, {})} for ip, v in top_src]
+        top_dests = [{"ip": ip, "bytes": v[1], "info": enriched.get(ip, {})} for ip, v in top_dst]
+
+        logger.info(
+            "Report: %d flows, %d packets, %d bytes | top_src=%s top_dst=%s",
+            num_flows,
+            total_packets,
+            total_bytes,
+            [(ip, v[1]) for ip, v in top_src[:3]],
+            [(ip, v[1]) for ip, v in top_dst[:3]],
+        )
+        if top_subnets:
+            logger.info("Top subnets: %s", {k: rows[:3] for k, rows in top_subnets.items() if rows})
+        if top_ports:
+            logger.info("Top ports: %s services: %s", [(proto_name(p["proto"]), p["port"], p["bytes"]) for p in top_ports[:5]],
+                        [(sv["ip"], proto_name(sv["proto"]), sv["port"], sv["bytes"]) for sv in top_services[:3]])
+        if m.count(FlowMerge.SOURCES):
+            logger.info("Mirror sources: %s",
+                        [(ip_to_str(ip), scale(b)) for ip, _, b in m.top(FlowMerge.SOURCES, 1, 5)])
+
+        self._alerter.check_detail(
+            total_bytes=total_bytes,
+            total_packets=total_packets,
+            interval_sec=interval,
+            top_sources=top_sources,
+            top_dests=top_dests,
+            top_flows=top_flows,
+            top_subnets=top_subnets,
+            top_ports=top_ports,
+            top_services=top_services,
+            protocols=protocols,
+        )
+
+        self._alerter.check_host(
+            src_agg=hot_src,
+            dst_agg=hot_dst,
+            interval_sec=interval,
+            enriched=enriched,
+        )
+
+        # Host rates against their own baselines (top talkers and host-alert candidates)
+        factor, min_bps = self._alerter.surge_limits()
+        if factor:
+            self._rates.update_hosts(self._clock(), {**dict(top_src), **hot_src}, {**dict(top_dst), **hot_dst})
+            self._alerter.check_surge(self._rates.host_surges(factor, min_bps), enriched)
+
+        self._after_report()
+
+    def _after_report(self) -> None:
+        """Runs after every report's alert checks."""
+
+
+class Coordinator(MergeReporter):
+    def __init__(self, num_workers: int, sample_rate: float, pkt_sample_n: int = 1,
+                 backend: str = "socket", xdp_iface: str = "",
+                 max_flows: int = 0, max_flows_limit: int = 0, hugepages: bool = False,
+                 pin_cpus: bool = False, steering: str = "none",
+                 rx_mode: str = "blocking", busy_poll_us: int = 0, udp_gro: bool = False,
+                 vnis: tuple = (), track_sources: bool = False, ext_counters: bool = False,
+                 host_window_ms: int = 0, prefix_cidrs: tuple = (),
+                 metrics_addr: str = "127.0.0.1", metrics_port: int = 0,
+                 aggregator: Optional[tuple[str, int]] = None, probe_id: str = "",
+                 export_ipfix: Optional[tuple[str, int]] = None, export_dir: str = "",
+                 export_rotate_sec: int = ROTATE_SEC, export_s3_bucket: str = "", export_s3_prefix: str = "flows/",
+                 pcap_path: str = "", replay_speed: float = 0.0, state_dir: str = ""):
         self._num_workers = num_workers
-        self._sample_rate = sample_rate
-        self._inv_rate = 1.0 / sample_rate if sample_rate > 0 else 1.0
-        self._queues: list[multiprocessing.Queue] = []
+        # RX-CPU steering only pays off with each socket's thread on that CPU
+        self._pin_cpus = pin_cpus or steering == "cpu"
+        self._steering = steering
+        self._table_args = (max_flows, max_flows_limit, hugepages)
+        self._rx_args = (rx_mode, busy_poll_us, udp_gro)
+        self._mirror_args = (tuple(vnis), track_sources)
+        self._ext_counters = ext_counters
+        self._host_window_ms = host_window_ms
+        self._backend = backend
+        self._xdp_iface = xdp_iface
+        self._xdp = None  # xdp_attach() handle while the AF_XDP steering program is loaded
+        # backend "pcap": workers replay this file, sharded by inner flow, in lock-step on capture time
+        self._replay = (pcap_path, replay_speed, num_workers) if backend == "pcap" else ("", 0.0, 1)
+        self._replay_rings: list[FlowRing] = []  # each worker's IPv4 ring, carrying replay_hold / replay_done
+        # Warm restart: stop() leaves the open window here and the next start resumes it (not when replaying)
+        self._state_dir = state_dir if backend != "pcap" else ""
+        self._resumable = False  # set once the main loop has taken over (or found nothing in) state_dir
+        if backend == "xdp_count" and (sample_rate < 1.0 or pkt_sample_n > 1):
+            # The kernel counts every packet; socket workers must not scale differently
+            logger.warning("PROBE_BACKEND=xdp_count counts every packet, ignoring sampling")
+            sample_rate, pkt_sample_n = 1.0, 1
+        self._flow_sample_rate = sample_rate
+        self._pkt_sample_n = max(1, pkt_sample_n)
+        # Expected effective rate; replaced by what workers report in their ring headers
+        self._sample_rate = sample_rate / self._pkt_sample_n
+        self._inv_rate = 1.0 / self._sample_rate if self._sample_rate > 0 else 1.0
+        self._rings: list[FlowRing] = []
+        self._event_rings: list[FlowRing] = []  # host_event, polled every HOST_EVENT_POLL
+        self._stats: list[WorkerStats] = []  # one per worker, in worker order
+        self._metrics_listen = (metrics_addr, metrics_port)
+        self._metrics: Optional[MetricsServer] = None
         self._workers: list[multiprocessing.Process] = []
         self._stop_event = multiprocessing.Event()
-        self._enricher = IPEnricher()
-        self._alerter = FlowAlerter()
+        self._stopped = False
+        self._enricher = IPEnricher(os.path.join(self._state_dir, "enricher.json") if self._state_dir else "")
+        # Behind an aggregator local alerts still fire, labelled with the probe they cover
+        self._probe_id = probe_id or socket.gethostname()
+        self._alerter = FlowAlerter(scope=self._probe_id if aggregator else "")
+        self._uplink = DeltaUplink(*aggregator) if aggregator else None
+        self._delta_seq = 0
+        # Flow records out of the merge as they are consumed: IPFIX and/or rotated columnar files
+        self._export_ipfix = export_ipfix
+        self._export_files = ExportFiles(export_dir, self._probe_id, export_rotate_sec,
+                                         export_s3_bucket, export_s3_prefix) if export_dir else None
+        self._export_last: dict[str, int] = {}
+        self._merge: Optional[FlowMerge] = FlowMerge() if _flow_merge_lib else None
+        # Subnets reported next to /24 and /16 roll-ups: (raw u32 network, prefix length)
+        if self._merge and prefix_cidrs and not self._merge.set_prefixes(list(prefix_cidrs)):
+            logger.error("Invalid subnet CIDRs %s, reporting /24 and /16 only", prefix_cidrs)
+        self._window_start = time.monotonic()
+        self._window_wall = time.time()  # interval start for the aggregator delta
+        # Sliding link / host rates fed with merge deltas; independent of the report window
+        self._rates = RateEngine(host_bucket_sec=REPORT_INTERVAL)
+        self._merged_totals = (0, 0)
         self._last_udp_drops = 0
+        self._drops_source = ""  # "meminfo" or "proc": _last_udp_drops is only compared within one
 
     def start(self) -> None:
         logger.info(
-            "Coordinator starting: %d workers, sample_rate=%.4f",
+            "Coordinator starting: %d workers, sample_rate=%.4f pkt_sample=1-in-%d",
             self._num_workers,
-            self._sample_rate,
+            self._flow_sample_rate,
+            self._pkt_sample_n,
         )
         self._enricher.start()
 
         if not _fast_recv_lib:
-            logger.error("fast_recv.so not found — compile with: gcc -O2 -shared -fPIC -o fast_recv.so fast_recv.c")
+            logger.error("fast_recv.so not found — compile with: gcc -O2 -shared -fPIC -o fast_recv.so fast_recv.c -lpthread")
+            sys.exit(1)
+        if not self._merge:
+            logger.error("flow_merge.so not found — compile with: gcc -O2 -shared -fPIC -o flow_merge.so flow_merge.c")
             sys.exit(1)
         worker_fn = _worker_c
+        xsk_map_id = self._attach_xdp() if self._backend == "af_xdp" else 0
+        # xdp_count: worker-0 owns the kernel program and maps; the others stay on
+        # UDP sockets, idle while it runs and the full capture path if it falls back
+        xdp_count = self._backend == "xdp_count"
+        cpus = _worker_cpus(self._num_workers, self._xdp_iface) if self._pin_cpus else [-1] * self._num_workers
+        sock_fds = self._open_steered_sockets(cpus)
+        # Per-host thresholds are also checked in C over short windows, for sub-second host alerts
+        max_pkts, max_bytes = self._alerter.host_limits(1.0)
+        host_args = (int(max_bytes * 8) if max_bytes else 0, int(max_pkts) if max_pkts else 0, self._host_window_ms)
 
         for i in range(self._num_workers):
-            q: multiprocessing.Queue = multiprocessing.Queue()
-            self._queues.append(q)
+            ring, ring6 = FlowRing(), FlowRing(records=RING6_RECORDS, record=_CFlowRecord6)
+            self._rings.extend((ring, ring6))
+            if self._replay[0]:
+                self._replay_rings.append(ring)
+            ext_name = ""
+            if self._ext_counters:
+                ring_ext = FlowRing(records=RING_EXT_RECORDS, record=_CFlowRecordExt)
+                self._rings.append(ring_ext)
+                ext_name = ring_ext.name
+            event_name = ""
+            if host_args[0] or host_args[1]:
+                ring_ev = FlowRing(records=HOST_EVENT_RECORDS, record=_CHostEvent)
+                self._event_rings.append(ring_ev)
+                event_name = ring_ev.name
+            stats = WorkerStats()
+            self._stats.append(stats)
             p = multiprocessing.Process(
                 target=worker_fn,
-                args=(i, q, self._stop_event, self._sample_rate),
+                args=(i, ring.name, self._stop_event, self._flow_sample_rate, self._pkt_sample_n,
+                      self._xdp_iface, xsk_map_id, xdp_count and i == 0, *self._table_args,
+                      cpus[i], sock_fds[i], *self._rx_args, *self._mirror_args, ring6.name, ext_name,
+                      event_name, *host_args, stats.name, *self._replay),
                 daemon=True,
             )
             p.start()
+            if sock_fds[i] >= 0:
+                os.close(sock_fds[i])  # the worker holds its own copy
             self._workers.append(p)
-            logger.info("Launched worker-%d (pid=%d)", i, p.pid)
+            logger.info("Launched worker-%d (pid=%d)%s", i, p.pid, f" on CPU {cpus[i]}" if cpus[i] >= 0 else "")
+
+        if self._uplink:
+            self._uplink.start()
+            logger.info("Sending interval deltas to aggregator %s:%d as %r", *self._uplink.addr, self._probe_id)
+        self._start_export()
+
+        if self._metrics_listen[1]:
+            try:
+                self._metrics = MetricsServer(*self._metrics_listen, self.metrics_text)
+                self._metrics.start()
+                logger.info("Metrics on http://%s:%d/metrics", self._metrics_listen[0], self._metrics.port)
+            except OSError as e:
+                logger.error("Metrics endpoint %s:%d unavailable: %s", *self._metrics_listen, e)
 
-        # Main loop: merge + report every REPORT_INTERVAL
+        # Main loop: merge + report every REPORT_INTERVAL (of capture time when replaying)
         try:
-            self._run_loop()
+            if self._replay[0]:
+                self._run_replay()
+            else:
+                self._run_loop()
         except KeyboardInterrupt:
             pass
         finally:
             self.stop()
 
+    def request_stop(self) -> None:
+        """Signal-safe: workers and the main loop wind down, then start() runs stop()."""
+        self._stop_event.set()
+
     def stop(self) -> None:
-        if self._stop_event.is_set():
+        if self._stopped:
             return
+        self._stopped = True
         logger.info("Coordinator stopping...")
         self._stop_event.set()
 
-        # Drain queues first to unblock workers stuck on queue.put()
-        time.sleep(0.5)
-        merged = self._drain_queues()
-
         for p in self._workers:
             p.join(timeout=3)
             if p.is_alive():
                 logger.warning("Worker pid=%d did not exit, terminating", p.pid)
                 p.terminate()
 
-        # Final drain after workers exit
-        final = self._drain_queues()
-        for key, counters in final.items():
-            entry = merged.setdefault(key, [0, 0])
-            entry[0] += counters[0]
-            entry[1] += counters[1]
-
-        if merged:
-            self._report(merged)
+        # Final drain after workers exit (they flush their last window on the way out);
+        # the partial window is reported now, or left in state_dir for the next start
+        if self._merge:
+            self._consume_rings()
+            now = self._clock()
+            if not self._save_state(now):
+                self._report(now - self._window_start)
+                self._send_delta(now - self._window_start)
+            if self._export_files:
+                self._export_files.close(self._merge)  # uploads the last file
+            self._merge.close()
+        if self._uplink:
+            self._uplink.stop()
+
+        if self._metrics:
+            self._metrics.stop()
+            self._metrics = None
+        for ring in self._rings + self._event_rings + self._stats:
+            ring.close()
+        self._rings = []
+        self._replay_rings = []
+        self._event_rings = []
+        self._stats = []
+
+        if self._xdp:
+            _fast_recv_lib.xdp_detach(self._xdp)
+            self._xdp = None
 
         self._enricher.stop()
         logger.info("Coordinator stopped")
 
+    def _open_steered_sockets(self, cpus: list[int]) -> list[int]:
+        """Open the workers' reuseport sockets in worker order and attach the
+        steering program. Returns one fd per worker, or all -1 (workers open
+        their own, kernel-hashed sockets) when steering is off or fails."""
+        none = [-1] * self._num_workers
+        if self._steering == "none":
+            return none
+        if self._backend != "socket":
+            logger.warning("PROBE_STEERING=%s applies to the socket backend only, ignoring", self._steering)
+            return none
+        lib = _fast_recv_lib
+        fds = []
+        for _ in range(self._num_workers):
+            fd = lib.cap_open_socket(BIND_PORT, RCVBUF_SIZE)
+            if fd < 0:
+                break
+            fds.append(fd)
+        mode = CAP_STEER_CPU if self._steering == "cpu" else CAP_STEER_FLOW
+        if len(fds) == self._num_workers and lib.cap_attach_steering(
+                fds[0], mode, (ctypes.c_int * len(cpus))(*cpus), len(fds)) == 0:
+            logger.info("SO_REUSEPORT steering by %s across %d sockets", self._steering, len(fds))
+            return fds
+        logger.warning("SO_REUSEPORT steering unavailable (%d/%d sockets opened), using kernel hash",
+                       len(fds), self._num_workers)
+        for fd in fds:
+            os.close(fd)
+        return none
+
+    def _attach_xdp(self) -> int:
+        """Load the AF_XDP steering program on xdp_iface. Returns the XSKMAP id
+        for workers, or 0 to keep every worker on the UDP socket path."""
+        self._xdp = _fast_recv_lib.xdp_attach(self._xdp_iface.encode(), BIND_PORT, self._num_workers)
+        if not self._xdp:
+            logger.warning("AF_XDP unavailable on %s (%s), using UDP sockets",
+                           self._xdp_iface, _fast_recv_lib.xdp_get_log().decode(errors="replace").strip())
+            return 0
+        mode = "native" if _fast_recv_lib.xdp_get_mode(self._xdp) == 1 else "generic"
+        logger.info("AF_XDP steering attached to %s (%s mode)", self._xdp_iface, mode)
+        return _fast_recv_lib.xdp_get_map_id(self._xdp)
+
     def _run_loop(self) -> None:
-        accumulated: dict[FlowKey, list[int]] = defaultdict(lambda: [0, 0])
-        last_report = time.monotonic()
+        now = time.monotonic()
+        self._window_start = now - self._restore_state()
+        self._rates.update_link(now, 0, 0)   # link window starts (or resumes) with the loop
+        poll = HOST_EVENT_POLL if self._event_rings else COORDINATOR_POLL
+        next_consume = now + COORDINATOR_POLL
 
         while not self._stop_event.is_set():
-            time.sleep(COORDINATOR_POLL)
-
-            # Drain worker queues into accumulator
-            fresh = self._drain_queues()
-            if fresh:
-                for key, counters in fresh.items():
-                    entry = accumulated[key]
-                    entry[0] += counters[0]
-                    entry[1] += counters[1]
-
-                # Quick alert check on every poll (low-latency detection)
-                now = time.monotonic()
-                accum_interval = now - last_report
-                if accum_interval > 0:
-                    total_bytes = sum(v[1] for v in accumulated.values())
-                    total_packets = sum(v[0] for v in accumulated.values())
-                    self._alerter.check_fast(
-                        total_bytes=total_bytes,
-                        total_packets=total_packets,
-                        interval_sec=accum_interval,
-                    )
+            time.sleep(poll)
+
+            # Host events from the capture threads: no flush or merge in between
+            if self._event_rings:
+                self._check_host_events()
+            if time.monotonic() < next_consume:
+                continue
+            next_consume = time.monotonic() + COORDINATOR_POLL
+
+            # Merge worker rings natively; totals are kept incrementally
+            merged = self._consume_rings()
+            if self._export_files:
+                self._export_files.tick(self._merge)
+            self._check_rates(time.monotonic(), merged)
 
             # Full report with Top-N every REPORT_INTERVAL
             now = time.monotonic()
-            if now - last_report >= REPORT_INTERVAL:
-                if accumulated:
-                    self._report(dict(accumulated), now - last_report)
-                accumulated = defaultdict(lambda: [0, 0])
-                last_report = now
-
-    def _drain_queues(self) -> dict[FlowKey, list[int]]:
-        merged: dict[FlowKey, list[int]] = defaultdict(lambda: [0, 0])
-        for q in self._queues:
-            while True:
-                try:
-                    snapshot = q.get_nowait()
-                except queue.Empty:
-                    break
-                for key, counters in snapshot.items():
-                    entry = merged[key]
-                    entry[0] += counters[0]
-                    entry[1] += counters[1]
-        return dict(merged)
-
-    def _report(self, flows: dict[FlowKey, list[int]], interval: float = REPORT_INTERVAL) -> None:
-        if not flows:
-            return
+            if now - self._window_start >= REPORT_INTERVAL:
+                self._close_window(now)
+
+    def _save_state(self, now: float) -> bool:
+        """Warm restart: write the open report window (FlowMerge.save()), the
+        rate windows and the alert cooldowns to state_dir for the next start.
+        Returns False, for stop() to report the partial window itself, without
+        a state_dir, before the main loop ran or if writing fails."""
+        if not self._resumable:
+            return False
+        path = os.path.join(self._state_dir, "coordinator.json")
+        window = os.path.join(self._state_dir, "window.snap")
+        state = {
+            "version": STATE_VERSION, "probe": self._probe_id, "saved": time.time(),
+            "sampling": [self._flow_sample_rate, self._pkt_sample_n], "sample_rate": self._sample_rate,
+            "window": {"elapsed": now - self._window_start, "wall": self._window_wall, "seq": self._delta_seq},
+            "rates": self._rates.state(now),
+            "alerts": self._alerter.state(),
+        }
+        try:
+            os.makedirs(self._state_dir, exist_ok=True)
+            if not self._merge.save(window + ".tmp"):
+                raise OSError(f"cannot write {window}.tmp")
+            os.replace(window + ".tmp", window)
+            with open(path + ".tmp", "w") as f:
+                json.dump(state, f, separators=(",", ":"))
+            os.replace(path + ".tmp", path)  # last: its presence says window.snap is complete
+        except OSError as e:
+            logger.error("Cannot save probe state to %s (%s), reporting the partial window", self._state_dir, e)
+            for name in (path, window):
+                with contextlib.suppress(OSError):
+                    os.remove(name)
+            return False
+        logger.info("Saved %.1fs of the report window (%d flows) to %s for the next start",
+                    now - self._window_start, self._merge.count(FlowMerge.FLOWS) + self._merge.count(FlowMerge.FLOWS6),
+                    self._state_dir)
+        return True
+
+    def _restore_state(self) -> float:
+        """Warm restart: take over what the last stop() saved in state_dir, if
+        no more than STATE_MAX_AGE ago and for this probe. The window merged
+        so far is added to the merge (dropped if the sampling changed), rate
+        windows and baselines continue where they stopped, and cooldowns keep
+        running. The files are removed, so a state is resumed at most once.
+        Returns how far into the report window the previous process was."""
+        self._resumable = bool(self._state_dir)
+        if not self._state_dir:
+            return 0.0
+        path = os.path.join(self._state_dir, "coordinator.json")
+        window = os.path.join(self._state_dir, "window.snap")
+        try:
+            with open(path) as f:
+                state = json.load(f)
+        except FileNotFoundError:
+            return 0.0
+        except (OSError, ValueError) as e:
+            logger.warning("Ignoring unreadable probe state %s: %s", path, e)
+            state = {}
+        try:
+            age = time.time() - state.get("saved", 0)
+            if state.get("version") != STATE_VERSION or state.get("probe") != self._probe_id \
+                    or not 0 <= age <= STATE_MAX_AGE:
+                if state:
+                    logger.info("Not resuming probe state in %s (%.0fs old, probe %r)",
+                                self._state_dir, age, state.get("probe"))
+                return 0.0
+            now = time.monotonic()
+            self._alerter.restore(state["alerts"])
+            windows = self._rates.restore(state["rates"], now)
+            elapsed, rows = 0.0, -1
+            if state["sampling"] != [self._flow_sample_rate, self._pkt_sample_n]:
+                logger.warning("Sampling changed since the last stop, not resuming its report window")
+            else:
+                rows = self._merge.load(window)
+                if rows < 0:
+                    logger.warning("Ignoring unreadable report window %s", window)
+            if rows >= 0:
+                elapsed = min(max(0.0, float(state["window"]["elapsed"])), REPORT_INTERVAL)
+                self._window_wall = float(state["window"]["wall"])
+                self._delta_seq = int(state["window"]["seq"])
+                self._merged_totals = self._merge.totals()
+                self._update_sample_rate(float(state["sample_rate"]))
+            logger.info("Resumed probe state from %.1fs ago: %.1fs into the report window (%d rows), "
+                        "%d rate windows", age, elapsed, max(rows, 0), windows)
+            return elapsed
+        except (KeyError, TypeError, ValueError) as e:
+            logger.warning("Ignoring incomplete probe state %s: %s", path, e)
+            return 0.0
+        finally:
+            for name in (path, window):
+                with contextlib.suppress(OSError):
+                    os.remove(name)
+
+    def _run_replay(self) -> None:
+        """Main loop for a capture file replay. Workers stop at every
+        CAP_FLUSH_INTERVAL of capture time (an epoch) and go no further than
+        the end of the report window until it has been reported, so windows,
+        rates and host counting windows run on the capture's timeline
+        whatever the replay speed. Returns when every worker has reached the
+        end of the file (or exited)."""
+        epochs = max(1, round(REPORT_INTERVAL / CAP_FLUSH_INTERVAL))
+        started = time.monotonic()
+        self._window_start = last = 0.0
+        self._rates.update_link(0.0, 0, 0)
+        hold = epochs
+        for ring in self._replay_rings:
+            ring.set_replay_hold(hold)
 
-        # Scale counters if sampling is active
+        while not self._stop_event.is_set():
+            running = any(p.is_alive() for p in self._workers)
+            # Read before consuming: every worker has flushed up to now into its rings
+            now = self._clock()
+            merged = self._consume_rings()
+            if self._event_rings:
+                self._check_host_events()
+            if self._export_files:
+                self._export_files.tick(self._merge)
+            if now > last or merged:
+                self._check_rates(now, merged)
+                last = now
+            if now - self._window_start >= REPORT_INTERVAL:
+                self._close_window(now)
+                hold += epochs
+                for ring in self._replay_rings:
+                    ring.set_replay_hold(hold)
+            if not running:
+                break
+            time.sleep(REPLAY_POLL)
+        logger.info("Replay finished: %.0fs of capture in %.1fs", self._clock(), time.monotonic() - started)
+
+    def _clock(self) -> float:
+        """Replay: capture seconds every running worker has flushed (CAP_FLUSH_INTERVAL
+        per epoch); the furthest any got once all have exited."""
+        if not self._replay_rings:
+            return time.monotonic()
+        done = [ring.replay_done() for ring, p in zip(self._replay_rings, self._workers) if p.is_alive()]
+        if not done:
+            done = [max(ring.replay_done() for ring in self._replay_rings)]
+        return min(done) * CAP_FLUSH_INTERVAL
+
+    def _check_rates(self, now: float, merged: int) -> None:
+        self._update_link_rate(now)
+        if merged:
+            # Quick alert check on every poll over the sliding link window,
+            # so a burst is not split by the REPORT_INTERVAL reset
+            packets, nbytes, span = self._rates.link.window(now)
+            if span > 0:
+                self._alerter.check_fast(total_bytes=nbytes, total_packets=packets, interval_sec=span)
+        factor, min_bps = self._alerter.surge_limits()
+        if factor:
+            change = self._rates.link_change(now, factor, min_bps)
+            if change:
+                self._alerter.check_surge([change], {})
+
+    def _close_window(self, now: float) -> None:
+        self._report(now - self._window_start)
+        self._send_delta(now - self._window_start)
+        self._merge.reset()
+        self._merged_totals = (0, 0)
+        self._window_start = now
+        self._window_wall = time.time()
+
+    def _consume_rings(self) -> int:
+        """Merge everything readable from the worker rings. Returns records merged."""
+        merged = 0
+        for ring in self._rings:
+            merged += self._merge.consume(ring)
+            self._update_sample_rate(ring.sample_rate())
+        if merged and self._export_ipfix:
+            self._merge.export_flush()
+        return merged
+
+    def _start_export(self) -> None:
+        if not (self._export_ipfix or self._export_files):
+            return
+        self._merge.export_interval(CAP_FLUSH_INTERVAL)
+        if self._export_ipfix:
+            # Observation domain: stable per probe, so a collector can tell probes apart
+            domain = zlib.crc32(self._probe_id.encode())
+            if self._merge.export_ipfix(*self._export_ipfix, domain):
+                logger.info("Exporting flows as IPFIX to %s:%d (domain %d)", *self._export_ipfix, domain)
+            else:
+                logger.error("Cannot export IPFIX to %s:%d, disabled", *self._export_ipfix)
+                self._export_ipfix = None
+        if self._export_files:
+            self._export_files.tick(self._merge)
+
+    def _log_export(self) -> None:
+        stats = self._merge.export_stats()
+        last, self._export_last = self._export_last, stats
+        delta = {k: v - last.get(k, 0) for k, v in stats.items()}
+        logger.info("Export: %d records, %d IPFIX messages, %d file rows",
+                    delta["records"], delta["ipfix_messages"], delta["file_rows"])
+        if delta["ipfix_errors"] or delta["file_errors"]:
+            logger.warning("Export errors: %d IPFIX sends failed, %d records not written to file",
+                           delta["ipfix_errors"], delta["file_errors"])
+
+    def _update_link_rate(self, now: float) -> None:
+        """Feed the merge totals added since the last call to the link window, scaled."""
+        packets, nbytes = self._merge.totals()
+        last_packets, last_bytes = self._merged_totals
+        self._merged_totals = (packets, nbytes)
+        self._rates.update_link(now, int((packets - last_packets) * self._inv_rate),
+                                int((nbytes - last_bytes) * self._inv_rate))
+
+    def interval_delta(self, interval: float) -> IntervalDelta:
+        """What the aggregator gets from this interval's merge, scaled: totals,
+        the top AGG_TOP_FLOWS flows and AGG_TOP_HOSTS hosts each way, and the
+        host sketch. Sent even when empty, so the aggregator sees the probe live."""
+        m = self._merge
         inv = self._inv_rate
-        if inv != 1.0:
-            for counters in flows.values():
-                counters[0] = int(counters[0] * inv)
-                counters[1] = int(counters[1] * inv)
-
-        total_bytes = sum(v[1] for v in flows.values())
-        total_packets = sum(v[0] for v in flows.values())
-
-        # Top-10 flows by bytes
-        sorted_flows = sorted(flows.items(), key=lambda x: x[1][1], reverse=True)
-        top_flows = [{"key": k, "packets": v[0], "bytes": v[1]} for k, v in sorted_flows[:10]]
-
-        # Aggregate by src_ip, dst_ip — [packets, bytes]
-        src_agg: dict[str, list[int]] = defaultdict(lambda: [0, 0])
-        dst_agg: dict[str, list[int]] = defaultdict(lambda: [0, 0])
-        for (src_ip, dst_ip, _, _, _), counters in flows.items():
-            s = src_agg[src_ip]
-            s[0] += counters[0]; s[1] += counters[1]
-            d = dst_agg[dst_ip]
-            d[0] += counters[0]; d[1] += counters[1]
-
-        top_src = sorted(src_agg.items(), key=lambda x: x[1][1], reverse=True)[:10]
-        top_dst = sorted(dst_agg.items(), key=lambda x: x[1][1], reverse=True)[:10]
-
-        # Enrich IPs (top-10 + any host-alert candidates)
-        all_ips = list({ip for ip, _ in top_src} | {ip for ip, _ in top_dst})
-        enriched = {e["ip"]: e for e in self._enricher.enrich_many(all_ips)}
-
-        top_sources = [{"ip": ip, "bytes": v[1], "info": enriched.get(ip, {})} for ip, v in top_src]
-        top_dests = [{"ip": ip, "bytes": v[1], "info": enriched.get(ip, {})} for ip, v in top_dst]
-
-        logger.info(
-            "Report: %d flows, %d packets, %d bytes | top_src=%s top_dst=%s",
-            len(flows),
-            total_packets,
-            total_bytes,
-            [(ip, v[1]) for ip, v in top_src[:3]],
-            [(ip, v[1]) for ip, v in top_dst[:3]],
-        )
-
-        self._alerter.check_detail(
-            total_bytes=total_bytes,
-            total_packets=total_packets,
-            interval_sec=interval,
-            top_sources=top_sources,
-            top_dests=top_dests,
-            top_flows=top_flows,
-        )
-
-        self._alerter.check_host(
-            src_agg=dict(src_agg),
-            dst_agg=dict(dst_agg),
-            interval_sec=interval,
-            enriched=enriched,
-        )
-
+        scale = (lambda n: int(n * inv)) if inv != 1.0 else int
+        packets, nbytes = m.totals()
+        d = IntervalDelta(self._probe_id, self._delta_seq, int(self._window_wall * 1000), int(interval * 1000),
+                          scale(packets), scale(nbytes))
+        if m.count(FlowMerge.HOSTS):
+            d.flows = [(src, dst, sport, dport, proto, scale(p), scale(b))
+                       for src, dst, sport, dport, proto, p, b in m.top(FlowMerge.FLOWS, 1, AGG_TOP_FLOWS)]
+            d.src_hosts = [(ip, scale(sp), scale(sb)) for ip, sp, sb, _, _ in m.top(FlowMerge.HOSTS, 1, AGG_TOP_HOSTS) if sp]
+            d.dst_hosts = [(ip, scale(dp), scale(db)) for ip, _, _, dp, db in m.top(FlowMerge.HOSTS, 3, AGG_TOP_HOSTS) if dp]
+            d.depth, d.width = SKETCH_DEPTH, SKETCH_WIDTH
+            d.sketch = [scale(n) for n in m.host_sketch(SKETCH_DEPTH, SKETCH_WIDTH)]
+        return d
+
+    def _send_delta(self, interval: float) -> None:
+        if not self._uplink:
+            return
+        self._uplink.send(encode_delta(self.interval_delta(interval)))
+        self._delta_seq += 1
+
+    def _check_host_events(self) -> int:
+        """Run check_host on the hosts the workers flagged since the last poll.
+        Event counts are the worker's window so far, already scaled for packet
+        sampling; per-IP cooldown keeps the REPORT_INTERVAL check from repeating
+        the alert. Returns events read."""
+        src: dict[int, list[int]] = {}
+        dst: dict[int, list[int]] = {}
+        window_ms = 0
+        n = 0
+        for ring in self._event_rings:
+            for ev in ring.pop():
+                n += 1
+                agg = src if ev.dir == HOST_EV_SRC else dst
+                prev = agg.get(ev.ip)
+                if prev is None or ev.bytes > prev[1]:
+                    agg[ev.ip] = [ev.packets, ev.bytes]
+                window_ms = max(window_ms, ev.window_ms)
+        if n:
+            # Looked up by raw u32; only the few flagged hosts become strings
+            raw = list(src.keys() | dst.keys())
+            enriched = {}
+            for ip, info in zip(raw, self._enricher.enrich_raw(raw)):
+                ip_s = ip_to_str(ip)
+                enriched[ip_s] = {"ip": ip_s, **info}
+            self._alerter.check_host(src_agg={ip_to_str(ip): v for ip, v in src.items()},
+                                     dst_agg={ip_to_str(ip): v for ip, v in dst.items()},
+                                     interval_sec=window_ms / 1000, enriched=enriched)
+        return n
+
+    def worker_stats(self) -> list[Optional[dict]]:
+        """Each worker's latest published counters (WorkerStats.read())."""
+        return [s.read() for s in self._stats]
+
+    def metrics_text(self) -> str:
+        return render_metrics(self.worker_stats())
+
+    def _after_report(self) -> None:
         # Monitor kernel-level UDP socket drops
-        current_drops = _read_udp_drops()
+        self._check_sockets()
+        if self._export_ipfix or self._export_files:
+            self._log_export()
+
+    def _check_sockets(self) -> None:
+        """Kernel UDP drops, from the workers' SO_MEMINFO when every one has a
+        socket (one getsockopt per drain), else from all of /proc/net/udp; and
+        a warning when a receive queue fills up, ahead of those drops."""
+        stats = self.worker_stats()
+        if stats and all(s and s["sock_rcvbuf"] for s in stats):
+            source, current_drops = "meminfo", sum(s["sock_drops"] for s in stats)
+        else:
+            source, current_drops = "proc", _read_udp_drops()
+        if self._drops_source and source != self._drops_source:
+            self._last_udp_drops = current_drops
+        self._drops_source = source
+        for i, s in enumerate(stats):
+            if s and s["sock_rcvbuf"] and s["sock_rmem"] >= s["sock_rcvbuf"] * SOCK_QUEUE_WARN:
+                logger.warning("Worker-%d socket queue %.0f%% full (%d of %d bytes)", i,
+                               100.0 * s["sock_rmem"] / s["sock_rcvbuf"], s["sock_rmem"], s["sock_rcvbuf"])
         delta = current_drops - self._last_udp_drops
         if delta > 0:
             logger.warning(
@@ -461,6 +1923,14 @@ class Coordinator:
             )
         self._last_udp_drops = current_drops
 
+    def _update_sample_rate(self, rate: float) -> None:
+        """Scale by the rate the C capture path actually applied, not the configured one."""
+        if rate <= 0 or rate == self._sample_rate:
+            return
+        logger.info("Worker-reported sample rate %.6f (was %.6f)", rate, self._sample_rate)
+        self._sample_rate = rate
+        self._inv_rate = 1.0 / rate
+
 
 # ---------------------------------------------------------------------------
 # Main
@@ -474,6 +1944,7 @@ def main() -> None:
     )
 
     _load_fast_recv()
+    _load_flow_merge()
 
     # Worker count: 0 or unset = auto-detect (vCPU count)
     try:
@@ -493,11 +1964,161 @@ def main() -> None:
     sample_rate = max(0.0001, min(1.0, sample_rate))
     logger.info("Sample rate: %.4f", sample_rate)
 
-    coordinator = Coordinator(num_workers=num_workers, sample_rate=sample_rate)
+    # Packet-level 1-in-N on top of flow sampling (1 = off)
+    try:
+        pkt_sample_n = int(os.environ.get("PROBE_PKT_SAMPLE_N", "1"))
+    except (ValueError, TypeError):
+        logger.error("Invalid PROBE_PKT_SAMPLE_N, using 1")
+        pkt_sample_n = 1
+    pkt_sample_n = max(1, pkt_sample_n)
+    if pkt_sample_n > 1:
+        logger.info("Packet sampling: 1-in-%d", pkt_sample_n)
+
+    # Capture backend: socket (recvmmsg), af_xdp or xdp_count (both fall back to socket),
+    # or pcap: replay PROBE_PCAP_FILE through the same pipeline, then exit
+    backend = os.environ.get("PROBE_BACKEND", "socket").lower()
+    if backend not in ("socket", "af_xdp", "xdp_count", "pcap"):
+        logger.error("Invalid PROBE_BACKEND %r, using socket", backend)
+        backend = "socket"
+    xdp_iface = os.environ.get("PROBE_XDP_IFACE", "eth0")
+    pcap_path = os.environ.get("PROBE_PCAP_FILE", "")
+    replay_speed = 0.0
+    if backend == "pcap":
+        if not os.path.isfile(pcap_path):
+            logger.error("PROBE_BACKEND=pcap needs PROBE_PCAP_FILE, a pcap / pcapng file (got %r)", pcap_path)
+            sys.exit(1)
+        try:
+            replay_speed = float(os.environ.get("PROBE_REPLAY_SPEED", "0"))
+            if not replay_speed >= 0:
+                raise ValueError
+        except ValueError:
+            logger.error("Invalid PROBE_REPLAY_SPEED (0 = as fast as possible, N = N times capture pace), using 0")
+            replay_speed = 0.0
+        logger.info("Capture backend: pcap replay of %s", pcap_path)
+    else:
+        logger.info("Capture backend: %s%s", backend, f" on {xdp_iface}" if backend != "socket" else "")
+
+    # Flow table sizing: initial capacity and growth ceiling per table (0 = C defaults)
+    try:
+        max_flows = int(os.environ.get("PROBE_MAX_FLOWS", "0"))
+        max_flows_limit = int(os.environ.get("PROBE_MAX_FLOWS_LIMIT", "0"))
+    except (ValueError, TypeError):
+        logger.error("Invalid PROBE_MAX_FLOWS / PROBE_MAX_FLOWS_LIMIT, using defaults")
+        max_flows, max_flows_limit = 0, 0
+    hugepages = os.environ.get("PROBE_HUGEPAGES", "0").lower() in ("1", "true", "yes")
+
+    # Worker placement: pin capture threads (NIC-local NUMA node first) and steer
+    # the reuseport group by RX CPU or inner 5-tuple instead of the kernel hash
+    pin_cpus = os.environ.get("PROBE_PIN_CPUS", "0").lower() in ("1", "true", "yes")
+    steering = os.environ.get("PROBE_STEERING", "none").lower()
+    if steering not in ("none", "cpu", "flow"):
+        logger.error("Invalid PROBE_STEERING %r, using none", steering)
+        steering = "none"
+
+    # Socket receive mode: blocking recvmmsg, busy polling, or adaptive batching
+    rx_mode = os.environ.get("PROBE_RX_MODE", "blocking").lower()
+    if rx_mode not in CAP_RX_MODES:
+        logger.error("Invalid PROBE_RX_MODE %r, using blocking", rx_mode)
+        rx_mode = "blocking"
+    try:
+        busy_poll_us = int(os.environ.get("PROBE_BUSY_POLL_US", "0"))
+    except (ValueError, TypeError):
+        logger.error("Invalid PROBE_BUSY_POLL_US, using default")
+        busy_poll_us = 0
+    udp_gro = os.environ.get("PROBE_UDP_GRO", "0").lower() in ("1", "true", "yes")
+
+    # Mirror sessions: accept only these VNIs (empty = all), count per outer source IP
+    try:
+        vnis = tuple(int(v) for v in os.environ.get("PROBE_VNIS", "").split(",") if v.strip())
+        if len(vnis) > CAP_MAX_VNIS or any(not 0 <= v < 1 << 24 for v in vnis):
+            raise ValueError
+    except ValueError:
+        logger.error("Invalid PROBE_VNIS (up to %d VNIs, 0-16777215), accepting all", CAP_MAX_VNIS)
+        vnis = ()
+    track_sources = os.environ.get("PROBE_TRACK_SOURCES", "0").lower() in ("1", "true", "yes")
+    # Per-flow TCP flags / SYN / RST / first-last seen / length histogram for alert detail
+    ext_counters = os.environ.get("PROBE_EXT_COUNTERS", "0").lower() in ("1", "true", "yes")
+    # Window of the in-worker ALERT_HOST_BPS / ALERT_HOST_PPS pre-check (0 = fast_recv.c default)
+    try:
+        host_window_ms = int(os.environ.get("PROBE_HOST_WINDOW_MS", "0"))
+        if not 0 <= host_window_ms <= HOST_WINDOW_MAX_MS:
+            raise ValueError
+    except ValueError:
+        logger.error("Invalid PROBE_HOST_WINDOW_MS (1-%d), using default", HOST_WINDOW_MAX_MS)
+        host_window_ms = 0
+
+    # Subnets to report besides /24 and /16: the on-prem blocks (ONPREM_CIDRS) by default
+    try:
+        prefix_cidrs = tuple(
+            (struct.unpack("=I", n.network_address.packed)[0], n.prefixlen)
+            for n in (ipaddress.IPv4Network(c.strip(), strict=False)
+                      for c in os.environ.get("ONPREM_CIDRS", "").split(",") if c.strip())
+        )
+        if len(prefix_cidrs) > FlowMerge.MAX_CIDRS:
+            raise ValueError
+    except ValueError:
+        logger.error("Invalid ONPREM_CIDRS (up to %d IPv4 CIDRs), reporting /24 and /16 only", FlowMerge.MAX_CIDRS)
+        prefix_cidrs = ()
+
+    # Prometheus text endpoint with the workers' counters and histograms (0 = off)
+    metrics_addr = os.environ.get("PROBE_METRICS_ADDR", "127.0.0.1")
+    try:
+        metrics_port = int(os.environ.get("PROBE_METRICS_PORT", "0"))
+        if not 0 <= metrics_port <= 65535:
+            raise ValueError
+    except ValueError:
+        logger.error("Invalid PROBE_METRICS_PORT, metrics endpoint off")
+        metrics_port = 0
+
+    def host_port(var: str, default_port: int, what: str) -> Optional[tuple[str, int]]:
+        value = os.environ.get(var, "").strip()
+        if not value:
+            return None
+        host, _, port = value.rpartition(":") if ":" in value else (value, "", str(default_port))
+        try:
+            if host and 0 < int(port) <= 65535:
+                return host, int(port)
+        except ValueError:
+            pass
+        logger.error("Invalid %s %r (host[:port]), %s", var, value, what)
+        return None
+
+    # Multi-probe: interval deltas to the aggregator (aggregator.py) at host[:port]
+    aggregator = host_port("AGGREGATOR_ADDR", AGG_PORT, "not sending deltas")
+    probe_id = os.environ.get("PROBE_ID", "")
+    if aggregator and len(probe_id.encode()) > MAX_PROBE_NAME:
+        logger.error("PROBE_ID is %d bytes, the aggregator takes at most %d", len(probe_id.encode()), MAX_PROBE_NAME)
+        sys.exit(1)
+
+    # Flow record export (flow_export.py): IPFIX to a collector, columnar files rotated to S3
+    export_ipfix = host_port("EXPORT_IPFIX_ADDR", IPFIX_PORT, "not exporting IPFIX")
+    try:
+        export_rotate_sec = int(os.environ.get("EXPORT_ROTATE_SEC", str(ROTATE_SEC)))
+        if export_rotate_sec < 60:
+            raise ValueError
+    except ValueError:
+        logger.error("Invalid EXPORT_ROTATE_SEC (60 or more), rotating hourly")
+        export_rotate_sec = ROTATE_SEC
+
+    coordinator = Coordinator(num_workers=num_workers, sample_rate=sample_rate, pkt_sample_n=pkt_sample_n,
+                              backend=backend, xdp_iface=xdp_iface, max_flows=max_flows,
+                              max_flows_limit=max_flows_limit, hugepages=hugepages,
+                              pin_cpus=pin_cpus, steering=steering,
+                              rx_mode=rx_mode, busy_poll_us=busy_poll_us, udp_gro=udp_gro,
+                              vnis=vnis, track_sources=track_sources, ext_counters=ext_counters,
+                              host_window_ms=host_window_ms, prefix_cidrs=prefix_cidrs,
+                              metrics_addr=metrics_addr, metrics_port=metrics_port,
+                              aggregator=aggregator, probe_id=probe_id,
+                              export_ipfix=export_ipfix, export_dir=os.environ.get("EXPORT_DIR", ""),
+                              export_rotate_sec=export_rotate_sec,
+                              export_s3_bucket=os.environ.get("EXPORT_S3_BUCKET", ""),
+                              export_s3_prefix=os.environ.get("EXPORT_S3_PREFIX", "flows/"),
+                              pcap_path=pcap_path, replay_speed=replay_speed,
+                              state_dir=os.environ.get("PROBE_STATE_DIR", ""))
 
     def handle_signal(signum, frame):
         logger.info("Received signal %d, shutting down", signum)
-        coordinator.stop()
+        coordinator.request_stop()
 
     signal.signal(signal.SIGTERM, handle_signal)
     signal.signal(signal.SIGINT, handle_signal)
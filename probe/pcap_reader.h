@@ -0,0 +1,301 @@
+/*
+ * Header-only capture file reader for the replay backend (CAP_BACKEND_PCAP
+ * in fast_recv.c) and offline tools.
+ *
+ * The file is mapped read-only and walked in place, so frames are handed
+ * to the capture path as pointers into the mapping, without a copy, just
+ * as AF_XDP frames are parsed in the UMEM. Formats:
+ *
+ *   - pcap: microsecond (0xa1b2c3d4) or nanosecond (0xa1b23c4d) timestamps,
+ *     either byte order;
+ *   - pcapng: Section Header, Interface Description (link type and
+ *     if_tsresol per interface), Enhanced and Simple Packet blocks, several
+ *     sections; other blocks are skipped.
+ *
+ * pcap_vxlan() then takes a frame down to the VXLAN header of an outer
+ * IPv4/UDP packet to the given port, for Ethernet (one optional 802.1Q
+ * tag), raw IPv4 and Linux cooked (SLL / SLL2) captures. Fragments, other
+ * ports and anything else are the caller's to count and skip.
+ */
+#ifndef PCAP_READER_H
+#define PCAP_READER_H
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define PCAP_MAGIC_US       0xa1b2c3d4u
+#define PCAP_MAGIC_NS       0xa1b23c4du
+#define PCAPNG_SHB          0x0a0d0d0au
+#define PCAPNG_IDB          1u
+#define PCAPNG_SPB          3u
+#define PCAPNG_EPB          6u
+#define PCAPNG_BOM          0x1a2b3c4du
+#define PCAPNG_MAX_IFS      64          /* interfaces per section; frames on later ones are skipped */
+#define PCAP_FILE_HDR       24
+#define PCAP_REC_HDR        16
+
+/* Link types (LINKTYPE_* in the pcap spec) */
+#define PCAP_LINK_ETHERNET  1
+#define PCAP_LINK_RAW       101
+#define PCAP_LINK_SLL       113
+#define PCAP_LINK_IPV4      228
+#define PCAP_LINK_SLL2      276
+
+struct pcap_ifc {
+    uint16_t linktype;
+    uint8_t  tsresol;               /* if_tsresol: 10^-n seconds, or 2^-n with the top bit set */
+};
+
+struct pcap_file {
+    const uint8_t *map;
+    size_t   len;
+    size_t   off;                   /* next record or block */
+    int      ng;                    /* pcapng */
+    int      swapped;               /* pcap: whole file, pcapng: current section */
+    uint32_t ns_per_tick;           /* pcap: 1000 (microseconds) or 1 */
+    uint16_t linktype;              /* pcap */
+    struct pcap_ifc ifs[PCAPNG_MAX_IFS];
+    int      nifs;
+    uint64_t last_ts_ns;            /* Simple Packet Blocks carry none: the previous frame's */
+};
+
+struct pcap_pkt {
+    uint64_t ts_ns;                 /* capture time, ns since the epoch */
+    const uint8_t *data;
+    uint32_t caplen;
+    uint16_t linktype;
+};
+
+static inline uint32_t pcap_u32(const struct pcap_file *f, const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return f->swapped ? __builtin_bswap32(v) : v;
+}
+
+static inline uint16_t pcap_u16(const struct pcap_file *f, const uint8_t *p)
+{
+    uint16_t v;
+    memcpy(&v, p, 2);
+    return f->swapped ? __builtin_bswap16(v) : v;
+}
+
+static inline uint16_t pcap_be16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+/* pcapng timestamp units -> ns */
+static inline uint64_t pcapng_ts_ns(uint64_t ts, uint8_t tsresol)
+{
+    int n = tsresol & 0x7f;
+    if (tsresol & 0x80)
+        return n >= 64 ? 0 : (uint64_t)(((unsigned __int128)ts * 1000000000u) >> n);
+    uint64_t scale = 1;
+    if (n <= 9) {
+        for (int i = n; i < 9; i++)
+            scale *= 10;
+        return ts * scale;
+    }
+    for (int i = 9; i < n && i < 28; i++)
+        scale *= 10;
+    return ts / scale;
+}
+
+static inline void pcap_close(struct pcap_file *f)
+{
+    if (f->map)
+        munmap((void *)f->map, f->len);
+    f->map = NULL;
+}
+
+/* Map path and check its header. Returns 0, or -1 (not a pcap/pcapng file, or unreadable). */
+static inline int pcap_open(struct pcap_file *f, const char *path)
+{
+    memset(f, 0, sizeof(*f));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= PCAP_FILE_HDR)
+        map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+    madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+    f->map = map;
+    f->len = (size_t)st.st_size;
+
+    uint32_t magic;
+    memcpy(&magic, f->map, 4);
+    if (magic == PCAPNG_SHB) {
+        f->ng = 1;              /* byte order is read with each section header */
+        return 0;
+    }
+    if (magic == PCAP_MAGIC_US || magic == PCAP_MAGIC_NS) {
+        f->swapped = 0;
+    } else if (magic == __builtin_bswap32(PCAP_MAGIC_US) || magic == __builtin_bswap32(PCAP_MAGIC_NS)) {
+        f->swapped = 1;
+        magic = __builtin_bswap32(magic);
+    } else {
+        pcap_close(f);
+        return -1;
+    }
+    f->ns_per_tick = magic == PCAP_MAGIC_NS ? 1 : 1000;
+    f->linktype = (uint16_t)pcap_u32(f, f->map + 20);
+    f->off = PCAP_FILE_HDR;
+    return 0;
+}
+
+static inline int pcap_next_classic(struct pcap_file *f, struct pcap_pkt *pkt)
+{
+    if (f->off == f->len)
+        return 0;
+    if (f->len - f->off < PCAP_REC_HDR)
+        return -1;
+    const uint8_t *r = f->map + f->off;
+    uint32_t caplen = pcap_u32(f, r + 8);
+    if (caplen > f->len - f->off - PCAP_REC_HDR)
+        return -1;
+    pkt->ts_ns = (uint64_t)pcap_u32(f, r) * 1000000000u + (uint64_t)pcap_u32(f, r + 4) * f->ns_per_tick;
+    pkt->data = r + PCAP_REC_HDR;
+    pkt->caplen = caplen;
+    pkt->linktype = f->linktype;
+    f->off += PCAP_REC_HDR + caplen;
+    return 1;
+}
+
+static inline void pcapng_idb(struct pcap_file *f, const uint8_t *b, uint32_t blen)
+{
+    if (f->nifs == PCAPNG_MAX_IFS || blen < 20)
+        return;
+    struct pcap_ifc *ifc = &f->ifs[f->nifs++];
+    ifc->linktype = pcap_u16(f, b + 8);
+    ifc->tsresol = 6;
+    for (uint32_t o = 16; o + 4 <= blen - 4;) {
+        uint16_t code = pcap_u16(f, b + o), olen = pcap_u16(f, b + o + 2);
+        if (code == 0 || o + 4 + olen > blen - 4)
+            break;
+        if (code == 9 && olen >= 1)
+            ifc->tsresol = b[o + 4];
+        o += 4 + ((olen + 3u) & ~3u);
+    }
+}
+
+static inline int pcap_next_ng(struct pcap_file *f, struct pcap_pkt *pkt)
+{
+    for (;;) {
+        if (f->off == f->len)
+            return 0;
+        if (f->len - f->off < 12)
+            return -1;
+        const uint8_t *b = f->map + f->off;
+        uint32_t type;
+        memcpy(&type, b, 4);
+        if (type == PCAPNG_SHB) {
+            uint32_t bom;
+            memcpy(&bom, b + 8, 4);
+            if (bom != PCAPNG_BOM && bom != __builtin_bswap32(PCAPNG_BOM))
+                return -1;
+            f->swapped = bom != PCAPNG_BOM;
+            f->nifs = 0;
+        } else {
+            type = pcap_u32(f, b);
+        }
+        uint32_t blen = pcap_u32(f, b + 4);
+        if (blen < 12 || (blen & 3) || blen > f->len - f->off)
+            return -1;
+        f->off += blen;
+        if (type == PCAPNG_IDB) {
+            pcapng_idb(f, b, blen);
+        } else if (type == PCAPNG_EPB && blen >= 32) {
+            uint32_t ifc = pcap_u32(f, b + 8), caplen = pcap_u32(f, b + 20);
+            if (ifc >= (uint32_t)f->nifs || caplen > blen - 32)
+                continue;
+            uint64_t ts = (uint64_t)pcap_u32(f, b + 12) << 32 | pcap_u32(f, b + 16);
+            pkt->ts_ns = f->last_ts_ns = pcapng_ts_ns(ts, f->ifs[ifc].tsresol);
+            pkt->data = b + 28;
+            pkt->caplen = caplen;
+            pkt->linktype = f->ifs[ifc].linktype;
+            return 1;
+        } else if (type == PCAPNG_SPB && blen >= 16 && f->nifs) {
+            uint32_t orig = pcap_u32(f, b + 8);
+            pkt->ts_ns = f->last_ts_ns;
+            pkt->data = b + 12;
+            pkt->caplen = orig < blen - 16 ? orig : blen - 16;
+            pkt->linktype = f->ifs[0].linktype;
+            return 1;
+        }
+    }
+}
+
+/* Next frame into *pkt: 1, 0 at the end of the file, -1 if the rest of the file is malformed */
+static inline int pcap_next(struct pcap_file *f, struct pcap_pkt *pkt)
+{
+    return f->ng ? pcap_next_ng(f, pkt) : pcap_next_classic(f, pkt);
+}
+
+/*
+ * Offset of the VXLAN header in a frame carrying outer IPv4/UDP to port,
+ * or -1. *len is set to the UDP payload bytes captured, *outer to the outer
+ * source IP (network byte order).
+ */
+static inline int pcap_vxlan(const struct pcap_pkt *pkt, int port, int *len, uint32_t *outer)
+{
+    const uint8_t *p = pkt->data;
+    uint32_t caplen = pkt->caplen, l3;
+    uint16_t type;
+    switch (pkt->linktype) {
+    case PCAP_LINK_ETHERNET:
+        if (caplen < 14)
+            return -1;
+        type = pcap_be16(p + 12);
+        l3 = 14;
+        if (type == 0x8100 && caplen >= 18) {
+            type = pcap_be16(p + 16);
+            l3 = 18;
+        }
+        break;
+    case PCAP_LINK_RAW:
+    case PCAP_LINK_IPV4:
+        type = 0x0800;
+        l3 = 0;
+        break;
+    case PCAP_LINK_SLL:
+        if (caplen < 16)
+            return -1;
+        type = pcap_be16(p + 14);
+        l3 = 16;
+        break;
+    case PCAP_LINK_SLL2:
+        if (caplen < 20)
+            return -1;
+        type = pcap_be16(p);
+        l3 = 20;
+        break;
+    default:
+        return -1;
+    }
+    if (type != 0x0800 || caplen < l3 + 20)
+        return -1;
+    const uint8_t *ip = p + l3;
+    uint32_t ihl = (ip[0] & 0x0fu) * 4;
+    if ((ip[0] >> 4) != 4 || ihl < 20 || ip[9] != 17 || (pcap_be16(ip + 6) & 0x3fff) ||
+        caplen < l3 + ihl + 8)
+        return -1;
+    const uint8_t *udp = ip + ihl;
+    if (pcap_be16(udp + 2) != port)
+        return -1;
+    uint32_t off = l3 + ihl + 8, udp_len = pcap_be16(udp + 4);
+    uint32_t avail = caplen - off;
+    *len = (int)(udp_len >= 8 && udp_len - 8 < avail ? udp_len - 8 : avail);
+    memcpy(outer, ip + 12, 4);
+    return (int)off;
+}
+
+#endif /* PCAP_READER_H */
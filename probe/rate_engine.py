@@ -0,0 +1,233 @@
+"""
+Streaming rate engine: ring-buffered fixed-width buckets per link and per
+host, fed with counter deltas as the coordinator merges them.
+
+Each SlidingRate keeps running sums over its ring, so updating it and
+reading the sliding-window rate are O(1) whatever the window length; every
+completed bucket also feeds an EWMA baseline, which is what rate-of-change
+(surge / drop) detection compares against. Time is passed in by the caller
+(time.monotonic()), never read here.
+
+state() / restore() carry windows and baselines over a probe restart as
+plain lists, times relative to the moment of the snapshot: the restarted
+probe resumes them where they stopped, without a warm-up and without the
+restart pause counted as a gap in traffic.
+"""
+
+import math
+from collections import OrderedDict
+from typing import Optional
+
+LINK_BUCKET_SEC = 1.0       # link window: 1s buckets, fed every COORDINATOR_POLL
+LINK_BUCKETS = 3            # check_fast sees the last 2-3s, across report boundaries
+HOST_BUCKETS = 12           # host window: REPORT_INTERVAL buckets, fed at report time
+BASELINE_TAU_SEC = 300.0    # EWMA time constant of the baselines
+BASELINE_WARMUP_SEC = 60.0  # no baseline (no surge/drop verdict) before this much history
+MAX_HOSTS = 4096            # per-host windows kept, least recently updated dropped first
+
+
+class SlidingRate:
+    """Packets/bytes over the last `buckets` buckets of `bucket_sec`, plus EWMA baselines."""
+
+    __slots__ = ("bucket_sec", "_pkts", "_bytes", "_sum_pkts", "_sum_bytes", "_cur", "_start",
+                 "_first", "_alpha", "_warmup", "_seen", "base_bps", "base_pps")
+
+    def __init__(self, bucket_sec: float, buckets: int, now: float,
+                 tau_sec: float = BASELINE_TAU_SEC, warmup_sec: float = BASELINE_WARMUP_SEC):
+        self.bucket_sec = bucket_sec
+        self._pkts = [0] * buckets
+        self._bytes = [0] * buckets
+        self._sum_pkts = 0
+        self._sum_bytes = 0
+        self._cur = 0                   # index of the bucket being filled
+        self._start = now               # when the current bucket began
+        self._first = now
+        self._alpha = 1 - math.exp(-bucket_sec / tau_sec)
+        self._warmup = max(1, math.ceil(warmup_sec / bucket_sec))
+        self._seen = 0                  # completed buckets folded into the baseline
+        self.base_bps = 0.0
+        self.base_pps = 0.0
+
+    def _advance(self, now: float) -> None:
+        """Close the buckets that ended before now: each feeds the baseline, then is cleared."""
+        k = int((now - self._start) / self.bucket_sec)
+        if k <= 0:
+            return
+        n = len(self._pkts)
+        # The bucket just completed, then k-1 empty ones (closed form for the EWMA)
+        i = self._cur
+        self._fold(self._pkts[i], self._bytes[i], 1)
+        if k > 1:
+            self._fold(0, 0, k - 1)
+        for _ in range(min(k, n)):
+            i = (i + 1) % n
+            self._sum_pkts -= self._pkts[i]
+            self._sum_bytes -= self._bytes[i]
+            self._pkts[i] = self._bytes[i] = 0
+        self._cur = i
+        self._start += k * self.bucket_sec
+
+    def _fold(self, packets: int, bytes_: int, times: int) -> None:
+        """Fold `times` completed buckets of these counts into the baselines."""
+        bps = bytes_ * 8 / self.bucket_sec
+        pps = packets / self.bucket_sec
+        if self._seen == 0:
+            self.base_bps, self.base_pps = bps, pps
+        else:
+            keep = (1 - self._alpha) ** times
+            self.base_bps = bps + (self.base_bps - bps) * keep
+            self.base_pps = pps + (self.base_pps - pps) * keep
+        self._seen += times
+
+    def add(self, now: float, packets: int, bytes_: int) -> None:
+        self._advance(now)
+        i = self._cur
+        self._pkts[i] += packets
+        self._bytes[i] += bytes_
+        self._sum_pkts += packets
+        self._sum_bytes += bytes_
+
+    def window(self, now: float) -> tuple[int, int, float]:
+        """(packets, bytes, seconds) in the window ending now; seconds < the
+        full window while history is shorter than it."""
+        self._advance(now)
+        span = (len(self._pkts) - 1) * self.bucket_sec + (now - self._start)
+        return self._sum_pkts, self._sum_bytes, min(span, now - self._first)
+
+    def current(self) -> tuple[float, float]:
+        """(bps, pps) of the bucket being filled, taken as a whole bucket."""
+        i = self._cur
+        return self._bytes[i] * 8 / self.bucket_sec, self._pkts[i] / self.bucket_sec
+
+    def rate(self, now: float) -> tuple[float, float]:
+        """Sliding-window (bps, pps)."""
+        pkts, byt, span = self.window(now)
+        if span <= 0:
+            return 0.0, 0.0
+        return byt * 8 / span, pkts / span
+
+    def baseline(self) -> Optional[tuple[float, float]]:
+        """EWMA (bps, pps) of completed buckets, None during warm-up."""
+        if self._seen < self._warmup:
+            return None
+        return self.base_bps, self.base_pps
+
+    def state(self, now: float) -> dict:
+        """Buckets and baselines as of now, JSON-serialisable."""
+        self._advance(now)
+        return {"bucket_sec": self.bucket_sec, "pkts": list(self._pkts), "bytes": list(self._bytes),
+                "cur": self._cur, "start": self._start - now, "first": self._first - now,
+                "seen": self._seen, "base": [self.base_bps, self.base_pps]}
+
+    @classmethod
+    def restore(cls, state: dict, now: float, bucket_sec: float, buckets: int) -> Optional["SlidingRate"]:
+        """The window of a state(), continuing at now; None unless it has
+        buckets of bucket_sec (the layout may change between versions)."""
+        try:
+            if state["bucket_sec"] != bucket_sec or len(state["pkts"]) != buckets or len(state["bytes"]) != buckets:
+                return None
+            w = cls(bucket_sec, buckets, now)
+            w._pkts = [int(n) for n in state["pkts"]]
+            w._bytes = [int(n) for n in state["bytes"]]
+            w._sum_pkts, w._sum_bytes = sum(w._pkts), sum(w._bytes)
+            w._cur = int(state["cur"]) % buckets
+            w._start = now + min(0.0, float(state["start"]))
+            w._first = now + min(0.0, float(state["first"]))
+            w._seen = int(state["seen"])
+            w.base_bps, w.base_pps = (float(v) for v in state["base"])
+        except (KeyError, TypeError, ValueError):
+            return None
+        return w
+
+
+class RateEngine:
+    """
+    One link window fed with merged totals every poll, and per-host windows
+    fed with each report's host counters (those only leave the native merge
+    at REPORT_INTERVAL, so host buckets are report-sized).
+    """
+
+    def __init__(self, host_bucket_sec: float, max_hosts: int = MAX_HOSTS):
+        self._host_bucket_sec = host_bucket_sec
+        self._max_hosts = max_hosts
+        self.link: Optional[SlidingRate] = None
+        self._hosts: "OrderedDict[tuple[str, str], SlidingRate]" = OrderedDict()
+        self._updated: list[tuple[str, str]] = []   # hosts fed by the last update_hosts()
+
+    def update_link(self, now: float, packets: int, bytes_: int) -> None:
+        if self.link is None:
+            self.link = SlidingRate(LINK_BUCKET_SEC, LINK_BUCKETS, now)
+        self.link.add(now, packets, bytes_)
+
+    def update_hosts(self, now: float, src: dict[str, list[int]], dst: dict[str, list[int]]) -> None:
+        """Add one report's [packets, bytes] per source and destination IP.
+        A host's buckets start half a bucket before its first report, so each
+        report (one REPORT_INTERVAL apart) lands in a bucket of its own."""
+        self._updated = []
+        for direction, agg in (("source", src), ("destination", dst)):
+            for ip, (pkts, byt) in agg.items():
+                key = (ip, direction)
+                w = self._hosts.pop(key, None)
+                if w is None:
+                    w = SlidingRate(self._host_bucket_sec, HOST_BUCKETS, now - self._host_bucket_sec / 2)
+                w.add(now, pkts, byt)
+                self._hosts[key] = w
+                self._updated.append(key)
+        while len(self._hosts) > self._max_hosts:
+            self._hosts.popitem(last=False)
+
+    def host_count(self) -> int:
+        return len(self._hosts)
+
+    def state(self, now: float) -> dict:
+        """Link and host windows (least recently updated host first), for restore()."""
+        return {"link": self.link.state(now) if self.link else None,
+                "hosts": [[ip, direction, w.state(now)] for (ip, direction), w in self._hosts.items()]}
+
+    def restore(self, state: dict, now: float) -> int:
+        """Replace the windows with those of a state() taken in an earlier
+        process, continuing at now. Returns windows restored."""
+        link = SlidingRate.restore(state.get("link") or {}, now, LINK_BUCKET_SEC, LINK_BUCKETS)
+        hosts: "OrderedDict[tuple[str, str], SlidingRate]" = OrderedDict()
+        for ip, direction, ws in state.get("hosts", [])[-self._max_hosts:]:
+            w = SlidingRate.restore(ws, now, self._host_bucket_sec, HOST_BUCKETS)
+            if w:
+                hosts[(ip, direction)] = w
+        self.link, self._hosts, self._updated = link, hosts, []
+        return len(hosts) + (link is not None)
+
+    def link_change(self, now: float, factor: float, min_bps: float) -> Optional[dict]:
+        """Link rate against its baseline: a "surge" row when the sliding-window
+        rate exceeds factor x baseline (and min_bps), a "drop" row when a
+        baseline of at least min_bps falls below 1/factor of itself; else None."""
+        if self.link is None or factor <= 1:
+            return None
+        base = self.link.baseline()
+        if base is None:
+            return None
+        bps, pps = self.link.rate(now)
+        if bps > min_bps and bps > base[0] * factor:
+            kind = "surge"
+        elif base[0] >= min_bps and bps * factor < base[0]:
+            kind = "drop"
+        else:
+            return None
+        return {"key": "link", "kind": kind, "direction": "link", "bps": bps, "pps": pps,
+                "baseline_bps": base[0], "baseline_pps": base[1]}
+
+    def host_surges(self, factor: float, min_bps: float) -> list[dict]:
+        """Hosts fed by the last update_hosts() whose latest bucket exceeds
+        factor x their baseline and min_bps. O(hosts in that report)."""
+        if factor <= 1:
+            return []
+        rows = []
+        for key in self._updated:
+            w = self._hosts.get(key)
+            base = w.baseline() if w else None
+            if base is None:
+                continue
+            bps, pps = w.current()
+            if bps > min_bps and bps > base[0] * factor:
+                rows.append({"key": key[0], "kind": "surge", "direction": key[1], "bps": bps, "pps": pps,
+                             "baseline_bps": base[0], "baseline_pps": base[1]})
+        return rows
@@ -0,0 +1,220 @@
+/*
+ * Header-only VXLAN → Ethernet [→ 802.1Q/QinQ] → IPv4 / IPv6 → L4 parser,
+ * shared by the capture loop (fast_recv.c), the ctypes parser (fast_parse.c)
+ * and offline tools; the IPv4 path is mirrored in BPF by xdp_count_prog()
+ * (xdp_prog.h, untagged frames only).
+ *
+ * vxlan_parse_batch() parses up to VXLAN_BATCH packets into a
+ * structure-of-arrays batch. No branch depends on packet contents: short
+ * packets are read from a zero page and every check is folded into one
+ * validity flag, so the loop runs at a steady rate whatever the traffic mix
+ * and each field array is written with unit stride.
+ *
+ * Accepted: VXLAN(8) + Ethernet(14) + IPv4 header (IHL >= 5) all present, inner
+ * ethertype 0x0800, after up to two 802.1Q (0x8100) / 802.1ad (0x88A8) tags.
+ * Ports are taken for TCP/UDP when the first 4 L4 bytes are present, else 0.
+ * The IP version nibble is not checked (same as the Python parser and the
+ * XDP program). The VNI is extracted, not checked: filtering against a
+ * configured set is up to the caller.
+ *
+ * IPv6 (ethertype 0x86DD) is not parsed by the batch: it only sets v6[i],
+ * and the caller hands those packets to vxlan_parse_v6(), which walks the
+ * extension header chain to reach L4 and fills a struct of its own, so the
+ * IPv4 arrays and the branch-free loop stay as they are.
+ */
+#ifndef VXLAN_PARSE_H
+#define VXLAN_PARSE_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define VXLAN_HDR       8
+#define ETH_HDR         14
+#define IP_MIN_HDR      20
+#define UDP_HDR         8
+#define ETH_P_IP        0x0800
+#define ETH_P_IPV6      0x86DD
+#define ETH_P_8021Q     0x8100
+#define ETH_P_8021AD    0x88A8
+#define VLAN_HDR        4
+#define IP6_HDR         40
+#define IP6_MAX_EXT     8           /* extension headers walked before giving up on L4 */
+#define VXLAN_MIN_LEN   (VXLAN_HDR + ETH_HDR + IP_MIN_HDR)
+#define VXLAN_BATCH     256         /* max packets per vxlan_parse_batch() */
+#define VXLAN_FLAG_I    0x08        /* VNI field is valid */
+#define VXLAN_NO_VNI    0x1000000   /* vni[] when the I flag is clear: matches no 24-bit VNI */
+
+/* Parsed batch, one array per field; entry i is packet i of the call */
+struct vxlan_batch {
+    uint32_t src_ip[VXLAN_BATCH];   /* network byte order, as on the wire */
+    uint32_t dst_ip[VXLAN_BATCH];
+    uint16_t src_port[VXLAN_BATCH]; /* host byte order; 0 unless TCP/UDP */
+    uint16_t dst_port[VXLAN_BATCH];
+    uint32_t vni[VXLAN_BATCH];      /* 24-bit VNI, or VXLAN_NO_VNI */
+    uint16_t ip_len[VXLAN_BATCH];   /* inner IPv4 total length */
+    uint8_t  proto[VXLAN_BATCH];
+    uint8_t  ok[VXLAN_BATCH];       /* 1 = parsed; 0 = fields are meaningless */
+    uint8_t  v6[VXLAN_BATCH];       /* 1 = IPv6 inner packet, for vxlan_parse_v6() */
+    int      nv6;                   /* v6[] entries set by the last vxlan_parse_batch() */
+};
+
+/* One IPv6 packet, from vxlan_parse_v6() */
+struct vxlan_v6 {
+    uint8_t  src_ip[16];
+    uint8_t  dst_ip[16];
+    uint16_t src_port;              /* host byte order; 0 unless TCP/UDP in the first fragment */
+    uint16_t dst_port;
+    uint16_t ip_len;                /* payload length + 40 */
+    uint8_t  proto;                 /* upper-layer protocol after extension headers */
+};
+
+/* Stand-in for packets too short to read headers from: 64 > VXLAN_MIN_LEN + 4 */
+static const uint8_t vxlan_zero_pkt[64];
+
+static inline uint16_t vxlan_be16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static inline int vxlan_is_vlan(uint16_t type)
+{
+    return (type == ETH_P_8021Q) | (type == ETH_P_8021AD);
+}
+
+/*
+ * L3 offset past up to two VLAN tags, and the ethertype found there.
+ * p must have VXLAN_MIN_LEN readable bytes; branch-free.
+ */
+static inline int vxlan_l3(const uint8_t *p, uint16_t *type)
+{
+    const uint8_t *eth = p + VXLAN_HDR;
+    uint16_t t = vxlan_be16(eth + 12);
+    int tag1 = vxlan_is_vlan(t);
+    t = tag1 ? vxlan_be16(eth + 12 + VLAN_HDR) : t;
+    int tag2 = tag1 & vxlan_is_vlan(t);
+    t = tag2 ? vxlan_be16(eth + 12 + 2 * VLAN_HDR) : t;
+    *type = t;
+    return VXLAN_HDR + ETH_HDR + VLAN_HDR * (tag1 + tag2);
+}
+
+static inline uint32_t vxlan_vni(const uint8_t *p)
+{
+    return p[0] & VXLAN_FLAG_I ? (uint32_t)p[4] << 16 | p[5] << 8 | p[6] : VXLAN_NO_VNI;
+}
+
+/* Parse one packet into entry i. Returns 1 if it is an IPv4 flow packet, else 0. */
+static inline int vxlan_parse_one(const uint8_t *data, int len, struct vxlan_batch *b, int i)
+{
+    int whole = len >= VXLAN_MIN_LEN;
+    const uint8_t *p = whole ? data : vxlan_zero_pkt;
+    uint16_t type;
+    int l3off = vxlan_l3(p, &type);
+    /* Tags can push the IPv4 header past a short packet: read the zero page then */
+    int hdr = l3off + IP_MIN_HDR <= len;
+    const uint8_t *ip = hdr ? p + l3off : vxlan_zero_pkt + VXLAN_HDR + ETH_HDR;
+    int ihl = (ip[0] & 0x0F) * 4;
+    int l4off = l3off + ihl;
+    uint8_t proto = ip[9];
+
+    int ok = whole & hdr & (type == ETH_P_IP) & (ihl >= IP_MIN_HDR) & (l4off <= len);
+    int ports = ok & ((proto == 6) | (proto == 17)) & (l4off + 4 <= len);
+    const uint8_t *l4 = ports ? p + l4off : vxlan_zero_pkt;
+
+    memcpy(&b->src_ip[i], ip + 12, 4);
+    memcpy(&b->dst_ip[i], ip + 16, 4);
+    b->src_port[i] = vxlan_be16(l4);
+    b->dst_port[i] = vxlan_be16(l4 + 2);
+    b->vni[i]      = vxlan_vni(p);
+    b->ip_len[i]   = vxlan_be16(ip + 2);
+    b->proto[i]    = proto;
+    b->ok[i]       = (uint8_t)ok;
+    b->v6[i]       = (uint8_t)(whole & (type == ETH_P_IPV6));
+    return ok;
+}
+
+/*
+ * Parse pkts[0..n) (n <= VXLAN_BATCH) of lens[i] bytes. Returns IPv4 packets
+ * parsed; b->nv6 counts the IPv6 ones left for vxlan_parse_v6().
+ */
+static inline int vxlan_parse_batch(const uint8_t *const *pkts, const int *lens, int n,
+                                    struct vxlan_batch *b)
+{
+    int parsed = 0, nv6 = 0;
+    for (int i = 0; i < n; i++) {
+        parsed += vxlan_parse_one(pkts[i], lens[i], b, i);
+        nv6 += b->v6[i];
+    }
+    b->nv6 = nv6;
+    return parsed;
+}
+
+/*
+ * TCP flags byte of a packet vxlan_parse_batch() accepted, 0 unless TCP with
+ * the first 14 header bytes present. Kept out of the batch: only the
+ * ext_counters path of the capture loop needs it.
+ */
+static inline uint8_t vxlan_tcp_flags(const uint8_t *data, int len)
+{
+    uint16_t type;
+    int l4off = vxlan_l3(data, &type);
+    const uint8_t *ip = data + l4off;
+    l4off += (ip[0] & 0x0F) * 4;
+    return ip[9] == 6 && l4off + 14 <= len ? data[l4off + 13] : 0;
+}
+
+/*
+ * Parse an IPv6 inner packet: fixed header present and version 6, then
+ * Hop-by-Hop / Routing / Destination Options / Fragment / AH headers
+ * skipped (up to IP6_MAX_EXT) to the upper-layer protocol. Ports are read
+ * for TCP/UDP in unfragmented packets and first fragments. Returns 1 if it
+ * is a flow packet, 0 if not IPv6 or an extension header is cut off.
+ */
+static inline int vxlan_parse_v6(const uint8_t *data, int len, struct vxlan_v6 *r)
+{
+    if (len < VXLAN_MIN_LEN)
+        return 0;
+    uint16_t type;
+    int off = vxlan_l3(data, &type);
+    if (type != ETH_P_IPV6 || off + IP6_HDR > len || data[off] >> 4 != 6)
+        return 0;
+    const uint8_t *ip = data + off;
+    uint8_t next = ip[6];
+    int later_frag = 0;
+    off += IP6_HDR;
+    for (int n = 0; n < IP6_MAX_EXT; n++) {
+        int hlen;
+        if (next == 0 || next == 43 || next == 60) {        /* HBH, Routing, Dest Opts */
+            if (off + 2 > len)
+                return 0;
+            hlen = (data[off + 1] + 1) * 8;
+        } else if (next == 44) {                            /* Fragment */
+            if (off + 8 > len)
+                return 0;
+            later_frag = (vxlan_be16(data + off + 2) & 0xFFF8) != 0;
+            hlen = 8;
+        } else if (next == 51) {                            /* AH */
+            if (off + 2 > len)
+                return 0;
+            hlen = (data[off + 1] + 2) * 4;
+        } else {
+            break;
+        }
+        next = data[off];
+        off += hlen;
+        if (off > len)
+            return 0;
+    }
+
+    memcpy(r->src_ip, ip + 8, 16);
+    memcpy(r->dst_ip, ip + 24, 16);
+    r->proto = next;
+    r->ip_len = (uint16_t)(vxlan_be16(ip + 4) + IP6_HDR);
+    r->src_port = r->dst_port = 0;
+    if (!later_frag && (next == 6 || next == 17) && off + 4 <= len) {
+        r->src_port = vxlan_be16(data + off);
+        r->dst_port = vxlan_be16(data + off + 2);
+    }
+    return 1;
+}
+
+#endif /* VXLAN_PARSE_H */
@@ -0,0 +1,466 @@
+/*
+ * In-process XDP support for fast_recv.c: raw bpf() syscalls plus a tiny
+ * eBPF assembler, so the probe needs no clang/libbpf toolchain.
+ *
+ * xdp_redirect_prog() builds the AF_XDP steering program:
+ *   Ethernet → IPv4 → UDP dport == port  →  bpf_redirect_map(xskmap, rx_queue)
+ *   anything else (or a queue with no AF_XDP socket) → XDP_PASS
+ *
+ * xdp_count_prog() builds the in-kernel aggregation program: the
+ * untagged VXLAN → Ethernet → IPv4 → L4 subset of vxlan_parse.h, counting
+ * into a per-CPU hash keyed like ht_entry. Counted packets are dropped in
+ * XDP and never reach userspace. Everything else passes, including VXLAN
+ * whose inner frame it does not parse (VLAN-tagged, IPv6, truncated): the
+ * other workers' UDP sockets take those through the full userspace parse.
+ */
+#ifndef XDP_PROG_H
+#define XDP_PROG_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+
+/* ---- bpf() syscall wrappers: return fd / 0, or -1 with errno ---- */
+static inline int sys_bpf(int cmd, union bpf_attr *attr)
+{
+    return (int)syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static inline int bpf_map_create_raw(uint32_t type, uint32_t key_size, uint32_t value_size,
+                                     uint32_t max_entries, uint32_t flags)
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type    = type;
+    attr.key_size    = key_size;
+    attr.value_size  = value_size;
+    attr.max_entries = max_entries;
+    attr.map_flags   = flags;
+    return sys_bpf(BPF_MAP_CREATE, &attr);
+}
+
+static inline int bpf_map_update_raw(int fd, const void *key, const void *value, uint64_t flags)
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = fd;
+    attr.key    = (uint64_t)(uintptr_t)key;
+    attr.value  = (uint64_t)(uintptr_t)value;
+    attr.flags  = flags;
+    return sys_bpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+static inline int bpf_map_delete_raw(int fd, const void *key)
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = fd;
+    attr.key    = (uint64_t)(uintptr_t)key;
+    return sys_bpf(BPF_MAP_DELETE_ELEM, &attr);
+}
+
+static inline int bpf_map_lookup_raw(int fd, const void *key, void *value)
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = fd;
+    attr.key    = (uint64_t)(uintptr_t)key;
+    attr.value  = (uint64_t)(uintptr_t)value;
+    return sys_bpf(BPF_MAP_LOOKUP_ELEM, &attr);
+}
+
+/*
+ * Copy out and delete up to *count entries (Linux 5.6+). in_batch = NULL
+ * starts from the beginning; pass the previous out_batch to continue.
+ * *count is always updated; -1/ENOENT means the map has been walked.
+ */
+static inline int bpf_map_lookup_and_delete_batch_raw(int fd, void *in_batch, void *out_batch,
+                                                      void *keys, void *values, uint32_t *count)
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.batch.map_fd    = fd;
+    attr.batch.in_batch  = (uint64_t)(uintptr_t)in_batch;
+    attr.batch.out_batch = (uint64_t)(uintptr_t)out_batch;
+    attr.batch.keys      = (uint64_t)(uintptr_t)keys;
+    attr.batch.values    = (uint64_t)(uintptr_t)values;
+    attr.batch.count     = *count;
+    int rc = sys_bpf(BPF_MAP_LOOKUP_AND_DELETE_BATCH, &attr);
+    *count = attr.batch.count;
+    return rc;
+}
+
+/* Kernel-wide map id, so other processes can reopen the map by id */
+static inline uint32_t bpf_map_id_raw(int fd)
+{
+    struct bpf_map_info info;
+    union bpf_attr attr;
+    memset(&info, 0, sizeof(info));
+    memset(&attr, 0, sizeof(attr));
+    attr.info.bpf_fd   = fd;
+    attr.info.info_len = sizeof(info);
+    attr.info.info     = (uint64_t)(uintptr_t)&info;
+    return sys_bpf(BPF_OBJ_GET_INFO_BY_FD, &attr) == 0 ? info.id : 0;
+}
+
+static inline int bpf_map_get_fd_by_id_raw(uint32_t id)
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_id = id;
+    return sys_bpf(BPF_MAP_GET_FD_BY_ID, &attr);
+}
+
+static inline int bpf_prog_load_raw(uint32_t type, const struct bpf_insn *insns, int n,
+                                    char *log, uint32_t log_size)
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = type;
+    attr.insns     = (uint64_t)(uintptr_t)insns;
+    attr.insn_cnt  = (uint32_t)n;
+    attr.license   = (uint64_t)(uintptr_t)"GPL";
+    if (log && log_size) {
+        log[0] = 0;
+        attr.log_buf   = (uint64_t)(uintptr_t)log;
+        attr.log_size  = log_size;
+        attr.log_level = 1;
+    }
+    int fd = sys_bpf(BPF_PROG_LOAD, &attr);
+    if (fd < 0 && log && log_size) {
+        /* Retry quietly: a too-small log buffer fails the load by itself */
+        attr.log_buf = 0; attr.log_size = 0; attr.log_level = 0;
+        int retry = sys_bpf(BPF_PROG_LOAD, &attr);
+        if (retry >= 0)
+            return retry;
+    }
+    return fd;
+}
+
+/* Attach an XDP program to an interface as a bpf_link; closing the fd detaches */
+static inline int bpf_xdp_link_raw(int prog_fd, int ifindex, uint32_t xdp_flags)
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd        = prog_fd;
+    attr.link_create.target_ifindex = ifindex;
+    attr.link_create.attach_type    = BPF_XDP;
+    attr.link_create.flags          = xdp_flags;
+    return sys_bpf(BPF_LINK_CREATE, &attr);
+}
+
+/* ---- Minimal eBPF assembler ---- */
+#define BPF_ASM_MAX     256
+#define BPF_ASM_LABELS  16
+#define BPF_ASM_FIXUPS  64
+#define L_PASS          0               /* "r0 = XDP_PASS; exit", see asm_pass_label() */
+
+struct bpf_asm {
+    struct bpf_insn insn[BPF_ASM_MAX];
+    int n;
+    int label[BPF_ASM_LABELS];          /* instruction index of each bound label */
+    struct { int at, label; } fixup[BPF_ASM_FIXUPS];
+    int nfixup;
+};
+
+#define INSN(c, d, s, o, i) \
+    ((struct bpf_insn){ .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) })
+
+#define A_MOV_REG(d, s)         INSN(BPF_ALU64 | BPF_MOV | BPF_X, d, s, 0, 0)
+#define A_MOV_IMM(d, i)         INSN(BPF_ALU64 | BPF_MOV | BPF_K, d, 0, 0, i)
+#define A_ALU_IMM(op, d, i)     INSN(BPF_ALU64 | (op) | BPF_K, d, 0, 0, i)
+#define A_ALU_REG(op, d, s)     INSN(BPF_ALU64 | (op) | BPF_X, d, s, 0, 0)
+#define A_BE16(d)               INSN(BPF_ALU | BPF_END | BPF_TO_BE, d, 0, 0, 16)
+#define A_LDX(sz, d, s, o)      INSN(BPF_LDX | (sz) | BPF_MEM, d, s, o, 0)
+#define A_STX(sz, d, s, o)      INSN(BPF_STX | (sz) | BPF_MEM, d, s, o, 0)
+#define A_ST(sz, d, o, i)       INSN(BPF_ST | (sz) | BPF_MEM, d, 0, o, i)
+#define A_JMP_IMM(op, d, i, o)  INSN(BPF_JMP | (op) | BPF_K, d, 0, o, i)
+#define A_JMP_REG(op, d, s, o)  INSN(BPF_JMP | (op) | BPF_X, d, s, o, 0)
+#define A_CALL(fn)              INSN(BPF_JMP | BPF_CALL, 0, 0, 0, fn)
+#define A_EXIT()                INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+
+static inline void asm_init(struct bpf_asm *a)
+{
+    memset(a, 0, sizeof(*a));
+    for (int i = 0; i < BPF_ASM_LABELS; i++)
+        a->label[i] = -1;
+}
+
+static inline void asm_emit(struct bpf_asm *a, struct bpf_insn insn)
+{
+    if (a->n < BPF_ASM_MAX)
+        a->insn[a->n] = insn;
+    a->n++;
+}
+
+/* 64-bit immediate load of a map fd (two instruction slots) */
+static inline void asm_ld_map_fd(struct bpf_asm *a, int reg, int map_fd)
+{
+    asm_emit(a, INSN(BPF_LD | BPF_DW | BPF_IMM, reg, BPF_PSEUDO_MAP_FD, 0, map_fd));
+    asm_emit(a, INSN(0, 0, 0, 0, 0));
+}
+
+/*
+ * Jump to a label, patched by asm_finish(). op = BPF_JA for unconditional;
+ * otherwise compares reg with src (src >= 0) or with imm.
+ */
+static inline void asm_jmp(struct bpf_asm *a, int op, int reg, int imm, int src, int label)
+{
+    if (a->nfixup < BPF_ASM_FIXUPS) {
+        a->fixup[a->nfixup].at = a->n;
+        a->fixup[a->nfixup].label = label;
+        a->nfixup++;
+    } else {
+        a->n = BPF_ASM_MAX + 1;     /* poison: asm_finish() fails */
+    }
+    if (op == BPF_JA)
+        asm_emit(a, INSN(BPF_JMP | BPF_JA, 0, 0, 0, 0));
+    else
+        asm_emit(a, src >= 0 ? A_JMP_REG(op, reg, src, 0) : A_JMP_IMM(op, reg, imm, 0));
+}
+
+static inline void asm_jmp_pass(struct bpf_asm *a, int op, int reg, int imm, int src)
+{
+    asm_jmp(a, op, reg, imm, src, L_PASS);
+}
+
+static inline void asm_label(struct bpf_asm *a, int label)
+{
+    a->label[label] = a->n;
+}
+
+/* Bind L_PASS to "r0 = XDP_PASS; exit" */
+static inline void asm_pass_label(struct bpf_asm *a)
+{
+    asm_label(a, L_PASS);
+    asm_emit(a, A_MOV_IMM(BPF_REG_0, XDP_PASS));
+    asm_emit(a, A_EXIT());
+}
+
+/* Resolve jumps; returns the instruction count, or -1 if the program overflowed */
+static inline int asm_finish(struct bpf_asm *a)
+{
+    if (a->n > BPF_ASM_MAX)
+        return -1;
+    for (int i = 0; i < a->nfixup; i++) {
+        int target = a->label[a->fixup[i].label];
+        if (target < 0)
+            return -1;
+        a->insn[a->fixup[i].at].off = (int16_t)(target - a->fixup[i].at - 1);
+    }
+    return a->n;
+}
+
+/*
+ * Parse outer Ethernet/IPv4/UDP. Expects r6 = xdp_md; leaves r2 = data +
+ * outer IHL (so r2 + 14 is the UDP header) and r3 = data_end. Non-matching
+ * packets jump to the pass label.
+ */
+static inline void asm_outer_udp(struct bpf_asm *a, int port)
+{
+    asm_emit(a, A_LDX(BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct xdp_md, data)));
+    asm_emit(a, A_LDX(BPF_W, BPF_REG_3, BPF_REG_6, offsetof(struct xdp_md, data_end)));
+    asm_emit(a, A_MOV_REG(BPF_REG_4, BPF_REG_2));
+    asm_emit(a, A_ALU_IMM(BPF_ADD, BPF_REG_4, 14 + 20));
+    asm_jmp_pass(a, BPF_JGT, BPF_REG_4, 0, BPF_REG_3);
+    asm_emit(a, A_LDX(BPF_H, BPF_REG_4, BPF_REG_2, 12));                /* ethertype */
+    asm_jmp_pass(a, BPF_JNE, BPF_REG_4, htons(0x0800), -1);
+    asm_emit(a, A_LDX(BPF_B, BPF_REG_4, BPF_REG_2, 14 + 9));            /* ip proto */
+    asm_jmp_pass(a, BPF_JNE, BPF_REG_4, 17, -1);
+    asm_emit(a, A_LDX(BPF_B, BPF_REG_5, BPF_REG_2, 14));                /* ihl * 4 */
+    asm_emit(a, A_ALU_IMM(BPF_AND, BPF_REG_5, 0x0f));
+    asm_emit(a, A_ALU_IMM(BPF_LSH, BPF_REG_5, 2));
+    asm_jmp_pass(a, BPF_JLT, BPF_REG_5, 20, -1);
+    asm_emit(a, A_ALU_REG(BPF_ADD, BPF_REG_2, BPF_REG_5));
+    asm_emit(a, A_MOV_REG(BPF_REG_4, BPF_REG_2));
+    asm_emit(a, A_ALU_IMM(BPF_ADD, BPF_REG_4, 14 + 8));
+    asm_jmp_pass(a, BPF_JGT, BPF_REG_4, 0, BPF_REG_3);
+    asm_emit(a, A_LDX(BPF_H, BPF_REG_4, BPF_REG_2, 14 + 2));            /* udp dport */
+    asm_jmp_pass(a, BPF_JNE, BPF_REG_4, htons((uint16_t)port), -1);
+}
+
+/* AF_XDP steering: VXLAN port → XSKMAP[rx_queue_index], fallback XDP_PASS */
+static inline int xdp_redirect_prog(struct bpf_asm *a, int port, int xskmap_fd)
+{
+    asm_init(a);
+    asm_emit(a, A_MOV_REG(BPF_REG_6, BPF_REG_1));
+    asm_outer_udp(a, port);
+    asm_emit(a, A_LDX(BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct xdp_md, rx_queue_index)));
+    asm_ld_map_fd(a, BPF_REG_1, xskmap_fd);
+    asm_emit(a, A_MOV_IMM(BPF_REG_3, XDP_PASS));    /* action when the queue has no socket */
+    asm_emit(a, A_CALL(BPF_FUNC_redirect_map));
+    asm_emit(a, A_EXIT());
+    asm_pass_label(a);
+    return asm_finish(a);
+}
+
+/* ---- In-kernel aggregation maps (shared with fast_recv.c) ---- */
+
+/* Flow key: same fields and byte orders as ht_entry (IPs raw, ports host order) */
+struct xdp_flow_key {
+    uint32_t src_ip;
+    uint32_t dst_ip;
+    uint16_t src_port;
+    uint16_t dst_port;
+    uint8_t  proto;
+    uint8_t  _pad[3];
+};
+
+/* Per-CPU value of both flow maps */
+struct xdp_flow_val {
+    uint64_t packets;
+    uint64_t bytes;                 /* inner IPv4 total_len */
+};
+
+/* Per-CPU counters, PERCPU_ARRAY[0] */
+struct xdp_count_stats {
+    uint64_t pkts;                  /* VXLAN-port packets seen */
+    uint64_t bytes;                 /* their UDP payload bytes */
+    uint64_t parsed;                /* inner IPv4 packets counted into a flow */
+    uint64_t dropped_flows;         /* new flows rejected because the map was full */
+};
+
+#define FP_KEY(f)   (-16 + (int)offsetof(struct xdp_flow_key, f))
+
+enum { L_COUNT = 1, L_DROP, L_PORTS, L_INSERT0, L_INSERT1, L_MAP1 };
+
+/* flows[map] += {1, r7} for the key at fp-16; stats pointer in r8 */
+static inline void asm_count_into(struct bpf_asm *a, int flows_fd, int insert_label)
+{
+    asm_ld_map_fd(a, BPF_REG_1, flows_fd);
+    asm_emit(a, A_MOV_REG(BPF_REG_2, BPF_REG_10));
+    asm_emit(a, A_ALU_IMM(BPF_ADD, BPF_REG_2, -16));
+    asm_emit(a, A_CALL(BPF_FUNC_map_lookup_elem));
+    asm_jmp(a, BPF_JEQ, BPF_REG_0, 0, -1, insert_label);
+    asm_emit(a, A_LDX(BPF_DW, BPF_REG_1, BPF_REG_0, 0));
+    asm_emit(a, A_ALU_IMM(BPF_ADD, BPF_REG_1, 1));
+    asm_emit(a, A_STX(BPF_DW, BPF_REG_0, BPF_REG_1, 0));
+    asm_emit(a, A_LDX(BPF_DW, BPF_REG_1, BPF_REG_0, 8));
+    asm_emit(a, A_ALU_REG(BPF_ADD, BPF_REG_1, BPF_REG_7));
+    asm_emit(a, A_STX(BPF_DW, BPF_REG_0, BPF_REG_1, 8));
+    asm_jmp(a, BPF_JA, 0, 0, -1, L_DROP);
+
+    /* New flow on this CPU: value {1, total_len} at fp-32 */
+    asm_label(a, insert_label);
+    asm_emit(a, A_ST(BPF_DW, BPF_REG_10, -32, 1));
+    asm_emit(a, A_STX(BPF_DW, BPF_REG_10, BPF_REG_7, -24));
+    asm_ld_map_fd(a, BPF_REG_1, flows_fd);
+    asm_emit(a, A_MOV_REG(BPF_REG_2, BPF_REG_10));
+    asm_emit(a, A_ALU_IMM(BPF_ADD, BPF_REG_2, -16));
+    asm_emit(a, A_MOV_REG(BPF_REG_3, BPF_REG_10));
+    asm_emit(a, A_ALU_IMM(BPF_ADD, BPF_REG_3, -32));
+    asm_emit(a, A_MOV_IMM(BPF_REG_4, BPF_ANY));
+    asm_emit(a, A_CALL(BPF_FUNC_map_update_elem));
+    asm_jmp(a, BPF_JEQ, BPF_REG_0, 0, -1, L_DROP);
+    asm_emit(a, A_LDX(BPF_DW, BPF_REG_1, BPF_REG_8, offsetof(struct xdp_count_stats, dropped_flows)));
+    asm_emit(a, A_ALU_IMM(BPF_ADD, BPF_REG_1, 1));
+    asm_emit(a, A_STX(BPF_DW, BPF_REG_8, BPF_REG_1, offsetof(struct xdp_count_stats, dropped_flows)));
+    asm_jmp(a, BPF_JA, 0, 0, -1, L_DROP);
+}
+
+/*
+ * In-kernel aggregation. ctrl_fd is ARRAY[0] = index of the flow map the
+ * program writes; userspace flips it and drains the other one, the same
+ * active/standby scheme as the userspace flow tables.
+ *
+ * Registers: r6 ctx, r7 inner total_len, r8 UDP payload length (later the
+ * stats pointer), r9 = 1 once a flow key is built; without one the packet
+ * passes, uncounted. Stack: fp-16 key, fp-32 new value, fp-36 u32 zero key.
+ */
+static inline int xdp_count_prog(struct bpf_asm *a, int port, int ctrl_fd, int stats_fd,
+                                 const int flows_fd[2])
+{
+    asm_init(a);
+    asm_emit(a, A_MOV_REG(BPF_REG_6, BPF_REG_1));
+    asm_outer_udp(a, port);             /* r2 + 14 = UDP, r2 + 22 = VXLAN, r2 + 44 = inner IP */
+    asm_emit(a, A_MOV_IMM(BPF_REG_7, 0));
+    asm_emit(a, A_MOV_IMM(BPF_REG_9, 0));
+    asm_emit(a, A_ST(BPF_DW, BPF_REG_10, -16, 0));
+    asm_emit(a, A_ST(BPF_DW, BPF_REG_10, -8, 0));
+    asm_emit(a, A_LDX(BPF_H, BPF_REG_8, BPF_REG_2, 14 + 4));            /* udp length */
+    asm_emit(a, A_BE16(BPF_REG_8));
+    asm_jmp(a, BPF_JLT, BPF_REG_8, 8, -1, L_DROP);
+    asm_emit(a, A_ALU_IMM(BPF_SUB, BPF_REG_8, 8));
+
+    /* vxlan_parse_one(): VXLAN(8) + ETH(14) + IP(20) present, inner IPv4 */
+    asm_emit(a, A_MOV_REG(BPF_REG_4, BPF_REG_2));
+    asm_emit(a, A_ALU_IMM(BPF_ADD, BPF_REG_4, 44 + 20));
+    asm_jmp(a, BPF_JGT, BPF_REG_4, 0, BPF_REG_3, L_COUNT);
+    asm_emit(a, A_LDX(BPF_H, BPF_REG_4, BPF_REG_2, 22 + 8 + 12));       /* inner ethertype */
+    asm_jmp(a, BPF_JNE, BPF_REG_4, htons(0x0800), -1, L_COUNT);
+    asm_emit(a, A_LDX(BPF_B, BPF_REG_5, BPF_REG_2, 44));                /* inner ihl * 4 */
+    asm_emit(a, A_ALU_IMM(BPF_AND, BPF_REG_5, 0x0f));
+    asm_emit(a, A_ALU_IMM(BPF_LSH, BPF_REG_5, 2));
+    asm_jmp(a, BPF_JLT, BPF_REG_5, 20, -1, L_COUNT);
+    asm_emit(a, A_MOV_REG(BPF_REG_1, BPF_REG_2));
+    asm_emit(a, A_ALU_REG(BPF_ADD, BPF_REG_1, BPF_REG_5));            /* r1 + 44 = inner L4 */
+    asm_emit(a, A_MOV_REG(BPF_REG_4, BPF_REG_1));
+    asm_emit(a, A_ALU_IMM(BPF_ADD, BPF_REG_4, 44));
+    asm_jmp(a, BPF_JGT, BPF_REG_4, 0, BPF_REG_3, L_COUNT);
+
+    asm_emit(a, A_LDX(BPF_H, BPF_REG_7, BPF_REG_2, 44 + 2));            /* total_len */
+    asm_emit(a, A_BE16(BPF_REG_7));
+    asm_emit(a, A_LDX(BPF_W, BPF_REG_4, BPF_REG_2, 44 + 12));
+    asm_emit(a, A_STX(BPF_W, BPF_REG_10, BPF_REG_4, FP_KEY(src_ip)));
+    asm_emit(a, A_LDX(BPF_W, BPF_REG_4, BPF_REG_2, 44 + 16));
+    asm_emit(a, A_STX(BPF_W, BPF_REG_10, BPF_REG_4, FP_KEY(dst_ip)));
+    asm_emit(a, A_LDX(BPF_B, BPF_REG_4, BPF_REG_2, 44 + 9));
+    asm_emit(a, A_STX(BPF_B, BPF_REG_10, BPF_REG_4, FP_KEY(proto)));
+    asm_emit(a, A_MOV_IMM(BPF_REG_9, 1));
+    asm_jmp(a, BPF_JEQ, BPF_REG_4, 6, -1, L_PORTS);
+    asm_jmp(a, BPF_JNE, BPF_REG_4, 17, -1, L_COUNT);
+    asm_label(a, L_PORTS);
+    asm_emit(a, A_MOV_REG(BPF_REG_4, BPF_REG_1));
+    asm_emit(a, A_ALU_IMM(BPF_ADD, BPF_REG_4, 44 + 4));
+    asm_jmp(a, BPF_JGT, BPF_REG_4, 0, BPF_REG_3, L_COUNT);
+    asm_emit(a, A_LDX(BPF_H, BPF_REG_4, BPF_REG_1, 44));
+    asm_emit(a, A_BE16(BPF_REG_4));
+    asm_emit(a, A_STX(BPF_H, BPF_REG_10, BPF_REG_4, FP_KEY(src_port)));
+    asm_emit(a, A_LDX(BPF_H, BPF_REG_4, BPF_REG_1, 44 + 2));
+    asm_emit(a, A_BE16(BPF_REG_4));
+    asm_emit(a, A_STX(BPF_H, BPF_REG_10, BPF_REG_4, FP_KEY(dst_port)));
+
+    /* stats[0] += {1, payload, parsed} */
+    asm_label(a, L_COUNT);
+    asm_jmp(a, BPF_JEQ, BPF_REG_9, 0, -1, L_PASS);
+    asm_emit(a, A_ST(BPF_W, BPF_REG_10, -36, 0));
+    asm_ld_map_fd(a, BPF_REG_1, stats_fd);
+    asm_emit(a, A_MOV_REG(BPF_REG_2, BPF_REG_10));
+    asm_emit(a, A_ALU_IMM(BPF_ADD, BPF_REG_2, -36));
+    asm_emit(a, A_CALL(BPF_FUNC_map_lookup_elem));
+    asm_jmp(a, BPF_JEQ, BPF_REG_0, 0, -1, L_DROP);
+    asm_emit(a, A_LDX(BPF_DW, BPF_REG_1, BPF_REG_0, offsetof(struct xdp_count_stats, pkts)));
+    asm_emit(a, A_ALU_IMM(BPF_ADD, BPF_REG_1, 1));
+    asm_emit(a, A_STX(BPF_DW, BPF_REG_0, BPF_REG_1, offsetof(struct xdp_count_stats, pkts)));
+    asm_emit(a, A_LDX(BPF_DW, BPF_REG_1, BPF_REG_0, offsetof(struct xdp_count_stats, bytes)));
+    asm_emit(a, A_ALU_REG(BPF_ADD, BPF_REG_1, BPF_REG_8));
+    asm_emit(a, A_STX(BPF_DW, BPF_REG_0, BPF_REG_1, offsetof(struct xdp_count_stats, bytes)));
+    asm_emit(a, A_LDX(BPF_DW, BPF_REG_1, BPF_REG_0, offsetof(struct xdp_count_stats, parsed)));
+    asm_emit(a, A_ALU_REG(BPF_ADD, BPF_REG_1, BPF_REG_9));
+    asm_emit(a, A_STX(BPF_DW, BPF_REG_0, BPF_REG_1, offsetof(struct xdp_count_stats, parsed)));
+    asm_emit(a, A_MOV_REG(BPF_REG_8, BPF_REG_0));
+
+    /* Pick the active flow map; each branch gets its own copy of the update */
+    asm_ld_map_fd(a, BPF_REG_1, ctrl_fd);
+    asm_emit(a, A_MOV_REG(BPF_REG_2, BPF_REG_10));
+    asm_emit(a, A_ALU_IMM(BPF_ADD, BPF_REG_2, -36));
+    asm_emit(a, A_CALL(BPF_FUNC_map_lookup_elem));
+    asm_jmp(a, BPF_JEQ, BPF_REG_0, 0, -1, L_DROP);
+    asm_emit(a, A_LDX(BPF_W, BPF_REG_1, BPF_REG_0, 0));
+    asm_jmp(a, BPF_JNE, BPF_REG_1, 0, -1, L_MAP1);
+    asm_count_into(a, flows_fd[0], L_INSERT0);
+    asm_label(a, L_MAP1);
+    asm_count_into(a, flows_fd[1], L_INSERT1);
+
+    asm_label(a, L_DROP);
+    asm_emit(a, A_MOV_IMM(BPF_REG_0, XDP_DROP));
+    asm_emit(a, A_EXIT());
+    asm_pass_label(a);
+    return asm_finish(a);
+}
+
+#endif /* XDP_PROG_H */
@@ -107,6 +107,8 @@ PROBE_SG_ID=$(create_sg_if_not_exists \
     "PROBE_SG_ID")
 
 ensure_sg_ingress "$PROBE_SG_ID" --protocol udp --port 4789 --cidr "$VPC_CIDR"
+# PROBE_COUNT > 1: probes send interval deltas to the aggregator on the first probe
+ensure_sg_ingress "$PROBE_SG_ID" --protocol tcp --port "${AGGREGATOR_PORT:-4790}" --cidr "$VPC_CIDR"
 ensure_sg_ingress "$PROBE_SG_ID" --protocol tcp --port 22 --cidr "$ADMIN_CIDR"
 ensure_sg_ingress "$PROBE_SG_ID" --protocol tcp --port 22 --cidr "$VPC_CIDR"
 
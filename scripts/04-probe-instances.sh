@@ -26,11 +26,17 @@ else
         --tags "Key=Project,Value=${PROJECT_TAG}" 2>/dev/null \
         || log_info "IAM role already exists"
 
+    # Flow export files are uploaded to EXPORT_S3_BUCKET when one is configured
+    EXPORT_STATEMENT=""
+    if [[ -n "${EXPORT_S3_BUCKET:-}" ]]; then
+        EXPORT_STATEMENT=',
+            {"Effect":"Allow","Action":"s3:PutObject","Resource":"arn:aws:s3:::'"${EXPORT_S3_BUCKET}/${EXPORT_S3_PREFIX:-flows/}"'*"}'
+    fi
     PROBE_POLICY='{
         "Version":"2012-10-17",
         "Statement":[
-            {"Effect":"Allow","Action":["ec2:DescribeInstances","ec2:DescribeNetworkInterfaces"],"Resource":"*"},
-            {"Effect":"Allow","Action":"sns:Publish","Resource":"'"${SNS_TOPIC_ARN:-*}"'"}
+            {"Effect":"Allow","Action":["ec2:DescribeInstances","ec2:DescribeNetworkInterfaces","ec2:DescribeSubnets","ec2:DescribeVpcs"],"Resource":"*"},
+            {"Effect":"Allow","Action":"sns:Publish","Resource":"'"${SNS_TOPIC_ARN:-*}"'"}'"${EXPORT_STATEMENT}"'
         ]
     }'
     aws iam put-role-policy \
@@ -50,6 +50,14 @@ fi
 
 log_info "Deploying probe to ${#PROBE_IPS[@]} instance(s)"
 
+# More than one probe: each sees only its share, the first one also runs the
+# aggregator and every probe sends it interval deltas for global alerts
+AGGREGATOR_ADDR=""
+if [[ ${#PROBE_IPS[@]} -gt 1 ]]; then
+    AGGREGATOR_ADDR="${PROBE_IPS[0]}:${AGGREGATOR_PORT:-4790}"
+    log_info "Aggregator on ${AGGREGATOR_ADDR}"
+fi
+
 SYSTEMD_UNIT="[Unit]
 Description=DX Traffic Monitor Probe
 After=network.target
@@ -60,6 +68,8 @@ User=root
 ExecStart=/usr/bin/python3 /home/ec2-user/probe/multiproc_probe.py
 Restart=always
 RestartSec=5
+KillMode=mixed
+StateDirectory=dx-probe
 LimitNOFILE=1048576
 Environment=AWS_REGION=${AWS_REGION}
 Environment=SNS_TOPIC_ARN=${SNS_TOPIC_ARN}
@@ -67,10 +77,63 @@ Environment=ALERT_THRESHOLD_BPS=${ALERT_THRESHOLD_BPS}
 Environment=ALERT_THRESHOLD_PPS=${ALERT_THRESHOLD_PPS}
 Environment=ALERT_HOST_BPS=${ALERT_HOST_BPS:-0}
 Environment=ALERT_HOST_PPS=${ALERT_HOST_PPS:-0}
+Environment=ALERT_SURGE_FACTOR=${ALERT_SURGE_FACTOR:-0}
+Environment=ALERT_SURGE_MIN_BPS=${ALERT_SURGE_MIN_BPS:-100000000}
 Environment=SLACK_WEBHOOK_URL=${SLACK_WEBHOOK_URL:-}
 Environment=VPC_ID=${VPC_ID}
+Environment=ONPREM_CIDRS=${ONPREM_CIDRS:-}
 Environment=PROBE_WORKERS=0
 Environment=PROBE_SAMPLE_RATE=1.0
+Environment=PROBE_PKT_SAMPLE_N=1
+Environment=PROBE_BACKEND=${PROBE_BACKEND:-socket}
+Environment=PROBE_XDP_IFACE=${PROBE_XDP_IFACE:-eth0}
+Environment=PROBE_MAX_FLOWS=${PROBE_MAX_FLOWS:-65536}
+Environment=PROBE_MAX_FLOWS_LIMIT=${PROBE_MAX_FLOWS_LIMIT:-2097152}
+Environment=PROBE_HUGEPAGES=${PROBE_HUGEPAGES:-0}
+Environment=PROBE_PIN_CPUS=${PROBE_PIN_CPUS:-0}
+Environment=PROBE_STEERING=${PROBE_STEERING:-none}
+Environment=PROBE_RX_MODE=${PROBE_RX_MODE:-blocking}
+Environment=PROBE_BUSY_POLL_US=${PROBE_BUSY_POLL_US:-50}
+Environment=PROBE_UDP_GRO=${PROBE_UDP_GRO:-0}
+Environment=PROBE_VNIS=${PROBE_VNIS:-${MIRROR_VNI:-}}
+Environment=PROBE_TRACK_SOURCES=${PROBE_TRACK_SOURCES:-0}
+Environment=PROBE_EXT_COUNTERS=${PROBE_EXT_COUNTERS:-0}
+Environment=PROBE_HOST_WINDOW_MS=${PROBE_HOST_WINDOW_MS:-100}
+Environment=PROBE_METRICS_PORT=${PROBE_METRICS_PORT:-0}
+Environment=PROBE_METRICS_ADDR=${PROBE_METRICS_ADDR:-127.0.0.1}
+Environment=AGGREGATOR_ADDR=${AGGREGATOR_ADDR}
+Environment=EXPORT_IPFIX_ADDR=${EXPORT_IPFIX_ADDR:-}
+Environment=EXPORT_DIR=${EXPORT_DIR:-}
+Environment=EXPORT_ROTATE_SEC=${EXPORT_ROTATE_SEC:-3600}
+Environment=EXPORT_S3_BUCKET=${EXPORT_S3_BUCKET:-}
+Environment=EXPORT_S3_PREFIX=${EXPORT_S3_PREFIX:-flows/}
+Environment=PROBE_STATE_DIR=${PROBE_STATE_DIR-/var/lib/dx-probe}
+
+[Install]
+WantedBy=multi-user.target"
+
+AGGREGATOR_UNIT="[Unit]
+Description=DX Traffic Monitor Aggregator
+After=network.target
+
+[Service]
+Type=simple
+User=root
+ExecStart=/usr/bin/python3 /home/ec2-user/probe/aggregator.py
+Restart=always
+RestartSec=5
+Environment=AWS_REGION=${AWS_REGION}
+Environment=SNS_TOPIC_ARN=${SNS_TOPIC_ARN}
+Environment=ALERT_THRESHOLD_BPS=${ALERT_THRESHOLD_BPS}
+Environment=ALERT_THRESHOLD_PPS=${ALERT_THRESHOLD_PPS}
+Environment=ALERT_HOST_BPS=${ALERT_HOST_BPS:-0}
+Environment=ALERT_HOST_PPS=${ALERT_HOST_PPS:-0}
+Environment=ALERT_SURGE_FACTOR=${ALERT_SURGE_FACTOR:-0}
+Environment=ALERT_SURGE_MIN_BPS=${ALERT_SURGE_MIN_BPS:-100000000}
+Environment=SLACK_WEBHOOK_URL=${SLACK_WEBHOOK_URL:-}
+Environment=VPC_ID=${VPC_ID}
+Environment=ONPREM_CIDRS=${ONPREM_CIDRS:-}
+Environment=AGGREGATOR_LISTEN=0.0.0.0:${AGGREGATOR_PORT:-4790}
 
 [Install]
 WantedBy=multi-user.target"
@@ -92,9 +155,9 @@ for IP in "${PROBE_IPS[@]}"; do
 ${SYSTEMD_UNIT}
 UNIT_EOF"
 
-    # Enable and start
+    # Enable and (re)start: a running probe saves its open window to PROBE_STATE_DIR, the new one resumes it
     log_info "Starting dx-probe service on $IP"
-    ssh $SSH_OPTS "ec2-user@${IP}" "sudo systemctl daemon-reload && sudo systemctl enable dx-probe && sudo systemctl start dx-probe"
+    ssh $SSH_OPTS "ec2-user@${IP}" "sudo systemctl daemon-reload && sudo systemctl enable dx-probe && sudo systemctl restart dx-probe"
 
     # Verify
     STATUS=$(ssh $SSH_OPTS "ec2-user@${IP}" "sudo systemctl is-active dx-probe" || true)
@@ -104,6 +167,14 @@ UNIT_EOF"
         log_error "dx-probe failed to start on $IP (status: $STATUS)"
         exit 1
     fi
+
+    if [[ -n "$AGGREGATOR_ADDR" && "$IP" == "${PROBE_IPS[0]}" ]]; then
+        log_info "Starting dx-aggregator service on $IP"
+        ssh $SSH_OPTS "ec2-user@${IP}" "sudo tee /etc/systemd/system/dx-aggregator.service > /dev/null << 'UNIT_EOF'
+${AGGREGATOR_UNIT}
+UNIT_EOF"
+        ssh $SSH_OPTS "ec2-user@${IP}" "sudo systemctl daemon-reload && sudo systemctl enable dx-aggregator && sudo systemctl restart dx-aggregator"
+    fi
 done
 
 log_info "Probe deployed to all ${#PROBE_IPS[@]} instance(s)"
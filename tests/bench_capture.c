@@ -0,0 +1,369 @@
+/*
+ * Capture pipeline microbenchmark: drives fast_recv.c's parse, hash, flow
+ * table and flush code directly from in-memory VXLAN packets, without
+ * sockets, Python or the coordinator. For each flow cardinality it reports
+ * - hash:   ns per hash_key()
+ * - parse:  ns per packet through vxlan_parse_batch()
+ * - record: ns per packet through record_packet()/record_flush(), the
+ *           capture thread's path into the active table (sampling off)
+ * - probes: linear-probe displacement histogram of the filled table
+ * - flush:  cap_flush() latency (swap + drain to the flush buffer)
+ * and, where perf_event_open() is allowed, cache misses per packet of the
+ * record phase. hash and parse are the best of -r repetitions, record and
+ * flush the median and minimum, all after warm-up; the corpus and the hash
+ * seed are fixed, so runs compare.
+ *
+ * Output is a text table, or with -j one JSON object per cardinality. -b
+ * compares record_ns against such a file and exits 2 if any cardinality is
+ * more than -t percent slower.
+ *
+ * Compile: gcc -O2 -o bench_capture tests/bench_capture.c -lpthread
+ * Usage:   ./bench_capture [-f flows,...] [-n packets] [-r reps] [-s seed] [-j] [-b baseline.jsonl [-t pct]]
+ */
+#include "../probe/fast_recv.c"
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#define PROBE_BUCKETS 8     /* displacement 0, 1, 2, 3, 4-7, 8-15, 16-31, 32+ */
+#define MAX_CARDS     16
+
+struct result {
+    int flows;
+    long packets;
+    double hash_ns, parse_ns, record_ns, record_min_ns, flush_us, flush_min_us;
+    double misses_per_pkt;          /* -1 = perf counters unavailable */
+    uint64_t probes[PROBE_BUCKETS];
+    double probe_mean;
+    uint32_t probe_max;
+    int table_flows, flushed;
+    uint64_t probe_failures, dropped_flows;
+};
+
+static double now_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double median(double *v, int n)
+{
+    qsort(v, n, sizeof(*v), cmp_double);
+    return n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+/* Hardware cache-miss counter for this thread, or -1 (containers, no PMU) */
+static int perf_open(void)
+{
+    struct perf_event_attr pe;
+    memset(&pe, 0, sizeof(pe));
+    pe.type = PERF_TYPE_HARDWARE;
+    pe.size = sizeof(pe);
+    pe.config = PERF_COUNT_HW_CACHE_MISSES;
+    pe.disabled = 1;
+    pe.exclude_kernel = 1;
+    pe.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &pe, 0, -1, -1, 0);
+}
+
+static uint64_t perf_read(int fd)
+{
+    uint64_t v = 0;
+    if (fd < 0 || read(fd, &v, sizeof(v)) != sizeof(v))
+        return 0;
+    return v;
+}
+
+/* Flow f: TCP/UDP mix over 10.x / 172.16.x addresses, as tests/vxlan_flood.c v2 */
+static void build_packet(uint8_t *buf, uint32_t f)
+{
+    memset(buf, 0, 64);
+    buf[0] = 0x08;
+    buf[4] = (12345 >> 16) & 0xFF;
+    buf[5] = (12345 >> 8) & 0xFF;
+    buf[6] = 12345 & 0xFF;
+    buf[8 + 12] = 0x08;
+    int off = 22;
+    buf[off] = 0x45;
+    buf[off + 3] = 42;
+    buf[off + 9] = (f % 3 == 0) ? 17 : 6;
+    buf[off + 12] = 10;
+    buf[off + 13] = (f >> 16) & 0xFF;
+    buf[off + 14] = (f >> 8) & 0xFF;
+    buf[off + 15] = (f & 0xFF) | 1;
+    buf[off + 16] = 172;
+    buf[off + 17] = 16 + ((f >> 16) & 0x0F);
+    buf[off + 18] = (f >> 8) & 0xFF;
+    buf[off + 19] = (f & 0xFF) | 1;
+    uint16_t sport = htons(1024 + f % 60000), dport = htons(80 + f % 1000);
+    memcpy(buf + 42, &sport, 2);
+    memcpy(buf + 44, &dport, 2);
+}
+
+/* Displacement of every occupied slot from its home slot */
+static void probe_stats(const struct flow_table *t, uint64_t seed, struct result *r)
+{
+    uint64_t sum = 0;
+    memset(r->probes, 0, sizeof(r->probes));
+    r->probe_max = 0;
+    for (int i = 0; i < t->num_flows; i++) {
+        uint32_t idx = t->used[i];
+        uint32_t d = (idx - (uint32_t)hash_key(seed, &t->entries[idx].key)) & t->mask;
+        int b = d < 4 ? (int)d : d < 8 ? 4 : d < 16 ? 5 : d < 32 ? 6 : 7;
+        r->probes[b]++;
+        sum += d;
+        if (d > r->probe_max)
+            r->probe_max = d;
+    }
+    r->probe_mean = t->num_flows ? (double)sum / t->num_flows : 0;
+}
+
+static int run(int flows, long npkts, int reps, uint64_t seed, struct result *r)
+{
+    struct cap_config cfg;
+    cap_config_init(&cfg);
+    cfg.port = 0;   /* the socket is never read */
+    if (flows > cfg.max_flows_limit)
+        cfg.max_flows_limit = flows;
+    capture_ctx_t *ctx = cap_create_ex(&cfg);
+    uint8_t (*pk)[64] = malloc((size_t)flows * 64);
+    uint32_t *order = malloc((size_t)npkts * sizeof(uint32_t));
+    const uint8_t **ptrs = malloc((size_t)npkts * sizeof(*ptrs));
+    int *lens = malloc((size_t)npkts * sizeof(int));
+    struct ht_key *keys = malloc((size_t)flows * sizeof(*keys));
+    double *rec = calloc(reps, sizeof(double)), *fl = calloc(reps, sizeof(double));
+    if (!ctx || !pk || !order || !ptrs || !lens || !keys || !rec || !fl) {
+        fprintf(stderr, "Error: setup failed for %d flows\n", flows);
+        return -1;
+    }
+    /* Fixed seed: the same slots, probe chains and growth on every run */
+    ctx->hash_seed = ctx->tables[0].seed = ctx->tables[1].seed = seed;
+
+    uint32_t x = (uint32_t)seed | 1;
+    for (int f = 0; f < flows; f++)
+        build_packet(pk[f], f);
+    for (long i = 0; i < npkts; i++) {
+        x = x * 1664525u + 1013904223u;
+        order[i] = (uint32_t)(((uint64_t)x * flows) >> 32);
+        ptrs[i] = pk[order[i]];
+        lens[i] = 64;
+    }
+
+    memset(r, 0, sizeof(*r));
+    r->flows = flows;
+    r->packets = npkts;
+
+    /* hash: one key per flow, cycled */
+    for (int f = 0; f < flows; f++) {
+        struct vxlan_batch *b = &ctx->parsed;
+        const uint8_t *p = pk[f];
+        int len = 64;
+        vxlan_parse_batch(&p, &len, 1, b);
+        keys[f] = batch_key(b, 0);
+    }
+    double best = 1e18;
+    uint64_t sink = 0;
+    for (int rep = 0; rep <= reps; rep++) {
+        double a = now_ns();
+        for (long i = 0; i < npkts; i++)
+            sink += hash_key(seed, &keys[order[i]]);
+        double el = (now_ns() - a) / npkts;
+        if (rep && el < best)
+            best = el;
+    }
+    r->hash_ns = best;
+
+    /* parse */
+    best = 1e18;
+    for (int rep = 0; rep <= reps; rep++) {
+        double a = now_ns();
+        for (long i = 0; i < npkts; i += VXLAN_BATCH) {
+            int n = npkts - i < VXLAN_BATCH ? (int)(npkts - i) : VXLAN_BATCH;
+            sink += vxlan_parse_batch(ptrs + i, lens + i, n, &ctx->parsed);
+        }
+        double el = (now_ns() - a) / npkts;
+        if (rep && el < best)
+            best = el;
+    }
+    r->parse_ns = best;
+
+    /* record + flush: cap_flush() alternates the two tables, so the first two
+     * reps (which grow them) are warm-up */
+    int pfd = perf_open();
+    uint64_t misses = 0;
+    for (int rep = -2; rep < reps; rep++) {
+        struct flow_table *t = atomic_load(&ctx->active);
+        if (pfd >= 0) {
+            ioctl(pfd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(pfd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+        double a = now_ns();
+        for (long i = 0; i < npkts; i++)
+            record_packet(ctx, t, ptrs[i], 64, 0);
+        record_flush(ctx, t);
+        double el = (now_ns() - a) / npkts;
+        if (pfd >= 0) {
+            ioctl(pfd, PERF_EVENT_IOC_DISABLE, 0);
+            if (rep >= 0)
+                misses += perf_read(pfd);
+        }
+        if (rep == reps - 1) {
+            probe_stats(t, seed, r);
+            r->table_flows = t->num_flows;
+            r->probe_failures = t->probe_failures;
+            r->dropped_flows = t->dropped_flows;
+        }
+        a = now_ns();
+        int n = cap_flush(ctx);
+        double fus = (now_ns() - a) / 1e3;
+        if (rep >= 0) {
+            rec[rep] = el;
+            fl[rep] = fus;
+            r->flushed = n;
+        }
+    }
+    r->misses_per_pkt = pfd >= 0 ? (double)misses / ((double)npkts * reps) : -1;
+    if (pfd >= 0)
+        close(pfd);
+    r->record_ns = median(rec, reps);     /* sorts: [0] is then the minimum */
+    r->record_min_ns = rec[0];
+    r->flush_us = median(fl, reps);
+    r->flush_min_us = fl[0];
+
+    if (sink == 42)
+        fprintf(stderr, " ");
+    cap_destroy(ctx);
+    free(pk);
+    free(order);
+    free(ptrs);
+    free(lens);
+    free(keys);
+    free(rec);
+    free(fl);
+    return 0;
+}
+
+static void print_json(const struct result *r)
+{
+    printf("{\"flows\":%d,\"packets\":%ld,\"hash_ns\":%.2f,\"parse_ns\":%.2f,\"record_ns\":%.2f,"
+           "\"record_min_ns\":%.2f,\"flush_us\":%.1f,\"flush_min_us\":%.1f,\"cache_misses_per_pkt\":",
+           r->flows, r->packets, r->hash_ns, r->parse_ns, r->record_ns, r->record_min_ns,
+           r->flush_us, r->flush_min_us);
+    if (r->misses_per_pkt < 0)
+        printf("null");
+    else
+        printf("%.3f", r->misses_per_pkt);
+    printf(",\"table_flows\":%d,\"flushed\":%d,\"probe_failures\":%lu,\"dropped_flows\":%lu,"
+           "\"probe_mean\":%.3f,\"probe_max\":%u,\"probe_hist\":[",
+           r->table_flows, r->flushed, (unsigned long)r->probe_failures, (unsigned long)r->dropped_flows,
+           r->probe_mean, r->probe_max);
+    for (int b = 0; b < PROBE_BUCKETS; b++)
+        printf("%s%lu", b ? "," : "", (unsigned long)r->probes[b]);
+    printf("]}\n");
+}
+
+static void print_text(const struct result *r, int header)
+{
+    if (header)
+        printf("%9s %7s %7s %9s %9s %9s %8s  %-36s\n", "flows", "hash", "parse", "record", "flush_us",
+               "miss/pkt", "p_mean", "displacement 0/1/2/3/4-7/8-15/16-31/32+");
+    char miss[16];
+    if (r->misses_per_pkt < 0)
+        snprintf(miss, sizeof(miss), "n/a");
+    else
+        snprintf(miss, sizeof(miss), "%.3f", r->misses_per_pkt);
+    printf("%9d %7.2f %7.2f %9.2f %9.1f %9s %8.3f  ", r->flows, r->hash_ns, r->parse_ns, r->record_ns,
+           r->flush_us, miss, r->probe_mean);
+    for (int b = 0; b < PROBE_BUCKETS; b++)
+        printf("%s%lu", b ? "/" : "", (unsigned long)r->probes[b]);
+    if (r->probe_failures || r->dropped_flows)
+        printf("  probe_failures=%lu dropped=%lu", (unsigned long)r->probe_failures,
+               (unsigned long)r->dropped_flows);
+    printf("\n");
+}
+
+/* record_ns of the baseline line for `flows`, or -1 */
+static double baseline_record_ns(const char *path, int flows)
+{
+    FILE *f = fopen(path, "r");
+    char line[1024];
+    double v = -1;
+    if (!f)
+        return -1;
+    while (fgets(line, sizeof(line), f)) {
+        int fl;
+        const char *p = strstr(line, "\"record_ns\":");
+        if (sscanf(line, "{\"flows\":%d", &fl) == 1 && fl == flows && p) {
+            v = atof(p + strlen("\"record_ns\":"));
+            break;
+        }
+    }
+    fclose(f);
+    return v;
+}
+
+int main(int argc, char *argv[])
+{
+    int cards[MAX_CARDS] = {1000, 10000, 100000, 1000000}, ncards = 4;
+    long npkts = 4000000;
+    int reps = 5, json = 0, opt;
+    uint64_t seed = 0x5eed;
+    const char *baseline = NULL;
+    double tolerance = 10;
+
+    while ((opt = getopt(argc, argv, "f:n:r:s:jb:t:")) != -1) {
+        switch (opt) {
+        case 'f': {
+            ncards = 0;
+            char *save = NULL;
+            for (char *tok = strtok_r(optarg, ",", &save); tok && ncards < MAX_CARDS;
+                 tok = strtok_r(NULL, ",", &save))
+                cards[ncards++] = atoi(tok);
+            break;
+        }
+        case 'n': npkts = atol(optarg); break;
+        case 'r': reps = atoi(optarg); break;
+        case 's': seed = strtoull(optarg, NULL, 0); break;
+        case 'j': json = 1; break;
+        case 'b': baseline = optarg; break;
+        case 't': tolerance = atof(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-f flows,...] [-n packets] [-r reps] [-s seed] [-j] "
+                            "[-b baseline.jsonl [-t pct]]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (ncards < 1 || npkts < VXLAN_BATCH || reps < 1) {
+        fprintf(stderr, "Error: need flows, packets >= %d and reps >= 1\n", VXLAN_BATCH);
+        return 1;
+    }
+
+    int regressed = 0;
+    for (int c = 0; c < ncards; c++) {
+        struct result r;
+        if (cards[c] < 1 || run(cards[c], npkts, reps, seed, &r) < 0)
+            return 1;
+        if (json)
+            print_json(&r);
+        else
+            print_text(&r, c == 0);
+        fflush(stdout);
+        if (baseline) {
+            double base = baseline_record_ns(baseline, r.flows);
+            if (base > 0 && r.record_ns > base * (1 + tolerance / 100)) {
+                fprintf(stderr, "REGRESSION: %d flows record %.2f ns/pkt vs baseline %.2f (%+.0f%%)\n",
+                        r.flows, r.record_ns, base, (r.record_ns / base - 1) * 100);
+                regressed = 1;
+            }
+        }
+    }
+    return regressed ? 2 : 0;
+}
@@ -5,13 +5,15 @@ BUCKET="dx-monitoring-deploy-${AWS_ACCOUNT_ID}"  # set AWS_ACCOUNT_ID in env
 NLB_DNS="$1"
 DURATION="${2:-30}"
 THREADS="${3:-8}"
+FLOWS="${4:-100000}"
+FLOOD_OPTS="${FLOOD_OPTS:-}"  # e.g. "-z 1.1 -R 10" for a Zipf, rotating DDoS profile
 
 # Install deps
 yum install -y gcc 2>/dev/null || true
 
 # Download and compile flood tool
 aws s3 cp "s3://$BUCKET/vxlan_flood.c" /tmp/vxlan_flood.c --region eu-central-1
-gcc -O2 -o /tmp/vxlan_flood /tmp/vxlan_flood.c -lpthread
+gcc -O2 -o /tmp/vxlan_flood /tmp/vxlan_flood.c -lpthread -lm
 echo "Compiled vxlan_flood"
 
 # Resolve NLB IP
@@ -19,6 +21,7 @@ NLB_IP=$(getent hosts "$NLB_DNS" | head -1 | awk '{print $1}')
 echo "NLB DNS: $NLB_DNS -> IP: $NLB_IP"
 
 # Run flood
-echo "Starting VXLAN flood: target=$NLB_IP:4789 threads=$THREADS duration=${DURATION}s"
-/tmp/vxlan_flood "$NLB_IP" 4789 "$THREADS" "$DURATION"
+echo "Starting VXLAN flood: target=$NLB_IP:4789 threads=$THREADS duration=${DURATION}s flows=$FLOWS $FLOOD_OPTS"
+# shellcheck disable=SC2086
+/tmp/vxlan_flood $FLOOD_OPTS "$NLB_IP" 4789 "$THREADS" "$DURATION" 128 "$FLOWS"
 echo "Flood complete"
@@ -0,0 +1,175 @@
+"""Tests for agg_protocol.py — interval delta codec, framing, sketches and the uplink."""
+
+import io
+import os
+import random
+import socket
+import struct
+import sys
+import time
+
+import pytest
+
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), "..", "probe"))
+
+import multiproc_probe
+from agg_protocol import (
+    MAX_PROBE_NAME,
+    SKETCH_DEPTH,
+    SKETCH_WIDTH,
+    DeltaUplink,
+    IntervalDelta,
+    decode,
+    encode,
+    frame,
+    read_frame,
+    sketch_column,
+    sketch_estimate,
+)
+from multiproc_probe import FLOW_REC_EXACT, FlowMerge
+
+PROBE_DIR = os.path.join(os.path.dirname(__file__), "..", "probe")
+SO_PATH = os.path.join(PROBE_DIR, "flow_merge.so")
+
+
+def _ip(addr: str) -> int:
+    return struct.unpack("=I", socket.inet_aton(addr))[0]
+
+
+def _delta(**fields) -> IntervalDelta:
+    d = IntervalDelta("probe-a", 7, 1_700_000_000_000, 5000, 123456, 98765432)
+    d.flows = [(_ip("10.0.1.1"), _ip("10.0.2.2"), 1234, 80, 6, 100, 150000),
+               (_ip("10.0.1.1"), _ip("10.0.0.9"), 53, 53, 17, 3, 300),
+               (_ip("192.168.1.1"), _ip("10.0.2.2"), 0, 0, 1, 1, 64)]
+    d.src_hosts = [(_ip("10.0.1.1"), 103, 150300), (_ip("192.168.1.1"), 1, 64)]
+    d.dst_hosts = [(_ip("10.0.2.2"), 101, 150064)]
+    for k, v in fields.items():
+        setattr(d, k, v)
+    return d
+
+
+def _sorted(d: IntervalDelta) -> IntervalDelta:
+    d.flows.sort()
+    d.src_hosts.sort()
+    d.dst_hosts.sort()
+    return d
+
+
+class TestCodec:
+    def test_roundtrip(self):
+        d = _delta(depth=2, width=8, sketch=[0] * 10 + [5, 0, 7] + [0] * 50 + [1])
+        assert _sorted(decode(encode(d))) == _sorted(_delta(depth=2, width=8, sketch=d.sketch))
+
+    def test_roundtrip_empty(self):
+        d = IntervalDelta("p", 0, 0, 5000, 0, 0)
+        assert decode(encode(d)) == d
+
+    def test_compact(self):
+        rng = random.Random(1)
+        d = _delta(flows=[(_ip("10.0.%d.%d" % (rng.randrange(4), rng.randrange(256))), _ip("10.1.0.%d" % rng.randrange(256)),
+                           rng.randrange(65536), 443, 6, rng.randrange(1000), rng.randrange(1 << 20))
+                          for _ in range(500)],
+                   depth=SKETCH_DEPTH, width=SKETCH_WIDTH,
+                   sketch=[rng.randrange(1 << 20) if rng.random() < 0.1 else 0
+                           for _ in range(4 * SKETCH_DEPTH * SKETCH_WIDTH)])
+        # 500 raw flow_records alone are 16 kB; the sketch 96 kB as u64
+        assert len(encode(d)) < 12 * 500 + 4 * 1200 * 3
+        assert _sorted(decode(encode(d))) == _sorted(d)
+
+    @pytest.mark.parametrize("mangle", [
+        lambda b: b"XYZ" + b[3:],               # magic
+        lambda b: b[:3] + b"\x09" + b[4:],      # version
+        lambda b: b[:-1],                       # truncated
+        lambda b: b + b"\x00",                  # trailing bytes
+        lambda b: b[:4] + b"\xff" * 12,         # runaway varint
+    ])
+    def test_malformed(self, mangle):
+        with pytest.raises(ValueError):
+            decode(mangle(encode(_delta())))
+
+    def test_probe_name_limit(self):
+        d = IntervalDelta("p" * MAX_PROBE_NAME, 0, 0, 5000, 0, 0)
+        assert decode(encode(d)) == d
+        with pytest.raises(ValueError):
+            encode(IntervalDelta("p" * (MAX_PROBE_NAME + 1), 0, 0, 5000, 0, 0))
+
+    def test_framing(self):
+        a, b = encode(_delta()), encode(_delta(seq=8))
+        stream = io.BytesIO(frame(a) + frame(b))
+        assert read_frame(stream) == a and read_frame(stream) == b
+        assert read_frame(stream) is None
+        with pytest.raises(ValueError):
+            read_frame(io.BytesIO(frame(a)[:-1]))
+
+
+class TestSketch:
+    def test_estimate_from_cells(self):
+        ip = _ip("10.0.1.1")
+        d = _delta(depth=2, width=16, sketch=[0] * (4 * 2 * 16))
+        for r in range(2):
+            d.sketch[1 * 32 + r * 16 + sketch_column(ip, r, 16)] = 500 + r  # src bytes plane
+        assert sketch_estimate(d, 1, ip) == 500
+        assert sketch_estimate(d, 0, ip) == 0
+        assert sketch_estimate(_delta(), 1, ip) == 0
+
+    @pytest.mark.skipif(not os.path.isfile(SO_PATH), reason="flow_merge.so not compiled")
+    def test_matches_flow_merge(self):
+        multiproc_probe._load_flow_merge()
+        m = FlowMerge()
+        try:
+            hosts = [(_ip("10.0.%d.%d" % (i // 200, i % 200)), i + 1) for i in range(600)]
+            m.add([(FLOW_REC_EXACT, ip, _ip("172.16.0.1"), 1, 2, 6, n, n * 100) for ip, n in hosts])
+            d = _delta(depth=SKETCH_DEPTH, width=SKETCH_WIDTH, sketch=m.host_sketch(SKETCH_DEPTH, SKETCH_WIDTH))
+            assert len(d.sketch) == 4 * SKETCH_DEPTH * SKETCH_WIDTH
+            # Count-min never underestimates, and with 600 hosts in 1024 columns mostly is exact
+            estimates = [(sketch_estimate(d, 0, ip), sketch_estimate(d, 1, ip)) for ip, _ in hosts]
+            assert all(p >= n and b >= n * 100 for (p, b), (_, n) in zip(estimates, hosts))
+            assert sum(p == n for (p, _), (_, n) in zip(estimates, hosts)) > 500
+            assert sketch_estimate(d, 3, _ip("172.16.0.1")) == sum(n * 100 for _, n in hosts)
+            assert m.host_sketch(3, 1000) == []     # width must be a power of two
+            # One host: exactly the cells sketch_column() names, in every row
+            m.reset()
+            ip = _ip("10.9.8.7")
+            m.add([(FLOW_REC_EXACT, ip, ip, 1, 2, 6, 3, 300)])
+            cells = m.host_sketch(4, 64)
+            for c, v in enumerate((3, 300, 3, 300)):
+                plane = cells[c * 256:(c + 1) * 256]
+                assert [i for i, n in enumerate(plane) if n] == [r * 64 + sketch_column(ip, r, 64) for r in range(4)]
+                assert set(plane) == {0, v}
+        finally:
+            m.close()
+
+
+class TestDeltaUplink:
+    def test_sends_frames(self):
+        srv = socket.socket()
+        srv.bind(("127.0.0.1", 0))
+        srv.listen(1)
+        srv.settimeout(5)
+        uplink = DeltaUplink("127.0.0.1", srv.getsockname()[1])
+        uplink.start()
+        try:
+            payload = encode(_delta())
+            uplink.send(payload)
+            conn, _ = srv.accept()
+            with conn, conn.makefile("rb") as f:
+                assert decode(read_frame(f)) == decode(payload)
+        finally:
+            uplink.stop()
+            srv.close()
+        assert uplink.sent == 1
+
+    def test_backlog_drops_oldest(self):
+        uplink = DeltaUplink("127.0.0.1", 1, backlog=2)  # never started
+        for i in range(5):
+            uplink.send(bytes([i]))
+        assert uplink.dropped == 3
+        assert [uplink._queue.get_nowait()[-1] for _ in range(2)] == [3, 4]
+
+    def test_unreachable_aggregator_does_not_block(self):
+        uplink = DeltaUplink("127.0.0.1", 1)
+        uplink.start()
+        t0 = time.monotonic()
+        uplink.send(b"x")
+        uplink.stop(timeout=1.0)
+        assert time.monotonic() - t0 < 3
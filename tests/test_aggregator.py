@@ -0,0 +1,115 @@
+"""Tests for aggregator.py — window pacing and the global merge of probe deltas."""
+
+import os
+import socket
+import struct
+import sys
+import time
+from unittest.mock import MagicMock
+
+import pytest
+
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), "..", "probe"))
+
+import multiproc_probe
+from agg_protocol import DeltaUplink, IntervalDelta, encode
+from aggregator import Aggregator
+from multiproc_probe import FLOW_REC_EXACT, REPORT_INTERVAL, FlowMerge
+
+PROBE_DIR = os.path.join(os.path.dirname(__file__), "..", "probe")
+SO_PATH = os.path.join(PROBE_DIR, "flow_merge.so")
+
+
+def _ip(addr: str) -> int:
+    return struct.unpack("=I", socket.inet_aton(addr))[0]
+
+
+def _probe_delta(probe: str, seq: int, flows: list[tuple[str, str, int, int]], top_hosts: int = 256) -> IntervalDelta:
+    """What a probe's Coordinator.interval_delta() sends for these (src, dst, packets, bytes) flows."""
+    m = FlowMerge()
+    try:
+        m.add([(FLOW_REC_EXACT, _ip(s), _ip(d), 1000, 443, 6, p, b) for s, d, p, b in flows])
+        packets, nbytes = m.totals()
+        d = IntervalDelta(probe, seq, 0, 5000, packets, nbytes)
+        d.flows = m.top(FlowMerge.FLOWS, 1, 500)
+        d.src_hosts = [(ip, sp, sb) for ip, sp, sb, _, _ in m.top(FlowMerge.HOSTS, 1, top_hosts) if sp]
+        d.dst_hosts = [(ip, dp, db) for ip, _, _, dp, db in m.top(FlowMerge.HOSTS, 3, top_hosts) if dp]
+        d.depth, d.width = 3, 1024
+        d.sketch = m.host_sketch(3, 1024)
+        return d
+    finally:
+        m.close()
+
+
+@pytest.mark.skipif(not os.path.isfile(SO_PATH), reason="flow_merge.so not compiled")
+class TestAggregator:
+    @pytest.fixture(autouse=True)
+    def agg(self):
+        multiproc_probe._load_flow_merge()
+        self.agg = Aggregator("127.0.0.1", 0)
+        self.agg._alerter.check_detail = MagicMock(return_value=False)
+        self.agg._alerter.check_host = MagicMock(return_value=[])
+        yield
+        self.agg.stop()
+
+    def test_window_waits_for_every_live_probe(self):
+        a = self.agg
+        a.submit(_probe_delta("a", 0, [("10.0.1.1", "10.0.2.2", 1, 100)]), now=100.0)
+        a.submit(_probe_delta("b", 0, [("10.0.1.1", "10.0.2.2", 1, 100)]), now=100.1)
+        assert a.poll(now=100.2) == 1
+        a.submit(_probe_delta("a", 1, [("10.0.1.1", "10.0.2.2", 1, 100)]), now=105.0)
+        assert a.poll(now=105.1) == 0                       # b not in yet
+        assert a.poll(now=105.0 + REPORT_INTERVAL) == 1     # overdue: a alone
+        assert a._alerter.check_detail.call_count == 2
+        assert a._alerter.check_detail.call_args.kwargs["total_bytes"] == 100
+        # b silent for PROBE_STALE_SEC: a's intervals go out as they come
+        a.submit(_probe_delta("a", 2, [("10.0.1.1", "10.0.2.2", 1, 100)]), now=120.0)
+        assert a.poll(now=120.0) == 1
+
+    def test_totals_and_flows_summed(self):
+        a = self.agg
+        a.submit(_probe_delta("a", 0, [("10.0.1.1", "10.0.2.2", 10, 1000)]), now=0)
+        a.submit(_probe_delta("b", 0, [("10.0.1.1", "10.0.2.2", 20, 3000), ("10.0.1.5", "10.0.2.2", 1, 60)]), now=0)
+        assert a.poll(now=0) == 1
+        detail = a._alerter.check_detail.call_args.kwargs
+        assert (detail["total_packets"], detail["total_bytes"]) == (31, 4060)
+        assert detail["top_flows"][0]["key"] == ("10.0.1.1", "10.0.2.2", 6, 1000, 443)
+        assert detail["top_flows"][0]["bytes"] == 4000
+        assert detail["top_dests"][0] == {"ip": "10.0.2.2", "bytes": 4060, "info": detail["top_dests"][0]["info"]}
+
+    def test_split_talker_alerts_globally(self):
+        """A source under ALERT_HOST_BPS on each probe, over it across the two."""
+        a = self.agg
+        a._alerter._host_threshold_bps = 8000 * 1000    # 1 MB/s = 5 MB per 5s interval
+        talker = ("10.0.1.1", "10.0.2.2", 3000, 3_000_000)
+        # On probe b the talker is not a top host: only the sketch has it
+        noise = [("10.0.3.%d" % i, "10.0.2.3", 1000, 4_000_000) for i in range(1, 5)]
+        a.submit(_probe_delta("a", 0, [talker]), now=0)
+        a.submit(_probe_delta("b", 0, [talker] + noise, top_hosts=4), now=0)
+        assert a.poll(now=0) == 1
+        host = a._alerter.check_host.call_args.kwargs
+        assert host["src_agg"]["10.0.1.1"] == [6000, 6_000_000]
+        assert host["interval_sec"] == 5.0
+
+    def test_sketch_fill_capped_by_smallest_listed_host(self):
+        a = self.agg
+        d = _probe_delta("b", 0, [("10.0.1.1", "10.0.2.2", 10, 9000), ("10.0.1.2", "10.0.2.2", 10, 500)], top_hosts=1)
+        assert [ip for ip, _, _ in d.src_hosts] == [_ip("10.0.1.1")]
+        fill = a._sketch_fill([_probe_delta("a", 0, [("10.0.1.2", "10.0.2.9", 1, 100)]), d])
+        src = [r for r in fill if r[0] == multiproc_probe.FLOW_REC_HH_SRC]
+        # 10.0.1.2 is estimated from b's sketch; 10.0.1.1 is absent from a's (estimate 0)
+        assert src == [(multiproc_probe.FLOW_REC_HH_SRC, _ip("10.0.1.2"), 0, 0, 0, 0, 10, 500)]
+
+    def test_receives_over_tcp(self):
+        a = self.agg
+        a.start()
+        uplink = DeltaUplink("127.0.0.1", a.port)
+        uplink.start()
+        try:
+            uplink.send(encode(_probe_delta("a", 0, [("10.0.1.1", "10.0.2.2", 1, 100)])))
+            deadline = time.monotonic() + 5
+            while not a.poll() and time.monotonic() < deadline:
+                time.sleep(0.05)
+        finally:
+            uplink.stop()
+        assert a._alerter.check_detail.call_args.kwargs["total_bytes"] == 100
@@ -9,7 +9,7 @@ import pytest
 
 sys.path.insert(0, os.path.join(os.path.dirname(__file__), "..", "probe"))
 
-from alerter import FlowAlerter, bps_to_human, pps_to_human, bytes_to_human
+from alerter import FlowAlerter, bps_to_human, pps_to_human, bytes_to_human, classify_flow, tcp_flags_str
 
 
 @pytest.fixture
@@ -225,6 +225,108 @@ class TestCheckHost:
         assert alerted == []
 
 
+def _ext_flow(proto: int, packets: int, **ext) -> dict:
+    counters = {"syn": 0, "rst": 0, "tcp_flags": 0, "first_ns": 1_000_000_000,
+                "last_ns": 3_500_000_000, "len_hist": [0] * 6}
+    counters.update(ext)
+    return {"key": ("10.0.1.1", "10.0.2.2", proto, 1234, 80), "packets": packets,
+            "bytes": packets * 100, "ext": counters}
+
+
+class TestStateRestore:
+    def test_cooldowns_survive_restart(self, host_alerter):
+        assert host_alerter.check_host({"10.0.0.1": [10, 10_000_000]}, {}, 1.0, {}) == ["10.0.0.1"]
+        assert host_alerter.check_fast(total_bytes=10_000_000, total_packets=5, interval_sec=1.0)
+        with patch.dict(os.environ, {"ALERT_HOST_BPS": "1000", "SNS_TOPIC_ARN": "", "SLACK_WEBHOOK_URL": "",
+                                     "ALERT_THRESHOLD_BPS": "1000"}):
+            restarted = FlowAlerter()
+        restarted.restore(host_alerter.state())
+        assert restarted.check_host({"10.0.0.1": [10, 10_000_000]}, {}, 1.0, {}) == []
+        assert not restarted.check_fast(total_bytes=10_000_000, total_packets=5, interval_sec=1.0)
+        assert restarted.check_host({"10.0.0.2": [10, 10_000_000]}, {}, 1.0, {}) == ["10.0.0.2"]
+
+
+class TestFlowClassification:
+    def test_syn_flood(self):
+        assert classify_flow(_ext_flow(6, 100, syn=90, tcp_flags=0x02)) == "syn-flood"
+
+    def test_udp_flood(self):
+        assert classify_flow(_ext_flow(17, 100, len_hist=[80, 10, 0, 0, 0, 10])) == "udp-flood"
+
+    def test_bulk_transfer(self):
+        assert classify_flow(_ext_flow(6, 100, syn=1, tcp_flags=0x18, len_hist=[40, 0, 0, 0, 0, 60])) == "bulk"
+
+    def test_unremarkable_or_no_counters(self):
+        assert classify_flow(_ext_flow(6, 100, syn=1, tcp_flags=0x18, len_hist=[50, 0, 50, 0, 0, 0])) == ""
+        assert classify_flow({"key": ("a", "b", 6, 1, 2), "packets": 100}) == ""
+
+    def test_flags_str(self):
+        assert tcp_flags_str(0x12) == "SYN|ACK"
+        assert tcp_flags_str(0) == "-"
+
+    def test_alert_shows_counters(self, alerter):
+        text = alerter._format_alert(2000, 200, [], [], [_ext_flow(6, 100, syn=90, rst=2, tcp_flags=0x06)])
+        assert "flags=SYN|RST syn=90 rst=2 seen=2.5s  [syn-flood]" in text
+
+    def test_alert_shows_top_subnets(self, alerter):
+        subnets = {"src /24": [("172.16.5.0/24", 2048), ("172.16.6.0/24", 1024)], "dst /24": []}
+        text = alerter._format_alert(2000, 200, [], [], [], subnets)
+        assert "--- Top Subnets ---\n  src /24   172.16.5.0/24 2.0 KB, 172.16.6.0/24 1.0 KB" in text
+        assert "dst /24" not in text
+        assert "Top Subnets" not in alerter._format_alert(2000, 200, [], [], [])
+
+
+    def test_alert_shows_ports_and_protocols(self, alerter):
+        ports = [{"proto": 6, "port": 443, "packets": 10, "bytes": 3072}]
+        services = [{"ip": "10.0.2.2", "proto": 17, "port": 53, "bytes": 1024, "info": {"name": "dns-1"}}]
+        text = alerter._format_alert(2000, 200, [], [], [], None, ports, services, {6: 300, 17: 100})
+        assert "--- Top Destination Ports ---\n          tcp/443      3.0 KB" in text
+        assert "--- Top Services ---\n         10.0.2.2  udp/53         1.0 KB  (dns-1)" in text
+        assert "Protocols: tcp 75.0%, udp 25.0%" in text
+        plain = alerter._format_alert(2000, 200, [], [], [])
+        assert "Top Destination Ports" not in plain and "Protocols:" not in plain
+
+
+class TestCheckSurge:
+    def _row(self, key="link", kind="surge", direction="link"):
+        return {"key": key, "kind": kind, "direction": direction, "bps": 8e9, "pps": 1e6,
+                "baseline_bps": 1e9, "baseline_pps": 1e5}
+
+    def test_off_by_default(self, alerter):
+        assert alerter.surge_limits() == (0, 1e8)
+
+    def test_per_key_and_kind_cooldown(self):
+        with patch.dict(os.environ, {"ALERT_SURGE_FACTOR": "4", "ALERT_SURGE_MIN_BPS": "1000",
+                                     "SNS_TOPIC_ARN": "", "SLACK_WEBHOOK_URL": ""}):
+            a = FlowAlerter()
+        assert a.surge_limits() == (4, 1000)
+        host = self._row("10.0.1.1", direction="source")
+        assert a.check_surge([self._row(), host], {"10.0.1.1": {"name": "web"}}) == ["link", "10.0.1.1"]
+        assert a.check_surge([self._row(), host], {}) == []
+        # A drop is its own alert, not silenced by the surge cooldown
+        assert a.check_surge([self._row(kind="drop")], {}) == ["link"]
+
+    def test_message_shows_baseline(self):
+        with patch.dict(os.environ, {"ALERT_SURGE_FACTOR": "4", "SNS_TOPIC_ARN": "arn:aws:sns:x",
+                                     "SLACK_WEBHOOK_URL": ""}), patch("alerter.boto3"):
+            a = FlowAlerter()
+        a._send_sns = MagicMock()
+        a.check_surge([self._row("10.0.1.1", direction="source")], {"10.0.1.1": {"name": "web"}})
+        message, subject = a._send_sns.call_args.args
+        assert subject == "[SURGE] Traffic Alert: 10.0.1.1 (web) 8.0 Gbps"
+        assert "Baseline: 1.0 Gbps / 100.0 Kpps" in message and "Direction: source" in message
+
+    def test_scope_prefixes_subject_and_slack(self):
+        with patch.dict(os.environ, {"ALERT_SURGE_FACTOR": "4", "SNS_TOPIC_ARN": "arn:aws:sns:x",
+                                     "SLACK_WEBHOOK_URL": "https://hooks.example"}), patch("alerter.boto3"):
+            a = FlowAlerter(scope="GLOBAL")
+        a._enqueue_send = MagicMock()
+        a.check_surge([self._row()], {})
+        (sns_method, message, subject), (slack_method, slack) = (c.args for c in a._enqueue_send.call_args_list)
+        assert subject.startswith("[GLOBAL] [SURGE] Traffic Alert: ")
+        assert slack.startswith("[GLOBAL] ") and slack.endswith(message)
+
+
 class TestHumanFormatters:
     def test_bps_to_human(self):
         assert bps_to_human(500) == "500.0 bps"
@@ -1,16 +1,20 @@
 """Tests for enricher.py — IPEnricher cache and lookup logic."""
 
 import os
+import shutil
+import socket
+import struct
 import sys
+import tempfile
 import threading
 import time
-from unittest.mock import MagicMock, patch
+from unittest.mock import MagicMock, call, patch
 
 import pytest
 
 sys.path.insert(0, os.path.join(os.path.dirname(__file__), "..", "probe"))
 
-from enricher import IPEnricher
+from enricher import IPEnricher, PrefixTable
 
 
 def _make_ec2_response(instances):
@@ -29,6 +33,23 @@ def _make_ec2_response(instances):
     return {"Reservations": reservations}
 
 
+def _ops(mock_ec2, **pages):
+    """Route get_paginator(op) to its own pages; ops not given return nothing."""
+    empty = {"describe_instances": {"Reservations": []}, "describe_network_interfaces": {"NetworkInterfaces": []},
+             "describe_subnets": {"Subnets": []}, "describe_vpcs": {"Vpcs": []}}
+    paginators = {}
+    for op, page in empty.items():
+        paginators[op] = MagicMock()
+        paginators[op].paginate.return_value = [pages.get(op, page)]
+    mock_ec2.get_paginator.side_effect = lambda op: paginators[op]
+    return paginators
+
+
+def _raw(ip):
+    """flow_merge / host event key: network-order address bytes in a native u32."""
+    return struct.unpack("=I", socket.inet_aton(ip))[0]
+
+
 @pytest.fixture
 def mock_ec2():
     """Patch boto3.client to return a mock EC2 client."""
@@ -152,6 +173,38 @@ class TestRefreshFailure:
         assert result["instance_id"] == "i-old"
 
 
+class TestCache:
+    def test_start_serves_cache_then_refreshes(self, mock_ec2):
+        tmp = tempfile.mkdtemp()
+        path = os.path.join(tmp, "state", "enricher.json")
+        try:
+            _ops(mock_ec2, describe_instances=_make_ec2_response([
+                {"id": "i-cached", "tags": {"Name": "web"}, "ips": ["10.0.1.1"]}]),
+                describe_subnets={"Subnets": [{"SubnetId": "subnet-1", "CidrBlock": "10.0.1.0/24"}]})
+            IPEnricher(path)._refresh()
+            assert os.path.isfile(path)
+
+            # A restarted probe looks up from the cache without waiting on describe_*
+            mock_ec2.get_paginator.reset_mock()
+            enricher = IPEnricher(path)
+            with patch.object(enricher, "_refresh_loop"):
+                enricher.start()
+            mock_ec2.get_paginator.assert_not_called()
+            assert enricher.enrich("10.0.1.1")["name"] == "web"
+            assert enricher.enrich("10.0.1.9")["subnet_id"] == "subnet-1"
+            enricher._thread.join()
+
+            # Another VPC's cache does not apply: blocking refresh as without one
+            other = IPEnricher(path)
+            other._vpc_id = "vpc-other"
+            assert not other._load_cache()
+            with open(path, "w") as f:
+                f.write("{")
+            assert not IPEnricher(path)._load_cache()
+        finally:
+            shutil.rmtree(tmp, ignore_errors=True)
+
+
 class TestVpcFilter:
     def test_vpc_filter_applied(self, mock_ec2):
         mock_ec2.get_paginator.return_value.paginate.return_value = [
@@ -162,9 +215,9 @@ class TestVpcFilter:
         enricher._vpc_id = "vpc-test123"
         enricher._refresh()
 
-        mock_ec2.get_paginator.return_value.paginate.assert_called_once_with(
-            Filters=[{"Name": "vpc-id", "Values": ["vpc-test123"]}]
-        )
+        calls = mock_ec2.get_paginator.return_value.paginate.call_args_list
+        assert calls[0] == call(Filters=[{"Name": "vpc-id", "Values": ["vpc-test123"]}])
+        assert call(VpcIds=["vpc-test123"]) in calls
 
     def test_no_vpc_filter_when_empty(self, mock_ec2):
         mock_ec2.get_paginator.return_value.paginate.return_value = [
@@ -175,9 +228,79 @@ class TestVpcFilter:
         enricher._vpc_id = ""
         enricher._refresh()
 
-        mock_ec2.get_paginator.return_value.paginate.assert_called_once_with(
-            Filters=[]
-        )
+        calls = mock_ec2.get_paginator.return_value.paginate.call_args_list
+        assert calls[0] == call(Filters=[])
+        assert call() in calls
+
+
+class TestPrefixMatch:
+    def test_longest_prefix_wins(self):
+        table = PrefixTable([
+            (0x0A000000, 8, {"name": "vpc"}),
+            (0x0A000100, 24, {"name": "subnet"}),
+            (0x0A000105, 32, {"name": "host"}),
+            (0x0A000100, 24, {"name": "dup"}),
+        ])
+        assert table.size == 3
+        assert table.lookup(0x0A000105)["name"] == "host"
+        assert table.lookup(0x0A000106)["name"] == "subnet"     # first of two equal prefixes
+        assert table.lookup(0x0A090000)["name"] == "vpc"
+        assert table.lookup(0x0B000000) is None
+        assert PrefixTable().lookup(0) is None
+
+    def test_enis_subnets_vpcs_and_onprem(self, mock_ec2):
+        _ops(mock_ec2,
+             describe_instances=_make_ec2_response([{"id": "i-web", "tags": {"Name": "web"}, "ips": ["10.0.1.10"]}]),
+             describe_network_interfaces={"NetworkInterfaces": [
+                 {"NetworkInterfaceId": "eni-nat", "Description": "Interface for NAT Gateway nat-1",
+                  "InterfaceType": "nat_gateway", "PrivateIpAddresses": [{"PrivateIpAddress": "10.0.1.5"}]},
+                 {"NetworkInterfaceId": "eni-web", "Attachment": {"InstanceId": "i-web"},
+                  "PrivateIpAddresses": [{"PrivateIpAddress": "10.0.1.10"}]},
+             ]},
+             describe_subnets={"Subnets": [{"SubnetId": "subnet-a", "CidrBlock": "10.0.1.0/24",
+                                            "Tags": [{"Key": "Name", "Value": "app-a"}]}]},
+             describe_vpcs={"Vpcs": [{"VpcId": "vpc-1", "CidrBlock": "10.0.0.0/16"}]})
+        with patch.dict(os.environ, {"ONPREM_CIDRS": "192.168.0.0/16, bogus"}):
+            enricher = IPEnricher()
+        enricher._refresh()
+
+        assert enricher.enrich("10.0.1.10")["instance_id"] == "i-web"
+        nat = enricher.enrich("10.0.1.5")
+        assert (nat["eni_id"], nat["interface_type"], nat["name"]) == \
+            ("eni-nat", "nat_gateway", "Interface for NAT Gateway nat-1")
+        assert enricher.enrich("10.0.1.99")["subnet_id"] == "subnet-a"
+        assert enricher.enrich("10.0.7.7") == {"ip": "10.0.7.7", "vpc_id": "vpc-1", "name": "vpc-1",
+                                               "cidr": "10.0.0.0/16"}
+        assert enricher.enrich("192.168.3.4")["name"] == "on-prem"
+        assert enricher.enrich("172.16.0.1") == {"ip": "172.16.0.1"}
+        assert enricher.enrich("not-an-ip") == {"ip": "not-an-ip"}
+
+    def test_enrich_raw(self, mock_ec2):
+        _ops(mock_ec2, describe_instances=_make_ec2_response([{"id": "i-a", "ips": ["10.0.1.1"]}]),
+             describe_subnets={"Subnets": [{"SubnetId": "subnet-b", "CidrBlock": "10.0.2.0/24"}]})
+        enricher = IPEnricher()
+        enricher._refresh()
+
+        infos = enricher.enrich_raw([_raw("10.0.1.1"), _raw("10.0.2.9"), _raw("10.0.3.1")])
+        assert infos[0]["instance_id"] == "i-a"
+        assert infos[1]["name"] == "subnet-b"
+        assert infos[2] == {}
+
+    def test_optional_source_failure_keeps_stale_entries(self, mock_ec2):
+        ops = _ops(mock_ec2, describe_subnets={"Subnets": [{"SubnetId": "subnet-a", "CidrBlock": "10.0.1.0/24"}]})
+        enricher = IPEnricher()
+        enricher._refresh()
+        old = enricher._table
+
+        # No DescribeSubnets permission any more; instances still refresh
+        ops["describe_subnets"].paginate.side_effect = Exception("UnauthorizedOperation")
+        ops["describe_instances"].paginate.return_value = [
+            _make_ec2_response([{"id": "i-new", "ips": ["10.0.1.1"]}])]
+        enricher._refresh()
+
+        assert enricher._table is not old
+        assert enricher.enrich("10.0.1.1")["instance_id"] == "i-new"
+        assert enricher.enrich("10.0.1.2")["subnet_id"] == "subnet-a"
 
 
 class TestThreadSafety:
@@ -10,7 +10,7 @@ import pytest
 
 sys.path.insert(0, os.path.join(os.path.dirname(__file__), "..", "probe"))
 
-from multiproc_probe import parse_vxlan_packet, _CFlowResult
+from multiproc_probe import parse_vxlan_packet, _CFlowResult, _CFlowResult6
 
 PROBE_DIR = os.path.join(os.path.dirname(__file__), "..", "probe")
 SO_PATH = os.path.join(PROBE_DIR, "fast_parse.so")
@@ -56,6 +56,30 @@ def _build_vxlan_packet(
     return vxlan + eth + ip_hdr + transport
 
 
+def _tagged(pkt: bytes, *tags: int) -> bytes:
+    """Insert VLAN tags (TPIDs) between the Ethernet addresses and the ethertype."""
+    vlans = b"".join(struct.pack("!HH", tpid, 100 + i) for i, tpid in enumerate(tags))
+    return pkt[:8 + 12] + vlans + pkt[8 + 12:]
+
+
+def _build_vxlan6_packet(
+    src_ip: str = "2001:db8::1",
+    dst_ip: str = "2001:db8::2",
+    proto: int = 6,
+    src_port: int = 12345,
+    dst_port: int = 443,
+    ext: bytes = b"",
+    first_next: int = None,
+    payload_len: int = 40,
+) -> bytes:
+    """VXLAN + Ethernet + IPv6; ext is a pre-built extension header chain, first_next its type."""
+    vxlan = struct.pack("!II", 0x08000000, 12345 << 8)
+    eth = b"\x00" * 12 + struct.pack("!H", 0x86DD)
+    ip6 = struct.pack("!IHBB", 6 << 28, payload_len, proto if first_next is None else first_next, 64)
+    ip6 += socket.inet_pton(socket.AF_INET6, src_ip) + socket.inet_pton(socket.AF_INET6, dst_ip)
+    return vxlan + eth + ip6 + ext + struct.pack("!HH", src_port, dst_port) + b"\x00" * 16
+
+
 class TestPythonParser:
     def test_basic_tcp(self):
         pkt = _build_vxlan_packet(
@@ -112,6 +136,41 @@ class TestPythonParser:
         assert parse_vxlan_packet(bytes(pkt)) is None
 
 
+class TestTaggedAndIPv6:
+    def test_vlan_and_qinq(self):
+        pkt = _build_vxlan_packet(proto=17, src_port=53, dst_port=1024)
+        want = parse_vxlan_packet(pkt)
+        assert parse_vxlan_packet(_tagged(pkt, 0x8100)) == want
+        assert parse_vxlan_packet(_tagged(pkt, 0x88A8, 0x8100)) == want
+        # A third tag is not walked
+        assert parse_vxlan_packet(_tagged(pkt, 0x88A8, 0x8100, 0x8100)) is None
+
+    def test_ipv6_tcp(self):
+        key, pkt_len = parse_vxlan_packet(_build_vxlan6_packet())
+        assert key == ("2001:db8::1", "2001:db8::2", 6, 12345, 443)
+        assert pkt_len == 80
+
+    def test_ipv6_extension_headers(self):
+        # Hop-by-Hop (8 bytes) -> Destination Options (16 bytes) -> UDP
+        ext = bytes([60, 0]) + b"\x00" * 6 + bytes([17, 1]) + b"\x00" * 14
+        key, _ = parse_vxlan_packet(_build_vxlan6_packet(proto=17, ext=ext, first_next=0))
+        assert key[2:] == (17, 12345, 443)
+
+    def test_ipv6_fragments(self):
+        first = struct.pack("!BBHI", 6, 0, 0x0001, 7)           # offset 0, M=1
+        later = struct.pack("!BBHI", 6, 0, 185 << 3, 7)         # offset 185*8
+        assert parse_vxlan_packet(_build_vxlan6_packet(ext=first, first_next=44))[0][3:] == (12345, 443)
+        assert parse_vxlan_packet(_build_vxlan6_packet(ext=later, first_next=44))[0][2:] == (6, 0, 0)
+
+    def test_ipv6_truncated_extension(self):
+        ext = bytes([6, 200])                                   # Hop-by-Hop claiming 1608 bytes
+        assert parse_vxlan_packet(_build_vxlan6_packet(ext=ext, first_next=0)) is None
+
+    def test_ipv6_tagged(self):
+        pkt = _build_vxlan6_packet()
+        assert parse_vxlan_packet(_tagged(pkt, 0x8100)) == parse_vxlan_packet(pkt)
+
+
 @pytest.mark.skipif(not os.path.isfile(SO_PATH), reason="fast_parse.so not compiled")
 class TestCParser:
     @pytest.fixture(autouse=True)
@@ -223,6 +282,69 @@ class TestParserEquivalence:
         c_result = self._c_parse(pkt)
         assert py_result == c_result
 
+    def test_batch_matches_single(self):
+        pkts = [
+            _build_vxlan_packet(src_ip="192.168.1.1", dst_ip="172.16.0.1", proto=6, src_port=80, dst_port=443),
+            b"\x00" * 20,
+            _build_vxlan_packet(proto=1),
+            _build_vxlan_packet(proto=17, src_port=53, dst_port=1024)[:8 + 14 + 20 + 2],  # ports cut off
+            _build_vxlan_packet(proto=17, src_port=53, dst_port=1024),
+        ] * 120  # > one VXLAN_BATCH (256)
+        self.lib.parse_vxlan_batch.argtypes = [
+            ctypes.POINTER(ctypes.c_char_p), ctypes.POINTER(ctypes.c_int), ctypes.c_int,
+            ctypes.POINTER(_CFlowResult),
+        ]
+        self.lib.parse_vxlan_batch.restype = ctypes.c_int
+        n = len(pkts)
+        out = (_CFlowResult * n)()
+        parsed = self.lib.parse_vxlan_batch((ctypes.c_char_p * n)(*pkts),
+                                            (ctypes.c_int * n)(*map(len, pkts)), n, out)
+        assert parsed == 4 * 120
+        for pkt, r in zip(pkts, out):
+            single = self._c_parse(pkt)
+            assert r.valid == (single is not None)
+            if single:
+                ips = tuple(socket.inet_ntoa(struct.pack("!I", ip)) for ip in (r.src_ip, r.dst_ip))
+                assert single == (ips + (r.protocol, r.src_port, r.dst_port), r.pkt_len)
+            assert parse_vxlan_packet(pkt) == single
+
+    def test_tagged_equivalence(self):
+        pkt = _build_vxlan_packet(proto=6, src_port=80, dst_port=443)
+        for tags in ((0x8100,), (0x88A8, 0x8100)):
+            tagged = _tagged(pkt, *tags)
+            assert self._c_parse(tagged) == parse_vxlan_packet(tagged) == parse_vxlan_packet(pkt)
+        assert self._c_parse(_tagged(pkt, 0x8100)[:8 + 14 + 4 + 19]) is None
+
+    def test_ipv6_equivalence(self):
+        self.lib.parse_vxlan_packet6.argtypes = [
+            ctypes.c_char_p, ctypes.c_int, ctypes.POINTER(_CFlowResult6),
+        ]
+        self.lib.parse_vxlan_packet6.restype = ctypes.c_int
+        hbh = bytes([44, 0]) + b"\x00" * 6
+        pkts = [
+            _build_vxlan6_packet(),
+            _build_vxlan6_packet(proto=17, src_ip="fe80::1", dst_ip="ff02::1"),
+            _build_vxlan6_packet(proto=58),
+            _build_vxlan6_packet(ext=hbh + struct.pack("!BBHI", 17, 0, 0, 1), first_next=0),
+            _build_vxlan6_packet(ext=struct.pack("!BBHI", 17, 0, 8 << 3, 1), first_next=44),
+            _build_vxlan6_packet(ext=bytes([17, 1]) + b"\x00" * 10, first_next=51),   # AH, 12 bytes
+            _tagged(_build_vxlan6_packet(), 0x88A8, 0x8100),
+            _build_vxlan6_packet(ext=bytes([6, 200]), first_next=0),
+            _build_vxlan6_packet()[:8 + 14 + 39],
+            _build_vxlan_packet(),
+        ]
+        for pkt in pkts:
+            r = _CFlowResult6()
+            rc = self.lib.parse_vxlan_packet6(pkt, len(pkt), ctypes.byref(r))
+            c_result = None
+            if rc == 0:
+                ips = tuple(socket.inet_ntop(socket.AF_INET6, bytes(ip)) for ip in (r.src_ip, r.dst_ip))
+                c_result = (ips + (r.protocol, r.src_port, r.dst_port), r.pkt_len)
+            py_result = parse_vxlan_packet(pkt)
+            if py_result is not None and ":" not in py_result[0][0]:
+                py_result = None                                # IPv4: not parse_vxlan_packet6's
+            assert c_result == py_result
+
     def test_equivalence_invalid_packets(self):
         invalid_packets = [
             b"",
@@ -0,0 +1,903 @@
+"""Tests for fast_recv.c (C capture engine) via ctypes over loopback."""
+
+import ctypes
+import os
+import shutil
+import socket
+import struct
+import sys
+import tempfile
+import threading
+import time
+
+import pytest
+
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), "..", "probe"))
+
+import multiproc_probe
+
+PROBE_DIR = os.path.join(os.path.dirname(__file__), "..", "probe")
+SO_PATH = os.path.join(PROBE_DIR, "fast_recv.so")
+
+
+def _build_vxlan_packet(
+    src_ip: str = "10.0.1.1",
+    dst_ip: str = "10.0.2.2",
+    proto: int = 6,
+    src_port: int = 12345,
+    dst_port: int = 80,
+    ip_total_length: int = 60,
+    vni: int = 12345,
+    tcp_flags: int = 0,
+) -> bytes:
+    vxlan = struct.pack("!II", 0x08000000, vni << 8)
+    eth = b"\x00" * 12 + struct.pack("!H", 0x0800)
+    ihl_ver = (4 << 4) | 5
+    ip_hdr = struct.pack(
+        "!BBHHHBBH4s4s",
+        ihl_ver, 0, ip_total_length, 0, 0, 64, proto, 0,
+        socket.inet_aton(src_ip), socket.inet_aton(dst_ip),
+    )
+    if proto == 6:
+        transport = struct.pack("!HHIIBBH", src_port, dst_port, 0, 0, 0x50, tcp_flags, 0) + b"\x00" * 4
+    elif proto == 17:
+        transport = struct.pack("!HH", src_port, dst_port) + b"\x00" * 16
+    else:
+        transport = b"\x00" * 20
+    return vxlan + eth + ip_hdr + transport
+
+
+def _build_vxlan6_packet(src_port: int = 53, dst_port: int = 1024) -> bytes:
+    ip6 = struct.pack("!IHBB", 6 << 28, 40, 17, 64)
+    ip6 += socket.inet_pton(socket.AF_INET6, "2001:db8::1") + socket.inet_pton(socket.AF_INET6, "2001:db8::2")
+    eth = b"\x00" * 12 + struct.pack("!H", 0x86DD)
+    return struct.pack("!II", 0x08000000, 12345 << 8) + eth + ip6 + struct.pack("!HH", src_port, dst_port) + b"\x00" * 36
+
+
+def _free_udp_port() -> int:
+    s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    s.bind(("127.0.0.1", 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+
+def _records(lib, ctx, count, kind: int = multiproc_probe.FLOW_REC_EXACT) -> dict:
+    buf = lib.cap_get_flush_buf(ctx)
+    out = {}
+    for i in range(count):
+        r = buf[i]
+        if r.kind != kind:
+            continue
+        key = (socket.inet_ntoa(struct.pack("=I", r.src_ip)), socket.inet_ntoa(struct.pack("=I", r.dst_ip)),
+               r.proto, r.src_port, r.dst_port)
+        out[key] = (r.packets, r.bytes)
+    return out
+
+
+@pytest.mark.skipif(not os.path.isfile(SO_PATH), reason="fast_recv.so not compiled")
+class TestCapture:
+    @pytest.fixture(autouse=True)
+    def capture(self):
+        multiproc_probe._load_fast_recv()
+        self.lib = multiproc_probe._fast_recv_lib
+        self.port = _free_udp_port()
+        self.ctx = self.lib.cap_create(self.port, 4 * 1024 * 1024)
+        assert self.ctx
+        self.tx = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        yield
+        self.tx.close()
+        self.lib.cap_destroy(self.ctx)
+
+    def _send(self, pkt: bytes, n: int = 1):
+        for _ in range(n):
+            self.tx.sendto(pkt, ("127.0.0.1", self.port))
+
+    def test_run_then_flush(self):
+        self._send(_build_vxlan_packet(src_ip="10.0.1.100", dst_ip="10.0.2.200", dst_port=443), 5)
+        self._send(_build_vxlan_packet(proto=17, src_port=53, dst_port=1024), 3)
+        self.lib.cap_run(self.ctx, 200)
+        count = self.lib.cap_flush(self.ctx)
+        flows = _records(self.lib, self.ctx, count)
+        assert flows[("10.0.1.100", "10.0.2.200", 6, 12345, 443)] == (5, 300)
+        assert flows[("10.0.1.1", "10.0.2.2", 17, 53, 1024)] == (3, 180)
+        # Table is reset after flush
+        assert self.lib.cap_flush(self.ctx) == 0
+
+    def test_drain_resets_only_touched_slots(self):
+        for i in range(50):
+            self._send(_build_vxlan_packet(src_port=1000 + i))
+        self.lib.cap_run(self.ctx, 200)
+        assert self.lib.cap_flush(self.ctx) == 50
+        assert self.lib.cap_get_num_flows(self.ctx) == 0
+
+        # Rotate back to the first table; same keys hit the cleared slots and start from scratch
+        assert self.lib.cap_flush(self.ctx) == 0
+        self._send(_build_vxlan_packet(src_port=1000), 2)
+        self.lib.cap_run(self.ctx, 200)
+        count = self.lib.cap_flush(self.ctx)
+        assert _records(self.lib, self.ctx, count) == {("10.0.1.1", "10.0.2.2", 6, 1000, 80): (2, 120)}
+
+    def test_swap_drain_while_capturing(self):
+        assert self.lib.cap_start(self.ctx) == 0
+        try:
+            self._send(_build_vxlan_packet(dst_port=1), 4)
+            time.sleep(0.2)
+            first = _records(self.lib, self.ctx, self.lib.cap_drain(self.ctx, self.lib.cap_swap(self.ctx)))
+
+            self._send(_build_vxlan_packet(dst_port=2), 2)
+            time.sleep(0.2)
+            second = _records(self.lib, self.ctx, self.lib.cap_drain(self.ctx, self.lib.cap_swap(self.ctx)))
+        finally:
+            self.lib.cap_stop(self.ctx)
+
+        assert first == {("10.0.1.1", "10.0.2.2", 6, 12345, 1): (4, 240)}
+        assert second == {("10.0.1.1", "10.0.2.2", 6, 12345, 2): (2, 120)}
+        assert self.lib.cap_get_total_pkts(self.ctx) == 6
+
+    def test_start_twice_rejected(self):
+        assert self.lib.cap_start(self.ctx) == 0
+        assert self.lib.cap_start(self.ctx) == -1
+        self.lib.cap_stop(self.ctx)
+
+    def test_non_ipv4_not_recorded(self):
+        pkt = bytearray(_build_vxlan_packet())
+        pkt[8 + 12] = 0x86
+        pkt[8 + 13] = 0xDD
+        self._send(bytes(pkt), 3)
+        self.lib.cap_run(self.ctx, 200)
+        assert self.lib.cap_get_total_pkts(self.ctx) == 3
+        assert self.lib.cap_get_total_parsed(self.ctx) == 0
+        assert self.lib.cap_flush(self.ctx) == 0
+
+    def test_vlan_tagged_ipv4_recorded(self):
+        pkt = _build_vxlan_packet(dst_port=443)
+        single = pkt[:8 + 12] + struct.pack("!HH", 0x8100, 10) + pkt[8 + 12:]
+        qinq = pkt[:8 + 12] + struct.pack("!HHHH", 0x88A8, 10, 0x8100, 20) + pkt[8 + 12:]
+        self._send(single, 2)
+        self._send(qinq, 3)
+        self.lib.cap_run(self.ctx, 200)
+        count = self.lib.cap_flush(self.ctx)
+        assert _records(self.lib, self.ctx, count) == {("10.0.1.1", "10.0.2.2", 6, 12345, 443): (5, 300)}
+
+    def test_ipv6_flows_drained_separately(self):
+        self._send(_build_vxlan6_packet(), 4)
+        self._send(_build_vxlan_packet(), 1)
+        self.lib.cap_run(self.ctx, 200)
+        assert self.lib.cap_get_total_parsed(self.ctx) == 5
+        assert len(_records(self.lib, self.ctx, self.lib.cap_flush(self.ctx))) == 1
+        assert self.lib.cap_get_flushed6(self.ctx) == 1
+        r = self.lib.cap_get_flush6_buf(self.ctx)[0]
+        key = tuple(socket.inet_ntop(socket.AF_INET6, bytes(ip)) for ip in (r.src_ip, r.dst_ip))
+        assert key + (r.proto, r.src_port, r.dst_port) == ("2001:db8::1", "2001:db8::2", 17, 53, 1024)
+        assert (r.kind, r.packets, r.bytes) == (multiproc_probe.FLOW_REC_EXACT, 4, 320)
+        assert self.lib.cap_flush(self.ctx) == 0 and self.lib.cap_get_flushed6(self.ctx) == 0
+
+    def test_flow_sampling_keeps_whole_flows(self):
+        assert self.lib.cap_set_sampling(self.ctx, 0.5, 1) == 0
+        assert self.lib.cap_get_sample_rate(self.ctx) == 0.5
+        for i in range(200):
+            self._send(_build_vxlan_packet(src_port=1000 + i), 3)
+        self.lib.cap_run(self.ctx, 300)
+        flows = _records(self.lib, self.ctx, self.lib.cap_flush(self.ctx))
+
+        assert 60 < len(flows) < 140, f"kept {len(flows)}/200 flows — expected ~100"
+        assert all(v == (3, 180) for v in flows.values())
+        assert self.lib.cap_get_total_parsed(self.ctx) == 600
+        assert self.lib.cap_get_total_sampled(self.ctx) == 3 * len(flows)
+
+        # Deterministic: the same 5-tuples are kept on the next window
+        self.lib.cap_flush(self.ctx)
+        for i in range(200):
+            self._send(_build_vxlan_packet(src_port=1000 + i))
+        self.lib.cap_run(self.ctx, 300)
+        again = _records(self.lib, self.ctx, self.lib.cap_flush(self.ctx))
+        assert again.keys() == flows.keys()
+
+        # ...and by another context, whose table hash has a different random seed
+        port2 = _free_udp_port()
+        ctx2 = self.lib.cap_create(port2, 4 * 1024 * 1024)
+        try:
+            assert self.lib.cap_set_sampling(ctx2, 0.5, 1) == 0
+            for i in range(200):
+                self.tx.sendto(_build_vxlan_packet(src_port=1000 + i), ("127.0.0.1", port2))
+            self.lib.cap_run(ctx2, 300)
+            other = _records(self.lib, ctx2, self.lib.cap_flush(ctx2))
+        finally:
+            self.lib.cap_destroy(ctx2)
+        assert other.keys() == flows.keys()
+
+    def test_packet_sampling_1_in_n(self):
+        assert self.lib.cap_set_sampling(self.ctx, 1.0, 4) == 0
+        assert self.lib.cap_get_sample_rate(self.ctx) == 0.25
+        self._send(_build_vxlan_packet(), 40)
+        self.lib.cap_run(self.ctx, 200)
+        flows = _records(self.lib, self.ctx, self.lib.cap_flush(self.ctx))
+        assert flows == {("10.0.1.1", "10.0.2.2", 6, 12345, 80): (10, 600)}
+        assert self.lib.cap_get_total_pkts(self.ctx) == 40
+        assert self.lib.cap_get_total_parsed(self.ctx) == 10
+
+    def test_set_sampling_rejects_invalid(self):
+        assert self.lib.cap_set_sampling(self.ctx, 0.0, 1) == -1
+        assert self.lib.cap_set_sampling(self.ctx, 1.5, 1) == -1
+        assert self.lib.cap_set_sampling(self.ctx, 0.5, 0) == -1
+        assert self.lib.cap_get_sample_rate(self.ctx) == 1.0
+        assert self.lib.cap_start(self.ctx) == 0
+        assert self.lib.cap_set_sampling(self.ctx, 0.5, 1) == -1
+        self.lib.cap_stop(self.ctx)
+
+    def test_stats_block_published_on_drain(self):
+        stats = multiproc_probe.WorkerStats()
+        try:
+            assert self.lib.cap_attach_stats(self.ctx, ctypes.create_string_buffer(1024)) == -1
+            assert self.lib.cap_attach_stats(self.ctx, stats.addr) == 0
+            for port in (1, 2, 3):
+                self._send(_build_vxlan_packet(dst_port=port))
+            self._send(b"\x08" + b"\x00" * 20, 2)                            # short
+            arp = bytearray(_build_vxlan_packet())
+            arp[8 + 12:8 + 14] = b"\x08\x06"
+            self._send(bytes(arp), 2)                                         # ethertype
+            bad_ihl = bytearray(_build_vxlan_packet())
+            bad_ihl[8 + 14] = 0x44
+            self._send(bytes(bad_ihl))                                        # ipv4
+            bad_v6 = bytearray(_build_vxlan6_packet())
+            bad_v6[8 + 14] = 0x40
+            self._send(bytes(bad_v6))                                         # ipv6
+            self.lib.cap_run(self.ctx, 200)
+            assert self.lib.cap_flush(self.ctx) == 3
+            s = stats.read()
+        finally:
+            stats.close()
+        assert (s["pkts"], s["parsed"], s["flows"]) == (9, 3, 3)
+        assert s["rejects"] == [2, 2, 1, 1, 0]
+        assert s["rx_entries"] == 9 and sum(s["batch_hist"]) == s["rx_calls"]
+        # One drained table of three flows, each at or next to its hash slot
+        assert s["drains"] == 1 and sum(s["drain_hist"]) == 1 and s["drain_ns"] > 0
+        assert sum(s["probe_hist"]) == 3
+        assert s["capacity"] >= 3 and s["sock_rcvbuf"] > 0 and s["sock_drops"] == 0
+
+
+def _xdp_attach(lib, port: int):
+    return lib.xdp_attach(b"lo", port, 1) if os.geteuid() == 0 else None
+
+
+@pytest.mark.skipif(not os.path.isfile(SO_PATH), reason="fast_recv.so not compiled")
+class TestBackends:
+    @pytest.fixture(autouse=True)
+    def setup(self):
+        multiproc_probe._load_fast_recv()
+        self.lib = multiproc_probe._fast_recv_lib
+        self.port = _free_udp_port()
+        self.tx = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        yield
+        self.tx.close()
+
+    def _config(self, **fields) -> multiproc_probe._CCapConfig:
+        cfg = multiproc_probe._CCapConfig()
+        self.lib.cap_config_init(cfg)
+        cfg.port = self.port
+        for name, value in fields.items():
+            setattr(cfg, name, value)
+        return cfg
+
+    def _capture(self, cfg) -> tuple[int, dict]:
+        ctx = self.lib.cap_create_ex(cfg)
+        assert ctx
+        try:
+            for _ in range(5):
+                self.tx.sendto(_build_vxlan_packet(), ("127.0.0.1", self.port))
+            self.lib.cap_run(ctx, 300)
+            return self.lib.cap_get_backend(ctx), _records(self.lib, ctx, self.lib.cap_flush(ctx))
+        finally:
+            self.lib.cap_destroy(ctx)
+
+    def test_default_config_is_socket(self):
+        backend, flows = self._capture(self._config())
+        assert backend == multiproc_probe.CAP_BACKEND_SOCKET
+        assert flows == {("10.0.1.1", "10.0.2.2", 6, 12345, 80): (5, 300)}
+
+    def test_af_xdp_falls_back_to_socket(self):
+        cfg = self._config(backend=multiproc_probe.CAP_BACKEND_AF_XDP, ifname=b"nosuchif0", xsk_map_id=1)
+        backend, flows = self._capture(cfg)
+        assert backend == multiproc_probe.CAP_BACKEND_SOCKET
+        assert flows == {("10.0.1.1", "10.0.2.2", 6, 12345, 80): (5, 300)}
+
+    def test_af_xdp_capture(self):
+        xdp = _xdp_attach(self.lib, self.port)
+        if not xdp:
+            pytest.skip("XDP not available: " + self.lib.xdp_get_log().decode(errors="replace"))
+        try:
+            cfg = self._config(backend=multiproc_probe.CAP_BACKEND_AF_XDP, ifname=b"lo", queue_id=0,
+                               xsk_map_id=self.lib.xdp_get_map_id(xdp))
+            backend, flows = self._capture(cfg)
+        finally:
+            self.lib.xdp_detach(xdp)
+        assert backend == multiproc_probe.CAP_BACKEND_AF_XDP
+        # Same records as the socket path: frames are parsed from the VXLAN header on
+        assert flows == {("10.0.1.1", "10.0.2.2", 6, 12345, 80): (5, 300)}
+
+    def test_xdp_count_falls_back_to_socket(self):
+        cfg = self._config(backend=multiproc_probe.CAP_BACKEND_XDP_COUNT, ifname=b"nosuchif0")
+        backend, flows = self._capture(cfg)
+        assert backend == multiproc_probe.CAP_BACKEND_SOCKET
+        assert flows == {("10.0.1.1", "10.0.2.2", 6, 12345, 80): (5, 300)}
+
+    def test_xdp_count_capture(self):
+        cfg = self._config(backend=multiproc_probe.CAP_BACKEND_XDP_COUNT, ifname=b"lo")
+        ctx = self.lib.cap_create_ex(cfg)
+        assert ctx
+        try:
+            if self.lib.cap_get_backend(ctx) != multiproc_probe.CAP_BACKEND_XDP_COUNT:
+                pytest.skip("XDP not available: " + self.lib.xdp_get_log().decode(errors="replace"))
+            # The kernel counts every packet, so sampling is refused
+            assert self.lib.cap_set_sampling(ctx, 0.5, 1) == -1
+            assert self.lib.cap_set_sampling(ctx, 1.0, 1) == 0
+            # Stands in for the other workers' sockets: only what the program passes arrives
+            rx = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+            rx.bind(("127.0.0.1", self.port))
+            rx.settimeout(0.5)
+            assert self.lib.cap_start(ctx) == 0
+            for _ in range(5):
+                self.tx.sendto(_build_vxlan_packet(), ("127.0.0.1", self.port))
+            self.tx.sendto(_build_vxlan_packet(src_ip="10.0.1.9", proto=17, src_port=53, dst_port=5353),
+                           ("127.0.0.1", self.port))
+            self.tx.sendto(_build_vxlan6_packet(), ("127.0.0.1", self.port))
+            time.sleep(0.3)
+            self.lib.cap_stop(ctx)
+            flows = _records(self.lib, ctx, self.lib.cap_flush(ctx))
+            assert self.lib.cap_get_total_pkts(ctx) == 6
+            assert self.lib.cap_get_total_parsed(ctx) == 6
+            # The IPv6 inner frame is not parsed in XDP: passed to the socket, not dropped
+            assert rx.recv(2048) == _build_vxlan6_packet()
+            rx.close()
+        finally:
+            self.lib.cap_destroy(ctx)
+        # Same records as the userspace parse
+        assert flows == {("10.0.1.1", "10.0.2.2", 6, 12345, 80): (5, 300),
+                         ("10.0.1.9", "10.0.2.2", 17, 53, 5353): (1, 60)}
+
+    def test_xdp_count_run_keeps_duration_under_load(self):
+        cfg = self._config(backend=multiproc_probe.CAP_BACKEND_XDP_COUNT, ifname=b"lo")
+        ctx = self.lib.cap_create_ex(cfg)
+        assert ctx
+        stop = threading.Event()
+
+        def flood():
+            pkts = [_build_vxlan_packet(src_port=1000 + i) for i in range(64)]
+            while not stop.is_set():
+                for p in pkts:
+                    self.tx.sendto(p, ("127.0.0.1", self.port))
+
+        sender = threading.Thread(target=flood)
+        try:
+            if self.lib.cap_get_backend(ctx) != multiproc_probe.CAP_BACKEND_XDP_COUNT:
+                pytest.skip("XDP not available: " + self.lib.xdp_get_log().decode(errors="replace"))
+            sender.start()
+            # Every 100ms harvest returns more flows than a full batch: the deadline still holds
+            t0 = time.monotonic()
+            assert self.lib.cap_run(ctx, 300) > 0
+            assert time.monotonic() - t0 < 0.8
+        finally:
+            stop.set()
+            if sender.is_alive():
+                sender.join()
+            self.lib.cap_destroy(ctx)
+
+    def _capture_flows(self, cfg, n: int, kind: int = multiproc_probe.FLOW_REC_EXACT) -> tuple[dict, int, int]:
+        ctx = self.lib.cap_create_ex(cfg)
+        assert ctx
+        try:
+            for i in range(n):
+                self.tx.sendto(_build_vxlan_packet(src_port=1000 + i), ("127.0.0.1", self.port))
+            self.lib.cap_run(ctx, 300)
+            flows = _records(self.lib, ctx, self.lib.cap_flush(ctx), kind)
+            return flows, self.lib.cap_get_dropped_flows(ctx), self.lib.cap_get_flow_capacity(ctx)
+        finally:
+            self.lib.cap_destroy(ctx)
+
+    def test_flow_table_grows_instead_of_dropping(self):
+        flows, dropped, capacity = self._capture_flows(self._config(max_flows=16, rcvbuf=4 << 20), 300)
+        assert len(flows) == 300 and dropped == 0
+        assert all(v == (1, 60) for v in flows.values())
+        # The drained table was resized to match, so the next interval starts large
+        assert capacity >= 300
+
+    def test_flow_table_grows_with_ipv6_flows(self):
+        ctx = self.lib.cap_create_ex(self._config(max_flows=16, rcvbuf=4 << 20))
+        assert ctx
+        try:
+            self.tx.sendto(_build_vxlan6_packet(), ("127.0.0.1", self.port))
+            for i in range(100):
+                self.tx.sendto(_build_vxlan_packet(src_port=1000 + i), ("127.0.0.1", self.port))
+            self.lib.cap_run(ctx, 300)
+            assert len(_records(self.lib, ctx, self.lib.cap_flush(ctx))) == 100
+            # Growing the IPv4 table keeps the IPv6 one
+            assert self.lib.cap_get_flushed6(ctx) == 1
+        finally:
+            self.lib.cap_destroy(ctx)
+
+    def test_flow_table_limit_drops_new_flows(self):
+        flows, dropped, _ = self._capture_flows(self._config(max_flows=16, max_flows_limit=40, rcvbuf=4 << 20), 100)
+        assert len(flows) == 40 and dropped == 60
+        # The first flows are kept, in arrival order
+        assert sorted(k[3] for k in flows) == list(range(1000, 1040))
+        # The rest is accounted in the overflow totals
+        cfg = self._config(max_flows=16, max_flows_limit=40, rcvbuf=4 << 20)
+        overflow, _, _ = self._capture_flows(cfg, 100, multiproc_probe.FLOW_REC_OVERFLOW)
+        assert list(overflow.values()) == [(60, 3600)]
+
+    def test_overflow_sketch_keeps_heavy_hitters(self):
+        cfg = self._config(max_flows=16, max_flows_limit=16, rcvbuf=16 << 20)
+        ctx = self.lib.cap_create_ex(cfg)
+        assert ctx
+        try:
+            dst = ("127.0.0.1", self.port)
+            for i in range(16):
+                self.tx.sendto(_build_vxlan_packet(src_port=i), dst)
+            # Spoofed-source scan with an attacker hidden in it, every flow new
+            for i in range(2000):
+                self.tx.sendto(_build_vxlan_packet(src_ip="172.16.%d.%d" % (i >> 8, i & 0xFF),
+                                                   dst_port=i), dst)
+                if i % 4 == 0:
+                    self.tx.sendto(_build_vxlan_packet(src_ip="10.9.9.9", src_port=i, dst_ip="10.0.3.3"), dst)
+            self.lib.cap_run(ctx, 500)
+            count = self.lib.cap_flush(ctx)
+            buf = self.lib.cap_get_flush_buf(ctx)
+            recs = [multiproc_probe._CFlowRecord.from_buffer_copy(buf[i]) for i in range(count)]
+            assert self.lib.cap_get_total_pkts(ctx) == 16 + 2500
+        finally:
+            self.lib.cap_destroy(ctx)
+
+        by_kind = {}
+        for r in recs:
+            by_kind.setdefault(r.kind, []).append(r)
+        assert len(by_kind[multiproc_probe.FLOW_REC_EXACT]) == 16
+        [overflow] = by_kind[multiproc_probe.FLOW_REC_OVERFLOW]
+        assert (overflow.packets, overflow.bytes) == (2500, 2500 * 60)
+        # The attacker tops the source candidates: a lower bound, within its error bound of 500
+        src = {socket.inet_ntoa(struct.pack("=I", r.src_ip)): r for r in by_kind[multiproc_probe.FLOW_REC_HH_SRC]}
+        attacker = src["10.9.9.9"]
+        assert attacker.packets <= 500 <= attacker.packets * (1 + attacker.err_q16 / 65536)
+        assert attacker.packets >= 250 and attacker.bytes == attacker.packets * 60
+        dst = {socket.inet_ntoa(struct.pack("=I", r.dst_ip)) for r in by_kind[multiproc_probe.FLOW_REC_HH_DST]}
+        assert {"10.0.2.2", "10.0.3.3"} <= dst
+
+    def test_flow_table_hugepages_fallback(self):
+        # Without reserved hugepages this falls back to THP or 4K pages
+        flows, dropped, _ = self._capture_flows(self._config(max_flows=1 << 17, hugepages=1), 5)
+        assert len(flows) == 5 and dropped == 0
+
+    def test_invalid_flow_table_config_rejected(self):
+        assert not self.lib.cap_create_ex(self._config(max_flows=0))
+        assert not self.lib.cap_create_ex(self._config(max_flows=100, max_flows_limit=50))
+
+    def test_pinned_capture_thread(self):
+        cpu = min(os.sched_getaffinity(0))
+        for want, pinned in ((cpu, cpu), (1 << 20, -1)):
+            ctx = self.lib.cap_create_ex(self._config(cpu=want))
+            assert ctx
+            try:
+                assert self.lib.cap_start(ctx) == 0
+                assert self.lib.cap_get_pinned_cpu(ctx) == pinned
+                self.lib.cap_stop(ctx)
+            finally:
+                self.lib.cap_destroy(ctx)
+
+    def test_rx_modes_capture(self):
+        for name, mode in multiproc_probe.CAP_RX_MODES.items():
+            ctx = self.lib.cap_create_ex(self._config(rx_mode=mode))
+            assert ctx
+            try:
+                # busy_poll without CAP_NET_ADMIN falls back to blocking
+                assert self.lib.cap_get_rx_mode(ctx) in (mode, 0), name
+                for _ in range(5):
+                    self.tx.sendto(_build_vxlan_packet(), ("127.0.0.1", self.port))
+                self.lib.cap_run(ctx, 200)
+                flows = _records(self.lib, ctx, self.lib.cap_flush(ctx))
+                stats = (ctypes.c_uint64 * 7)()
+                self.lib.cap_get_batch_stats(ctx, stats)
+            finally:
+                self.lib.cap_destroy(ctx)
+            assert flows == {("10.0.1.1", "10.0.2.2", 6, 12345, 80): (5, 300)}, name
+            calls, empty, full, pkts, batch, wait_us, dgrams = stats
+            assert pkts == 5 and full == 0 and 0 < calls - empty <= 5, name
+            if mode == multiproc_probe.CAP_RX_MODES["adaptive"]:
+                # Shallow batches shrink it; the idle timeouts that follow cancel the wait
+                assert 16 <= batch < 256 and wait_us == 0
+            else:
+                assert batch == 256 and wait_us == 0
+
+    def test_adaptive_batch_grows_when_full(self):
+        ctx = self.lib.cap_create_ex(self._config(rx_mode=multiproc_probe.CAP_RX_MODES["adaptive"],
+                                                  rcvbuf=16 << 20))
+        assert ctx
+        try:
+            for i in range(600):
+                self.tx.sendto(_build_vxlan_packet(src_port=1000 + i % 50), ("127.0.0.1", self.port))
+            self.lib.cap_run(ctx, 200)
+            stats = (ctypes.c_uint64 * 7)()
+            self.lib.cap_get_batch_stats(ctx, stats)
+        finally:
+            self.lib.cap_destroy(ctx)
+        calls, empty, full, pkts, batch, wait_us, dgrams = stats
+        # 256 full -> 512, then 344 of 512 left; the idle timeouts keep it there
+        assert pkts == 600 and full == 1 and batch == 512
+
+    def test_udp_gro_splits_super_datagrams(self):
+        pkt = _build_vxlan_packet()
+        try:
+            # UDP_SEGMENT: one send becomes a GSO skb that loopback hands over unsegmented
+            self.tx.setsockopt(socket.IPPROTO_UDP, 103, len(pkt))
+        except OSError:
+            pytest.skip("UDP_SEGMENT not supported")
+        for gro in (1, 0):
+            ctx = self.lib.cap_create_ex(self._config(udp_gro=gro))
+            assert ctx
+            try:
+                if gro and not self.lib.cap_get_udp_gro(ctx):
+                    pytest.skip("UDP_GRO not supported")
+                short = pkt[:-4]  # a shorter tail segment is allowed; bytes count the inner IP length
+                self.tx.sendto(pkt * 9 + short, ("127.0.0.1", self.port))
+                self.lib.cap_run(ctx, 200)
+                flows = _records(self.lib, ctx, self.lib.cap_flush(ctx))
+                stats = (ctypes.c_uint64 * 7)()
+                self.lib.cap_get_batch_stats(ctx, stats)
+            finally:
+                self.lib.cap_destroy(ctx)
+            assert flows == {("10.0.1.1", "10.0.2.2", 6, 12345, 80): (10, 600)}
+            # With GRO all ten arrive in one recvmmsg() entry; without, the kernel segments them
+            assert (stats[3], stats[6]) == ((10, 1) if gro else (10, 10))
+
+    def test_vni_filter_drops_other_vnis(self):
+        ctx = self.lib.cap_create_ex(self._config())
+        assert ctx
+        try:
+            too_many = (ctypes.c_uint32 * 17)()
+            assert self.lib.cap_set_vni_filter(ctx, too_many, 17) == -1
+            vnis = (ctypes.c_uint32 * 2)(12345, 777)
+            assert self.lib.cap_set_vni_filter(ctx, vnis, 2) == 0
+            for _ in range(5):
+                self.tx.sendto(_build_vxlan_packet(), ("127.0.0.1", self.port))
+            for _ in range(3):
+                self.tx.sendto(_build_vxlan_packet(dst_port=81, vni=12346), ("127.0.0.1", self.port))
+            self.tx.sendto(_build_vxlan_packet(dst_port=82, vni=777), ("127.0.0.1", self.port))
+            self.lib.cap_run(ctx, 300)
+            flows = _records(self.lib, ctx, self.lib.cap_flush(ctx))
+            assert flows == {("10.0.1.1", "10.0.2.2", 6, 12345, 80): (5, 300),
+                             ("10.0.1.1", "10.0.2.2", 6, 12345, 82): (1, 60)}
+            assert self.lib.cap_get_vni_dropped(ctx) == 3
+        finally:
+            self.lib.cap_destroy(ctx)
+
+    def test_track_sources_tags_flows_and_totals(self):
+        for track in (1, 0):
+            ctx = self.lib.cap_create_ex(self._config(track_sources=track))
+            assert ctx
+            try:
+                for _ in range(5):
+                    self.tx.sendto(_build_vxlan_packet(), ("127.0.0.1", self.port))
+                self.tx.sendto(_build_vxlan_packet(dst_port=81), ("127.0.0.1", self.port))
+                self.lib.cap_run(ctx, 300)
+                n = self.lib.cap_flush(ctx)
+                recs = [self.lib.cap_get_flush_buf(ctx)[i] for i in range(n)]
+                exact = [r.source for r in recs if r.kind == multiproc_probe.FLOW_REC_EXACT]
+                sources = [(socket.inet_ntoa(struct.pack("=I", r.src_ip)), r.source, r.packets, r.bytes)
+                           for r in recs if r.kind == multiproc_probe.FLOW_REC_SOURCE]
+                assert self.lib.cap_get_num_sources(ctx) == track
+            finally:
+                self.lib.cap_destroy(ctx)
+            assert len(exact) == 2
+            if track:
+                # Loopback: every packet's outer source is 127.0.0.1, the first (id 1) source seen
+                assert exact == [1, 1]
+                assert sources == [("127.0.0.1", 1, 6, 360)]
+            else:
+                assert exact == [0, 0] and sources == []
+
+    def test_ext_counters(self):
+        ctx = self.lib.cap_create_ex(self._config(max_flows=16, ext_counters=1))
+        assert ctx
+        try:
+            assert self.lib.cap_get_ext_counters(ctx) == 1
+            before = time.time_ns()
+            for _ in range(3):
+                self.tx.sendto(_build_vxlan_packet(ip_total_length=40, tcp_flags=0x02), ("127.0.0.1", self.port))
+            self.tx.sendto(_build_vxlan_packet(ip_total_length=40, tcp_flags=0x14), ("127.0.0.1", self.port))
+            for i in range(60):  # grows the table: counters move with their flows
+                self.tx.sendto(_build_vxlan_packet(proto=17, src_port=2000 + i, ip_total_length=1500),
+                               ("127.0.0.1", self.port))
+            self.lib.cap_run(ctx, 300)
+            flows = _records(self.lib, ctx, self.lib.cap_flush(ctx))
+            buf = self.lib.cap_get_flush_ext_buf(ctx)
+            ext = {(r.proto, r.src_port): (r.tcp_flags, r.syn, r.rst, list(r.len_hist), r.first_ns, r.last_ns)
+                   for r in (buf[i] for i in range(self.lib.cap_get_flushed_ext(ctx)))}
+            after = time.time_ns()
+        finally:
+            self.lib.cap_destroy(ctx)
+        assert flows[("10.0.1.1", "10.0.2.2", 6, 12345, 80)] == (4, 160)
+        assert len(ext) == len(flows) == 61
+        flags, syn, rst, hist, first, last = ext[(6, 12345)]
+        # Bare SYNs count as SYN, RST|ACK as RST; all four are < 64 bytes
+        assert (flags, syn, rst, hist) == (0x16, 3, 1, [4, 0, 0, 0, 0, 0])
+        assert before - 50_000_000 <= first <= last <= after + 50_000_000
+        assert all(e[:4] == (0, 0, 0, [0, 0, 0, 0, 0, 1]) for k, e in ext.items() if k[0] == 17)
+
+    def test_ext_counters_off_by_default(self):
+        ctx = self.lib.cap_create_ex(self._config())
+        assert ctx
+        try:
+            self.tx.sendto(_build_vxlan_packet(tcp_flags=0x02), ("127.0.0.1", self.port))
+            self.lib.cap_run(ctx, 200)
+            assert self.lib.cap_flush(ctx) == 1
+            assert self.lib.cap_get_ext_counters(ctx) == 0 and self.lib.cap_get_flushed_ext(ctx) == 0
+        finally:
+            self.lib.cap_destroy(ctx)
+
+    def test_host_threshold_events(self):
+        # 8 kbit/s over a 1 s window: 1000 bytes per host and direction
+        ctx = self.lib.cap_create_ex(self._config(host_bps=8000, host_window_ms=1000))
+        assert ctx
+        ring = multiproc_probe.FlowRing(records=16, record=multiproc_probe._CHostEvent)
+        try:
+            assert self.lib.cap_get_host_check(ctx) == 1
+            assert self.lib.cap_attach_events(ctx, ring.addr) == 0
+            for _ in range(30):
+                self.tx.sendto(_build_vxlan_packet(ip_total_length=100), ("127.0.0.1", self.port))
+            for _ in range(2):
+                self.tx.sendto(_build_vxlan_packet(src_ip="10.0.9.9", ip_total_length=100),
+                               ("127.0.0.1", self.port))
+            self.lib.cap_run(ctx, 300)
+            events = {(multiproc_probe.ip_to_str(e.ip), e.dir): (e.reason, e.window_ms, e.packets, e.bytes)
+                      for e in ring.pop()}
+            assert self.lib.cap_get_host_events(ctx) == 2
+            # The flow table is untouched by the pre-check
+            assert _records(self.lib, ctx, self.lib.cap_flush(ctx))[("10.0.1.1", "10.0.2.2", 6, 12345, 80)] == (30, 3000)
+        finally:
+            self.lib.cap_destroy(ctx)
+            ring.close()
+        # One event per host and direction, raised by the packet that crossed 1000 bytes
+        assert events == {
+            ("10.0.1.1", multiproc_probe.HOST_EV_SRC): (1, 1000, 11, 1100),
+            ("10.0.2.2", multiproc_probe.HOST_EV_DST): (1, 1000, 11, 1100),
+        }
+
+    def test_host_check_off_by_default(self):
+        ctx = self.lib.cap_create_ex(self._config())
+        assert ctx
+        ring = multiproc_probe.FlowRing(records=16, record=multiproc_probe._CHostEvent)
+        try:
+            assert self.lib.cap_get_host_check(ctx) == 0
+            assert self.lib.cap_attach_events(ctx, ring.addr) == -1
+            assert ring.pop() == []
+        finally:
+            self.lib.cap_destroy(ctx)
+            ring.close()
+        assert not self.lib.cap_create_ex(self._config(host_pps=1000, host_window_ms=0))
+
+    def _steered_group(self, mode, cpus) -> list:
+        fds = [self.lib.cap_open_socket(self.port, 4 << 20) for _ in cpus]
+        assert all(fd >= 0 for fd in fds)
+        assert self.lib.cap_attach_steering(fds[0], mode, (ctypes.c_int * len(cpus))(*cpus), len(cpus)) == 0
+        ctxs = [self.lib.cap_create_ex(self._config(sock_fd=fd)) for fd in fds]
+        assert all(ctxs)
+        return ctxs
+
+    def _drain_group(self, ctxs) -> list[dict]:
+        try:
+            out = []
+            for ctx in ctxs:
+                self.lib.cap_run(ctx, 200)
+                out.append(_records(self.lib, ctx, self.lib.cap_flush(ctx)))
+            return out
+        finally:
+            for ctx in ctxs:
+                self.lib.cap_destroy(ctx)
+
+    def test_flow_steering_keeps_each_flow_on_one_socket(self):
+        ctxs = self._steered_group(multiproc_probe.CAP_STEER_FLOW, [0, 0])
+        for i in range(32):
+            for _ in range(3):
+                self.tx.sendto(_build_vxlan_packet(src_port=2000 + i), ("127.0.0.1", self.port))
+        per_socket = self._drain_group(ctxs)
+        assert all(per_socket)
+        assert not per_socket[0].keys() & per_socket[1].keys()
+        merged = {**per_socket[0], **per_socket[1]}
+        assert len(merged) == 32 and all(v == (3, 180) for v in merged.values())
+
+    def test_cpu_steering_follows_rx_cpu(self):
+        saved = os.sched_getaffinity(0)
+        cpu = min(saved)
+        # Loopback delivers on the sending CPU: only socket 1 (mapped to it) should see packets
+        ctxs = self._steered_group(multiproc_probe.CAP_STEER_CPU, [cpu + 1, cpu])
+        os.sched_setaffinity(0, {cpu})
+        try:
+            for i in range(8):
+                self.tx.sendto(_build_vxlan_packet(src_port=3000 + i), ("127.0.0.1", self.port))
+        finally:
+            os.sched_setaffinity(0, saved)
+        per_socket = self._drain_group(ctxs)
+        assert per_socket[0] == {} and len(per_socket[1]) == 8
+
+
+def _outer_frame(payload: bytes, src_ip: str = "192.0.2.10", dst_port: int = 4789, vlan: bool = False,
+                 link: str = "eth") -> bytes:
+    """Mirror frame carrying payload in outer IPv4/UDP, as a capture on the probe's NIC sees it."""
+    udp = struct.pack("!HHHH", 40000, dst_port, 8 + len(payload), 0) + payload
+    ip = struct.pack("!BBHHHBBH4s4s", 0x45, 0, 20 + len(udp), 0, 0, 64, 17, 0,
+                     socket.inet_aton(src_ip), socket.inet_aton("192.0.2.1")) + udp
+    if link == "raw":
+        return ip
+    if link == "sll2":
+        return struct.pack("!HHIHBB8s", 0x0800, 0, 2, 1, 0, 6, b"\x00" * 8) + ip
+    tag = struct.pack("!HH", 0x8100, 7) if vlan else b""
+    return b"\x00" * 12 + tag + struct.pack("!H", 0x0800) + ip
+
+
+def _write_pcap(path: str, frames, linktype: int = 1, ns: bool = False, order: str = "<") -> None:
+    """Classic pcap of (capture time in seconds, frame) pairs."""
+    with open(path, "wb") as f:
+        f.write(struct.pack(order + "IHHiIII", 0xA1B23C4D if ns else 0xA1B2C3D4, 2, 4, 0, 0, 65535, linktype))
+        for ts, frame in frames:
+            sec = int(ts)
+            frac = round((ts - sec) * (1e9 if ns else 1e6))
+            f.write(struct.pack(order + "IIII", sec, frac, len(frame), len(frame)) + frame)
+
+
+def _pcapng_block(order: str, btype: int, body: bytes) -> bytes:
+    body += b"\x00" * (-len(body) % 4)
+    return struct.pack(order + "II", btype, 12 + len(body)) + body + struct.pack(order + "I", 12 + len(body))
+
+
+def _pcapng_section(order: str, links, frames) -> bytes:
+    """One pcapng section: interfaces (linktype, if_tsresol), then (interface, time, frame) Enhanced Packet Blocks."""
+    out = _pcapng_block(order, 0x0A0D0D0A, struct.pack(order + "IHHq", 0x1A2B3C4D, 1, 0, -1))
+    for linktype, tsresol in links:
+        opts = struct.pack(order + "HHB3x", 9, 1, tsresol) + struct.pack(order + "HH", 0, 0)
+        out += _pcapng_block(order, 1, struct.pack(order + "HHI", linktype, 0, 65535) + opts)
+    for ifc, ts, frame in frames:
+        scale = 10 ** links[ifc][1]
+        units = int(ts) * scale + round((ts - int(ts)) * scale)
+        out += _pcapng_block(order, 6, struct.pack(order + "IIIII", ifc, units >> 32, units & 0xFFFFFFFF,
+                                                   len(frame), len(frame)) + frame)
+    return out
+
+
+@pytest.mark.skipif(not os.path.isfile(SO_PATH), reason="fast_recv.so not compiled")
+class TestReplay:
+    T0 = 1_700_000_000.0
+
+    @pytest.fixture(autouse=True)
+    def setup(self):
+        multiproc_probe._load_fast_recv()
+        self.lib = multiproc_probe._fast_recv_lib
+        self.tmp = tempfile.mkdtemp()
+        self.ctxs = []
+        yield
+        for ctx in self.ctxs:
+            self.lib.cap_destroy(ctx)
+        shutil.rmtree(self.tmp, ignore_errors=True)
+
+    def _open(self, path: str, **fields):
+        cfg = multiproc_probe._CCapConfig()
+        self.lib.cap_config_init(cfg)
+        cfg.backend = multiproc_probe.CAP_BACKEND_PCAP
+        cfg.pcap_path = path.encode()
+        for name, value in fields.items():
+            setattr(cfg, name, value)
+        ctx = self.lib.cap_create_ex(cfg)
+        if ctx:
+            self.ctxs.append(ctx)
+        return ctx
+
+    def _stats(self, ctx) -> list:
+        out = (ctypes.c_uint64 * 6)()
+        self.lib.cap_get_replay_stats(ctx, out)
+        return list(out)
+
+    def _replay(self, path: str, **fields) -> tuple[dict, list]:
+        ctx = self._open(path, **fields)
+        assert ctx
+        self.lib.cap_run(ctx, 0)  # to the end of the file
+        return _records(self.lib, ctx, self.lib.cap_flush(ctx)), self._stats(ctx)
+
+    def test_pcap_replays_vxlan_frames(self):
+        path = os.path.join(self.tmp, "mirror.pcap")
+        frames = [(self.T0 + i * 0.001, _outer_frame(_build_vxlan_packet(src_port=1000 + i % 3), vlan=i % 2))
+                  for i in range(30)]
+        frames.insert(5, (self.T0, _outer_frame(b"\x00" * 40, dst_port=53)))   # other UDP
+        frames.insert(9, (self.T0, b"\xff" * 12 + b"\x08\x06" + b"\x00" * 28))  # ARP
+        _write_pcap(path, frames)
+        ctx = self._open(path)
+        assert self.lib.cap_get_backend(ctx) == multiproc_probe.CAP_BACKEND_PCAP
+        self.lib.cap_run(ctx, 0)
+        flows = _records(self.lib, ctx, self.lib.cap_flush(ctx))
+        assert flows == {("10.0.1.1", "10.0.2.2", 6, 1000 + i, 80): (10, 600) for i in range(3)}
+        frames_done, skipped, last_ns, first_ns, malformed, eof = self._stats(ctx)
+        assert (frames_done, skipped, malformed, eof) == (30, 2, 0, 1)
+        assert first_ns == int(self.T0 * 1e9) and abs(last_ns - first_ns - 29_000_000) < 1000
+
+    def test_link_types_byte_orders_and_pcapng(self):
+        pkt = _build_vxlan_packet()
+        # Big-endian nanosecond pcap of Linux cooked (SLL2) frames
+        sll2 = os.path.join(self.tmp, "sll2.pcap")
+        _write_pcap(sll2, [(self.T0 + 0.5, _outer_frame(pkt, link="sll2"))] * 4, linktype=276, ns=True, order=">")
+        flows, stats = self._replay(sll2)
+        assert flows == {("10.0.1.1", "10.0.2.2", 6, 12345, 80): (4, 240)}
+        assert stats[3] == int((self.T0 + 0.5) * 1e9)
+        # pcapng: a little-endian section (Ethernet, microseconds) and a big-endian one (raw IPv4, ns)
+        ng = os.path.join(self.tmp, "mirror.pcapng")
+        with open(ng, "wb") as f:
+            f.write(_pcapng_section("<", [(1, 6)], [(0, self.T0, _outer_frame(pkt))] * 3))
+            f.write(_pcapng_section(">", [(1, 6), (101, 9)],
+                                    [(1, self.T0 + 2.25, _outer_frame(_build_vxlan_packet(src_port=7), link="raw"))] * 2))
+        flows, stats = self._replay(ng)
+        assert flows == {("10.0.1.1", "10.0.2.2", 6, 12345, 80): (3, 180), ("10.0.1.1", "10.0.2.2", 6, 7, 80): (2, 120)}
+        assert stats[2] - stats[3] == 2_250_000_000
+
+    def test_shards_split_flows_between_contexts(self):
+        path = os.path.join(self.tmp, "mirror.pcap")
+        frames = [(self.T0, _outer_frame(_build_vxlan_packet(src_port=2000 + i % 64))) for i in range(640)]
+        frames.append((self.T0, _outer_frame(b"\x00" * 40, dst_port=53)))
+        _write_pcap(path, frames)
+        shards = [self._replay(path, pcap_shard=i, pcap_shards=4) for i in range(4)]
+        seen = [flows.keys() for flows, _ in shards]
+        assert all(seen)
+        assert sum(len(s) for s in seen) == len(set().union(*seen)) == 64
+        assert all(v == (10, 600) for flows, _ in shards for v in flows.values())
+        # Non-VXLAN frames are counted once, by shard 0
+        assert [stats[1] for _, stats in shards] == [1, 0, 0, 0]
+
+    def test_step_stops_at_each_epoch(self):
+        path = os.path.join(self.tmp, "mirror.pcap")
+        times = (0.0, 0.4, 1.2, 3.7)
+        _write_pcap(path, [(self.T0 + t, _outer_frame(_build_vxlan_packet(src_port=i))) for i, t in enumerate(times)])
+        ctx = self._open(path, replay_epoch_ms=1000)
+        assert self.lib.cap_start(ctx) == 0
+        ports = []
+        for epoch in range(1, 5):
+            state = self.lib.cap_replay_step(ctx, epoch, 2000)
+            ports.append((state, sorted(k[3] for k in _records(self.lib, ctx, self.lib.cap_flush(ctx)))))
+        # Epoch 3 (2.0-3.0 s) is empty; the last frame ends the file
+        assert ports == [(1, [0, 1]), (1, [2]), (1, []), (2, [3])]
+
+    def test_step_holds_without_permission(self):
+        path = os.path.join(self.tmp, "mirror.pcap")
+        _write_pcap(path, [(self.T0, _outer_frame(_build_vxlan_packet()))] * 3)
+        ctx = self._open(path, replay_epoch_ms=1000)
+        assert self.lib.cap_start(ctx) == 0
+        time.sleep(0.05)
+        # Nothing replayed before the first step
+        assert self.lib.cap_flush(ctx) == 0 and self._stats(ctx)[0] == 0
+        assert self.lib.cap_replay_step(ctx, 1, 2000) == 2
+        assert _records(self.lib, ctx, self.lib.cap_flush(ctx)) == {("10.0.1.1", "10.0.2.2", 6, 12345, 80): (3, 180)}
+
+    def test_replay_speed_paces_by_capture_time(self):
+        path = os.path.join(self.tmp, "mirror.pcap")
+        _write_pcap(path, [(self.T0 + i * 0.04, _outer_frame(_build_vxlan_packet())) for i in range(11)])
+        start = time.monotonic()
+        flows, _ = self._replay(path, replay_speed=2.0)
+        assert time.monotonic() - start >= 0.19  # 0.4 s of capture at twice its pace
+        assert flows == {("10.0.1.1", "10.0.2.2", 6, 12345, 80): (11, 660)}
+
+    def test_truncated_file_replays_up_to_the_cut(self):
+        path = os.path.join(self.tmp, "mirror.pcap")
+        _write_pcap(path, [(self.T0, _outer_frame(_build_vxlan_packet()))] * 5)
+        with open(path, "r+b") as f:
+            f.truncate(os.path.getsize(path) - 10)
+        flows, stats = self._replay(path)
+        assert flows == {("10.0.1.1", "10.0.2.2", 6, 12345, 80): (4, 240)}
+        assert stats[4] == 1 and stats[5] == 1
+
+    def test_invalid_replay_rejected(self):
+        path = os.path.join(self.tmp, "mirror.pcap")
+        _write_pcap(path, [(self.T0, _outer_frame(_build_vxlan_packet()))])
+        junk = os.path.join(self.tmp, "junk.pcap")
+        with open(junk, "wb") as f:
+            f.write(b"not a capture file at all" * 4)
+        assert not self._open(os.path.join(self.tmp, "missing.pcap"))
+        assert not self._open(junk)
+        assert not self._open(path, pcap_shard=2, pcap_shards=2)
+        assert not self._open(path, replay_speed=-1.0)
+        # Stepping needs a replay context with epochs
+        ctx = self._open(path)
+        assert ctx and self.lib.cap_replay_step(ctx, 1, 0) == -1
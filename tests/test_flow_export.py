@@ -0,0 +1,263 @@
+"""Tests for flow export — IPFIX messages, columnar files, and their rotation to S3."""
+
+import ctypes
+import os
+import socket
+import struct
+import sys
+import tempfile
+from unittest.mock import MagicMock, patch
+
+import pytest
+
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), "..", "probe"))
+
+import multiproc_probe
+from flow_export import ExportFiles, read_file
+from multiproc_probe import FLOW_REC_EXACT, FLOW_REC_HH_SRC, FlowMerge, FlowRing
+
+PROBE_DIR = os.path.join(os.path.dirname(__file__), "..", "probe")
+HAVE_LIBS = all(os.path.isfile(os.path.join(PROBE_DIR, so)) for so in ("fast_recv.so", "flow_merge.so"))
+
+_RING_SAMPLE_RATE = 24  # offsetof(struct flow_ring, sample_rate)
+
+
+def _ip(addr: str) -> int:
+    return struct.unpack("=I", socket.inet_aton(addr))[0]
+
+
+def _push(ring: FlowRing, *recs) -> int:
+    """recs: (kind, src, dst, sport, dport, proto, packets, bytes), addresses as strings."""
+    out = (ring.record * len(recs))()
+    for r, (kind, src, dst, sport, dport, proto, packets, nbytes) in zip(out, recs):
+        if ring.record is multiproc_probe._CFlowRecord6:
+            r.src_ip[:] = socket.inet_pton(socket.AF_INET6, src)
+            r.dst_ip[:] = socket.inet_pton(socket.AF_INET6, dst)
+        else:
+            r.src_ip, r.dst_ip = _ip(src), _ip(dst)
+        r.kind, r.src_port, r.dst_port, r.proto, r.packets, r.bytes = kind, sport, dport, proto, packets, nbytes
+    # ring_push copies rec_size bytes per record, whatever the ring holds
+    recs_ptr = ctypes.cast(out, ctypes.POINTER(multiproc_probe._CFlowRecord))
+    return multiproc_probe._fast_recv_lib.ring_push(ring.addr, recs_ptr, len(recs))
+
+
+def _ipfix_records(msg: bytes) -> tuple[tuple, dict, list]:
+    """(header, templates {id: [(ie, len)]}, data [(template id, fields)]) of one IPFIX message."""
+    version, length, export_s, seq, domain = struct.unpack_from("!HHIII", msg)
+    assert version == 10 and length == len(msg)
+    templates, data, off = {}, [], 16
+    while off < length:
+        set_id, set_len = struct.unpack_from("!HH", msg, off)
+        body, end = off + 4, off + set_len
+        if set_id == 2:
+            while body < end:
+                tid, count = struct.unpack_from("!HH", msg, body)
+                templates[tid] = [struct.unpack_from("!HH", msg, body + 4 + 4 * i) for i in range(count)]
+                body += 4 + 4 * count
+        else:
+            size = 45 if set_id == 256 else 69
+            for rec in range(body, end, size):
+                alen = 4 if set_id == 256 else 16
+                src, dst = msg[rec:rec + alen], msg[rec + alen:rec + 2 * alen]
+                data.append((set_id, (src, dst) + struct.unpack_from("!HHBQQQQ", msg, rec + 2 * alen)))
+        off = end
+    return (export_s, seq, domain), templates, data
+
+
+@pytest.mark.skipif(not HAVE_LIBS, reason="fast_recv.so / flow_merge.so not compiled")
+class TestFlowExport:
+    @pytest.fixture(autouse=True)
+    def setup(self):
+        multiproc_probe._load_fast_recv()
+        multiproc_probe._load_flow_merge()
+        self.merge = FlowMerge()
+        self.ring = FlowRing(records=64)
+        self.ring6 = FlowRing(records=16, record=multiproc_probe._CFlowRecord6)
+        self.tmp = tempfile.mkdtemp()
+        yield
+        self.merge.close()
+        self.ring.close()
+        self.ring6.close()
+        for name in os.listdir(self.tmp):
+            os.remove(os.path.join(self.tmp, name))
+        os.rmdir(self.tmp)
+
+    def _collector(self) -> socket.socket:
+        sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        sock.bind(("127.0.0.1", 0))
+        sock.settimeout(2)
+        return sock
+
+    def test_ipfix_templates_and_records(self):
+        collector = self._collector()
+        try:
+            assert self.merge.export_ipfix("127.0.0.1", collector.getsockname()[1], domain=7)
+            self.merge.export_interval(1.0)
+            _push(self.ring, (FLOW_REC_EXACT, "10.0.1.1", "10.0.2.2", 1234, 443, 6, 10, 1500),
+                  (FLOW_REC_HH_SRC, "10.0.1.9", "0.0.0.0", 0, 0, 0, 99, 9999))
+            _push(self.ring6, (FLOW_REC_EXACT, "2001:db8::1", "2001:db8::2", 53, 5353, 17, 2, 200))
+            assert self.merge.consume(self.ring) == 2
+            assert self.merge.consume(self.ring6) == 1
+            self.merge.export_flush()
+            (export_s, seq, domain), templates, data = _ipfix_records(collector.recv(65535))
+        finally:
+            collector.close()
+        assert (seq, domain) == (0, 7)
+        assert [ie for ie, _ in templates[256]] == [8, 12, 7, 11, 4, 2, 1, 152, 153]
+        assert [ie for ie, _ in templates[257]] == [27, 28, 7, 11, 4, 2, 1, 152, 153]
+        # Only the exact flows; sketch candidates stay in the merge
+        assert len(data) == 2
+        tid, (src, dst, sport, dport, proto, packets, nbytes, start_ms, end_ms) = data[0]
+        assert (tid, socket.inet_ntoa(src), socket.inet_ntoa(dst)) == (256, "10.0.1.1", "10.0.2.2")
+        assert (sport, dport, proto, packets, nbytes) == (1234, 443, 6, 10, 1500)
+        assert end_ms - start_ms == 1000 and abs(end_ms // 1000 - export_s) <= 1
+        tid, (src, _, sport, dport, proto, packets, nbytes, _, _) = data[1]
+        assert (tid, socket.inet_ntop(socket.AF_INET6, src)) == (257, "2001:db8::1")
+        assert (sport, dport, proto, packets, nbytes) == (53, 5353, 17, 2, 200)
+        stats = self.merge.export_stats()
+        assert (stats["records"], stats["ipfix_messages"], stats["ipfix_errors"]) == (2, 1, 0)
+
+    def test_ipfix_splits_at_mtu_with_sequence(self):
+        collector = self._collector()
+        try:
+            assert self.merge.export_ipfix("127.0.0.1", collector.getsockname()[1])
+            for batch in range(2):
+                _push(self.ring, *[(FLOW_REC_EXACT, "10.0.1.1", "10.0.2.2", 1000 + i, 80, 6, 1, 100)
+                                   for i in range(batch * 32, batch * 32 + 32)])
+                self.merge.consume(self.ring)
+            self.merge.export_flush()
+            msgs = []
+            while len(msgs) < 3:
+                msgs.append(collector.recv(65535))
+        finally:
+            collector.close()
+        assert all(len(m) <= 1400 for m in msgs)
+        parsed = [_ipfix_records(m) for m in msgs]
+        # Sequence numbers count the data records sent before each message
+        seqs = [hdr[1] for hdr, _, _ in parsed]
+        counts = [len(data) for _, _, data in parsed]
+        assert sum(counts) == 64
+        assert seqs == [0, counts[0], counts[0] + counts[1]]
+        assert [d[1][2] for _, _, data in parsed for d in data] == list(range(1000, 1064))
+
+    def test_bad_collector_leaves_export_off(self):
+        assert not self.merge.export_ipfix("no such host.invalid", 4739)
+        _push(self.ring, (FLOW_REC_EXACT, "10.0.1.1", "10.0.2.2", 1234, 443, 6, 10, 1500))
+        assert self.merge.consume(self.ring) == 1
+        assert self.merge.export_stats()["records"] == 0
+
+    def test_file_columns_scaled_and_readable_while_open(self):
+        path = os.path.join(self.tmp, "flows.dxf")
+        assert self.merge.export_file(path)
+        ctypes.c_double.from_address(self.ring.addr + _RING_SAMPLE_RATE).value = 0.5
+        _push(self.ring, (FLOW_REC_EXACT, "10.0.1.1", "10.0.2.2", 1234, 443, 6, 10, 1500),
+              (FLOW_REC_EXACT, "10.0.1.2", "10.0.2.2", 1235, 443, 6, 1, 60))
+        _push(self.ring6, (FLOW_REC_EXACT, "2001:db8::1", "2001:db8::2", 53, 5353, 17, 2, 200))
+        self.merge.consume(self.ring)
+        self.merge.consume(self.ring6)
+
+        blocks = list(read_file(path))              # a partial block, still mapped by the writer
+        assert [(b.family, len(b)) for b in blocks] == [(4, 2), (6, 1)]
+        rows = list(blocks[0].rows())
+        assert rows[0][1:] == (_ip("10.0.1.1"), _ip("10.0.2.2"), 1234, 443, 6, 20, 3000)
+        assert rows[1][5:] == (6, 2, 120)
+        assert blocks[0].first_s <= rows[0][0] <= blocks[0].last_s
+        (row6,) = blocks[1].rows()
+        assert row6[1] == socket.inet_pton(socket.AF_INET6, "2001:db8::1")
+        assert row6[3:] == (53, 5353, 17, 2, 200)
+
+        assert self.merge.export_file(None)
+        assert sum(len(b) for b in read_file(path)) == 3
+        assert self.merge.export_stats()["file_rows"] == 3
+
+    def test_file_grows_past_one_block(self):
+        path = os.path.join(self.tmp, "flows.dxf")
+        assert self.merge.export_file(path)
+        ring = FlowRing(records=1 << 15)
+        try:
+            recs = [(FLOW_REC_EXACT, "10.0.1.1", "10.0.2.2", i & 0xFFFF, 80, 6, 1, 100) for i in range(20000)]
+            assert _push(ring, *recs) == 20000
+            self.merge.consume(ring)
+        finally:
+            ring.close()
+        self.merge.export_file(None)
+        blocks = list(read_file(path))
+        assert [len(b) for b in blocks] == [16384, 20000 - 16384]
+        assert [r[3] for b in blocks for r in b.rows()] == [i & 0xFFFF for i in range(20000)]
+
+    def test_not_an_export_file(self):
+        path = os.path.join(self.tmp, "junk.dxf")
+        with open(path, "wb") as f:
+            f.write(b"\0" * 4096)
+        with pytest.raises(ValueError):
+            list(read_file(path))
+
+
+@pytest.mark.skipif(not HAVE_LIBS, reason="fast_recv.so / flow_merge.so not compiled")
+class TestExportFiles:
+    @pytest.fixture(autouse=True)
+    def setup(self):
+        multiproc_probe._load_flow_merge()
+        self.merge = FlowMerge()
+        self.tmp = tempfile.mkdtemp()
+        yield
+        self.merge.close()
+        for name in os.listdir(self.tmp):
+            os.remove(os.path.join(self.tmp, name))
+        os.rmdir(self.tmp)
+
+    def test_rotates_per_period_and_uploads_closed_files(self):
+        s3 = MagicMock()
+        files = ExportFiles(self.tmp, "probe-a", rotate_sec=3600, s3_bucket="bkt", s3_prefix="flows/")
+        hour = 1_760_400_000 // 3600 * 3600        # 2025-10-14T00:00:00Z
+        with patch("flow_export.boto3.client", return_value=s3):
+            first = files.tick(self.merge, now=hour + 10)
+            assert first == os.path.join(self.tmp, "flows-probe-a-20251014T000010Z.dxf")
+            assert files.tick(self.merge, now=hour + 3599) is None
+            second = files.tick(self.merge, now=hour + 3600)
+            files.close(self.merge)
+        assert second.endswith("flows-probe-a-20251014T010000Z.dxf")
+        keys = [c.args for c in s3.upload_file.call_args_list]
+        assert keys == [(first, "bkt", "flows/probe-a/2025/10/14/flows-probe-a-20251014T000010Z.dxf"),
+                        (second, "bkt", "flows/probe-a/2025/10/14/flows-probe-a-20251014T010000Z.dxf")]
+        assert files.uploaded == 2
+        assert os.listdir(self.tmp) == []
+
+    def test_failed_upload_keeps_file(self):
+        s3 = MagicMock()
+        s3.upload_file.side_effect = RuntimeError("AccessDenied")
+        files = ExportFiles(self.tmp, "probe-a", s3_bucket="bkt")
+        with patch("flow_export.boto3.client", return_value=s3):
+            path = files.tick(self.merge, now=0)
+            files.close(self.merge)
+        assert os.path.isfile(path) and files.uploaded == 0
+
+    def test_without_bucket_files_stay_local(self):
+        files = ExportFiles(self.tmp, "probe-a", rotate_sec=60)
+        files.tick(self.merge, now=0)
+        files.tick(self.merge, now=60)
+        files.close(self.merge)
+        assert sorted(os.listdir(self.tmp)) == ["flows-probe-a-19700101T000000Z.dxf",
+                                                "flows-probe-a-19700101T000100Z.dxf"]
+
+    def test_restart_within_period_keeps_earlier_file(self):
+        before = ExportFiles(self.tmp, "probe-a")
+        first = before.tick(self.merge, now=3600 + 5)
+        ring = FlowRing(records=64)
+        try:
+            _push(ring, (FLOW_REC_EXACT, "10.0.1.1", "10.0.2.2", 1234, 443, 6, 10, 1500))
+            self.merge.consume(ring)
+        finally:
+            ring.close()
+        before.close(self.merge)
+
+        after = ExportFiles(self.tmp, "probe-a")
+        second = after.tick(self.merge, now=3600 + 20)
+        third = after.tick(self.merge, now=3600 + 20)          # same period: no new file
+        after.close(self.merge)
+        again = ExportFiles(self.tmp, "probe-a").tick(self.merge, now=3600 + 20)
+        self.merge.export_file(None)
+        assert first.endswith("T010005Z.dxf") and second.endswith("T010020Z.dxf") and third is None
+        assert again.endswith("T010020Z-1.dxf")
+        assert not self.merge.export_file(first)               # never truncated
+        assert sum(len(b) for b in read_file(first)) == 1
@@ -0,0 +1,249 @@
+"""Tests for flow_merge.c (coordinator merge + Top-K engine) via ctypes."""
+
+import os
+import shutil
+import socket
+import struct
+import sys
+import tempfile
+
+import pytest
+
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), "..", "probe"))
+
+import multiproc_probe
+from multiproc_probe import FlowMerge, _CFlowRecord, _CFlowRecord6, _CFlowRecordExt
+
+PROBE_DIR = os.path.join(os.path.dirname(__file__), "..", "probe")
+SO_PATH = os.path.join(PROBE_DIR, "flow_merge.so")
+
+
+def _ip(addr: str) -> int:
+    return struct.unpack("=I", socket.inet_aton(addr))[0]
+
+
+def _records(*flows: tuple, kind: int = multiproc_probe.FLOW_REC_EXACT):
+    recs = (_CFlowRecord * len(flows))()
+    for r, (src, dst, proto, sport, dport, pkts, byt) in zip(recs, flows):
+        r.src_ip, r.dst_ip, r.proto, r.src_port, r.dst_port = _ip(src), _ip(dst), proto, sport, dport
+        r.packets, r.bytes, r.kind = pkts, byt, kind
+    return recs
+
+
+@pytest.mark.skipif(not os.path.isfile(SO_PATH), reason="flow_merge.so not compiled")
+class TestFlowMerge:
+    @pytest.fixture(autouse=True)
+    def merge(self):
+        multiproc_probe._load_flow_merge()
+        self.lib = multiproc_probe._flow_merge_lib
+        self.m = FlowMerge()
+        yield
+        self.m.close()
+
+    def _add(self, *flows, kind: int = multiproc_probe.FLOW_REC_EXACT):
+        recs = _records(*flows, kind=kind)
+        self.lib.merge_add(self.m._ctx, recs, len(flows))
+
+    def test_same_key_merges(self):
+        self._add(("10.0.1.1", "10.0.2.2", 6, 1234, 80, 10, 1000),
+                  ("10.0.1.1", "10.0.2.2", 6, 1234, 80, 5, 500))
+        assert self.m.count(FlowMerge.FLOWS) == 1
+        assert self.m.top(FlowMerge.FLOWS, 1, 10) == [(_ip("10.0.1.1"), _ip("10.0.2.2"), 1234, 80, 6, 15, 1500)]
+        assert self.m.totals() == (15, 1500)
+
+    def test_hosts_split_by_direction(self):
+        self._add(("10.0.1.1", "10.0.2.2", 6, 1234, 80, 10, 1000),
+                  ("10.0.2.2", "10.0.1.1", 6, 80, 1234, 2, 200))
+        hosts = {row[0]: row[1:] for row in self.m.top(FlowMerge.HOSTS, 1, 10)}
+        assert hosts[_ip("10.0.1.1")] == (10, 1000, 2, 200)
+        assert hosts[_ip("10.0.2.2")] == (2, 200, 10, 1000)
+
+    def test_top_k_largest_first(self):
+        self._add(*[("10.0.1.%d" % i, "10.0.2.2", 6, 1234, 80, 100 - i, i * 10) for i in range(1, 51)])
+        by_bytes = self.m.top(FlowMerge.FLOWS, 1, 5)
+        assert [r[-1] for r in by_bytes] == [500, 490, 480, 470, 460]
+        by_pkts = self.m.top(FlowMerge.FLOWS, 0, 3)
+        assert [r[-2] for r in by_pkts] == [99, 98, 97]
+        # k larger than the table returns every row
+        assert len(self.m.top(FlowMerge.FLOWS, 1, 1000)) == 50
+
+    def test_grows_past_initial_capacity(self):
+        n = 100000
+        flows = [("10.%d.%d.%d" % (i >> 16, (i >> 8) & 0xFF, i & 0xFF), "10.255.0.1", 17, 53, 1024, 1, 64)
+                 for i in range(n)]
+        for i in range(0, n, 10000):
+            self._add(*flows[i:i + 10000])
+        self._add(flows[0])
+        assert self.m.count(FlowMerge.FLOWS) == n
+        assert self.m.count(FlowMerge.HOSTS) == n + 1
+        assert self.m.totals() == (n + 1, (n + 1) * 64)
+        assert self.m.top(FlowMerge.FLOWS, 0, 1)[0][-2:] == (2, 128)
+        assert self.lib.merge_get_dropped(self.m._ctx) == 0
+
+    def test_hosts_over(self):
+        self._add(("10.0.1.1", "10.0.2.2", 6, 1234, 80, 10, 50000),
+                  ("10.0.1.9", "10.0.2.9", 6, 1234, 80, 1, 100))
+        rows = self.m.hosts_over(FlowMerge.NO_LIMIT, 1000)
+        assert sorted(r[0] for r in rows) == sorted([_ip("10.0.1.1"), _ip("10.0.2.2")])
+        rows = self.m.hosts_over(5, FlowMerge.NO_LIMIT)
+        assert len(rows) == 2
+        assert self.m.hosts_over(FlowMerge.NO_LIMIT, FlowMerge.NO_LIMIT) == []
+
+    def test_sketch_records_feed_one_table_each(self):
+        self._add(("10.0.1.1", "10.0.2.2", 6, 1234, 80, 10, 1000))
+        self._add(("10.9.9.9", "0.0.0.0", 0, 0, 0, 500, 50000), kind=multiproc_probe.FLOW_REC_HH_SRC)
+        self._add(("0.0.0.0", "10.0.2.2", 0, 0, 0, 400, 40000), kind=multiproc_probe.FLOW_REC_HH_DST)
+        self._add(("10.9.9.9", "10.0.2.2", 17, 1, 53, 7, 700), kind=multiproc_probe.FLOW_REC_HH_FLOW)
+        self._add(("0.0.0.0", "0.0.0.0", 0, 0, 0, 600, 60000), kind=multiproc_probe.FLOW_REC_OVERFLOW)
+        # Hosts see the sketched attacker; 0.0.0.0 never appears
+        hosts = {row[0]: row[1:] for row in self.m.hosts_over(0, 0)}
+        assert hosts == {_ip("10.0.1.1"): (10, 1000, 0, 0), _ip("10.9.9.9"): (500, 50000, 0, 0),
+                         _ip("10.0.2.2"): (0, 0, 410, 41000)}
+        assert self.m.count(FlowMerge.FLOWS) == 2
+        # Only exact and overflow records count towards totals
+        assert self.m.totals() == (610, 61000)
+
+    def test_source_records_feed_sources_table(self):
+        self._add(("10.0.1.1", "10.0.2.2", 6, 1234, 80, 10, 1000))
+        # Two workers report the same mirror source under their own ids
+        SRC = multiproc_probe.FLOW_REC_SOURCE
+        self._add(("172.31.0.5", "0.0.0.0", 0, 0, 0, 6, 600), ("172.31.0.9", "0.0.0.0", 0, 0, 0, 4, 400), kind=SRC)
+        self._add(("172.31.0.5", "0.0.0.0", 0, 0, 0, 3, 300), kind=SRC)
+        assert self.m.top(FlowMerge.SOURCES, 1, 10) == [(_ip("172.31.0.5"), 9, 900), (_ip("172.31.0.9"), 4, 400)]
+        # Per-source totals re-count exact traffic: hosts and totals are untouched
+        assert self.m.count(FlowMerge.HOSTS) == 2
+        assert self.m.totals() == (10, 1000)
+
+    def test_ipv6_records_feed_flows6_and_totals(self):
+        recs = (_CFlowRecord6 * 3)()
+        addrs = [("2001:db8::1", "2001:db8::2", 10, 1000), ("2001:db8::1", "2001:db8::2", 5, 500),
+                 ("2001:db8::3", "2001:db8::2", 1, 100)]
+        for r, (src, dst, pkts, byt) in zip(recs, addrs):
+            r.src_ip[:] = socket.inet_pton(socket.AF_INET6, src)
+            r.dst_ip[:] = socket.inet_pton(socket.AF_INET6, dst)
+            r.proto, r.src_port, r.dst_port, r.packets, r.bytes = 6, 1234, 443, pkts, byt
+            r.kind = multiproc_probe.FLOW_REC_EXACT
+        self.lib.merge_add6(self.m._ctx, recs, len(recs))
+        assert self.m.count(FlowMerge.FLOWS6) == 2
+        top = self.m.top(FlowMerge.FLOWS6, 1, 10)
+        assert [(multiproc_probe.ip6_to_str(t[0]),) + t[2:] for t in top] == [
+            ("2001:db8::1", 1234, 443, 6, 15, 1500), ("2001:db8::3", 1234, 443, 6, 1, 100)]
+        # IPv6 counts toward the totals but not the IPv4 tables
+        assert self.m.totals() == (16, 1600)
+        assert self.m.count(FlowMerge.FLOWS) == 0 and self.m.count(FlowMerge.HOSTS) == 0
+
+    def test_ext_records_merge_per_flow(self):
+        recs = (_CFlowRecordExt * 3)()
+        # Two workers saw the same flow; a third record is another flow
+        for r, (sport, flags, syn, first, last, hist) in zip(recs, [
+                (1234, 0x02, 3, 200, 300, [3, 0, 0, 0, 0, 0]),
+                (1234, 0x14, 0, 100, 250, [1, 0, 0, 0, 0, 2]),
+                (5678, 0x10, 0, 400, 400, [0, 1, 0, 0, 0, 0])]):
+            r.src_ip, r.dst_ip, r.proto, r.src_port, r.dst_port = _ip("10.0.1.1"), _ip("10.0.2.2"), 6, sport, 80
+            r.tcp_flags, r.syn, r.rst, r.first_ns, r.last_ns = flags, syn, flags >> 2 & 1, first, last
+            r.len_hist[:] = hist
+        self.lib.merge_add_ext(self.m._ctx, recs, len(recs))
+        assert self.m.count(FlowMerge.FLOW_EXT) == 2
+        assert self.m.flow_ext(_ip("10.0.1.1"), _ip("10.0.2.2"), 1234, 80, 6) == {
+            "syn": 3, "rst": 1, "tcp_flags": 0x16, "first_ns": 100, "last_ns": 300,
+            "len_hist": [4, 0, 0, 0, 0, 2]}
+        assert self.m.flow_ext(_ip("10.0.1.1"), _ip("10.0.2.2"), 1234, 81, 6) is None
+        # Counters annotate flows; they add nothing to the totals
+        assert self.m.totals() == (0, 0)
+
+    def test_rollup_subnets(self):
+        # 200 sources in one /24, none of them large, plus one big host elsewhere
+        self._add(*[("172.16.5.%d" % i, "10.0.2.2", 6, 1234, 80, 1, 100) for i in range(1, 201)])
+        self._add(("172.17.0.1", "10.0.3.3", 6, 1234, 80, 1, 5000),
+                  ("192.168.1.1", "10.0.2.9", 17, 53, 53, 1, 50))
+        assert self.m.set_prefixes([(_ip("172.16.0.0"), 12), (_ip("192.168.7.7"), 16), (_ip("10.0.0.0"), 8)])
+        assert self.m.rollup() == self.m.count(FlowMerge.NET24) + self.m.count(FlowMerge.NET16) + \
+            self.m.count(FlowMerge.CIDRS) + self.m.count(FlowMerge.SERVICES)
+
+        assert self.m.top(FlowMerge.NET24, 1, 1) == [(_ip("172.16.5.0"), 200, 20000, 0, 0)]
+        assert self.m.top(FlowMerge.NET16, 1, 1) == [(_ip("172.16.0.0"), 200, 20000, 0, 0)]
+        assert self.m.top(FlowMerge.NET16, 3, 1) == [(_ip("10.0.0.0"), 0, 0, 202, 25050)]
+        # Host bits of a configured CIDR are dropped; each CIDR sums every host inside it
+        assert self.m.top(FlowMerge.CIDRS, 1, 10) == [
+            (_ip("172.16.0.0"), 12, 201, 25000, 0, 0),
+            (_ip("192.168.0.0"), 16, 1, 50, 0, 0),
+        ]
+        assert self.m.top(FlowMerge.CIDRS, 3, 10) == [(_ip("10.0.0.0"), 8, 0, 0, 202, 25050)]
+        # Rebuilt from scratch on every call, and cleared by reset()
+        self.m.rollup()
+        assert self.m.top(FlowMerge.NET24, 1, 1)[0][1:3] == (200, 20000)
+        self.m.reset()
+        assert self.m.rollup() == 0
+        assert not self.m.set_prefixes([(0, 33)])
+
+    def test_ports_and_protocols(self):
+        self._add(("10.0.1.1", "10.0.2.2", 6, 1234, 443, 10, 9000),
+                  ("10.0.1.2", "10.0.2.2", 6, 1235, 443, 5, 3000),
+                  ("10.0.1.1", "10.0.2.3", 17, 5000, 53, 2, 200),
+                  ("10.0.1.1", "10.0.2.3", 6, 5000, 53, 1, 100),
+                  ("10.0.1.1", "10.0.2.4", 1, 0, 0, 4, 400))
+        self._add(("10.9.9.9", "10.0.2.5", 17, 1, 443, 7, 700), kind=multiproc_probe.FLOW_REC_HH_FLOW)
+        # tcp/53 and udp/53 stay apart; ICMP counts towards protocols only
+        assert self.m.top_ports(10) == [(443, 6, 15, 12000), (443, 17, 7, 700), (53, 17, 2, 200), (53, 6, 1, 100)]
+        assert self.m.top_ports(1) == [(443, 6, 15, 12000)]
+        assert self.m.protocols() == {1: (4, 400), 6: (16, 12100), 17: (9, 900)}
+        # Services (dst_ip, port, proto) come from the flows table at rollup time
+        self.m.rollup()
+        assert self.m.top(FlowMerge.SERVICES, 1, 2) == [
+            (_ip("10.0.2.2"), 443, 6, 15, 12000),
+            (_ip("10.0.2.5"), 443, 17, 7, 700),
+        ]
+        self.m.reset()
+        assert self.m.top_ports(10) == []
+        assert self.m.protocols() == {}
+
+    def test_reset(self):
+        self._add(("10.0.1.1", "10.0.2.2", 6, 1234, 80, 10, 1000))
+        self.m.reset()
+        assert self.m.count(FlowMerge.FLOWS) == 0
+        assert self.m.count(FlowMerge.HOSTS) == 0
+        assert self.m.totals() == (0, 0)
+        assert self.m.top(FlowMerge.FLOWS, 1, 10) == []
+        # Same key starts from scratch after reset
+        self._add(("10.0.1.1", "10.0.2.2", 6, 1234, 80, 3, 300))
+        assert self.m.top(FlowMerge.FLOWS, 1, 10)[0][-2:] == (3, 300)
+
+    def test_save_load_round_trip(self):
+        self._add(("10.0.1.1", "10.0.2.2", 6, 1234, 443, 10, 9000),
+                  ("10.0.1.2", "10.0.2.2", 17, 5353, 53, 2, 200))
+        self._add(("10.0.1.9", "10.0.2.9", 6, 1, 80, 7, 700), kind=multiproc_probe.FLOW_REC_HH_FLOW)
+        self._add(("172.31.0.5", "0.0.0.0", 0, 0, 0, 9, 900), kind=multiproc_probe.FLOW_REC_SOURCE)
+        self._add(("0.0.0.0", "0.0.0.0", 0, 0, 0, 3, 300), kind=multiproc_probe.FLOW_REC_OVERFLOW)
+        ext = (_CFlowRecordExt * 1)()
+        ext[0].src_ip, ext[0].dst_ip, ext[0].proto, ext[0].src_port, ext[0].dst_port = \
+            _ip("10.0.1.1"), _ip("10.0.2.2"), 6, 1234, 443
+        ext[0].tcp_flags, ext[0].syn, ext[0].first_ns, ext[0].last_ns = 0x02, 1, 100, 200
+        self.lib.merge_add_ext(self.m._ctx, ext, 1)
+        tables = (FlowMerge.FLOWS, FlowMerge.HOSTS, FlowMerge.SOURCES, FlowMerge.FLOW_EXT)
+        saved = {t: sorted(self.m.top(t, 1 if t != FlowMerge.FLOW_EXT else 0, 100)) for t in tables}
+
+        tmp = tempfile.mkdtemp()
+        try:
+            path = os.path.join(tmp, "window.snap")
+            assert self.m.save(path)
+            m2 = FlowMerge()
+            try:
+                assert m2.load(path) == sum(self.m.count(t) for t in tables)
+                assert {t: sorted(m2.top(t, 1 if t != FlowMerge.FLOW_EXT else 0, 100)) for t in tables} == saved
+                assert m2.totals() == self.m.totals()
+                assert m2.top_ports(10) == self.m.top_ports(10)
+                assert m2.protocols() == self.m.protocols()
+                # Loading adds to what is there, as consuming the same records would
+                assert m2.load(path) > 0
+                assert m2.totals() == tuple(2 * n for n in self.m.totals())
+                assert m2.flow_ext(_ip("10.0.1.1"), _ip("10.0.2.2"), 1234, 443, 6)["first_ns"] == 100
+                # Truncated or missing: rejected whole, nothing added
+                totals = m2.totals()
+                with open(path, "r+b") as f:
+                    f.truncate(os.path.getsize(path) - 1)
+                assert m2.load(path) == -1 and m2.load(os.path.join(tmp, "none")) == -1
+                assert m2.totals() == totals
+            finally:
+                m2.close()
+        finally:
+            shutil.rmtree(tmp, ignore_errors=True)
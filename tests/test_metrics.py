@@ -0,0 +1,81 @@
+"""Tests for metrics.py — Prometheus text rendering and the HTTP endpoint."""
+
+import os
+import sys
+import urllib.error
+import urllib.request
+
+import pytest
+
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), "..", "probe"))
+
+from metrics import CONTENT_TYPE, MetricsServer, render
+
+
+def _stats(**fields) -> dict:
+    s = {
+        "updated_ns": 1_700_000_000_500_000_000, "pkts": 100, "bytes": 6000, "parsed": 90, "sampled": 90,
+        "rejects": [4, 3, 2, 1, 0], "rx_calls": 10, "rx_full": 1, "rx_entries": 100,
+        "batch_hist": [2, 0, 0, 0, 3, 5] + [0] * 6, "probe_hist": [80, 8, 2, 0, 0, 0, 0], "probe_sum": 12,
+        "drain_hist": [1, 1] + [0] * 9 + [1], "drain_ns": 40_000_000, "drains": 3,
+        "dropped_flows": 0, "probe_failures": 0, "ring_drops": 0,
+        "flows": 90, "capacity": 65536, "sock_rmem": 4096, "sock_rcvbuf": 1 << 20, "sock_drops": 7,
+    }
+    s.update(fields)
+    return s
+
+
+def _samples(text: str) -> dict[str, str]:
+    return dict(line.rsplit(" ", 1) for line in text.splitlines() if line and not line.startswith("#"))
+
+
+class TestRender:
+    def test_counters_and_gauges_per_worker(self):
+        out = _samples(render([_stats(), None, _stats(pkts=5)]))
+        assert out['dx_probe_worker_up{worker="1"}'] == "0"
+        assert out['dx_probe_packets_total{worker="0"}'] == "100"
+        assert out['dx_probe_packets_total{worker="2"}'] == "5"
+        # Workers without a block only report worker_up
+        assert 'dx_probe_packets_total{worker="1"}' not in out
+        assert out['dx_probe_parse_rejects_total{worker="0",reason="ethertype"}'] == "3"
+        assert out['dx_probe_socket_drops_total{worker="0"}'] == "7"
+        assert out['dx_probe_socket_rcvbuf_bytes{worker="0"}'] == str(1 << 20)
+        assert out['dx_probe_stats_timestamp_seconds{worker="0"}'] == "1700000000.500"
+
+    def test_histograms_cumulative(self):
+        out = _samples(render([_stats()]))
+        batch = "dx_probe_rx_batch_entries"
+        assert out[f'{batch}_bucket{{worker="0",le="0"}}'] == "2"
+        assert out[f'{batch}_bucket{{worker="0",le="7"}}'] == "2"
+        assert out[f'{batch}_bucket{{worker="0",le="15"}}'] == "5"
+        assert out[f'{batch}_bucket{{worker="0",le="+Inf"}}'] == "10"
+        assert out[f'{batch}_sum{{worker="0"}}'] == "100" and out[f'{batch}_count{{worker="0"}}'] == "10"
+        assert out['dx_probe_flow_probe_distance_bucket{worker="0",le="1"}'] == "88"
+        drain = "dx_probe_drain_seconds"
+        assert out[f'{drain}_bucket{{worker="0",le="1.6384e-05"}}'] == "1"
+        assert out[f'{drain}_bucket{{worker="0",le="3.2768e-05"}}'] == "2"
+        assert out[f'{drain}_bucket{{worker="0",le="+Inf"}}'] == "3"
+        assert out[f'{drain}_sum{{worker="0"}}'] == "0.04"
+
+    def test_every_family_typed_once(self):
+        text = render([_stats(), _stats()])
+        types = [line.split()[2] for line in text.splitlines() if line.startswith("# TYPE")]
+        assert len(types) == len(set(types))
+
+
+class TestMetricsServer:
+    def test_serves_metrics(self):
+        server = MetricsServer("127.0.0.1", 0, lambda: render([_stats()]))
+        server.start()
+        try:
+            with urllib.request.urlopen(f"http://127.0.0.1:{server.port}/metrics", timeout=5) as resp:
+                assert resp.headers["Content-Type"] == CONTENT_TYPE
+                body = resp.read().decode()
+            assert 'dx_probe_packets_total{worker="0"} 100' in body
+            with pytest.raises(urllib.error.HTTPError):
+                urllib.request.urlopen(f"http://127.0.0.1:{server.port}/other", timeout=5)
+        finally:
+            server.stop()
+
+    def test_stop_without_start(self):
+        MetricsServer("127.0.0.1", 0, lambda: "").stop()
@@ -1,24 +1,36 @@
 """Tests for multiproc_probe.py — coordinator, worker logic, and sampling."""
 
-import multiprocessing
+import ctypes
 import os
-import queue
+import shutil
 import socket
 import struct
 import sys
+import tempfile
 import time
+from unittest.mock import MagicMock, patch
 
 import pytest
 
 sys.path.insert(0, os.path.join(os.path.dirname(__file__), "..", "probe"))
 
+import multiproc_probe
 from multiproc_probe import (
     Coordinator,
     FlowKey,
+    FlowMerge,
+    FlowRing,
+    RawFlowKey,
     REPORT_INTERVAL,
+    _CFlowRecord,
+    _CFlowRecordExt,
+    _CHostEvent,
     parse_vxlan_packet,
 )
 
+PROBE_DIR = os.path.join(os.path.dirname(__file__), "..", "probe")
+HAVE_LIBS = all(os.path.isfile(os.path.join(PROBE_DIR, so)) for so in ("fast_recv.so", "flow_merge.so"))
+
 
 def _build_vxlan_packet(
     src_ip: str = "10.0.1.1",
@@ -40,82 +52,347 @@ def _build_vxlan_packet(
     return vxlan + eth + ip_hdr + transport
 
 
-class TestCoordinatorDrainQueues:
-    def test_merge_single_queue(self):
-        coord = Coordinator(num_workers=1, sample_rate=1.0)
-        q = multiprocessing.Queue()
-        coord._queues = [q]
+def _raw_key(src: str, dst: str, proto: int, sport: int, dport: int) -> RawFlowKey:
+    """FlowKey with IPs as the raw u32 a flow_record carries."""
+    ip = lambda a: struct.unpack("=I", socket.inet_aton(a))[0]
+    return (ip(src), ip(dst), proto, sport, dport)
 
-        flow1: FlowKey = ("10.0.1.1", "10.0.2.2", 6, 1234, 80)
-        flow2: FlowKey = ("10.0.1.1", "10.0.2.3", 17, 53, 1024)
-        q.put({flow1: [10, 1000], flow2: [5, 500]})
-        time.sleep(0.05)  # Let Queue background thread flush
 
-        merged = coord._drain_queues()
-        assert merged[flow1] == [10, 1000]
-        assert merged[flow2] == [5, 500]
+def _push(ring: FlowRing, *flows: tuple[RawFlowKey, int, int]) -> int:
+    recs = (_CFlowRecord * len(flows))()
+    for r, ((src, dst, proto, sport, dport), pkts, byt) in zip(recs, flows):
+        r.src_ip, r.dst_ip, r.proto, r.src_port, r.dst_port = src, dst, proto, sport, dport
+        r.packets, r.bytes = pkts, byt
+    return multiproc_probe._fast_recv_lib.ring_push(ring.addr, recs, len(flows))
 
-    def test_merge_multiple_queues(self):
-        coord = Coordinator(num_workers=2, sample_rate=1.0)
-        q1 = multiprocessing.Queue()
-        q2 = multiprocessing.Queue()
-        coord._queues = [q1, q2]
 
-        flow: FlowKey = ("10.0.1.1", "10.0.2.2", 6, 1234, 80)
-        q1.put({flow: [10, 1000]})
-        q2.put({flow: [20, 2000]})
-        time.sleep(0.05)
+@pytest.mark.skipif(not HAVE_LIBS, reason="fast_recv.so / flow_merge.so not compiled")
+class TestCoordinatorMerge:
+    @pytest.fixture(autouse=True)
+    def load_libs(self):
+        multiproc_probe._load_fast_recv()
+        multiproc_probe._load_flow_merge()
+        self.rings = []
+        self.merges = []
+        yield
+        for ring in self.rings:
+            ring.close()
+        for merge in self.merges:
+            merge.close()
 
-        merged = coord._drain_queues()
-        assert merged[flow] == [30, 3000]
+    def _coord(self, num_rings: int = 1, records: int = 64, sample_rate: float = 1.0, **kwargs) -> Coordinator:
+        coord = Coordinator(num_workers=num_rings, sample_rate=sample_rate, **kwargs)
+        coord._rings = [FlowRing(records=records) for _ in range(num_rings)]
+        self.rings.extend(coord._rings)
+        self.merges.append(coord._merge)
+        return coord
 
-    def test_drain_empty_queues(self):
-        coord = Coordinator(num_workers=2, sample_rate=1.0)
-        q1 = multiprocessing.Queue()
-        q2 = multiprocessing.Queue()
-        coord._queues = [q1, q2]
+    def _flows(self, coord: Coordinator) -> dict:
+        rows = coord._merge.top(FlowMerge.FLOWS, 1, 1000)
+        return {(src, dst, proto, sport, dport): [p, b] for src, dst, sport, dport, proto, p, b in rows}
 
-        merged = coord._drain_queues()
-        assert merged == {}
+    def test_merge_single_ring(self):
+        coord = self._coord()
+        flow1 = _raw_key("10.0.1.1", "10.0.2.2", 6, 1234, 80)
+        flow2 = _raw_key("10.0.1.1", "10.0.2.3", 17, 53, 1024)
+        assert _push(coord._rings[0], (flow1, 10, 1000), (flow2, 5, 500)) == 2
 
-    def test_drain_multiple_snapshots(self):
-        coord = Coordinator(num_workers=1, sample_rate=1.0)
-        q = multiprocessing.Queue()
-        coord._queues = [q]
+        assert coord._consume_rings() == 2
+        merged = self._flows(coord)
+        assert merged[flow1] == [10, 1000]
+        assert merged[flow2] == [5, 500]
+        assert coord._merge.totals() == (15, 1500)
 
-        flow: FlowKey = ("10.0.1.1", "10.0.2.2", 6, 1234, 80)
-        q.put({flow: [5, 500]})
-        q.put({flow: [10, 1000]})
-        time.sleep(0.05)
+    def test_merge_multiple_rings(self):
+        coord = self._coord(num_rings=2)
+        flow = _raw_key("10.0.1.1", "10.0.2.2", 6, 1234, 80)
+        _push(coord._rings[0], (flow, 10, 1000))
+        _push(coord._rings[1], (flow, 20, 2000))
 
-        merged = coord._drain_queues()
-        assert merged[flow] == [15, 1500]
+        coord._consume_rings()
+        assert self._flows(coord) == {flow: [30, 3000]}
 
+    def test_consume_empty_rings(self):
+        coord = self._coord(num_rings=2)
+        assert coord._consume_rings() == 0
+        assert coord._merge.count(FlowMerge.FLOWS) == 0
 
-class TestCoordinatorReport:
-    def test_report_with_sampling_scale(self):
-        coord = Coordinator(num_workers=1, sample_rate=0.5)
-        q = multiprocessing.Queue()
-        coord._queues = [q]
+    def test_merge_accumulates_across_polls(self):
+        coord = self._coord()
+        flow = _raw_key("10.0.1.1", "10.0.2.2", 6, 1234, 80)
+        _push(coord._rings[0], (flow, 5, 500))
+        coord._consume_rings()
+        _push(coord._rings[0], (flow, 10, 1000))
+        coord._consume_rings()
+        assert self._flows(coord) == {flow: [15, 1500]}
+        assert coord._consume_rings() == 0
+
+    def test_consume_across_wrap(self):
+        coord = self._coord(records=8)
+        flows = [(_raw_key("10.0.1.1", "10.0.2.2", 6, 1000 + i, 80), 1, 100) for i in range(6)]
+        _push(coord._rings[0], *flows)
+        assert coord._consume_rings() == 6
+        # Next 6 records wrap around the end of the 8-slot ring
+        _push(coord._rings[0], *flows)
+        assert coord._consume_rings() == 6
+        merged = self._flows(coord)
+        assert len(merged) == 6
+        assert all(v == [2, 200] for v in merged.values())
+
+    def test_full_ring_counts_drops(self):
+        ring = FlowRing(records=4)
+        self.rings.append(ring)
+        flows = [(_raw_key("10.0.1.1", "10.0.2.2", 6, 1000 + i, 80), 1, 100) for i in range(6)]
+        assert _push(ring, *flows) == 4
+        assert ring.dropped() == 2
 
-        flow: FlowKey = ("10.0.1.1", "10.0.2.2", 6, 1234, 80)
-        flows = {flow: [100, 10000]}
+    def _report(self, coord: Coordinator, *flows, interval: float = REPORT_INTERVAL) -> tuple[dict, dict]:
+        """Push flows, merge, run _report; returns (check_detail kwargs, check_host kwargs)."""
+        coord._alerter.check_detail = MagicMock(return_value=False)
+        coord._alerter.check_host = MagicMock(return_value=[])
+        _push(coord._rings[0], *flows)
+        coord._consume_rings()
+        coord._report(interval)
+        return coord._alerter.check_detail.call_args.kwargs, coord._alerter.check_host.call_args.kwargs
+
+    def test_report_with_sampling_scale(self):
+        coord = self._coord(sample_rate=0.5)
+        flow = _raw_key("10.0.1.1", "10.0.2.2", 6, 1234, 80)
+        detail, _ = self._report(coord, (flow, 100, 10000))
 
         # _report should scale by 1/0.5 = 2x
-        coord._report(flows)
-        # After report, the flows dict is mutated
-        assert flows[flow] == [200, 20000]
+        assert detail["total_packets"] == 200
+        assert detail["total_bytes"] == 20000
+        assert detail["top_flows"] == [{"key": ("10.0.1.1", "10.0.2.2", 6, 1234, 80), "packets": 200, "bytes": 20000}]
+        assert detail["top_sources"][0]["bytes"] == 20000
+
+    def test_report_scales_by_worker_reported_rate(self):
+        coord = self._coord()
+        ctx = multiproc_probe._fast_recv_lib.cap_create(0, 1 << 20)
+        try:
+            # Worker attaches with 1-in-4 packet sampling; the ring header carries the rate
+            assert multiproc_probe._fast_recv_lib.cap_set_sampling(ctx, 1.0, 4) == 0
+            assert multiproc_probe._fast_recv_lib.cap_attach_ring(ctx, coord._rings[0].addr) == 0
+        finally:
+            multiproc_probe._fast_recv_lib.cap_destroy(ctx)
+        assert coord._rings[0].sample_rate() == 0.25
+
+        flow = _raw_key("10.0.1.1", "10.0.2.2", 6, 1234, 80)
+        detail, _ = self._report(coord, (flow, 100, 10000))
+        assert detail["total_packets"] == 400
+        assert detail["total_bytes"] == 40000
 
     def test_report_no_scale_at_rate_1(self):
-        coord = Coordinator(num_workers=1, sample_rate=1.0)
-        flow: FlowKey = ("10.0.1.1", "10.0.2.2", 6, 1234, 80)
-        flows = {flow: [100, 10000]}
-        coord._report(flows)
-        assert flows[flow] == [100, 10000]
+        coord = self._coord()
+        flow = _raw_key("10.0.1.1", "10.0.2.2", 6, 1234, 80)
+        detail, _ = self._report(coord, (flow, 100, 10000))
+        assert detail["total_packets"] == 100
+        assert detail["total_bytes"] == 10000
+
+    def test_report_top_ordering(self):
+        coord = self._coord()
+        flows = [(_raw_key(f"10.0.1.{i}", "10.0.2.2", 6, 1234, 80), 1, 100 * i) for i in range(1, 21)]
+        detail, _ = self._report(coord, *flows)
+        assert [f["bytes"] for f in detail["top_flows"]] == [100 * i for i in range(20, 10, -1)]
+        assert detail["top_sources"][0]["ip"] == "10.0.1.20"
+        assert [d["ip"] for d in detail["top_dests"]] == ["10.0.2.2"]
+        assert detail["top_dests"][0]["bytes"] == sum(100 * i for i in range(1, 21))
+
+    def test_report_passes_only_hot_hosts_as_strings(self):
+        coord = self._coord()
+        coord._alerter._host_threshold_bps = 8000  # 1000 bytes/s
+        _, host = self._report(
+            coord,
+            (_raw_key("10.0.1.1", "10.0.2.2", 6, 1234, 80), 10, 50000),
+            (_raw_key("10.0.1.9", "10.0.2.9", 6, 1234, 80), 1, 100),
+            interval=5.0,
+        )
+        assert host["src_agg"] == {"10.0.1.1": [10, 50000]}
+        assert host["dst_agg"] == {"10.0.2.2": [10, 50000]}
+
+    def test_report_passes_top_subnets(self):
+        coord = self._coord(sample_rate=0.5)
+        assert coord._merge.set_prefixes([(struct.unpack("=I", socket.inet_aton("172.16.0.0"))[0], 12)])
+        detail, _ = self._report(coord, *[
+            (_raw_key("172.16.5.%d" % i, "10.0.2.2", 6, 1234, 80), 1, 100) for i in range(1, 41)
+        ], (_raw_key("10.9.9.9", "10.0.2.3", 6, 1234, 80), 1, 1000))
+        subnets = detail["top_subnets"]
+        # Forty small sources add up to the largest /24; counts are scaled like hosts
+        assert subnets["src /24"][0] == ("172.16.5.0/24", 8000)
+        assert subnets["src /16"] == [("172.16.0.0/16", 8000), ("10.9.0.0/16", 2000)]
+        assert subnets["dst /16"] == [("10.0.0.0/16", 10000)]
+        assert subnets["src cidr"] == [("172.16.0.0/12", 8000)]
+
+    def test_report_passes_ports_and_services(self):
+        coord = self._coord(sample_rate=0.5)
+        detail, _ = self._report(coord,
+                                 (_raw_key("10.0.1.1", "10.0.2.2", 6, 1234, 443), 10, 3000),
+                                 (_raw_key("10.0.1.2", "10.0.2.2", 6, 1235, 443), 10, 1000),
+                                 (_raw_key("10.0.1.1", "10.0.2.3", 17, 5000, 53), 1, 100))
+        assert detail["top_ports"] == [{"proto": 6, "port": 443, "packets": 40, "bytes": 8000},
+                                       {"proto": 17, "port": 53, "packets": 2, "bytes": 200}]
+        sv = detail["top_services"][0]
+        assert (sv["ip"], sv["proto"], sv["port"], sv["bytes"]) == ("10.0.2.2", 6, 443, 8000)
+        assert "info" in sv
+        assert detail["protocols"] == {6: 8000, 17: 200}
+
+    def test_link_rate_spans_report_reset(self):
+        coord = self._coord(sample_rate=0.5)
+        coord._rates.update_link(100.0, 0, 0)
+        _push(coord._rings[0], (_raw_key("10.0.1.1", "10.0.2.2", 6, 1, 80), 10, 1000))
+        coord._consume_rings()
+        coord._update_link_rate(100.5)
+        # Report boundary: merge totals restart, the link window keeps its history
+        coord._merge.reset()
+        coord._merged_totals = (0, 0)
+        _push(coord._rings[0], (_raw_key("10.0.1.1", "10.0.2.2", 6, 1, 80), 5, 500))
+        coord._consume_rings()
+        coord._update_link_rate(101.0)
+        assert coord._rates.link.window(101.0) == (30, 3000, 1.0)
+
+    def test_report_attaches_ext_counters(self):
+        coord = self._coord(sample_rate=0.5)
+        flow = _raw_key("10.0.1.1", "10.0.2.2", 6, 1234, 80)
+        ext = (_CFlowRecordExt * 1)()
+        e = ext[0]
+        e.src_ip, e.dst_ip, e.proto, e.src_port, e.dst_port = flow[0], flow[1], 6, 1234, 80
+        e.tcp_flags, e.syn, e.first_ns, e.last_ns = 0x02, 90, 100, 200
+        e.len_hist[0] = 100
+        multiproc_probe._flow_merge_lib.merge_add_ext(coord._merge._ctx, ext, 1)
+        detail, _ = self._report(coord, (flow, 100, 6000), (_raw_key("10.0.1.2", "10.0.2.2", 6, 1, 80), 1, 60))
+        # Counts scale like packets; the flow without a counter record has no "ext"
+        assert detail["top_flows"][0]["ext"] == {"syn": 180, "rst": 0, "tcp_flags": 0x02, "first_ns": 100,
+                                                 "last_ns": 200, "len_hist": [200, 0, 0, 0, 0, 0]}
+        assert "ext" not in detail["top_flows"][1]
+
+    def test_host_events_run_check_host(self):
+        coord = self._coord()
+        coord._event_rings = [FlowRing(records=16, record=_CHostEvent) for _ in range(2)]
+        self.rings.extend(coord._event_rings)
+        coord._alerter.check_host = MagicMock(return_value=[])
+        ip = lambda a: struct.unpack("=I", socket.inet_aton(a))[0]
+        # The same source flagged by two workers, and one destination
+        for ring, events in zip(coord._event_rings, (
+                [("10.0.1.1", multiproc_probe.HOST_EV_SRC, 11, 1100), ("10.0.2.2", multiproc_probe.HOST_EV_DST, 9, 1200)],
+                [("10.0.1.1", multiproc_probe.HOST_EV_SRC, 20, 2000)])):
+            evs = (_CHostEvent * len(events))()
+            for e, (addr, d, pkts, byt) in zip(evs, events):
+                e.ip, e.dir, e.reason, e.window_ms, e.packets, e.bytes = ip(addr), d, 1, 100, pkts, byt
+            lib = multiproc_probe._fast_recv_lib
+            assert lib.ring_push(ring.addr, ctypes.cast(evs, ctypes.POINTER(_CFlowRecord)), len(events)) == len(events)
+
+        assert coord._check_host_events() == 3
+        coord._alerter.check_host.assert_called_once()
+        kwargs = coord._alerter.check_host.call_args.kwargs
+        assert kwargs["src_agg"] == {"10.0.1.1": [20, 2000]}
+        assert kwargs["dst_agg"] == {"10.0.2.2": [9, 1200]}
+        assert kwargs["interval_sec"] == pytest.approx(0.1)
+        # Rings are drained: nothing to check on the next poll
+        assert coord._check_host_events() == 0
+        coord._alerter.check_host.assert_called_once()
 
     def test_report_empty_flows(self):
-        coord = Coordinator(num_workers=1, sample_rate=1.0)
-        coord._report({})  # Should not raise
+        coord = self._coord()
+        coord._report()  # Should not raise
+
+    def test_ipv6_only_window_reported(self):
+        coord = self._coord()
+        ring6 = FlowRing(records=64, record=multiproc_probe._CFlowRecord6)
+        coord._rings.append(ring6)
+        self.rings.append(ring6)
+        coord._alerter.check_detail = MagicMock(return_value=False)
+        coord._alerter.check_host = MagicMock(return_value=[])
+        rec = multiproc_probe._CFlowRecord6()
+        rec.src_ip[:] = socket.inet_pton(socket.AF_INET6, "2001:db8::1")
+        rec.dst_ip[:] = socket.inet_pton(socket.AF_INET6, "2001:db8::2")
+        rec.proto, rec.src_port, rec.dst_port, rec.packets, rec.bytes = 6, 1234, 443, 10, 1500
+        rec.kind = multiproc_probe.FLOW_REC_EXACT
+        recs = ctypes.cast(ctypes.pointer(rec), ctypes.POINTER(_CFlowRecord))
+        assert multiproc_probe._fast_recv_lib.ring_push(ring6.addr, recs, 1) == 1
+        coord._consume_rings()
+        coord._window_start = 0.0
+
+        coord._close_window(REPORT_INTERVAL)
+        detail = coord._alerter.check_detail.call_args.kwargs
+        assert detail["total_packets"] == 10 and detail["total_bytes"] == 1500
+        assert [f["key"] for f in detail["top_flows"]] == [("2001:db8::1", "2001:db8::2", 6, 1234, 443)]
+        coord._alerter.check_host.assert_called_once()
+
+    def test_socket_drops_from_worker_stats(self):
+        coord = self._coord(num_rings=2)
+        coord._stats = [multiproc_probe.WorkerStats() for _ in range(2)]
+        self.rings.extend(coord._stats)
+        proc_drops = MagicMock(return_value=1000)
+        stats = [{"sock_rcvbuf": 1000, "sock_rmem": 100, "sock_drops": 2},
+                 {"sock_rcvbuf": 1000, "sock_rmem": 700, "sock_drops": 3}]
+        with patch.object(multiproc_probe, "_read_udp_drops", proc_drops), \
+                patch.object(multiproc_probe, "logger") as log:
+            # No worker has published yet: all of /proc/net/udp
+            assert coord.worker_stats() == [None, None]
+            coord._check_sockets()
+            assert coord._last_udp_drops == 1000
+            # Every worker has a socket: their SO_MEMINFO drops, re-based on the switch
+            coord.worker_stats = lambda: stats
+            log.reset_mock()
+            coord._check_sockets()
+            assert proc_drops.call_count == 1 and coord._last_udp_drops == 5
+            assert [c.args[1] for c in log.warning.call_args_list] == [1]       # worker-1 queue 70% full
+            stats[0]["sock_drops"] = 4
+            coord._check_sockets()
+            assert "KERNEL UDP DROPS" in log.warning.call_args_list[-1].args[0]
+            assert log.warning.call_args_list[-1].args[1] == 2
+
+    def test_warm_restart_resumes_window(self):
+        """With a state dir, stop() leaves the open window, rates and cooldowns
+        for the next start instead of reporting the partial window."""
+        tmp = tempfile.mkdtemp()
+        try:
+            key = _raw_key("10.0.1.1", "10.0.2.2", 6, 1234, 80)
+            old = self._coord(state_dir=tmp)
+            assert old._restore_state() == 0.0  # nothing saved yet
+            _push(old._rings[0], (key, 10, 1000))
+            old._consume_rings()
+            now = time.monotonic()
+            old._window_start = now - 2.0
+            old._update_link_rate(now)
+            old._delta_seq = 7
+            old._rings = []  # closed by the fixture
+            with patch.object(old, "_report") as report, patch.object(old, "_clock", return_value=now):
+                old.stop()
+            report.assert_not_called()
+            assert sorted(os.listdir(tmp)) == ["coordinator.json", "window.snap"]
+
+            new = self._coord(state_dir=tmp)
+            assert 2.0 <= new._restore_state() < 2.5
+            assert self._flows(new) == {key: [10, 1000]}
+            assert new._delta_seq == 7 and new._merged_totals == (10, 1000)
+            assert new._rates.link.window(time.monotonic())[:2] == (10, 1000)
+            assert os.listdir(tmp) == []  # resumed once
+            assert self._coord(state_dir=tmp)._restore_state() == 0.0
+
+            # A state of another probe (or too old) is not resumed
+            old = self._coord(state_dir=tmp, probe_id="probe-a")
+            old._resumable = True
+            assert old._save_state(time.monotonic())
+            assert self._coord(state_dir=tmp, probe_id="probe-b")._restore_state() == 0.0
+        finally:
+            shutil.rmtree(tmp, ignore_errors=True)
+
+    def test_interval_delta_scaled(self):
+        coord = self._coord(sample_rate=0.5)
+        coord._probe_id = "probe-a"
+        flow = _raw_key("10.0.1.1", "10.0.2.2", 6, 1234, 80)
+        dns = _raw_key("10.0.1.2", "10.0.2.2", 17, 53, 53)
+        _push(coord._rings[0], (flow, 10, 1000), (dns, 1, 100))
+        coord._consume_rings()
+        d = coord.interval_delta(5.0)
+        assert (d.probe, d.seq, d.interval_ms, d.packets, d.bytes) == ("probe-a", 0, 5000, 22, 2200)
+        assert d.flows[0] == (flow[0], flow[1], 1234, 80, 6, 20, 2000)
+        assert d.src_hosts == [(flow[0], 20, 2000), (dns[0], 2, 200)]
+        assert d.dst_hosts == [(flow[1], 22, 2200)]
+        assert len(d.sketch) == 4 * d.depth * d.width and max(d.sketch) == 2200
+        coord._merge.reset()
+        assert coord.interval_delta(5.0).flows == []
 
 
 class TestSamplingDeterminism:
@@ -148,3 +425,47 @@ class TestCoordinatorStopIdempotent:
         # Second stop should be a no-op
         coord.stop()
         coord.stop()
+
+
+class TestWorkerPlacement:
+    def test_parse_cpulist(self):
+        assert multiproc_probe._parse_cpulist("0-3,8,10-11\n") == {0, 1, 2, 3, 8, 10, 11}
+        assert multiproc_probe._parse_cpulist("") == set()
+
+    def test_worker_cpus_wraps_allowed_cpus(self):
+        allowed = sorted(os.sched_getaffinity(0))
+        cpus = multiproc_probe._worker_cpus(len(allowed) + 1, "nosuchif0")
+        assert cpus[:len(allowed)] == allowed and cpus[-1] == allowed[0]
+
+
+@pytest.mark.skipif(not HAVE_LIBS, reason="fast_recv.so / flow_merge.so not compiled")
+class TestReplay:
+    def test_replay_reports_on_capture_time(self):
+        """PROBE_BACKEND=pcap: two workers replay one file, sharded, and the
+        reports follow the capture's 5 s windows, not the replay's speed."""
+        multiproc_probe._load_fast_recv()
+        multiproc_probe._load_flow_merge()
+        tmp = tempfile.mkdtemp()
+        path = os.path.join(tmp, "mirror.pcap")
+        t0 = 1_700_000_000
+        with open(path, "wb") as f:
+            f.write(struct.pack("<IHHiIII", 0xA1B2C3D4, 2, 4, 0, 0, 65535, 1))
+            # One packet per flow at 0.5 s, 1.5 s, ... 11.5 s of capture
+            for i in range(12):
+                vxlan = _build_vxlan_packet(src_port=1000 + i)
+                udp = struct.pack("!HHHH", 40000, 4789, 8 + len(vxlan), 0) + vxlan
+                ip = struct.pack("!BBHHHBBH4s4s", 0x45, 0, 20 + len(udp), 0, 0, 64, 17, 0,
+                                 socket.inet_aton("192.0.2.10"), socket.inet_aton("192.0.2.1")) + udp
+                frame = b"\x00" * 12 + b"\x08\x00" + ip
+                f.write(struct.pack("<IIII", t0 + i, 500000, len(frame), len(frame)) + frame)
+
+        coord = Coordinator(num_workers=2, sample_rate=1.0, backend="pcap", pcap_path=path)
+        reports = []
+        try:
+            with patch.object(coord._enricher, "start"), patch.object(coord._enricher, "stop"), \
+                    patch.object(coord, "_report", lambda interval: reports.append((interval, coord._merge.totals()))):
+                coord.start()  # returns once both workers reach the end of the file
+        finally:
+            coord.stop()
+            shutil.rmtree(tmp, ignore_errors=True)
+        assert reports == [(5.0, (5, 300)), (5.0, (5, 300)), (2.0, (2, 120))]
@@ -0,0 +1,105 @@
+"""Tests for rate_engine.py — sliding-window rates, EWMA baselines, surge/drop detection."""
+
+import math
+import os
+import sys
+
+import pytest
+
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), "..", "probe"))
+
+from rate_engine import LINK_BUCKETS, RateEngine, SlidingRate
+
+
+class TestSlidingRate:
+    def test_window_slides(self):
+        w = SlidingRate(1.0, 3, now=100.0)
+        w.add(100.2, 10, 1000)
+        w.add(101.5, 20, 2000)
+        # History shorter than the window: rate over what was seen
+        assert w.window(102.0) == (30, 3000, 2.0)
+        assert w.rate(102.0) == (12000.0, 15.0)
+        w.add(103.1, 5, 500)
+        # The bucket from t=100 has left the 3-bucket window
+        assert w.window(103.5) == (25, 2500, 2.5)
+        # A long gap clears everything
+        assert w.window(110.0)[:2] == (0, 0)
+
+    def test_baseline_ewma_and_warmup(self):
+        w = SlidingRate(1.0, 3, now=0.0, tau_sec=10.0, warmup_sec=3.0)
+        for t in range(3):
+            w.add(t + 0.5, 100, 1000)
+        assert w.baseline() is None                 # two buckets completed so far
+        w.add(3.5, 100, 1000)
+        assert w.baseline() == (8000.0, 100.0)
+        # The t=3 bucket, then nine idle seconds folded as zero samples in closed form
+        w.window(13.5)
+        bps, _ = w.baseline()
+        assert bps == pytest.approx(8000.0 * math.exp(-0.9), rel=1e-6)
+
+    def test_current_bucket(self):
+        w = SlidingRate(5.0, 4, now=0.0)
+        w.add(2.5, 50, 5000)
+        assert w.current() == (8000.0, 10.0)
+
+
+class TestRateEngine:
+    def _warm_link(self, eng, seconds=120, bps=8000):
+        for i in range(seconds * 2):
+            eng.update_link(i * 0.5, bps // 16, bps // 16)
+
+    def test_link_surge_and_drop(self):
+        eng = RateEngine(host_bucket_sec=5.0)
+        self._warm_link(eng)
+        assert eng.link_change(120.0, 4, 0) is None
+        # 10x the baseline for a second
+        eng.update_link(120.5, 0, 5000)
+        eng.update_link(121.0, 0, 5000)
+        row = eng.link_change(121.0, 4, 0)
+        assert row["kind"] == "surge" and row["baseline_bps"] == pytest.approx(8000, rel=0.05)
+        # min_bps keeps small links quiet
+        assert eng.link_change(121.0, 4, 1e6) is None
+        # Traffic stops: a drop once the sliding window has emptied
+        eng.update_link(121.0 + LINK_BUCKETS + 1, 0, 0)
+        assert eng.link_change(121.0 + LINK_BUCKETS + 1, 4, 0)["kind"] == "drop"
+        assert eng.link_change(130.0, 1, 0) is None             # factor <= 1 = disabled
+
+    def test_host_surge_against_own_baseline(self):
+        eng = RateEngine(host_bucket_sec=5.0)
+        t = 0.0
+        for _ in range(20):
+            t += 5.0
+            eng.update_hosts(t, {"10.0.1.1": [10, 5000], "10.0.1.2": [10, 5000]}, {"10.0.2.2": [20, 10000]})
+        assert eng.host_surges(4, 0) == []
+        t += 5.0
+        eng.update_hosts(t, {"10.0.1.1": [100, 50000]}, {"10.0.2.2": [20, 10000]})
+        rows = eng.host_surges(4, 0)
+        assert [(r["key"], r["direction"]) for r in rows] == [("10.0.1.1", "source")]
+        assert rows[0]["bps"] == 80000.0 and rows[0]["baseline_bps"] == pytest.approx(8000)
+        # A host seen for the first time has no baseline yet
+        t += 5.0
+        eng.update_hosts(t, {"10.9.9.9": [10**6, 10**9]}, {})
+        assert eng.host_surges(4, 0) == []
+
+    def test_host_windows_bounded(self):
+        eng = RateEngine(host_bucket_sec=5.0, max_hosts=3)
+        eng.update_hosts(5.0, {f"10.0.0.{i}": [1, 100] for i in range(5)}, {})
+        assert eng.host_count() == 3
+
+    def test_state_restore_resumes_windows(self):
+        eng = RateEngine(host_bucket_sec=5.0)
+        self._warm_link(eng)
+        eng.update_hosts(120.0, {"10.0.1.1": [10, 5000]}, {})
+        before = eng.link.rate(120.0), eng.link.baseline()
+        # Another process, another monotonic clock: the windows continue from its now
+        eng2 = RateEngine(host_bucket_sec=5.0)
+        assert eng2.restore(eng.state(120.0), 5000.0) == 2
+        assert (eng2.link.rate(5000.0), eng2.link.baseline()) == before
+        assert eng2.host_count() == 1
+        eng2.update_link(5000.5, 0, 5000)
+        eng2.update_link(5001.0, 0, 5000)
+        assert eng2.link_change(5001.0, 4, 0)["kind"] == "surge"   # no warm-up after the restart
+        # A window of another layout is dropped
+        state = eng.state(120.0)
+        state["link"]["pkts"].append(0)
+        assert RateEngine(host_bucket_sec=5.0).restore(state, 0.0) == 1
@@ -1,197 +1,500 @@
 /*
- * High-performance VXLAN packet flood generator v2.
- * - Configurable flow count (default 100K) and packet size (default 128B)
- * - Uses sendmmsg() for batched sends
+ * High-performance VXLAN packet flood generator v3.
+ * - Flow population of any size (default 100K), split across threads
+ * - Uniform or Zipf (-z) packet distribution over the flows
+ * - Rotating 5-tuples (-R): the whole population is replaced every N seconds
+ * - Several targets and VNIs; IPv6, 802.1Q and QinQ inner frames
+ * - Pre-built per-thread packet pool (-P) sent with sendmmsg(); a batch is
+ *   rebuilt only when its flows change, so replay costs no more than v2
  * - Atomic counters for live progress reporting
  *
- * Compile: gcc -O2 -o vxlan_flood vxlan_flood.c -lpthread
- * Usage:   ./vxlan_flood <target_ip> <port> <threads> <duration> [pkt_size] [num_flows]
+ * Pool and flows: a thread owns num_flows / threads flows. If they fit in its
+ * pool, the pool is built once (and again at each rotation) and replayed. If
+ * not, every pass through the pool rebuilds it with the next flows (uniform)
+ * or fresh draws (Zipf), so all of them are sent over time.
+ *
+ * Compile: gcc -O2 -o vxlan_flood vxlan_flood.c -lpthread -lm
+ * Usage:   ./vxlan_flood [options] <ip[,ip...]> <port> <threads> <duration> [pkt_size] [num_flows]
  */
 
 #define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <time.h>
 #include <signal.h>
 #include <errno.h>
+#include <math.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <stdatomic.h>
 
-#define BATCH_SIZE 256
+#define BATCH_SIZE   256
+#define MAX_THREADS  64
+#define MAX_TARGETS  16
+#define MAX_VNIS     64
+#define DEFAULT_POOL 65536          /* packets per thread when -P is not given */
 
 static volatile int running = 1;
-static atomic_long counters[64];
+static atomic_long counters[MAX_THREADS];
+static atomic_uint epoch;           /* bumped by -R: every flow gets a new 5-tuple */
+static pthread_barrier_t pools_built;
+
+/* Set by main() before the threads start, read-only afterwards */
+static struct {
+    struct sockaddr_in targets[MAX_TARGETS];
+    int ntargets;
+    uint32_t vnis[MAX_VNIS];
+    int nvnis;
+    int threads;
+    int pkt_size;
+    uint32_t flows_per_thread;
+    uint64_t total_flows;
+    int pool;                       /* packets per thread, a multiple of BATCH_SIZE */
+    double zipf_s;                  /* 0 = uniform */
+    int pct_v6, pct_vlan, pct_qinq;
+    uint64_t seed;
+} cfg;
 
 struct thread_args {
     int thread_id;
-    struct sockaddr_in target;
-    int pkt_size;
-    int num_flows;
 };
 
-static void build_vxlan_packet(uint8_t *buf, int pkt_size, int flow_id)
+static const uint16_t dst_ports[] = {80, 443, 53, 22, 3306, 5432, 6379, 8080};
+
+static uint64_t mix64(uint64_t x)
+{
+    x ^= x >> 30; x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27; x *= 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static uint64_t rng_next(uint64_t *s)
 {
+    return mix64(*s += 0x9e3779b97f4a7c15ULL);
+}
+
+static double rng_unit(uint64_t *s)
+{
+    return (double)(rng_next(s) >> 11) * 0x1.0p-53;
+}
+
+/*
+ * Zipf over 1..n with exponent s > 0 by rejection-inversion (Hörmann and
+ * Derflinger, 1996): O(1) per draw and no per-flow table, so n can be large.
+ */
+struct zipf {
+    double s, h_x1, h_n, sdiv;
+    uint64_t n;
+};
+
+static double zipf_helper1(double x)     /* log1p(x) / x */
+{
+    return fabs(x) > 1e-8 ? log1p(x) / x : 1 - x * (0.5 - x * (1.0 / 3 - x / 4));
+}
+
+static double zipf_helper2(double x)     /* expm1(x) / x */
+{
+    return fabs(x) > 1e-8 ? expm1(x) / x : 1 + x / 2 * (1 + x / 3 * (1 + x / 4));
+}
+
+static double zipf_h(const struct zipf *z, double x) { return exp(-z->s * log(x)); }
+
+static double zipf_hint(const struct zipf *z, double x)
+{
+    double lx = log(x);
+    return zipf_helper2((1 - z->s) * lx) * lx;
+}
+
+static double zipf_hinv(const struct zipf *z, double x)
+{
+    double t = x * (1 - z->s);
+    if (t < -1)
+        t = -1;
+    return exp(zipf_helper1(t) * x);
+}
+
+static void zipf_init(struct zipf *z, uint64_t n, double s)
+{
+    z->n = n;
+    z->s = s;
+    z->h_x1 = zipf_hint(z, 1.5) - 1;
+    z->h_n = zipf_hint(z, (double)n + 0.5);
+    z->sdiv = 2 - zipf_hinv(z, zipf_hint(z, 2.5) - zipf_h(z, 2));
+}
+
+/* Rank 0..n-1, 0 the heaviest */
+static uint64_t zipf_next(const struct zipf *z, uint64_t *rng)
+{
+    for (;;) {
+        double u = z->h_n + rng_unit(rng) * (z->h_x1 - z->h_n);
+        double x = zipf_hinv(z, u);
+        double k = floor(x + 0.5);
+        if (k < 1)
+            k = 1;
+        else if (k > (double)z->n)
+            k = (double)z->n;
+        if (k - x <= z->sdiv || u >= zipf_hint(z, k + 0.5) - zipf_h(z, k))
+            return (uint64_t)k - 1;
+    }
+}
+
+static void put16(uint8_t *p, uint16_t v) { p[0] = v >> 8; p[1] = v & 0xFF; }
+
+/* Bytes before the inner L4 header of the largest variant enabled */
+static int max_l4_offset(void)
+{
+    return 8 + 14 + (cfg.pct_vlan + cfg.pct_qinq ? 8 : 0) + (cfg.pct_v6 ? 40 : 20);
+}
+
+/*
+ * One packet of flow `key`. Everything about the flow (addresses, ports,
+ * protocol, VNI, target, IPv6 / VLAN variant) follows from the key, so a
+ * flow looks the same whichever thread, pass or pool slot sends it.
+ */
+static void build_vxlan_packet(uint8_t *buf, struct msghdr *mh, uint64_t key)
+{
+    uint64_t h = mix64(key ^ cfg.seed), h2 = mix64(h);
+    int pkt_size = cfg.pkt_size;
     memset(buf, 0, pkt_size);
 
     /* VXLAN header (8 bytes) */
+    uint32_t vni = cfg.vnis[h2 % cfg.nvnis];
     buf[0] = 0x08;
-    buf[4] = (12345 >> 16) & 0xFF;
-    buf[5] = (12345 >> 8) & 0xFF;
-    buf[6] = 12345 & 0xFF;
-
-    /* Ethernet header (14 bytes) at offset 8 */
-    buf[8 + 12] = 0x08;
-    buf[8 + 13] = 0x00;
-
-    /* IP header (20 bytes) at offset 22 */
-    int off = 22;
-    buf[off] = 0x45;
-    int ip_total = pkt_size - 8 - 14;
-    buf[off + 2] = (ip_total >> 8) & 0xFF;
-    buf[off + 3] = ip_total & 0xFF;
-    buf[off + 8] = 64;
-    buf[off + 9] = (flow_id % 3 == 0) ? 17 : 6;  /* mix TCP/UDP */
-
-    /* src IP: spread across 10.x.x.x */
-    buf[off + 12] = 10;
-    buf[off + 13] = (flow_id >> 16) & 0xFF;
-    buf[off + 14] = (flow_id >> 8) & 0xFF;
-    buf[off + 15] = (flow_id & 0xFF) | 1;
-
-    /* dst IP: spread across 172.16.x.x */
-    buf[off + 16] = 172;
-    buf[off + 17] = 16 + ((flow_id >> 16) & 0x0F);
-    buf[off + 18] = (flow_id >> 8) & 0xFF;
-    buf[off + 19] = (flow_id & 0xFF) | 1;
-
-    /* TCP/UDP ports at offset 42 */
-    if (pkt_size >= 46) {
-        uint16_t sport = htons(1024 + (flow_id % 60000));
-        uint16_t dport = htons(80 + (flow_id % 1000));
-        memcpy(buf + 42, &sport, 2);
-        memcpy(buf + 44, &dport, 2);
+    buf[4] = (vni >> 16) & 0xFF;
+    buf[5] = (vni >> 8) & 0xFF;
+    buf[6] = vni & 0xFF;
+
+    /* Ethernet header at offset 8, then up to two VLAN tags */
+    int off = 8 + 12;
+    int pick = (h2 >> 48) % 100;
+    int tags = pick < cfg.pct_vlan ? 1 : pick < cfg.pct_vlan + cfg.pct_qinq ? 2 : 0;
+    uint16_t vid = 100 + (h2 >> 24) % 4000;
+    if (tags == 2) {
+        put16(buf + off, 0x88A8);
+        put16(buf + off + 2, vid);
+        off += 4;
+    }
+    if (tags) {
+        put16(buf + off, 0x8100);
+        put16(buf + off + 2, vid + 1);
+        off += 4;
+    }
+    int v6 = ((h2 >> 32) & 0xFFFF) % 100 < (uint64_t)cfg.pct_v6;
+    put16(buf + off, v6 ? 0x86DD : 0x0800);
+    off += 2;
+
+    int ip_total = pkt_size - off;
+    uint8_t proto = (key % 3 == 0) ? 17 : 6;  /* mix TCP/UDP */
+    int l4;
+    if (v6) {
+        /* 2001:db8:a::<key> -> 2001:db8:ac10::<hash> */
+        static const uint8_t src6[8] = {0x20, 0x01, 0x0d, 0xb8, 0x00, 0x0a, 0, 0};
+        static const uint8_t dst6[8] = {0x20, 0x01, 0x0d, 0xb8, 0xac, 0x10, 0, 0};
+        buf[off] = 0x60;
+        put16(buf + off + 4, ip_total - 40);
+        buf[off + 6] = proto;
+        buf[off + 7] = 64;
+        memcpy(buf + off + 8, src6, 8);
+        memcpy(buf + off + 24, dst6, 8);
+        for (int i = 0; i < 8; i++) {
+            buf[off + 16 + i] = key >> (56 - 8 * i);
+            buf[off + 32 + i] = h >> (56 - 8 * i);
+        }
+        l4 = off + 40;
+    } else {
+        buf[off] = 0x45;
+        put16(buf + off + 2, ip_total);
+        buf[off + 8] = 64;
+        buf[off + 9] = proto;
+        /* src 10.0.0.0/8 by key, dst 172.16.0.0/12: unique for 2^36 keys */
+        buf[off + 12] = 10;
+        buf[off + 13] = (key >> 16) & 0xFF;
+        buf[off + 14] = (key >> 8) & 0xFF;
+        buf[off + 15] = key & 0xFF;
+        buf[off + 16] = 172;
+        buf[off + 17] = 16 + ((key >> 32) & 0x0F);
+        buf[off + 18] = (key >> 24) & 0xFF;
+        buf[off + 19] = h & 0xFF;
+        l4 = off + 20;
+    }
+
+    /* TCP/UDP ports; TCP data offset and ACK, UDP length */
+    put16(buf + l4, 1024 + (h >> 8) % 64000);
+    put16(buf + l4 + 2, dst_ports[(h >> 40) % (sizeof(dst_ports) / sizeof(dst_ports[0]))]);
+    if (proto == 6) {
+        buf[l4 + 12] = 0x50;
+        buf[l4 + 13] = 0x10;
+    } else {
+        put16(buf + l4 + 4, pkt_size - l4);
+    }
+
+    mh->msg_name = &cfg.targets[(h2 >> 16) % cfg.ntargets];
+    mh->msg_namelen = sizeof(cfg.targets[0]);
+}
+
+struct pool {
+    uint8_t *packets;
+    struct mmsghdr *msgs;
+    struct iovec *iovecs;
+    uint64_t *built;                /* per batch: generation its packets are for */
+    struct zipf zipf;
+    uint64_t rng;
+    int refill;                     /* flows do not fit: every pass brings new ones */
+};
+
+/* Flow keys of batch b for generation (ep, pass) */
+static void build_batch(struct pool *p, int tid, int b, uint32_t ep, uint64_t pass)
+{
+    uint64_t f = cfg.flows_per_thread;
+    for (int i = b * BATCH_SIZE; i < (b + 1) * BATCH_SIZE; i++) {
+        uint64_t id;
+        if (cfg.zipf_s > 0)
+            id = zipf_next(&p->zipf, &p->rng);
+        else
+            id = ((p->refill ? pass * cfg.pool : 0) + i) % f;
+        uint64_t key = ep * cfg.total_flows + id * cfg.threads + tid;
+        build_vxlan_packet(p->packets + (size_t)i * cfg.pkt_size, &p->msgs[i].msg_hdr, key);
     }
 }
 
+static uint64_t generation(const struct pool *p, uint32_t ep, uint64_t pass)
+{
+    return (uint64_t)ep << 32 | (p->refill ? pass & 0xFFFFFFFF : 0);
+}
+
 static void *sender_thread(void *arg)
 {
     struct thread_args *ta = (struct thread_args *)arg;
     int tid = ta->thread_id;
-    int pkt_size = ta->pkt_size;
-    int flows_per_thread = ta->num_flows;
+    int nbatches = cfg.pool / BATCH_SIZE;
+    struct pool p = {0};
 
     int sock = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sock < 0) { perror("socket"); return NULL; }
+    if (sock < 0) { perror("socket"); running = 0; }
 
     /* Increase send buffer */
     int sndbuf = 16 * 1024 * 1024;
-    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
-
-    /* Pre-build packets for diverse flows */
-    int batch = BATCH_SIZE;
-    if (batch > flows_per_thread) batch = flows_per_thread;
-
-    uint8_t *packets = malloc(batch * pkt_size);
-    if (!packets) { perror("malloc"); close(sock); return NULL; }
-
-    for (int i = 0; i < batch; i++) {
-        build_vxlan_packet(packets + i * pkt_size, pkt_size,
-                           tid * flows_per_thread + i);
-    }
-
-    struct mmsghdr *msgs = calloc(batch, sizeof(struct mmsghdr));
-    struct iovec *iovecs = calloc(batch, sizeof(struct iovec));
-
-    for (int i = 0; i < batch; i++) {
-        iovecs[i].iov_base = packets + i * pkt_size;
-        iovecs[i].iov_len = pkt_size;
-        msgs[i].msg_hdr.msg_name = &ta->target;
-        msgs[i].msg_hdr.msg_namelen = sizeof(ta->target);
-        msgs[i].msg_hdr.msg_iov = &iovecs[i];
-        msgs[i].msg_hdr.msg_iovlen = 1;
+    if (sock >= 0)
+        setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+    p.packets = malloc((size_t)cfg.pool * cfg.pkt_size);
+    p.msgs = calloc(cfg.pool, sizeof(struct mmsghdr));
+    p.iovecs = calloc(cfg.pool, sizeof(struct iovec));
+    p.built = malloc(nbatches * sizeof(uint64_t));
+    if (!p.packets || !p.msgs || !p.iovecs || !p.built) { perror("malloc"); running = 0; }
+
+    /* Pre-build the whole pool before the clock starts */
+    if (running) {
+        p.rng = cfg.seed + tid;
+        p.refill = cfg.flows_per_thread > (uint32_t)cfg.pool;
+        if (cfg.zipf_s > 0)
+            zipf_init(&p.zipf, cfg.flows_per_thread, cfg.zipf_s);
+        for (int i = 0; i < cfg.pool; i++) {
+            p.iovecs[i].iov_base = p.packets + (size_t)i * cfg.pkt_size;
+            p.iovecs[i].iov_len = cfg.pkt_size;
+            p.msgs[i].msg_hdr.msg_iov = &p.iovecs[i];
+            p.msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        for (int b = 0; b < nbatches; b++) {
+            build_batch(&p, tid, b, 0, 0);
+            p.built[b] = generation(&p, 0, 0);
+        }
     }
+    pthread_barrier_wait(&pools_built);
 
+    uint64_t pass = 0;
+    int b = 0;
     while (running) {
-        int sent = sendmmsg(sock, msgs, batch, 0);
+        uint32_t ep = atomic_load_explicit(&epoch, memory_order_relaxed);
+        uint64_t gen = generation(&p, ep, pass);
+        if (p.built[b] != gen) {
+            build_batch(&p, tid, b, ep, pass);
+            p.built[b] = gen;
+        }
+        int sent = sendmmsg(sock, p.msgs + (size_t)b * BATCH_SIZE, BATCH_SIZE, 0);
         if (sent > 0) {
             atomic_fetch_add(&counters[tid], sent);
         } else if (errno == ENOBUFS || errno == EAGAIN) {
             usleep(1);
+            continue;
+        }
+        if (++b == nbatches) {
+            b = 0;
+            pass++;
         }
     }
 
-    free(packets);
-    free(msgs);
-    free(iovecs);
-    close(sock);
+    free(p.packets);
+    free(p.msgs);
+    free(p.iovecs);
+    free(p.built);
+    if (sock >= 0)
+        close(sock);
     return NULL;
 }
 
 static void handle_signal(int sig) { (void)sig; running = 0; }
 
+/* Comma-separated list of u32; returns count, or -1 on a bad item or too many */
+static int parse_list(const char *arg, uint32_t *out, int max)
+{
+    int n = 0;
+    char *copy = strdup(arg), *save = NULL;
+    for (char *tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        char *end;
+        unsigned long v = strtoul(tok, &end, 0);
+        if (*end || n == max || v > 0xFFFFFF) {
+            n = -1;
+            break;
+        }
+        out[n++] = (uint32_t)v;
+    }
+    free(copy);
+    return n;
+}
+
+static int parse_targets(const char *arg, int port)
+{
+    int n = 0, ok = 1;
+    char *copy = strdup(arg), *save = NULL;
+    for (char *tok = strtok_r(copy, ",", &save); tok && ok; tok = strtok_r(NULL, ",", &save)) {
+        if (n == MAX_TARGETS) { ok = 0; break; }
+        struct sockaddr_in *t = &cfg.targets[n++];
+        memset(t, 0, sizeof(*t));
+        t->sin_family = AF_INET;
+        t->sin_port = htons(port);
+        if (inet_pton(AF_INET, tok, &t->sin_addr) != 1) {
+            fprintf(stderr, "Error: invalid IP address '%s'\n", tok);
+            ok = 0;
+        }
+    }
+    free(copy);
+    return ok ? n : -1;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [options] <ip[,ip...]> <port> <threads> <duration> [pkt_size=128] [total_flows=100000]\n"
+            "  -z S      Zipf exponent for packets per flow (default 0 = uniform)\n"
+            "  -R SEC    replace every flow's 5-tuple each SEC seconds (default 0 = never)\n"
+            "  -P N      pre-built packets per thread (default min(flows/thread, %d))\n"
+            "  -v LIST   inner VNIs, comma-separated (default 12345)\n"
+            "  -6 PCT    percent of flows with an IPv6 inner packet\n"
+            "  -q PCT    percent of flows with one 802.1Q tag\n"
+            "  -Q PCT    percent of flows with QinQ (802.1ad + 802.1Q) tags\n"
+            "  -s SEED   flow and sampling seed (default 1)\n",
+            prog, DEFAULT_POOL);
+}
+
 int main(int argc, char *argv[])
 {
-    if (argc < 5) {
-        fprintf(stderr, "Usage: %s <ip> <port> <threads> <duration> [pkt_size=128] [total_flows=100000]\n", argv[0]);
+    int rotate = 0, pool = 0, opt;
+    cfg.vnis[0] = 12345;
+    cfg.nvnis = 1;
+    cfg.seed = 1;
+    while ((opt = getopt(argc, argv, "z:R:P:v:6:q:Q:s:h")) != -1) {
+        switch (opt) {
+        case 'z': cfg.zipf_s = atof(optarg); break;
+        case 'R': rotate = atoi(optarg); break;
+        case 'P': pool = atoi(optarg); break;
+        case 'v':
+            cfg.nvnis = parse_list(optarg, cfg.vnis, MAX_VNIS);
+            if (cfg.nvnis < 1) { fprintf(stderr, "Error: bad VNI list '%s'\n", optarg); return 1; }
+            break;
+        case '6': cfg.pct_v6 = atoi(optarg); break;
+        case 'q': cfg.pct_vlan = atoi(optarg); break;
+        case 'Q': cfg.pct_qinq = atoi(optarg); break;
+        case 's': cfg.seed = strtoull(optarg, NULL, 0); break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if (argc - optind < 4) {
+        usage(argv[0]);
         return 1;
     }
 
-    const char *target_ip = argv[1];
-    int port = atoi(argv[2]);
-    int num_threads = atoi(argv[3]);
-    int duration = atoi(argv[4]);
-    int pkt_size = argc > 5 ? atoi(argv[5]) : 128;
-    int total_flows = argc > 6 ? atoi(argv[6]) : 100000;
+    const char *target_ip = argv[optind];
+    int port = atoi(argv[optind + 1]);
+    int num_threads = atoi(argv[optind + 2]);
+    int duration = atoi(argv[optind + 3]);
+    int pkt_size = argc - optind > 4 ? atoi(argv[optind + 4]) : 128;
+    long total_flows = argc - optind > 5 ? atol(argv[optind + 5]) : 100000;
 
-    if (num_threads < 1 || num_threads > 64) {
-        fprintf(stderr, "Error: threads must be 1-64, got %d\n", num_threads);
+    if (num_threads < 1 || num_threads > MAX_THREADS) {
+        fprintf(stderr, "Error: threads must be 1-%d, got %d\n", MAX_THREADS, num_threads);
         return 1;
     }
     if (duration < 1) { fprintf(stderr, "Error: duration must be >= 1\n"); return 1; }
     if (port < 1 || port > 65535) { fprintf(stderr, "Error: invalid port %d\n", port); return 1; }
+    if (cfg.zipf_s < 0 || rotate < 0 || pool < 0) { fprintf(stderr, "Error: -z, -R, -P must be >= 0\n"); return 1; }
+    if (cfg.pct_v6 < 0 || cfg.pct_v6 > 100 || cfg.pct_vlan < 0 || cfg.pct_qinq < 0
+        || cfg.pct_vlan + cfg.pct_qinq > 100) {
+        fprintf(stderr, "Error: -6 must be 0-100 and -q + -Q at most 100\n");
+        return 1;
+    }
+    if (total_flows < num_threads || total_flows > 0xFFFFFFFFL * num_threads) {
+        fprintf(stderr, "Error: total_flows must be at least the thread count\n");
+        return 1;
+    }
     if (pkt_size < 64) pkt_size = 64;
     if (pkt_size > 9000) pkt_size = 9000;
-    int flows_per_thread = total_flows / num_threads;
-
-    struct sockaddr_in target = {0};
-    target.sin_family = AF_INET;
-    target.sin_port = htons(port);
-    if (inet_pton(AF_INET, target_ip, &target.sin_addr) != 1) {
-        fprintf(stderr, "Error: invalid IP address '%s'\n", target_ip);
+    cfg.pkt_size = pkt_size;
+    if (pkt_size < max_l4_offset() + 20) {
+        fprintf(stderr, "Error: pkt_size must be >= %d for the IPv6/VLAN variants\n", max_l4_offset() + 20);
+        return 1;
+    }
+    if ((cfg.ntargets = parse_targets(target_ip, port)) < 1) {
+        fprintf(stderr, "Error: 1-%d target IPs expected, got '%s'\n", MAX_TARGETS, target_ip);
         return 1;
     }
 
+    cfg.threads = num_threads;
+    cfg.flows_per_thread = total_flows / num_threads;
+    cfg.total_flows = (uint64_t)cfg.flows_per_thread * num_threads;
+    if (!pool)
+        pool = cfg.flows_per_thread < DEFAULT_POOL ? (int)cfg.flows_per_thread : DEFAULT_POOL;
+    cfg.pool = (pool + BATCH_SIZE - 1) / BATCH_SIZE * BATCH_SIZE;
+
     signal(SIGINT, handle_signal);
     signal(SIGTERM, handle_signal);
 
-    printf("VXLAN Flood v2\n");
+    printf("VXLAN Flood v3\n");
     printf("  Target:    %s:%d\n", target_ip, port);
     printf("  Threads:   %d\n", num_threads);
     printf("  Duration:  %ds\n", duration);
     printf("  Pkt size:  %d bytes\n", pkt_size);
-    printf("  Flows:     %d total (%d/thread)\n", total_flows, flows_per_thread);
+    printf("  Flows:     %lu total (%u/thread), %s", (unsigned long)cfg.total_flows, cfg.flows_per_thread,
+           cfg.zipf_s > 0 ? "Zipf" : "uniform");
+    if (cfg.zipf_s > 0)
+        printf(" s=%.2f", cfg.zipf_s);
+    if (rotate)
+        printf(", rotated every %ds", rotate);
+    printf("\n");
+    printf("  VNIs:      %d, IPv6 %d%%, VLAN %d%%, QinQ %d%%\n", cfg.nvnis, cfg.pct_v6, cfg.pct_vlan, cfg.pct_qinq);
+    printf("  Pool:      %d pkts/thread (%.1f MB)%s\n", cfg.pool, (double)cfg.pool * pkt_size / (1 << 20),
+           cfg.flows_per_thread > (uint32_t)cfg.pool ? ", rebuilt every pass" : "");
     printf("  Batch:     %d\n", BATCH_SIZE);
     printf("\n");
 
-    pthread_t threads[64];
-    struct thread_args args[64];
-
-    struct timespec start;
-    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_t threads[MAX_THREADS];
+    struct thread_args args[MAX_THREADS];
+    pthread_barrier_init(&pools_built, NULL, num_threads + 1);
 
     for (int i = 0; i < num_threads; i++) {
         args[i].thread_id = i;
-        args[i].target = target;
-        args[i].pkt_size = pkt_size;
-        args[i].num_flows = flows_per_thread;
         atomic_store(&counters[i], 0);
         pthread_create(&threads[i], NULL, sender_thread, &args[i]);
     }
+    pthread_barrier_wait(&pools_built);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
     long prev_total = 0;
     for (int s = 0; s < duration && running; s++) {
@@ -212,11 +515,14 @@ int main(int argc, char *argv[])
 
         printf("[%3ds] total=%ld  avg=%.0f pps/%.2f Gbps  inst=%.0f pps/%.2f Gbps\n",
                s + 1, total, avg_pps, avg_gbps, inst_pps, inst_gbps);
+        if (rotate && (s + 1) % rotate == 0 && s + 1 < duration)
+            printf("        rotated to flow epoch %u\n", atomic_fetch_add(&epoch, 1) + 1);
     }
 
     running = 0;
     for (int i = 0; i < num_threads; i++)
         pthread_join(threads[i], NULL);
+    pthread_barrier_destroy(&pools_built);
 
     long total = 0;
     for (int i = 0; i < num_threads; i++) {